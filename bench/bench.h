@@ -0,0 +1,55 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/* Shared scaffolding for the geminon benchmarks.  Each benchmark is a
+   standalone program, run by `make bench`; they print one line of results
+   per case, to stdout. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/evp.h>
+#include <openssl/err.h>
+
+#include "../t/fixtures.h"
+
+static inline double bench_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline const char * bench_size(size_t n) {
+	static char buf[32];
+	if      (n >= 1u << 30) snprintf(buf, sizeof(buf), "%zuGiB", n >> 30);
+	else if (n >= 1u << 20) snprintf(buf, sizeof(buf), "%zuMiB", n >> 20);
+	else if (n >= 1u << 10) snprintf(buf, sizeof(buf), "%zuKiB", n >> 10);
+	else                    snprintf(buf, sizeof(buf), "%zuB",   n);
+	return buf;
+}
+
+/* Build a server-side SSL_CTX with a throwaway, self-signed certificate
+   (the same one the tests use), so that benchmarks don't need any key
+   material on disk. */
+static inline SSL_CTX * bench_server_ctx() {
+	SSL_CTX *ctx;
+	EVP_PKEY *key;
+	X509 *cert;
+
+	cert = test_cert("localhost", 0, 3600, &key);
+	ctx = SSL_CTX_new(TLS_server_method());
+	if (!ctx || SSL_CTX_use_certificate(ctx, cert) != 1 || SSL_CTX_use_PrivateKey(ctx, key) != 1) {
+		ERR_print_errors_fp(stderr);
+		exit(2);
+	}
+
+	X509_free(cert);
+	EVP_PKEY_free(key);
+	return ctx;
+}
+
+#endif
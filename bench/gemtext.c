@@ -0,0 +1,121 @@
+/* Throughput of the streaming gemtext parser, gemini_gemtext_feed(), on
+   multi-megabyte documents of a few different shapes, fed to it in
+   GEMINI_STREAM_BLOCK_SIZE chunks the way they'd come off the wire.
+
+   For comparison, each case is also split into lines with memchr(3) and
+   nothing else, which is about as fast as anything that looks at every
+   line can hope to go.
+ */
+#include "./bench.h"
+#include "../gemini.h"
+
+static const char *prose =
+	"Gemini is a new internet technology supporting an electronic library of interconnected text documents. "
+	"That's not a new idea, but it's not old fashioned either. It's timeless, and deserves tools which treat it "
+	"as a first class concept, not a vestigial corner case.\n";
+
+static const char *links =
+	"=> gemini://example.com/docs/specification.gmi Specification\n"
+	"=> /software/ Software\n"
+	"* a list item\n";
+
+static const char *mixed =
+	"## A heading\n"
+	"Some ordinary text, about as long as a line of ordinary text tends to be.\n"
+	"> A quotation from someone.\n"
+	"=> gemini://example.com/ A link\n"
+	"```\n"
+	"    preformatted text\n"
+	"```\n"
+	"\n";
+
+static int s_count(const struct gemini_gemtext_line *line, void *_links) {
+	if (line->type == GEMINI_GEMTEXT_LINK) {
+		++*(unsigned long *)_links;
+	}
+	return 0;
+}
+
+/* A document of (about) size octets, made of copies of unit. */
+static char * s_doc(const char *unit, size_t size) {
+	size_t n, len;
+	char *doc;
+
+	doc = malloc(size);
+	if (!doc) {
+		perror("malloc");
+		exit(2);
+	}
+	len = strlen(unit);
+	for (n = 0; n + len <= size; n += len) {
+		memcpy(doc + n, unit, len);
+	}
+	memset(doc + n, '\n', size - n);
+	return doc;
+}
+
+static double s_parse(const char *doc, size_t size, unsigned long *lines) {
+	struct gemini_gemtext g;
+	unsigned long nlinks;
+	size_t off, n;
+	double t0;
+
+	nlinks = 0;
+	t0 = bench_now();
+	gemini_gemtext_init(&g, s_count, &nlinks);
+	for (off = 0; off < size; off += n) {
+		n = size - off < GEMINI_STREAM_BLOCK_SIZE ? size - off : GEMINI_STREAM_BLOCK_SIZE;
+		gemini_gemtext_feed(&g, doc + off, n);
+	}
+	*lines = g.lines;
+	gemini_gemtext_finish(&g);
+	return bench_now() - t0;
+}
+
+static double s_split(const char *doc, size_t size, unsigned long *lines) {
+	const char *p, *end, *eol;
+	double t0;
+
+	t0 = bench_now();
+	*lines = 0;
+	for (p = doc, end = doc + size; p < end && (eol = memchr(p, '\n', end - p)) != NULL; p = eol + 1) {
+		++*lines;
+	}
+	return bench_now() - t0;
+}
+
+int main(int argc, char **argv) {
+	static const size_t sizes[] = { 1 << 20, 16 << 20, 64 << 20 };
+	static const struct { const char *name, **unit; } shapes[] = {
+		{ "prose", &prose },
+		{ "links", &links },
+		{ "mixed", &mixed },
+	};
+	unsigned long lines, split;
+	double t, ts;
+	size_t max;
+	char *doc;
+	int i, j;
+
+	/* `bench/gemtext 1048576` caps the sizes tried, for a quicker run */
+	max = argc > 1 ? strtoull(argv[1], NULL, 10) : (size_t)-1;
+
+	for (j = 0; j < sizeof(shapes) / sizeof(shapes[0]); j++) {
+		for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && sizes[i] <= max; i++) {
+			doc = s_doc(*shapes[j].unit, sizes[i]);
+			t  = s_parse(doc, sizes[i], &lines);
+			ts = s_split(doc, sizes[i], &split);
+			free(doc);
+
+			if (lines != split) {
+				fprintf(stderr, "gemtext %s %s: parsed %lu lines, but there are %lu\n",
+					shapes[j].name, bench_size(sizes[i]), lines, split);
+				return 1;
+			}
+			printf("gemtext %-5s %6s  %8.3f ms  %8.1f MiB/s  %6.1f Mlines/s  (memchr: %8.1f MiB/s)\n",
+				shapes[j].name, bench_size(sizes[i]), t * 1e3, sizes[i] / t / (1 << 20),
+				lines / t / 1e6, sizes[i] / ts / (1 << 20));
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,152 @@
+/* Memory held by each idle connection slot: one whose connection has
+   finished its TLS handshake, and is waiting on the client for a request
+   line.  This is what the server has to keep around per connection, in
+   the default mode (slots set up ahead of time, OpenSSL buffers kept), and
+   with low_memory set (see gemini_server).
+
+   The two ends of each connection are wired together in-process, with a
+   small BIO pair standing in for the socket (that 2x PAIRBUF octets is
+   counted, too), so that thousands of them don't need twice as many
+   descriptors.  The client end is let go of after the handshake.
+
+   This measures per-connection memory, and nothing else; it is not a
+   count of how many idle connections a server can hold.  gemini_serve()
+   dedicates a thread (and a slot) to each connection for as long as it
+   lasts, so a real server holds no more connections than it has threads
+   (and drops those that are still idle after its request_timeout).  The
+   slot counts here are only there to average over, and thread stacks
+   aren't counted.
+
+   Each case runs in a child process of its own, so that what one leaves
+   lying around in the heap doesn't flatter the next one.
+ */
+#include "./bench.h"
+#include "../gemini.h"
+
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define PAIRBUF 1024
+
+/* Leave this much memory free, no matter what we were asked to do. */
+#define HEADROOM (256 << 20)
+
+static size_t s_rss() {
+	unsigned long size, resident;
+	FILE *io;
+
+	io = fopen("/proc/self/statm", "r");
+	if (!io || fscanf(io, "%lu %lu", &size, &resident) != 2) {
+		perror("/proc/self/statm");
+		exit(2);
+	}
+	fclose(io);
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* Do what gemini_serve() does with a new connection, up to the point where
+   it waits for the request line. */
+static void s_connect(struct gemini_request *req, SSL_CTX *sctx, SSL_CTX *cctx) {
+	BIO *sb, *cb;
+	SSL *c;
+	char b;
+	int i, done;
+
+	if (BIO_new_bio_pair(&sb, PAIRBUF, &cb, PAIRBUF) != 1) {
+		ERR_print_errors_fp(stderr);
+		exit(2);
+	}
+	req->ssl = req->spare ? req->spare : SSL_new(sctx);
+	req->spare = NULL;
+	SSL_set_bio(req->ssl, sb, sb);
+	SSL_set_accept_state(req->ssl);
+
+	c = SSL_new(cctx);
+	SSL_set_bio(c, cb, cb);
+	SSL_set_connect_state(c);
+
+	for (i = done = 0; i < 100 && done != 2; i++) {
+		done  = SSL_do_handshake(c) == 1;
+		done += SSL_do_handshake(req->ssl) == 1;
+	}
+	if (done != 2) {
+		fprintf(stderr, "handshake didn't finish\n");
+		ERR_print_errors_fp(stderr);
+		exit(2);
+	}
+
+	/* the server sends its session tickets, which the client reads, and
+	   then both sides go idle, waiting on the other */
+	SSL_read(req->ssl, &b, 1);
+	SSL_read(c, &b, 1);
+	SSL_read(req->ssl, &b, 1);
+	ERR_clear_error();
+	SSL_free(c);
+}
+
+static void s_run(const char *mode, int lean, unsigned int n) {
+	struct gemini_slots *slots;
+	SSL_CTX *sctx, *cctx;
+	size_t rss0, rss;
+	unsigned int i;
+
+	sctx = bench_server_ctx();
+	cctx = SSL_CTX_new(TLS_client_method());
+	if (lean) {
+		SSL_CTX_set_mode(sctx, SSL_MODE_RELEASE_BUFFERS);
+	}
+
+	/* warm up OpenSSL, so its one-time setup isn't charged to anyone */
+	slots = gemini_slots_new(lean ? NULL : sctx, 1);
+	s_connect(gemini_slots_acquire(slots), sctx, cctx);
+	gemini_slots_free(slots);
+
+	rss0 = s_rss();
+	slots = gemini_slots_new(lean ? NULL : sctx, n);
+	if (!slots) {
+		fprintf(stderr, "idle %s: unable to set up %u slots\n", mode, n);
+		exit(2);
+	}
+	for (i = 0; i < n; i++) {
+		if (i % 1000 == 0 && sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE) < HEADROOM) {
+			printf("idle %-7s %6u slots  (stopped at %u; running out of memory)\n", mode, n, i);
+			n = i;
+			break;
+		}
+		s_connect(gemini_slots_acquire(slots), sctx, cctx);
+	}
+	rss = s_rss();
+
+	printf("idle %-7s %6u slots  %8.1f KiB per idle connection  (%s total)\n",
+		mode, n, (double)(rss - rss0) / n / 1024, bench_size(rss - rss0));
+	fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+	static const unsigned int counts[] = { 1000, 10000 };
+	static const struct { const char *name; int lean; } modes[] = {
+		{ "default", 0 },
+		{ "lowmem",  1 },
+	};
+	unsigned int max;
+	pid_t kid;
+	int i, j, st;
+
+	/* `bench/idle 1000` caps the slot counts tried, for a quicker run */
+	max = argc > 1 ? strtoul(argv[1], NULL, 10) : (unsigned int)-1;
+
+	gemini_init();
+	for (i = 0; i < sizeof(counts) / sizeof(counts[0]) && counts[i] <= max; i++) {
+		for (j = 0; j < sizeof(modes) / sizeof(modes[0]); j++) {
+			kid = fork();
+			if (kid == 0) {
+				s_run(modes[j].name, modes[j].lean, counts[i]);
+				_exit(0);
+			}
+			if (kid < 0 || waitpid(kid, &st, 0) != kid || !WIFEXITED(st) || WEXITSTATUS(st) != 0) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
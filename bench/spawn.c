@@ -0,0 +1,75 @@
+/* Latency of launching a CGI-style child process: fork(2) + execve(2), the
+   way cgi_handler used to, versus posix_spawn(3), which glibc implements
+   with vfork semantics (no copying of the parent's page tables).
+
+   The cost of fork(2) grows with the size of the parent, so each method is
+   measured with an increasingly large (and fully touched) heap.
+ */
+#include "./bench.h"
+
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+#define ROUNDS 200
+
+static char *argv[] = { "/bin/true", NULL };
+
+static void s_fork() {
+	pid_t kid;
+
+	kid = fork();
+	if (kid == 0) {
+		execve(argv[0], argv, environ);
+		_exit(42);
+	}
+	waitpid(kid, NULL, 0);
+}
+
+static void s_spawn() {
+	pid_t kid;
+
+	if (posix_spawn(&kid, argv[0], NULL, NULL, argv, environ) == 0) {
+		waitpid(kid, NULL, 0);
+	}
+}
+
+static double s_time(void (*fn)()) {
+	double t0;
+	int i;
+
+	t0 = bench_now();
+	for (i = 0; i < ROUNDS; i++) {
+		fn();
+	}
+	return (bench_now() - t0) / ROUNDS;
+}
+
+int main(int argc, char **argv) {
+	static const size_t heaps[] = { 0, 64 << 20, 256 << 20, 1 << 30 };
+	size_t max;
+	char *heap;
+	int i;
+
+	/* `bench/spawn 268435456` caps the heap sizes tried */
+	max = argc > 1 ? strtoull(argv[1], NULL, 10) : (size_t)-1;
+
+	for (i = 0; i < sizeof(heaps) / sizeof(heaps[0]) && heaps[i] <= max; i++) {
+		heap = NULL;
+		if (heaps[i]) {
+			heap = malloc(heaps[i]);
+			if (!heap) {
+				perror("malloc");
+				return 1;
+			}
+			memset(heap, 0x5a, heaps[i]);
+		}
+
+		printf("spawn heap=%-7s  fork+exec %9.1f us  posix_spawn %9.1f us\n",
+			bench_size(heaps[i]), s_time(s_fork) * 1e6, s_time(s_spawn) * 1e6);
+		free(heap);
+	}
+	return 0;
+}
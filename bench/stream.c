@@ -0,0 +1,99 @@
+/* Throughput of the server-side streaming writer, gemini_request_stream(),
+   across a range of file sizes.  The server and client ends of a TLS
+   session are wired together over a local socket pair; the client side
+   just reads and discards.
+
+   Files are created sparse (via ftruncate(2)), so for the larger sizes this
+   measures the writer and TLS, not the disk.
+ */
+#include "./bench.h"
+#include "../gemini.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+static void * s_drain(void *_ssl) {
+	char buf[65536];
+	size_t n;
+
+	while (SSL_read_ex(_ssl, buf, sizeof(buf), &n) == 1)
+		;
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	static const size_t sizes[] = {
+		1 << 10, 16 << 10, 64 << 10, 256 << 10,
+		1 << 20, 16 << 20, 256 << 20, 1 << 30,
+	};
+	struct gemini_request req;
+	SSL_CTX *sctx, *cctx;
+	SSL *cssl;
+	pthread_t tid;
+	char path[] = "/tmp/geminon-bench-XXXXXX";
+	size_t max;
+	double t0, t;
+	int i, fd, sv[2];
+
+	/* `bench/stream 16777216` caps the sizes tried, for a quicker run */
+	max = argc > 1 ? strtoull(argv[1], NULL, 10) : (size_t)-1;
+
+	gemini_init();
+	sctx = bench_server_ctx();
+	cctx = SSL_CTX_new(TLS_client_method());
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror(path);
+		return 1;
+	}
+	unlink(path);
+
+	memset(&req, 0, sizeof(req));
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && sizes[i] <= max; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+			perror("socketpair");
+			return 1;
+		}
+
+		req.fd  = sv[0];
+		req.ssl = SSL_new(sctx);
+		SSL_set_fd(req.ssl, sv[0]);
+		cssl = SSL_new(cctx);
+		SSL_set_fd(cssl, sv[1]);
+		SSL_set_connect_state(cssl);
+		pthread_create(&tid, NULL, s_drain, cssl);
+
+		if (SSL_accept(req.ssl) != 1) {
+			ERR_print_errors_fp(stderr);
+			return 1;
+		}
+
+		if (ftruncate(fd, sizes[i]) != 0 || lseek(fd, 0, SEEK_SET) != 0) {
+			perror(path);
+			return 1;
+		}
+
+		t0 = bench_now();
+		if (gemini_request_stream(&req, fd, GEMINI_STREAM_BLOCK_SIZE) != 0) {
+			fprintf(stderr, "gemini_request_stream() failed at %s\n", bench_size(sizes[i]));
+			return 1;
+		}
+		t = bench_now() - t0;
+		gemini_request_close(&req);
+		pthread_join(tid, NULL);
+		SSL_free(cssl);
+		close(sv[1]);
+
+		printf("stream %8s  %10.3f ms  %10.1f MiB/s\n",
+			bench_size(sizes[i]), t * 1e3, sizes[i] / t / (1 << 20));
+	}
+
+	gemini_request_release(&req);
+	close(fd);
+	SSL_CTX_free(sctx);
+	SSL_CTX_free(cctx);
+	return 0;
+}
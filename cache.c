@@ -0,0 +1,380 @@
+#include "./gemini.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+struct _policy {
+	struct _policy *next;
+
+	char *prefix;
+	int   ttl;   /* seconds a response stays fresh */
+	int   stale; /* seconds after that it may still be served */
+	int   flags; /* GEMINI_CACHE_* */
+};
+
+struct _cached {
+	struct _cached *prev, *next; /* LRU list, most recent first */
+
+	char   *key;
+	char   *data; /* the whole response, status line and all */
+	size_t  len;
+
+	time_t  fresh;   /* serve as-is until then */
+	time_t  expires; /* serve (and refresh) until then */
+
+	int     refs;       /* requests currently sending data */
+	int     refreshing; /* non-zero while someone is refreshing it */
+	int     evicted;    /* no longer in the cache; free on last unref */
+};
+
+/* What a wrapped handler has produced so far. */
+struct _capture {
+	struct gemini_request *req;
+	int ttl; /* from the policy; the handler can still override it */
+
+	char   *data;
+	size_t  len, cap;
+	int     skip; /* non-zero once we know it isn't worth keeping */
+
+	void  (*tap)(void *, const void *, size_t); /* whoever was tapping before us */
+	void   *tapdata;
+};
+
+static void s_free(struct _cached *e) {
+	free(e->key);
+	free(e->data);
+	free(e);
+}
+
+static void s_unlink(struct gemini_cache *cache, struct _cached *e) {
+	if (e->prev) e->prev->next = e->next;
+	else         cache->lru    = e->next;
+	if (e->next) e->next->prev = e->prev;
+	else         cache->lru_tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void s_push(struct gemini_cache *cache, struct _cached *e) {
+	e->prev = NULL;
+	e->next = cache->lru;
+	if (cache->lru) cache->lru->prev = e;
+	else            cache->lru_tail  = e;
+	cache->lru = e;
+}
+
+/* Take a response out of the cache; called with the lock held. */
+static void s_evict(struct gemini_cache *cache, struct _cached *e) {
+	gemini_map_delete(&cache->entries, e->key);
+	s_unlink(cache, e);
+	cache->stats.entries--;
+	cache->stats.bytes -= e->len;
+
+	if (e->refs > 0) e->evicted = 1; /* the last one out frees it */
+	else             s_free(e);
+}
+
+static void s_unref(struct gemini_cache *cache, struct _cached *e) {
+	pthread_mutex_lock(&cache->lock);
+	if (--e->refs == 0 && e->evicted) {
+		s_free(e);
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+static struct _policy * s_policy(struct gemini_cache *cache, const char *path) {
+	struct _policy *p, *best;
+
+	for (best = NULL, p = cache->policies; p; p = p->next) {
+		if (strncmp(path, p->prefix, strlen(p->prefix)) == 0
+		 && (!best || strlen(p->prefix) > strlen(best->prefix))) {
+			best = p;
+		}
+	}
+	return best;
+}
+
+static void s_tap(void *_cap, const void *buf, size_t n) {
+	struct _capture *cap;
+	char *data;
+	size_t want;
+
+	cap = _cap;
+	if (cap->tap) {
+		cap->tap(cap->tapdata, buf, n);
+	}
+
+	/* by the time output shows up, the handler has said all it's going
+	   to say about caching; don't bother recording what we can't keep. */
+	if (cap->skip || cap->req->maxage == 0 || (cap->req->maxage < 0 && cap->ttl <= 0)) {
+		cap->skip = 1;
+		return;
+	}
+
+	if (cap->len + n > cap->cap) {
+		if (cap->len + n > GEMINI_CACHE_ENTRY_MAX) {
+			cap->skip = 1;
+			return;
+		}
+		for (want = cap->cap ? cap->cap : 4096; want < cap->len + n; want *= 2)
+			;
+		data = realloc(cap->data, want);
+		if (!data) {
+			cap->skip = 1;
+			return;
+		}
+		cap->data = data;
+		cap->cap  = want;
+	}
+	memcpy(cap->data + cap->len, buf, n);
+	cap->len += n;
+}
+
+/* Run the wrapped handler, recording what it sends. */
+static int s_run(struct gemini_cached *c, const char *prefix, struct gemini_request *req, struct _capture *cap, struct _policy *policy) {
+	int rc;
+
+	memset(cap, 0, sizeof(*cap));
+	cap->req     = req;
+	cap->ttl     = policy ? policy->ttl : -1;
+	cap->tap     = req->tap;
+	cap->tapdata = req->tapdata;
+
+	req->maxage  = req->stale = -1;
+	req->tap     = s_tap;
+	req->tapdata = cap;
+
+	rc = c->fn(prefix, req, c->data);
+
+	req->tap     = cap->tap;
+	req->tapdata = cap->tapdata;
+	return rc;
+}
+
+/* Keep a freshly captured response, if it's worth keeping.  Either way,
+   whatever was cached under key before is superseded. */
+static void s_store(struct gemini_cache *cache, const char *key, struct _capture *cap, struct _policy *policy) {
+	struct _cached *e, *old;
+	int ttl, stale;
+	time_t now;
+
+	ttl   = cap->req->maxage >= 0 ? cap->req->maxage : cap->ttl;
+	stale = cap->req->stale  >= 0 ? cap->req->stale  : policy ? policy->stale : 0;
+
+	e = NULL;
+	if (!cap->skip && ttl > 0 && cap->len > 3 && cap->len <= cache->budget
+	 && (cap->data[0] == '2' || cap->data[0] == '3')) {
+		e = calloc(1, sizeof(struct _cached));
+		if (e) {
+			e->key = strdup(key);
+			if (!e->key) {
+				free(e);
+				e = NULL;
+			}
+		}
+	}
+
+	now = time(NULL);
+	pthread_mutex_lock(&cache->lock);
+	old = gemini_map_get(&cache->entries, key);
+	if (old) {
+		s_evict(cache, old);
+	}
+
+	if (e) {
+		e->data    = cap->data;
+		e->len     = cap->len;
+		e->fresh   = now + ttl;
+		e->expires = now + ttl + stale;
+		cap->data  = NULL;
+
+		while (cache->lru_tail && cache->stats.bytes + e->len > cache->budget) {
+			s_evict(cache, cache->lru_tail);
+			cache->stats.evictions++;
+		}
+		if (gemini_map_set(&cache->entries, key, e) == e) {
+			cap->data = e->data; /* out of memory; give it back */
+			e->data = NULL;
+			s_free(e);
+		} else {
+			s_push(cache, e);
+			cache->stats.entries++;
+			cache->stats.bytes += e->len;
+			cache->stats.stores++;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/* Run the wrapped handler again, with nobody on the other end, to bring a
+   stale response up to date. */
+static void s_refresh(struct gemini_cached *c, const char *prefix, const char *url, X509 *cert, const char *key, struct _policy *policy) {
+	struct gemini_request shadow;
+	struct _capture cap;
+	struct _cached *e;
+	int rc;
+
+	memset(&shadow, 0, sizeof(shadow));
+	memset(&cap, 0, sizeof(cap));
+	shadow.fd   = -1;
+	shadow.cert = cert;
+
+	rc = gemini_request_url(&shadow, url) == 0 ? s_run(c, prefix, &shadow, &cap, policy) : GEMINI_HANDLER_ABORT;
+	if (rc == GEMINI_HANDLER_DONE) {
+		s_store(c->cache, key, &cap, policy);
+	} else {
+		/* leave the stale response be; someone else can try later */
+		pthread_mutex_lock(&c->cache->lock);
+		e = gemini_map_get(&c->cache->entries, key);
+		if (e) e->refreshing = 0;
+		pthread_mutex_unlock(&c->cache->lock);
+	}
+
+	free(cap.data);
+	gemini_request_close(&shadow);
+	gemini_request_release(&shadow);
+}
+
+int gemini_cache_handler(const char *prefix, struct gemini_request *req, void *_cached) {
+	struct gemini_cached *c;
+	struct _policy *policy;
+	struct _capture cap;
+	struct _cached *e;
+	char key[GEMINI_MAX_KEY], url[GEMINI_MAX_REQUEST + 64];
+	int rc, refresh;
+	time_t now;
+
+	c = _cached;
+	policy = s_policy(c->cache, req->url->path);
+	gemini_request_key(req, key, sizeof(key), policy && (policy->flags & GEMINI_CACHE_PER_CERT));
+
+	now = time(NULL);
+	refresh = 0;
+	pthread_mutex_lock(&c->cache->lock);
+	e = gemini_map_get(&c->cache->entries, key);
+	if (e && now >= e->expires) {
+		s_evict(c->cache, e);
+		e = NULL;
+	}
+	if (e) {
+		e->refs++;
+		s_unlink(c->cache, e);
+		s_push(c->cache, e);
+		c->cache->stats.hits++;
+		if (now >= e->fresh && !e->refreshing) {
+			e->refreshing = refresh = 1;
+			c->cache->stats.stale++;
+		}
+	} else {
+		c->cache->stats.misses++;
+	}
+	pthread_mutex_unlock(&c->cache->lock);
+
+	if (e) {
+		if (gemini_request_write(req, e->data, e->len) < 0) {
+			fprintf(stderr, "[gemini_cache] short write!\n");
+		}
+		s_unref(c->cache, e);
+
+		if (!refresh) {
+			gemini_request_close(req);
+			return GEMINI_HANDLER_DONE;
+		}
+
+		/* the client has what it came for; let it go before we (possibly
+		   slowly) refresh the response on its behalf. */
+		snprintf(url, sizeof(url), "gemini://%s:%u%s", req->url->host, req->url->port, req->url->path);
+		gemini_request_close(req);
+		s_refresh(c, prefix, url, req->cert, key, policy);
+		return GEMINI_HANDLER_DONE;
+	}
+
+	rc = s_run(c, prefix, req, &cap, policy);
+	if (rc == GEMINI_HANDLER_DONE) {
+		s_store(c->cache, key, &cap, policy);
+	}
+	free(cap.data);
+	return rc;
+}
+
+struct gemini_cache * gemini_cache_new(size_t budget) {
+	struct gemini_cache *cache;
+
+	cache = calloc(1, sizeof(struct gemini_cache));
+	if (!cache) {
+		return NULL;
+	}
+	if (gemini_map_init(&cache->entries, 1024) != 0) {
+		free(cache);
+		return NULL;
+	}
+
+	cache->budget = budget ? budget : GEMINI_CACHE_BUDGET;
+	cache->refs   = 1;
+	pthread_mutex_init(&cache->lock, NULL);
+	return cache;
+}
+
+int gemini_cache_policy(struct gemini_cache *cache, const char *prefix, int ttl, int stale, int flags) {
+	struct _policy *p;
+
+	if (ttl < 0 || stale < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	p = calloc(1, sizeof(struct _policy));
+	if (!p) {
+		return -1;
+	}
+	p->prefix = strdup(prefix);
+	if (!p->prefix) {
+		free(p);
+		return -1;
+	}
+	p->ttl   = ttl;
+	p->stale = stale;
+	p->flags = flags;
+
+	p->next = cache->policies;
+	cache->policies = p;
+	return 0;
+}
+
+void gemini_cache_stats(struct gemini_cache *cache, struct gemini_cache_stats *stats) {
+	pthread_mutex_lock(&cache->lock);
+	memcpy(stats, &cache->stats, sizeof(struct gemini_cache_stats));
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void gemini_cache_free(struct gemini_cache *cache) {
+	struct _cached *e, *next;
+	struct _policy *p, *pnext;
+	int refs;
+
+	if (!cache) return;
+
+	pthread_mutex_lock(&cache->lock);
+	refs = --cache->refs;
+	pthread_mutex_unlock(&cache->lock);
+	if (refs > 0) {
+		return;
+	}
+
+	for (e = cache->lru; e; e = next) {
+		next = e->next;
+		s_free(e);
+	}
+	gemini_map_free(&cache->entries, NULL);
+
+	for (p = cache->policies; p; p = pnext) {
+		pnext = p->next;
+		free(p->prefix);
+		free(p);
+	}
+
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
@@ -0,0 +1,192 @@
+#define _GNU_SOURCE
+#include "./gemini.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/* Copy everything the CGI program writes to the client, as it becomes
+   available, until it closes its end of the pipe.  The pipe is
+   non-blocking, and we poll(2) it alongside the client connection, so that
+   we can give up early if the client goes away (hangs up entirely; having
+   shut down its side after sending the request line is business as usual)
+   or the program runs past GEMINI_CGI_TIMEOUT, all told.
+   A leading Cache-Control: line is for us (see gemini_request_directives),
+   not the client, so we hold on to the start of the output until we know
+   whether there is one.  Returns 0 on success, or -1 if we had to give up. */
+static int s_relay(struct gemini_request *req, int fd, size_t *relayed) {
+	char buf[GEMINI_STREAM_BLOCK_SIZE];
+	struct pollfd pfd[2];
+	ssize_t n, skip;
+	size_t len;
+	long deadline, left;
+	int rc, head;
+
+	pfd[0].fd = fd;      pfd[0].events = POLLIN;
+	pfd[1].fd = req->fd; pfd[1].events = 0; /* POLLHUP and POLLERR, always */
+
+	deadline = gemini_now_ms() + GEMINI_CGI_TIMEOUT * 1000;
+	for (*relayed = 0, len = 0, head = 1;;) {
+		left = deadline - gemini_now_ms();
+		rc = left > 0 ? poll(pfd, 2, left) : 0;
+		if (rc < 0 && errno == EINTR) continue;
+		if (rc <= 0) {
+			fprintf(stderr, "[gemini_cgi] program timed out after %ds\n", GEMINI_CGI_TIMEOUT);
+			return -1;
+		}
+		if (pfd[1].revents & (POLLHUP | POLLERR)) {
+			fprintf(stderr, "[gemini_cgi] client went away before the program finished\n");
+			return -1;
+		}
+
+		while ((n = read(fd, buf + len, sizeof(buf) - len)) > 0) {
+			len += n;
+			skip = 0;
+			if (head) {
+				skip = gemini_request_directives(req, buf, len);
+				if (skip < 0 && len < sizeof(buf)) continue;
+				if (skip < 0) skip = 0;
+				head = 0;
+			}
+			if (len > skip && gemini_request_write(req, buf + skip, len - skip) < 0) {
+				return -1;
+			}
+			*relayed += len - skip;
+			len = 0;
+		}
+		if (n == 0) {
+			/* whatever we were holding on to wasn't a directive after all */
+			if (len > 0 && gemini_request_write(req, buf, len) < 0) {
+				return -1;
+			}
+			*relayed += len;
+			return 0;
+		}
+		if (errno != EAGAIN && errno != EINTR) {
+			return -1;
+		}
+	}
+}
+
+/* Walk the resolved path, one component at a time, from the root, until we
+   come to a regular file we can execute; that's the program, and whatever
+   is left over is its PATH_INFO.  prog is filled in with the full path to
+   the program; the return value points into path, at the '/' that starts
+   the PATH_INFO (or at its terminating NUL, if there isn't any), or is NULL
+   if no such program exists. */
+static const char * s_find(const char *root, size_t n, const char *path, char *prog) {
+	struct stat st;
+	const char *p, *end;
+	size_t len;
+
+	len = sprintf(prog, "%.*s", (int)n, root);
+	for (p = path; *p; p = end + 1) {
+		end = p + strcspn(p, "/");
+		len += sprintf(prog + len, "/%.*s", (int)(end - p), p);
+		if (stat(prog, &st) != 0) {
+			return NULL;
+		}
+		if (S_ISREG(st.st_mode)) {
+			return access(prog, X_OK) == 0 ? end : NULL;
+		}
+		if (!S_ISDIR(st.st_mode) || !*end) {
+			return NULL;
+		}
+	}
+	return NULL;
+}
+
+int gemini_cgi_handler(const char *prefix, struct gemini_request *req, void *_root) {
+	int rc, pfd[2];
+	const char *root, *info;
+	char *path, *prog, *argv[2], **envp, want[GEMINI_MAX_REQUEST], script[GEMINI_MAX_REQUEST];
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	sigset_t sigs;
+	size_t relayed, n, pre;
+	pid_t kid;
+
+	root = _root;
+	for (n = strlen(root); n > 0 && root[n-1] == '/'; n--)
+		;
+	for (pre = strlen(prefix); pre > 0 && prefix[pre-1] == '/'; pre--)
+		;
+
+	/* the query string is for the program (as QUERY_STRING), and has no
+	   say in which program that is */
+	snprintf(want, sizeof(want), "%.*s", (int)strcspn(req->url->path + strlen(prefix), "?"), req->url->path + strlen(prefix));
+	path = gemini_request_alloc(req, GEMINI_MAX_PATH+1);
+	prog = gemini_request_alloc(req, n + 1 + GEMINI_MAX_PATH+1);
+	if (!path || !prog || gemini_fs_resolve_into(want, path) != 0) {
+		return GEMINI_HANDLER_ABORT;
+	}
+
+	info = s_find(root, n, path, prog);
+	if (!info) {
+		gemini_request_respond(req, 51, "Not Found");
+		gemini_request_close(req);
+		return GEMINI_HANDLER_DONE;
+	}
+	snprintf(script, sizeof(script), "%.*s/%.*s", (int)pre, prefix, (int)(info - path), path);
+	envp = gemini_request_environ(req, script, info);
+	if (!envp) {
+		return GEMINI_HANDLER_ABORT;
+	}
+	argv[0] = prog;
+	argv[1] = NULL;
+
+	rc = pipe2(pfd, O_CLOEXEC);
+	if (rc != 0) {
+		return GEMINI_HANDLER_ABORT;
+	}
+
+	/* stdout goes to the pipe, stdin comes from nowhere, and the signals
+	   we ignore (like SIGCHLD) go back to their defaults, since ignored
+	   dispositions would otherwise survive the exec.  Everything else the
+	   server has open is close-on-exec, and stays behind. */
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, pfd[1], 1);
+	posix_spawn_file_actions_addopen(&fa, 0, "/dev/null", O_RDONLY, 0);
+	posix_spawnattr_init(&attr);
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGCHLD);
+	sigaddset(&sigs, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &sigs);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+	fprintf(stderr, "[gemini_cgi] executing '%s'...\n", prog);
+	rc = posix_spawn(&kid, prog, &fa, &attr, argv, envp);
+	posix_spawn_file_actions_destroy(&fa);
+	posix_spawnattr_destroy(&attr);
+	close(pfd[1]);
+
+	if (rc != 0) {
+		fprintf(stderr, "[gemini_cgi] spawn of '%s' failed: %s (error %d)\n", prog, strerror(rc), rc);
+		close(pfd[0]);
+		return GEMINI_HANDLER_ABORT;
+	}
+
+	fcntl(pfd[0], F_SETFL, fcntl(pfd[0], F_GETFL) | O_NONBLOCK);
+	rc = s_relay(req, pfd[0], &relayed);
+	close(pfd[0]);
+	if (rc != 0) {
+		kill(kid, SIGKILL);
+		req->maxage = 0; /* don't cache half a response */
+	}
+	waitpid(kid, NULL, 0);
+
+	if (relayed == 0) {
+		gemini_request_respond(req, 42, "CGI Error");
+	}
+	gemini_request_close(req);
+	return GEMINI_HANDLER_DONE;
+}
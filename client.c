@@ -1,7 +1,18 @@
 #include "./gemini.h"
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
+#include <stdint.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include <arpa/inet.h>
 #include <netinet/ip.h>
@@ -38,72 +49,331 @@ int gemini_client_tls(struct gemini_client *client, const char *cert, const char
 	}
 
 	SSL_CTX_set_verify(client->ssl, SSL_VERIFY_NONE, all_ok);
+#ifdef SSL_OP_ENABLE_KTLS
+	/* let the kernel decrypt, where it can, so gemini_response_stream()
+	   can splice(2) */
+	SSL_CTX_set_options(client->ssl, SSL_OP_ENABLE_KTLS);
+#endif
 	return 0;
 }
 
-struct gemini_response * gemini_client_request(struct gemini_client *client, const char *url) {
-	int fd, rc;
-	struct gemini_response *res;
-	struct addrinfo *info, hint, *rp;
-	struct gemini_url *u;
+/* OpenSSL hands us sessions as servers issue them, which (for TLS 1.3)
+   can be well after the handshake; the SSL remembers which host:port it
+   is talking to, and the SSL_CTX which client's sessions to put it in. */
+static int s_new_session(SSL *ssl, SSL_SESSION *sess) {
+	struct gemini_sessions *sessions;
+	const char *key;
+
+	sessions = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+	key = SSL_get_app_data(ssl);
+	if (!sessions || !key) {
+		return 0;
+	}
+
+	gemini_sessions_put(sessions, key, sess);
+	return 1; /* the session cache owns it now, one way or another */
+}
+
+int gemini_client_resolver(struct gemini_client *client, int ttl, int negative_ttl, int threads) {
+	if (client->resolver) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	client->resolver = gemini_resolver_new(ttl, negative_ttl, threads);
+	return client->resolver ? 0 : -1;
+}
+
+int gemini_client_sessions(struct gemini_client *client, size_t max, int ttl) {
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int i, mdlen;
+	X509 *cert;
+
+	if (!client->ssl || client->sessions) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	client->sessions = gemini_sessions_new(max, ttl);
+	if (!client->sessions) {
+		return -1;
+	}
+
+	/* a session resumes whatever identity it was established with, so
+	   sessions made with one client certificate mustn't be resumed with
+	   another (say, by the next run of gurl, reading the same file) */
+	cert = SSL_CTX_get0_certificate(client->ssl);
+	if (cert && X509_digest(cert, EVP_sha256(), md, &mdlen)) {
+		for (i = 0; i < 8 && i < mdlen; i++) {
+			snprintf(client->sessions->ident + 2 * i, 3, "%02x", md[i]);
+		}
+	}
+
+	SSL_CTX_set_app_data(client->ssl, client->sessions);
+	SSL_CTX_set_session_cache_mode(client->ssl, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(client->ssl, s_new_session);
+	return 0;
+}
+
+int gemini_client_store(struct gemini_client *client, const char *dir, size_t budget, int ttl) {
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int i, mdlen;
+	X509 *cert;
 
-	int port;
-	char p[6], *service;
+	if (!client->ssl || client->store) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	client->store = gemini_store_open(dir, budget, ttl);
+	if (!client->store) {
+		return -1;
+	}
 
+	/* what the server sends one client certificate isn't necessarily
+	   what it would send another */
+	cert = SSL_CTX_get0_certificate(client->ssl);
+	if (cert && X509_digest(cert, EVP_sha256(), md, &mdlen)) {
+		for (i = 0; i < 8 && i < mdlen; i++) {
+			snprintf(client->store->ident + 2 * i, 3, "%02x", md[i]);
+		}
+	}
+	return 0;
+}
+
+/* RFC 8305 has us alternate between address families, starting with
+   whichever one getaddrinfo(3) liked best, so that one broken family
+   can't keep us from trying the other. */
+static void s_interleave(struct gemini_addr *addrs, int n) {
+	struct gemini_addr sorted[GEMINI_RESOLVE_MAX];
+	int a, b, i, first;
+
+	first = addrs[0].sa.ss_family;
+	for (a = b = i = 0; i < n; i++) {
+		/* a chases the preferred family, b everything else */
+		while (a < n && addrs[a].sa.ss_family != first) a++;
+		while (b < n && addrs[b].sa.ss_family == first) b++;
+
+		if (a < n && (i % 2 == 0 || b >= n)) {
+			memcpy(&sorted[i], &addrs[a++], sizeof(struct gemini_addr));
+		} else {
+			memcpy(&sorted[i], &addrs[b++], sizeof(struct gemini_addr));
+		}
+	}
+	memcpy(addrs, sorted, n * sizeof(struct gemini_addr));
+}
+
+/* Connect to one of the n addresses, starting a new (non-blocking)
+   attempt every stagger milliseconds, or as soon as the previous one
+   fails, until one of them succeeds.  Returns the connected (still
+   non-blocking) socket, or -1 on failure. */
+static int s_connect(struct gemini_client *client, const char *name, struct gemini_addr *addrs, int n) {
+	struct pollfd fds[GEMINI_RESOLVE_MAX];
 	char host[NI_MAXHOST];
+	long now, next, deadline, wait;
+	int i, fd, rc, err, started, pending;
+	socklen_t len;
 
-	u = gemini_parse_url(url);
-	if (!u) {
-		return NULL;
+	s_interleave(addrs, n);
+
+	now = gemini_now_ms();
+	deadline = now + (client->connect_timeout > 0 ? client->connect_timeout : GEMINI_CONNECT_TIMEOUT);
+	next = now;
+	fd = -1;
+	err = ECONNREFUSED;
+	for (started = pending = 0; fd < 0; ) {
+		now = gemini_now_ms();
+		if (now >= deadline) {
+			err = ETIMEDOUT;
+			break;
+		}
+
+		if (started < n && now >= next) {
+			i = started++;
+			rc = socket(addrs[i].sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+			if (rc < 0) {
+				err = errno;
+				continue;
+			}
+
+			getnameinfo((struct sockaddr *)&addrs[i].sa, addrs[i].len, host, sizeof(host), NULL, 0, NI_NUMERICHOST);
+			fprintf(stderr, "connecting to %s (via %s)\n", name, host);
+
+			if (connect(rc, (struct sockaddr *)&addrs[i].sa, addrs[i].len) == 0) {
+				fd = rc;
+				break;
+			}
+			if (errno != EINPROGRESS) {
+				err = errno;
+				close(rc);
+				continue;
+			}
+			fds[pending].fd = rc;
+			fds[pending].events = POLLOUT;
+			pending++;
+			next = now + (client->stagger > 0 ? client->stagger : GEMINI_CONNECT_STAGGER);
+			continue;
+		}
+		if (pending == 0) {
+			break; /* nothing left to try */
+		}
+
+		wait = deadline - now;
+		if (started < n && next - now < wait) {
+			wait = next - now;
+		}
+		if (poll(fds, pending, wait) < 0 && errno != EINTR) {
+			err = errno;
+			break;
+		}
+
+		for (i = 0; i < pending && fd < 0; i++) {
+			if (!fds[i].revents) continue;
+
+			len = sizeof(rc);
+			if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &rc, &len) != 0) {
+				rc = errno;
+			}
+			if (rc == 0) {
+				fd = fds[i].fd;
+			} else {
+				err = rc;
+				close(fds[i].fd);
+				next = now; /* don't wait around to try the next one */
+			}
+			memmove(&fds[i], &fds[i+1], (pending - i - 1) * sizeof(struct pollfd));
+			pending--;
+			i--;
+		}
 	}
 
-	port = u->port;
-	service = p + 5;
-	*service-- = '\0';
-	while (service >= p && port > 0) {
-		*service-- = '0' + (port % 10);
-		port = port / 10;
+	for (i = 0; i < pending; i++) {
+		close(fds[i].fd);
+	}
+	if (fd < 0) {
+		errno = err;
 	}
-	service++;
+	return fd;
+}
 
-	memset(&hint, 0, sizeof(hint));
-	hint.ai_family = AF_INET;
-	hint.ai_socktype = SOCK_STREAM;
-	fprintf(stderr, "looking up '%s' (port '%s')...\n", u->host, service);
-	rc = getaddrinfo(u->host, service, &hint, &info);
-	if (rc != 0) {
-		free(u);
-		fprintf(stderr, "addrinfo error, lookup fail:  %s\n", gai_strerror(rc));
+/* After a non-blocking SSL_*() call returned rc, wait (until deadline)
+   for the socket to be ready for whatever OpenSSL wants to do next.
+   Returns 0 if the call should be retried, or -1 if it failed (or if we
+   ran out of time, in which case errno is ETIMEDOUT). */
+static int s_ssl_wait(SSL *ssl, int rc, long deadline) {
+	struct pollfd pfd;
+	long left;
+
+	switch (SSL_get_error(ssl, rc)) {
+	case SSL_ERROR_WANT_READ:  pfd.events = POLLIN;  break;
+	case SSL_ERROR_WANT_WRITE: pfd.events = POLLOUT; break;
+	default: return -1;
+	}
+
+	pfd.fd = SSL_get_fd(ssl);
+	for (;;) {
+		left = deadline - gemini_now_ms();
+		if (left <= 0) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		rc = poll(&pfd, 1, left);
+		if (rc > 0) return 0;
+		if (rc < 0 && errno != EINTR) return -1;
+	}
+}
+
+/* Set up the TLS side of a connection to u, on fd, resuming a previous
+   session if we have one. */
+static SSL * s_ssl(struct gemini_client *client, struct gemini_url *u, int fd) {
+	SSL *ssl;
+	SSL_SESSION *sess;
+	char key[NI_MAXHOST + 32];
+
+	ssl = SSL_new(client->ssl);
+	if (!ssl) {
 		return NULL;
 	}
+	SSL_set_fd(ssl, fd);
+	SSL_set_tlsext_host_name(ssl, u->host);
 
-	fd = -1;
-	for (rp = info; rp != NULL; rp = rp->ai_next) {
-		fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-		if (fd < 0) continue;
+	if (client->sessions) {
+		snprintf(key, sizeof(key), "%s:%u%s%s", u->host, u->port,
+			client->sessions->ident[0] ? "/" : "", client->sessions->ident);
+		SSL_set_app_data(ssl, strdup(key)); /* freed along with the SSL */
 
-		getnameinfo(rp->ai_addr, rp->ai_addrlen, host, sizeof(host), NULL, 0, NI_NUMERICHOST);
-		fprintf(stderr, "connecting to %s (via %s)\n", u->host, host);
+		sess = gemini_sessions_get(client->sessions, key);
+		if (sess) {
+			SSL_set_session(ssl, sess);
+			SSL_SESSION_free(sess);
+		}
+	}
+	return ssl;
+}
 
-		rc = connect(fd, rp->ai_addr, rp->ai_addrlen);
-		if (rc == 0) break;
+static void s_ssl_free(SSL *ssl) {
+	free(SSL_get_app_data(ssl));
+	SSL_free(ssl);
+}
 
-		close(fd);
-		fd = -1;
+/* Count a finished handshake towards the session cache's stats. */
+static void s_resumed(struct gemini_client *client, SSL *ssl) {
+	if (client->sessions && SSL_session_reused(ssl)) {
+		pthread_mutex_lock(&client->sessions->lock);
+		client->sessions->stats.resumed++;
+		pthread_mutex_unlock(&client->sessions->lock);
+	}
+}
+
+struct gemini_response * gemini_client_request(struct gemini_client *client, const char *url) {
+	int fd, rc, n, error;
+	long deadline;
+	struct gemini_response *res;
+	struct gemini_addr addrs[GEMINI_RESOLVE_MAX];
+	struct gemini_url *u;
+	char line[GEMINI_MAX_REQUEST + 3];
+
+	u = gemini_parse_url(url);
+	if (!u) {
+		return NULL;
+	}
+
+	/* a fresh enough copy on disk is as good as the real thing */
+	if (client->store && (fd = gemini_store_get(client->store, url)) >= 0) {
+		free(u);
+		res = calloc(1, sizeof(struct gemini_response));
+		if (!res) {
+			close(fd);
+			return NULL;
+		}
+		res->fd = fd;
+		return res;
 	}
-	freeaddrinfo(info);
 
+	fprintf(stderr, "looking up '%s' (port '%u')...\n", u->host, u->port);
+	n = gemini_resolve(client->resolver, u->host, u->port, addrs, GEMINI_RESOLVE_MAX, &error);
+	if (n < 0) {
+		free(u);
+		fprintf(stderr, "addrinfo error, lookup fail:  %s\n", gai_strerror(error));
+		return NULL;
+	}
+
+	fd = s_connect(client, u->host, addrs, n);
 	if (fd < 0) {
+		free(u);
 		return NULL;
 	}
 
-	res = malloc(sizeof(struct gemini_response));
+	res = calloc(1, sizeof(struct gemini_response));
 	if (!res) {
+		free(u);
 		close(fd);
 		return res;
 	}
+	res->fd = fd;
 
-	res->ssl = SSL_new(client->ssl);
+	res->ssl = s_ssl(client, u, fd);
+	free(u);
 	if (!res->ssl) {
 		fprintf(stderr, "ssl setup failed\n");
 		ERR_print_errors_fp(stderr);
@@ -111,20 +381,55 @@ struct gemini_response * gemini_client_request(struct gemini_client *client, con
 		free(res);
 		return NULL;
 	}
-	SSL_set_fd(res->ssl, fd);
 
-	if (SSL_connect(res->ssl) != 1) {
-		fprintf(stderr, "ssl handshake failed\n");
-		ERR_print_errors_fp(stderr);
-		close(fd);
-		SSL_free(res->ssl);
-		free(res);
-		return NULL;
+	deadline = gemini_now_ms() + (client->handshake_timeout > 0 ? client->handshake_timeout : GEMINI_HANDSHAKE_TIMEOUT);
+	while ((rc = SSL_connect(res->ssl)) != 1) {
+		if (s_ssl_wait(res->ssl, rc, deadline) != 0) {
+			fprintf(stderr, "ssl handshake %s\n", errno == ETIMEDOUT ? "timed out" : "failed");
+			ERR_print_errors_fp(stderr);
+			goto fail;
+		}
 	}
 
-	SSL_write(res->ssl, url, strlen(url));
-	SSL_write(res->ssl, "\r\n", 2);
+	s_resumed(client, res->ssl);
+
+	/* send the request, and wait for the response to start showing up;
+	   peeking (rather than polling the socket) keeps us from mistaking
+	   post-handshake TLS messages, like session tickets, for a response. */
+	deadline = gemini_now_ms() + (client->first_byte_timeout > 0 ? client->first_byte_timeout : GEMINI_FIRST_BYTE_TIMEOUT);
+	n = snprintf(line, sizeof(line), "%s\r\n", url);
+	if (n >= (int)sizeof(line)) {
+		errno = EINVAL;
+		goto fail;
+	}
+	while ((rc = SSL_write(res->ssl, line, n)) <= 0) {
+		if (s_ssl_wait(res->ssl, rc, deadline) != 0) {
+			goto fail;
+		}
+	}
+	while ((rc = SSL_peek(res->ssl, line, 1)) <= 0) {
+		if (s_ssl_wait(res->ssl, rc, deadline) != 0) {
+			if (errno == ETIMEDOUT) {
+				fprintf(stderr, "timed out waiting for a response\n");
+				goto fail;
+			}
+			break; /* end-of-file (or worse); the caller will find out */
+		}
+	}
+
+	/* from here on out, reads block */
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	if (client->store) {
+		res->fill = gemini_store_begin(client->store, url);
+	}
 	return res;
+
+fail:
+	error = errno;
+	gemini_response_close(res);
+	free(res);
+	errno = error;
+	return NULL;
 }
 
 void gemini_client_close(struct gemini_client *client) {
@@ -134,4 +439,607 @@ void gemini_client_close(struct gemini_client *client) {
 		SSL_CTX_free(client->ssl);
 		client->ssl = NULL;
 	}
+
+	gemini_sessions_free(client->sessions);
+	client->sessions = NULL;
+
+	gemini_resolver_free(client->resolver);
+	client->resolver = NULL;
+
+	gemini_store_close(client->store);
+	client->store = NULL;
+}
+
+/* The life of an asynchronous call. */
+#define CALL_LOOKING    1 /* waiting on the resolver */
+#define CALL_CONNECTING 2 /* waiting on one (or more) connection attempts */
+#define CALL_HANDSHAKE  3 /* in the TLS handshake */
+#define CALL_SENDING    4 /* sending the request line */
+#define CALL_HEADER     5 /* waiting on the status line */
+#define CALL_BODY       6 /* reading the response body */
+#define CALL_DEAD       7 /* finished, or cancelled */
+
+struct gemini_call {
+	struct gemini_call *prev, *next; /* gemini_async's live (or dead) calls */
+	struct gemini_call *looked;      /* next call whose lookup has finished */
+
+	struct gemini_async    *async;
+	struct gemini_callbacks cb;
+	void                   *data;
+
+	int   state;
+	int   error;    /* the last thing that went wrong */
+	long  deadline; /* when the current phase times out */
+	int   looking;  /* non-zero while the resolver has our address */
+
+	struct gemini_url *url;
+	char              *line; /* the request line, CRLF and all */
+	size_t             sent; /* how much of it is sent */
+
+	/* connection attempts, happy eyeballs style */
+	struct gemini_addr addrs[GEMINI_RESOLVE_MAX];
+	int                naddrs, tried;
+	int                fds[GEMINI_RESOLVE_MAX];
+	int                nfds;
+	long               next_attempt;
+
+	int      fd;     /* the winning connection */
+	SSL     *ssl;
+	uint32_t events; /* what we're waiting for on fd */
+
+	struct gemini_response res; /* just for parsing the status line */
+};
+
+static void s_timer(struct gemini_async *a, long when) {
+	if (when < a->next_timer) {
+		a->next_timer = when;
+	}
+}
+
+static void s_watch(struct gemini_call *call, int fd, uint32_t events, int op) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = events;
+	ev.data.ptr = call;
+	epoll_ctl(call->async->epfd, op, fd, &ev);
+}
+
+/* Wait for fd to become readable (or writable) before going on. */
+static void s_want(struct gemini_call *call, uint32_t events) {
+	if (call->events != events) {
+		s_watch(call, call->fd, events, EPOLL_CTL_MOD);
+		call->events = events;
+	}
+}
+
+static void s_unlink_call(struct gemini_call **list, struct gemini_call *call) {
+	if (call->prev) call->prev->next = call->next;
+	else            *list            = call->next;
+	if (call->next) call->next->prev = call->prev;
+	call->prev = call->next = NULL;
+}
+
+static void s_push_call(struct gemini_call **list, struct gemini_call *call) {
+	call->prev = NULL;
+	call->next = *list;
+	if (*list) (*list)->prev = call;
+	*list = call;
+}
+
+/* Let go of a call's sockets and TLS state, and move it to the dead list,
+   to be freed once nothing is looking at it. */
+static void s_bury(struct gemini_call *call) {
+	struct gemini_async *a;
+	int i;
+
+	if (call->state == CALL_DEAD) {
+		return;
+	}
+	a = call->async;
+
+	for (i = 0; i < call->nfds; i++) {
+		close(call->fds[i]);
+	}
+	call->nfds = 0;
+	if (call->ssl) {
+		s_ssl_free(call->ssl);
+		call->ssl = NULL;
+	}
+	if (call->fd >= 0) {
+		close(call->fd); /* which takes it out of the epoll set, too */
+		call->fd = -1;
+	}
+
+	call->state = CALL_DEAD;
+	a->outstanding--;
+	s_unlink_call(&a->calls, call);
+	s_push_call(&a->dead, call);
+}
+
+static void s_finish(struct gemini_call *call, int error) {
+	if (call->state == CALL_DEAD) {
+		return;
+	}
+	s_bury(call);
+	if (call->cb.done) {
+		call->cb.done(call, error, call->data);
+	}
+}
+
+static void s_free_call(struct gemini_call *call) {
+	free(call->url);
+	free(call->line);
+	free(call);
+}
+
+static void s_handshake(struct gemini_call *call, int fd);
+
+/* Start the next connection attempt, if there are any addresses left to
+   try; if there aren't, and nothing is pending, the call has failed. */
+static void s_attempt(struct gemini_call *call) {
+	struct gemini_addr *addr;
+	struct gemini_client *client;
+	int fd;
+
+	client = call->async->client;
+	while (call->tried < call->naddrs) {
+		addr = &call->addrs[call->tried++];
+		fd = socket(addr->sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0) {
+			call->error = errno;
+			continue;
+		}
+		if (connect(fd, (struct sockaddr *)&addr->sa, addr->len) != 0 && errno != EINPROGRESS) {
+			call->error = errno;
+			close(fd);
+			continue;
+		}
+
+		call->fds[call->nfds++] = fd;
+		s_watch(call, fd, EPOLLOUT, EPOLL_CTL_ADD);
+		call->next_attempt = gemini_now_ms() + (client->stagger > 0 ? client->stagger : GEMINI_CONNECT_STAGGER);
+		if (call->tried < call->naddrs) {
+			s_timer(call->async, call->next_attempt);
+		}
+		return;
+	}
+
+	if (call->nfds == 0) {
+		s_finish(call, call->error ? call->error : ECONNREFUSED);
+	}
+}
+
+/* See which of our connection attempts have come to something. */
+static void s_connecting(struct gemini_call *call) {
+	struct pollfd pfd;
+	socklen_t len;
+	int i, fd, err;
+
+	for (i = 0; i < call->nfds; i++) {
+		pfd.fd = call->fds[i];
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, 0) <= 0) {
+			continue;
+		}
+
+		len = sizeof(err);
+		if (getsockopt(pfd.fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0) {
+			err = errno;
+		}
+		if (err == 0) {
+			fd = call->fds[i];
+			call->fds[i] = call->fds[--call->nfds];
+			s_handshake(call, fd);
+			return;
+		}
+
+		/* that one's no good; on to the next, without waiting */
+		call->error = err;
+		close(call->fds[i]);
+		call->fds[i--] = call->fds[--call->nfds];
+		s_attempt(call);
+		if (call->state == CALL_DEAD) {
+			return;
+		}
+	}
+}
+
+/* We have a connection; drop the other attempts, and start up TLS. */
+static void s_handshake(struct gemini_call *call, int fd) {
+	struct gemini_client *client;
+	int i;
+
+	client = call->async->client;
+	for (i = 0; i < call->nfds; i++) {
+		close(call->fds[i]);
+	}
+	call->nfds = 0;
+
+	call->fd     = fd;
+	call->events = EPOLLOUT;
+	call->ssl    = s_ssl(client, call->url, fd);
+	if (!call->ssl) {
+		s_finish(call, ENOMEM);
+		return;
+	}
+
+	call->state    = CALL_HANDSHAKE;
+	call->deadline = gemini_now_ms() + (client->handshake_timeout > 0 ? client->handshake_timeout : GEMINI_HANDSHAKE_TIMEOUT);
+	s_timer(call->async, call->deadline);
+}
+
+/* Deal with an OpenSSL call that didn't do what we wanted; returns 0 if
+   we should wait and try again, or -1 if the call failed. */
+static int s_ssl_want(struct gemini_call *call, int rc) {
+	switch (SSL_get_error(call->ssl, rc)) {
+	case SSL_ERROR_WANT_READ:  s_want(call, EPOLLIN);  return 0;
+	case SSL_ERROR_WANT_WRITE: s_want(call, EPOLLOUT); return 0;
+	}
+	ERR_clear_error();
+	s_finish(call, EPROTO);
+	return -1;
+}
+
+/* Move a call along as far as it can go without blocking. */
+static void s_step(struct gemini_call *call) {
+	struct gemini_client *client;
+	char buf[GEMINI_STREAM_BLOCK_SIZE / 4];
+	int rc, n;
+
+	client = call->async->client;
+	switch (call->state) {
+	case CALL_CONNECTING:
+		s_connecting(call);
+		if (call->state != CALL_HANDSHAKE) {
+			return;
+		}
+		/* fall through */
+
+	case CALL_HANDSHAKE:
+		rc = SSL_connect(call->ssl);
+		if (rc != 1) {
+			s_ssl_want(call, rc);
+			return;
+		}
+		s_resumed(client, call->ssl);
+
+		call->state    = CALL_SENDING;
+		call->deadline = gemini_now_ms() + (client->first_byte_timeout > 0 ? client->first_byte_timeout : GEMINI_FIRST_BYTE_TIMEOUT);
+		s_timer(call->async, call->deadline);
+		/* fall through */
+
+	case CALL_SENDING:
+		while (call->line[call->sent]) {
+			rc = SSL_write(call->ssl, call->line + call->sent, strlen(call->line + call->sent));
+			if (rc <= 0) {
+				s_ssl_want(call, rc);
+				return;
+			}
+			call->sent += rc;
+		}
+		call->state = CALL_HEADER;
+		s_want(call, EPOLLIN);
+		/* fall through */
+
+	case CALL_HEADER:
+	case CALL_BODY:
+		for (;;) {
+			rc = SSL_read(call->ssl, buf, sizeof(buf));
+
+			if (rc <= 0) {
+				switch (SSL_get_error(call->ssl, rc)) {
+				case SSL_ERROR_WANT_READ:  s_want(call, EPOLLIN);  return;
+				case SSL_ERROR_WANT_WRITE: s_want(call, EPOLLOUT); return;
+
+				case SSL_ERROR_ZERO_RETURN:
+				case SSL_ERROR_SYSCALL: /* plenty of servers just hang up */
+					ERR_clear_error();
+					s_finish(call, call->state == CALL_BODY ? 0 : EPROTO);
+					return;
+				}
+				ERR_clear_error();
+				s_finish(call, EPROTO);
+				return;
+			}
+
+			if (call->state == CALL_BODY) {
+				if (call->cb.body) {
+					call->cb.body(call, buf, rc, call->data);
+				}
+				if (call->state == CALL_DEAD) {
+					return;
+				}
+				continue;
+			}
+
+			n = gemini_response_parse(&call->res, buf, rc);
+			if (n < 0) {
+				s_finish(call, EPROTO);
+				return;
+			}
+			if (!call->res.status) {
+				continue;
+			}
+			if (call->cb.status) {
+				call->cb.status(call, call->res.status, call->res.meta, call->data);
+				if (call->state == CALL_DEAD) {
+					return;
+				}
+			}
+
+			/* the response has started; from here on out, it can take
+			   as long as it likes */
+			call->state    = CALL_BODY;
+			call->deadline = 0;
+			if (n < rc && call->cb.body) {
+				call->cb.body(call, buf + n, rc - n, call->data);
+			}
+		}
+
+	default:
+		return;
+	}
+}
+
+/* Called (from a resolver thread, probably) when a lookup finishes. */
+static void s_looked(void *_call, const struct gemini_addr *addrs, int n, int error) {
+	struct gemini_call *call;
+	struct gemini_async *a;
+	uint64_t one = 1;
+
+	call = _call;
+	a = call->async;
+	if (n > 0) {
+		memcpy(call->addrs, addrs, n * sizeof(struct gemini_addr));
+	}
+	call->naddrs = n > 0 ? n : 0;
+
+	/* wake the event loop before letting go of the lock; as soon as
+	   looking drops to zero, gemini_async_free() may close wakefd and
+	   free the whole thing out from under us */
+	pthread_mutex_lock(&a->lock);
+	call->looked = a->looked;
+	a->looked = call;
+	if (write(a->wakefd, &one, sizeof(one)) < 0) {
+		/* the counter is already non-zero; it'll wake up */
+	}
+	a->looking--;
+	pthread_cond_broadcast(&a->idle);
+	pthread_mutex_unlock(&a->lock);
+}
+
+/* Pick up the calls whose lookups have finished, and start connecting. */
+static void s_connect_looked(struct gemini_async *a) {
+	struct gemini_call *call, *next;
+	struct gemini_client *client;
+	uint64_t n;
+
+	if (read(a->wakefd, &n, sizeof(n)) < 0) {
+		/* nothing to read; that's fine */
+	}
+
+	pthread_mutex_lock(&a->lock);
+	call = a->looked;
+	a->looked = NULL;
+	pthread_mutex_unlock(&a->lock);
+
+	client = a->client;
+	for (; call; call = next) {
+		next = call->looked;
+		call->looking = 0;
+		if (call->state == CALL_DEAD) {
+			continue; /* cancelled while we were looking */
+		}
+		if (call->naddrs == 0) {
+			s_finish(call, EHOSTUNREACH);
+			continue;
+		}
+
+		s_interleave(call->addrs, call->naddrs);
+		call->state    = CALL_CONNECTING;
+		call->deadline = gemini_now_ms() + (client->connect_timeout > 0 ? client->connect_timeout : GEMINI_CONNECT_TIMEOUT);
+		s_timer(a, call->deadline);
+		s_attempt(call);
+	}
+}
+
+/* Time out whoever has run out of time, start staggered connection
+   attempts that are due, and work out when we need to do this next. */
+static void s_timers(struct gemini_async *a) {
+	struct gemini_call *call, *next;
+	long now;
+
+	now = gemini_now_ms();
+	if (now < a->next_timer) {
+		return;
+	}
+
+	a->next_timer = LONG_MAX;
+	for (call = a->calls; call; call = next) {
+		next = call->next;
+		if (call->deadline && now >= call->deadline) {
+			s_finish(call, ETIMEDOUT);
+			continue;
+		}
+
+		if (call->state == CALL_CONNECTING && call->tried < call->naddrs) {
+			if (now >= call->next_attempt) {
+				s_attempt(call);
+				if (call->state == CALL_DEAD) continue;
+			}
+			if (call->tried < call->naddrs) {
+				s_timer(a, call->next_attempt);
+			}
+		}
+		if (call->deadline) {
+			s_timer(a, call->deadline);
+		}
+	}
+}
+
+/* Free the dead, unless the resolver still has hold of them. */
+static void s_reap(struct gemini_async *a) {
+	struct gemini_call *call, *next;
+
+	for (call = a->dead; call; call = next) {
+		next = call->next;
+		if (!call->looking) {
+			s_unlink_call(&a->dead, call);
+			s_free_call(call);
+		}
+	}
+}
+
+struct gemini_async * gemini_async_new(struct gemini_client *client) {
+	struct gemini_async *a;
+	struct epoll_event ev;
+
+	a = calloc(1, sizeof(struct gemini_async));
+	if (!a) {
+		return NULL;
+	}
+	a->client     = client;
+	a->next_timer = LONG_MAX;
+	a->epfd       = epoll_create1(EPOLL_CLOEXEC);
+	a->wakefd     = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	a->resolver = client->resolver;
+	if (!a->resolver) {
+		a->resolver = gemini_resolver_new(0, 0, 0);
+		a->own_resolver = 1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL; /* that's the wakefd */
+	if (a->epfd < 0 || a->wakefd < 0 || !a->resolver
+	 || epoll_ctl(a->epfd, EPOLL_CTL_ADD, a->wakefd, &ev) != 0) {
+		if (a->epfd >= 0) close(a->epfd);
+		if (a->wakefd >= 0) close(a->wakefd);
+		if (a->own_resolver) gemini_resolver_free(a->resolver);
+		free(a);
+		return NULL;
+	}
+
+	pthread_mutex_init(&a->lock, NULL);
+	pthread_cond_init(&a->idle, NULL);
+	return a;
+}
+
+struct gemini_call * gemini_async_request(struct gemini_async *a, const char *url, const struct gemini_callbacks *cb, void *data) {
+	struct gemini_call *call;
+	size_t len;
+
+	call = calloc(1, sizeof(struct gemini_call));
+	if (!call) {
+		return NULL;
+	}
+	call->async = a;
+	call->data  = data;
+	call->fd    = -1;
+	if (cb) {
+		memcpy(&call->cb, cb, sizeof(call->cb));
+	}
+
+	len = strlen(url);
+	call->url  = gemini_parse_url(url);
+	call->line = malloc(len + 3);
+	if (!call->url || !call->line || len > GEMINI_MAX_REQUEST) {
+		s_free_call(call);
+		errno = EINVAL;
+		return NULL;
+	}
+	memcpy(call->line, url, len);
+	memcpy(call->line + len, "\r\n", 3);
+
+	call->state   = CALL_LOOKING;
+	call->looking = 1;
+	s_push_call(&a->calls, call);
+	a->outstanding++;
+
+	pthread_mutex_lock(&a->lock);
+	a->looking++;
+	pthread_mutex_unlock(&a->lock);
+
+	if (gemini_resolve_async(a->resolver, call->url->host, call->url->port, s_looked, call) != 0) {
+		pthread_mutex_lock(&a->lock);
+		a->looking--;
+		pthread_mutex_unlock(&a->lock);
+
+		s_unlink_call(&a->calls, call);
+		a->outstanding--;
+		s_free_call(call);
+		return NULL;
+	}
+	return call;
+}
+
+void gemini_async_cancel(struct gemini_async *a, struct gemini_call *call) {
+	s_bury(call);
+}
+
+int gemini_async_run(struct gemini_async *a, int timeout) {
+	struct epoll_event events[64];
+	struct gemini_call *call;
+	int i, n, wait;
+
+	wait = gemini_async_timeout(a);
+	if (wait < 0 || (timeout >= 0 && timeout < wait)) {
+		wait = timeout;
+	}
+
+	n = epoll_wait(a->epfd, events, sizeof(events) / sizeof(events[0]), wait);
+	for (i = 0; i < n; i++) {
+		call = events[i].data.ptr;
+		if (!call) {
+			s_connect_looked(a);
+		} else if (call->state != CALL_DEAD) {
+			s_step(call);
+		}
+	}
+
+	s_timers(a);
+	s_reap(a);
+	return a->outstanding;
+}
+
+int gemini_async_fd(struct gemini_async *a) {
+	return a->epfd;
+}
+
+int gemini_async_timeout(struct gemini_async *a) {
+	long left;
+
+	if (a->next_timer == LONG_MAX) {
+		return -1;
+	}
+	left = a->next_timer - gemini_now_ms();
+	return left < 0 ? 0 : left > INT_MAX ? INT_MAX : left;
+}
+
+void gemini_async_free(struct gemini_async *a) {
+	if (!a) return;
+
+	while (a->calls) {
+		s_bury(a->calls);
+	}
+
+	/* the resolver may still be working on some of them */
+	pthread_mutex_lock(&a->lock);
+	while (a->looking > 0) {
+		pthread_cond_wait(&a->idle, &a->lock);
+	}
+	pthread_mutex_unlock(&a->lock);
+	s_connect_looked(a);
+	s_reap(a);
+
+	if (a->own_resolver) {
+		gemini_resolver_free(a->resolver);
+	}
+	close(a->epfd);
+	close(a->wakefd);
+	pthread_cond_destroy(&a->idle);
+	pthread_mutex_destroy(&a->lock);
+	free(a);
 }
@@ -0,0 +1,10 @@
+#include "./gemini.h"
+
+#include <time.h>
+
+long gemini_now_ms() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,251 @@
+#include "./gemini.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+struct _coalesce {
+	struct _coalesce *next;
+
+	char         *prefix;
+	unsigned int  max_waiters;
+	int           timeout;
+};
+
+struct gemini_flight {
+	char          *key;    /* what everyone on the flight asked for */
+	pthread_cond_t landed; /* broadcast when the leader is done */
+
+	unsigned int max_waiters;
+	unsigned int waiters; /* how many are waiting, right now */
+	int refs;             /* the leader, plus whoever is waiting */
+	int done;             /* non-zero once the leader is done */
+	int shared;           /* non-zero if the response can be shared */
+
+	char   *data; /* the leader's response, as sent */
+	size_t  len, cap;
+	int     overflow; /* non-zero if the response outgrew data */
+
+	void  (*tap)(void *, const void *, size_t); /* whoever was tapping before us */
+	void   *tapdata;
+};
+
+static void s_tap(void *_f, const void *buf, size_t n) {
+	struct gemini_flight *f;
+	char *data;
+	size_t want;
+
+	f = _f;
+	if (f->tap) {
+		f->tap(f->tapdata, buf, n);
+	}
+
+	if (f->overflow) {
+		return;
+	}
+	if (f->len + n > f->cap) {
+		if (f->len + n > GEMINI_FLIGHT_MAX) {
+			f->overflow = 1;
+			return;
+		}
+		for (want = f->cap ? f->cap : 4096; want < f->len + n; want *= 2)
+			;
+		data = realloc(f->data, want);
+		if (!data) {
+			f->overflow = 1;
+			return;
+		}
+		f->data = data;
+		f->cap  = want;
+	}
+	memcpy(f->data + f->len, buf, n);
+	f->len += n;
+}
+
+/* Drop a reference to a flight; called with the lock held. */
+static void s_unref(struct gemini_flight *f) {
+	if (--f->refs == 0) {
+		pthread_cond_destroy(&f->landed);
+		free(f->key);
+		free(f->data);
+		free(f);
+	}
+}
+
+static struct _coalesce * s_coalesce(struct gemini_flights *fl, const char *path) {
+	struct _coalesce *c, *best;
+
+	for (best = NULL, c = fl->prefixes; c; c = c->next) {
+		if (strncmp(path, c->prefix, strlen(c->prefix)) == 0
+		 && (!best || strlen(c->prefix) > strlen(best->prefix))) {
+			best = c;
+		}
+	}
+	return best;
+}
+
+/* Wait for the flight to land, and answer the request with its response.
+   Returns 1 if that worked out, or 0 if the caller has to handle the
+   request itself.  Called (and returns) with the lock held. */
+static int s_wait(struct gemini_flights *fl, struct gemini_flight *f, struct gemini_request *req, int timeout) {
+	struct timespec deadline;
+	int rc;
+
+	f->waiters++;
+	f->refs++;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout;
+	for (rc = 0; !f->done && rc != ETIMEDOUT; ) {
+		rc = pthread_cond_timedwait(&f->landed, &fl->lock, &deadline);
+	}
+	f->waiters--;
+
+	if (!f->done) {
+		fl->stats.timeouts++;
+		s_unref(f);
+		return 0;
+	}
+	if (!f->shared) {
+		fl->stats.failures++;
+		s_unref(f);
+		return 0;
+	}
+	fl->stats.coalesced++;
+
+	/* the response won't change now that the flight has landed, and our
+	   reference keeps it around, so we can send it without the lock. */
+	pthread_mutex_unlock(&fl->lock);
+	if (gemini_request_write(req, f->data, f->len) < 0) {
+		fprintf(stderr, "[gemini_flights] short write!\n");
+	}
+	gemini_request_close(req);
+	pthread_mutex_lock(&fl->lock);
+
+	s_unref(f);
+	return 1;
+}
+
+int gemini_flights_begin(struct gemini_flights *fl, struct gemini_request *req, struct gemini_flight **flight) {
+	struct gemini_flight *f;
+	struct _coalesce *c;
+	char key[GEMINI_MAX_KEY];
+	int rc;
+
+	*flight = NULL;
+	c = s_coalesce(fl, req->url->path);
+	if (!c) {
+		return 0;
+	}
+	gemini_request_key(req, key, sizeof(key), 1);
+
+	pthread_mutex_lock(&fl->lock);
+	f = gemini_map_get(&fl->inflight, key);
+	if (f) {
+		if (f->waiters >= f->max_waiters) {
+			fl->stats.overflows++;
+			rc = 0;
+		} else {
+			rc = s_wait(fl, f, req, c->timeout);
+		}
+		pthread_mutex_unlock(&fl->lock);
+		return rc;
+	}
+
+	/* nobody else is on it; we'll lead a new flight */
+	f = calloc(1, sizeof(struct gemini_flight));
+	if (!f || !(f->key = strdup(key))) {
+		free(f);
+		pthread_mutex_unlock(&fl->lock);
+		return 0;
+	}
+	pthread_cond_init(&f->landed, NULL);
+	f->max_waiters = c->max_waiters;
+	f->refs = 1;
+
+	if (gemini_map_set(&fl->inflight, key, f) == f) {
+		s_unref(f);
+		pthread_mutex_unlock(&fl->lock);
+		return 0;
+	}
+	fl->stats.flights++;
+	pthread_mutex_unlock(&fl->lock);
+
+	f->tap       = req->tap;
+	f->tapdata   = req->tapdata;
+	req->tap     = s_tap;
+	req->tapdata = f;
+	*flight = f;
+	return 0;
+}
+
+void gemini_flights_end(struct gemini_flights *fl, struct gemini_request *req, struct gemini_flight *f) {
+	req->tap     = f->tap;
+	req->tapdata = f->tapdata;
+
+	/* anyone who comes along after this starts a new flight */
+	pthread_mutex_lock(&fl->lock);
+	gemini_map_delete(&fl->inflight, f->key);
+	f->done   = 1;
+	f->shared = !f->overflow && f->len > 0 && req->maxage != 0;
+	pthread_cond_broadcast(&f->landed);
+	s_unref(f);
+	pthread_mutex_unlock(&fl->lock);
+}
+
+int gemini_coalesce(struct gemini_server *server, const char *prefix, unsigned int max_waiters, int timeout) {
+	struct gemini_flights *fl;
+	struct _coalesce *c;
+
+	if (!server->flights) {
+		fl = calloc(1, sizeof(struct gemini_flights));
+		if (!fl) {
+			return -1;
+		}
+		if (gemini_map_init(&fl->inflight, 64) != 0) {
+			free(fl);
+			return -1;
+		}
+		pthread_mutex_init(&fl->lock, NULL);
+		server->flights = fl;
+	}
+
+	c = calloc(1, sizeof(struct _coalesce));
+	if (!c) {
+		return -1;
+	}
+	c->prefix = strdup(prefix);
+	if (!c->prefix) {
+		free(c);
+		return -1;
+	}
+	c->max_waiters = max_waiters ? max_waiters : GEMINI_FLIGHT_WAITERS;
+	c->timeout     = timeout > 0 ? timeout : GEMINI_FLIGHT_TIMEOUT;
+
+	c->next = server->flights->prefixes;
+	server->flights->prefixes = c;
+	return 0;
+}
+
+void gemini_flights_stats(struct gemini_flights *fl, struct gemini_flights_stats *stats) {
+	pthread_mutex_lock(&fl->lock);
+	memcpy(stats, &fl->stats, sizeof(struct gemini_flights_stats));
+	pthread_mutex_unlock(&fl->lock);
+}
+
+void gemini_flights_free(struct gemini_flights *fl) {
+	struct _coalesce *c, *next;
+
+	if (!fl) return;
+
+	for (c = fl->prefixes; c; c = next) {
+		next = c->next;
+		free(c->prefix);
+		free(c);
+	}
+	gemini_map_free(&fl->inflight, NULL);
+	pthread_mutex_destroy(&fl->lock);
+	free(fl);
+}
@@ -67,30 +67,24 @@ static int s_parse_path(struct _parser *p) {
 	}
 }
 
-char * gemini_fs_resolve(const char *file) {
-	char *path, *p, *q;
+int gemini_fs_resolve_into(const char *file, char *path) {
+	char *p, *q;
 	int deep = 0;
 	size_t left;
 	struct _parser parser;
 
 	if (file == NULL) {
-		return NULL;
+		return -1;
 	}
 
 	memset(&parser, 0, sizeof(parser));
 	parser.src = file;
-
-	path = malloc(GEMINI_MAX_PATH+1);
-	if (!path) {
-		return NULL;
-	}
 	memset(path, 0, GEMINI_MAX_PATH+1);
 
 	for (;;) {
 		switch (s_parse_path(&parser)) {
 		case PARSED_ERR:
-			free(path);
-			return NULL;
+			return -1;
 
 		case PARSED_DIR:
 			left = GEMINI_MAX_PATH - strlen(path) - 1;
@@ -117,28 +111,42 @@ char * gemini_fs_resolve(const char *file) {
 			break;
 
 		case PARSED_END:
-			return path;
+			return 0;
 		}
 	}
 }
 
-int gemini_fs_open(struct gemini_fs *fs, const char *file, int flags) {
+char * gemini_fs_resolve(const char *file) {
 	char *path;
+
+	path = malloc(GEMINI_MAX_PATH+1);
+	if (!path) {
+		return NULL;
+	}
+
+	if (gemini_fs_resolve_into(file, path) != 0) {
+		free(path);
+		return NULL;
+	}
+	return path;
+}
+
+int gemini_fs_open(struct gemini_fs *fs, const char *file, int flags) {
+	char path[GEMINI_MAX_PATH+1];
 	int dirfd, fd, rc;
 	struct stat st;
 
-	dirfd = open(fs->root, O_RDONLY);
-	if (dirfd < 0) {
+	if (gemini_fs_resolve_into(file, path) != 0) {
 		return -1;
 	}
 
-	path = gemini_fs_resolve(file);
-	if (!path) {
+	dirfd = open(fs->root, O_RDONLY | O_CLOEXEC);
+	if (dirfd < 0) {
 		return -1;
 	}
 
-	fd = openat(dirfd, path, flags);
-	free(path);
+	fd = openat(dirfd, path, flags | O_CLOEXEC);
+	close(dirfd);
 	if (fd < 0) {
 		return -1;
 	}
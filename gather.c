@@ -0,0 +1,376 @@
+#include "./gemini.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+
+#define PART_WAITING 0 /* not asked yet */
+#define PART_ASKING  1 /* asked, and not done answering */
+#define PART_DONE    2 /* answered, failed, or given up on */
+
+/* What one upstream had to say, for one inbound request. */
+struct _part {
+	struct _gathering  *g;
+	const char         *url;   /* with the inbound query string, if any */
+	int                 state; /* PART_WAITING, PART_ASKING or PART_DONE */
+	struct gemini_call *call;
+	long                started;
+
+	int    status;
+	char   meta[GEMINI_MAX_META + 1];
+	char  *body;
+	size_t len, cap;
+	int    truncated; /* there was more than GEMINI_GATHER_BODY of it */
+};
+
+/* One inbound request, and the upstreams it is waiting on. */
+struct _gathering {
+	struct gemini_gather  *gather;
+	struct gemini_request *req;
+	struct gemini_async   *async;
+	struct _part          *parts;
+
+	int next;   /* the next upstream to ask */
+	int asking; /* how many are being asked right now */
+	int gone;   /* the client has stopped listening */
+
+	int answered, failed, timedout, skipped;
+};
+
+static void s_write(struct _gathering *g, const void *buf, size_t n) {
+	if (!g->gone && gemini_request_write(g->req, buf, n) < 0) {
+		g->gone = 1;
+	}
+}
+
+static void s_printf(struct _gathering *g, const char *fmt, ...) {
+	char line[GEMINI_MAX_REQUEST + GEMINI_MAX_META + 64];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	if (n > 0) {
+		s_write(g, line, (size_t)n < sizeof(line) ? (size_t)n : sizeof(line) - 1);
+	}
+}
+
+/* Pass along the body of a part.  Gemtext goes in as it is (closing any
+   preformatted block it leaves open, so that it doesn't swallow the rest
+   of the document); other text goes in a preformatted block of its own,
+   with a space in front of anything that would end it early; anything
+   else is only described. */
+static void s_show(struct _gathering *g, struct _part *p) {
+	const char *s, *eol, *end;
+	int gemtext, fenced;
+
+	if (p->status != 20 || p->len == 0) {
+		return;
+	}
+	if (strncmp(p->meta, "text/", 5) != 0) {
+		s_printf(g, "(%zu%s octets of %s, not shown)\n", p->len, p->truncated ? "+" : "", p->meta);
+		return;
+	}
+
+	gemtext = strncmp(p->meta, "text/gemini", 11) == 0;
+	fenced = 0;
+	if (!gemtext) {
+		s_write(g, "```\n", 4);
+	}
+	for (s = p->body, end = p->body + p->len; s < end; s = eol) {
+		eol = memchr(s, '\n', end - s);
+		eol = eol ? eol + 1 : end;
+		if (eol - s >= 3 && memcmp(s, "```", 3) == 0) {
+			if (gemtext) fenced = !fenced;
+			else         s_write(g, " ", 1);
+		}
+		s_write(g, s, eol - s);
+	}
+	if (end[-1] != '\n') {
+		s_write(g, "\n", 1);
+	}
+	if (fenced || !gemtext) {
+		s_write(g, "```\n", 4);
+	}
+	if (p->truncated) {
+		s_printf(g, "(cut off after %d octets)\n", GEMINI_GATHER_BODY);
+	}
+}
+
+/* Send a part's section of the document on its way, as soon as there is
+   nothing more to wait for.  error is 0 for an answer, an errno value for
+   a failure, or -1 for an upstream that never got asked. */
+static void s_section(struct _gathering *g, struct _part *p, int error) {
+	long ms;
+
+	ms = gemini_now_ms() - p->started;
+	gemini_request_cork(g->req);
+	s_printf(g, "## %s\n", p->url);
+	if (error < 0) {
+		s_printf(g, "Not asked; out of time\n");
+	} else if (error == ETIMEDOUT) {
+		s_printf(g, "Timed out after %ldms\n", ms);
+	} else if (error) {
+		s_printf(g, "Failed after %ldms: %s\n", ms, strerror(error));
+	} else {
+		s_printf(g, "=> %s %d %s (%ldms)\n", p->url, p->status, p->meta, ms);
+		s_show(g, p);
+	}
+	s_write(g, "\n", 1);
+	if (!g->gone && gemini_request_uncork(g->req) != 0) {
+		g->gone = 1;
+	}
+}
+
+static void s_ask(struct _gathering *g);
+
+/* A part is finished with, one way or another. */
+static void s_finish(struct _part *p, int error) {
+	struct _gathering *g;
+
+	g = p->g;
+	p->state = PART_DONE;
+	p->call  = NULL;
+	g->asking--;
+
+	if      (error == ETIMEDOUT) g->timedout++;
+	else if (error)              g->failed++;
+	else                         g->answered++;
+
+	s_section(g, p, error);
+	free(p->body);
+	p->body = NULL;
+
+	s_ask(g); /* make room for the next one */
+}
+
+static void s_status(struct gemini_call *call, int status, const char *meta, void *_p) {
+	struct _part *p = _p;
+
+	p->status = status;
+	snprintf(p->meta, sizeof(p->meta), "%s", meta);
+}
+
+static void s_chunk(struct gemini_call *call, const void *buf, size_t n, void *_p) {
+	struct _part *p = _p;
+	size_t cap;
+	char *body;
+
+	if (p->len + n > GEMINI_GATHER_BODY) {
+		p->truncated = 1;
+		n = GEMINI_GATHER_BODY - p->len;
+	}
+	if (p->len + n > p->cap) {
+		for (cap = p->cap ? p->cap : 4096; cap < p->len + n; cap *= 2)
+			;
+		cap = cap < GEMINI_GATHER_BODY ? cap : GEMINI_GATHER_BODY;
+		body = realloc(p->body, cap);
+		if (!body) {
+			p->truncated = 1;
+			return;
+		}
+		p->body = body;
+		p->cap  = cap;
+	}
+	memcpy(p->body + p->len, buf, n);
+	p->len += n;
+}
+
+static void s_done(struct gemini_call *call, int error, void *_p) {
+	s_finish(_p, error);
+}
+
+/* Ask as many more upstreams as the concurrency limit allows. */
+static void s_ask(struct _gathering *g) {
+	static const struct gemini_callbacks cb = { s_status, s_chunk, s_done };
+	struct gemini_gather *gather;
+	struct _part *p;
+
+	gather = g->gather;
+	while (!g->gone && g->next < gather->n
+	    && (gather->concurrency <= 0 || g->asking < gather->concurrency)) {
+		p = &g->parts[g->next++];
+		p->state   = PART_ASKING;
+		p->started = gemini_now_ms();
+		g->asking++;
+
+		errno = 0;
+		p->call = gemini_async_request(g->async, p->url, &cb, p);
+		if (!p->call) {
+			s_finish(p, errno ? errno : EINVAL);
+		}
+	}
+}
+
+struct gemini_gather * gemini_gather_new(const char **urls, int n, int concurrency, int deadline) {
+	struct gemini_gather *gather;
+	struct gemini_url *url;
+	int i;
+
+	if (n < 1) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	gather = calloc(1, sizeof(struct gemini_gather));
+	if (!gather) {
+		return NULL;
+	}
+	pthread_mutex_init(&gather->lock, NULL);
+	gather->concurrency = concurrency;
+	gather->deadline    = deadline > 0 ? deadline : GEMINI_GATHER_DEADLINE;
+
+	gather->urls = calloc(n, sizeof(char *));
+	if (!gather->urls) {
+		goto fail;
+	}
+	for (i = 0; i < n; i++) {
+		url = gemini_parse_url(urls[i]);
+		if (!url) {
+			fprintf(stderr, "[gemini_gather] %s is not a valid gemini:// URL\n", urls[i]);
+			errno = EINVAL;
+			goto fail;
+		}
+		free(url);
+		gather->urls[i] = strdup(urls[i]);
+		gather->n = i + 1;
+		if (!gather->urls[i]) {
+			goto fail;
+		}
+	}
+
+	if (gemini_client_tls(&gather->client, NULL, NULL) != 0
+	 || gemini_client_sessions(&gather->client, 0, 0) != 0
+	 || gemini_client_resolver(&gather->client, 0, 0, 0) != 0) {
+		goto fail;
+	}
+	return gather;
+
+fail:
+	gemini_gather_free(gather);
+	return NULL;
+}
+
+void gemini_gather_stats(struct gemini_gather *gather, struct gemini_gather_stats *stats) {
+	pthread_mutex_lock(&gather->lock);
+	memcpy(stats, &gather->stats, sizeof(struct gemini_gather_stats));
+	pthread_mutex_unlock(&gather->lock);
+}
+
+void gemini_gather_free(struct gemini_gather *gather) {
+	int i;
+
+	if (!gather) return;
+
+	gemini_client_close(&gather->client);
+	for (i = 0; gather->urls && i < gather->n; i++) {
+		free(gather->urls[i]);
+	}
+	free(gather->urls);
+	pthread_mutex_destroy(&gather->lock);
+	free(gather);
+}
+
+int gemini_gather_handler(const char *prefix, struct gemini_request *req, void *_gather) {
+	struct gemini_gather *gather;
+	struct _gathering g;
+	struct _part *p;
+	const char *query;
+	char *url;
+	long start, left;
+	int i, n;
+
+	gather = _gather;
+	memset(&g, 0, sizeof(g));
+	g.gather = gather;
+	g.req    = req;
+	g.parts  = gemini_request_alloc(req, gather->n * sizeof(struct _part));
+	if (!g.parts) {
+		return GEMINI_HANDLER_ABORT;
+	}
+	memset(g.parts, 0, gather->n * sizeof(struct _part));
+
+	/* the inbound query string, if there is one, is the query for
+	   every upstream, in place of any they were configured with */
+	query = strchr(req->url->path, '?');
+	for (i = 0; i < gather->n; i++) {
+		p = &g.parts[i];
+		p->g = &g;
+		p->url = gather->urls[i];
+		if (query) {
+			url = gemini_request_alloc(req, GEMINI_MAX_REQUEST + 1);
+			if (!url) {
+				return GEMINI_HANDLER_ABORT;
+			}
+			n = snprintf(url, GEMINI_MAX_REQUEST + 1, "%.*s%s",
+				(int)strcspn(p->url, "?"), p->url, query);
+			if (n < 0 || n > GEMINI_MAX_REQUEST) {
+				gemini_request_respond(req, 59, "Request Too Long");
+				gemini_request_close(req);
+				return GEMINI_HANDLER_DONE;
+			}
+			p->url = url;
+		}
+	}
+
+	g.async = gemini_async_new(&gather->client);
+	if (!g.async) {
+		return GEMINI_HANDLER_ABORT;
+	}
+
+	start = gemini_now_ms();
+	gemini_request_cork(req);
+	gemini_request_respond(req, 20, "text/gemini");
+	s_printf(&g, "# %d upstreams\n\n", gather->n);
+	if (gemini_request_uncork(req) != 0) {
+		g.gone = 1;
+	}
+
+	/* sections go out in the order their upstreams finish */
+	s_ask(&g);
+	while (g.asking > 0 && !g.gone && (left = start + gather->deadline - gemini_now_ms()) > 0) {
+		gemini_async_run(g.async, left);
+	}
+
+	/* whoever is left is out of time (unless the client gave up first) */
+	for (i = 0; i < gather->n; i++) {
+		p = &g.parts[i];
+		if (p->state == PART_ASKING) {
+			gemini_async_cancel(g.async, p->call);
+			if (!g.gone) {
+				g.timedout++;
+				s_section(&g, p, ETIMEDOUT);
+			}
+
+		} else if (p->state == PART_WAITING && !g.gone) {
+			p->started = gemini_now_ms();
+			g.skipped++;
+			s_section(&g, p, -1);
+		}
+		free(p->body);
+	}
+
+	s_printf(&g, "%d answered, %d failed, %d timed out, %d not asked, in %ldms\n",
+		g.answered, g.failed, g.timedout, g.skipped, gemini_now_ms() - start);
+	if (g.failed || g.timedout || g.skipped) {
+		req->maxage = 0; /* don't cache an incomplete picture */
+	}
+
+	pthread_mutex_lock(&gather->lock);
+	gather->stats.requests++;
+	gather->stats.calls    += g.answered + g.failed + g.timedout;
+	gather->stats.failures += g.failed;
+	gather->stats.timeouts += g.timedout;
+	gather->stats.skipped  += g.skipped;
+	pthread_mutex_unlock(&gather->lock);
+
+	/* freeing waits out any name lookups still going (an upstream
+	   whose DNS is slow, say), so the client gets its answer first */
+	gemini_request_close(req);
+	gemini_async_free(g.async);
+	return GEMINI_HANDLER_DONE;
+}
@@ -2,6 +2,10 @@
 #define __GEMINON_GEMINI_H
 
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <signal.h>
+#include <pthread.h>
 #include <openssl/ssl.h>
 
 /* Handlers should return GEMINI_HANDLER_CONTINUE to have the core continue
@@ -29,14 +33,45 @@
 /* The maximum size (in bytes) of a response status line */
 #define GEMINI_MAX_RESPONSE 256
 
+/* The maximum size (in bytes) of the meta field of a response status line
+   that we'll accept from a server, per the protocol. */
+#define GEMINI_MAX_META 1024
+
 /* The maximum size (in bytes) of a single filesystem component */
 #define GEMINI_MAX_PATH    2048
 
 /* How large should the server's backlog of unaccepted connections be? */
 #define GEMINI_LISTEN_BACKLOG    1024
 
-/* Preferred block size to use for streaming fd-to-fd copies */
-#define GEMINI_STREAM_BLOCK_SIZE 8192
+/* Preferred block size to use for streaming fd-to-fd copies.  This is big
+   enough to hold a few maximum-sized TLS records, so that the server-side
+   streaming writer can read ahead of what it is sending. */
+#define GEMINI_STREAM_BLOCK_SIZE 65536
+
+/* When streaming a response body, the server starts out sending small TLS
+   records, each of which fits comfortably in a single TCP segment, so that
+   the client can start decrypting (and displaying) the response as soon as
+   the first packet arrives, rather than waiting for a full 16k record to
+   trickle in over a cold congestion window.  Once GEMINI_TLS_RAMP octets
+   have gone out, it switches over to maximum-sized records, to cut down on
+   per-record overhead for bulk transfers.
+ */
+#define GEMINI_TLS_RECORD_SMALL 1360
+#define GEMINI_TLS_RECORD_MAX   16384
+#define GEMINI_TLS_RAMP         (64 * 1024)
+
+/* Files at least this large (in octets) get posix_fadvise(2) hints that
+   they are about to be read sequentially, so the kernel can read ahead
+   more aggressively. */
+#define GEMINI_STREAM_FADVISE_MIN (1024 * 1024)
+
+/* Request-scoped memory (see gemini_request_alloc()) is carved out of
+   blocks of at least GEMINI_ARENA_BLOCK octets.  Between requests, the
+   blocks are folded into one, so that a connection slot settles on a
+   single allocation big enough for its usual request; anything past
+   GEMINI_ARENA_MAX is handed back to the system instead of being kept. */
+#define GEMINI_ARENA_BLOCK 16384
+#define GEMINI_ARENA_MAX   (1024 * 1024)
 
 /* Before you can use the geminon library, either as a server handling
    requests from clients, or as a client making said requests, you have to
@@ -56,6 +91,12 @@ int gemini_init();
  */
 int gemini_deinit();
 
+/* Milliseconds on a clock that only goes forward (CLOCK_MONOTONIC), for
+   deadlines and for timing things.  It has nothing to do with the time of
+   day; only the difference between two readings means anything.
+ */
+long gemini_now_ms();
+
 /* A gemini_client can make protocol requests to any number of Gemini
    servers on the network.  It also allows you to specify what TLS client
    credentials you want to use for said requests (although that is entirely
@@ -92,8 +133,41 @@ int gemini_deinit();
        free(my_client);
 
  */
+/* Servers that answer on more than one address (IPv4 and IPv6, say) are
+   connected to "happy eyeballs" style (RFC 8305): rather than waiting for
+   each address to fail in turn, a new connection attempt is started every
+   GEMINI_CONNECT_STAGGER milliseconds (or as soon as the last one fails),
+   alternating between address families, and the first one to connect
+   wins.  Each phase of making a request is bounded by its own timeout,
+   also in milliseconds: connecting (across all addresses), the TLS
+   handshake, and waiting for the first octet of the response.
+
+   Each can be changed per-client, by setting the corresponding member of
+   the gemini_client; zero means the default.
+ */
+#define GEMINI_CONNECT_STAGGER      250
+#define GEMINI_CONNECT_TIMEOUT      10000
+#define GEMINI_HANDSHAKE_TIMEOUT    10000
+#define GEMINI_FIRST_BYTE_TIMEOUT   30000
+
+struct gemini_sessions;
+struct gemini_resolver;
+struct gemini_store;
+struct gemini_store_entry;
 struct gemini_client {
 	SSL_CTX *ssl; /* TLS parameters (client certificate / private key) */
+
+	struct gemini_sessions *sessions; /* TLS sessions to resume; see
+	                                     gemini_client_sessions() */
+	struct gemini_resolver *resolver; /* cached name lookups; see
+	                                     gemini_client_resolver() */
+	struct gemini_store    *store;    /* responses kept on disk; see
+	                                     gemini_client_store() */
+
+	int stagger;            /* ms between connection attempts */
+	int connect_timeout;    /* ms to connect to any address */
+	int handshake_timeout;  /* ms to finish the TLS handshake */
+	int first_byte_timeout; /* ms to wait for the response to start */
 };
 
 /* A gemini_response is what gets sent in reply to an request.  Mostly, this
@@ -104,6 +178,23 @@ struct gemini_client {
 struct gemini_response {
 	int  fd;   /* underlying file descriptor; for reading */
 	SSL *ssl;  /* OpenSSL descriptor, wrapping fd, for encrytion */
+
+	int eager; /* if non-zero, reads return as soon as there is anything
+	              to return, instead of waiting to fill the buffer */
+
+	/* the status line, once it has been parsed; see gemini_response_header()
+	   and gemini_response_parse() */
+	int         status; /* zero until then */
+	const char *meta;   /* points into head */
+
+	char   head[GEMINI_MAX_META + 8]; /* the status line, so far, and any of
+	                                     the body that came in with it */
+	size_t nhead;
+	size_t rest, nrest; /* where that body starts in head, and how much of
+	                       it hasn't been read yet */
+
+	struct gemini_store_entry *fill; /* if the response is going into a
+	                                    store, what's been recorded so far */
 };
 
 /* The Gemini protocol explicitly requires that servers always provide X.509
@@ -132,6 +223,9 @@ int gemini_client_tls(struct gemini_client *client, const char *cert, const char
    The returned gemini_response structure can be read from buffer-wise
    (using gemini_request_read()), or streamed wholesale (thanks to the
    gemini_request_stream() function).
+
+   On failure, NULL is returned; if it was because one of the client's
+   timeouts ran out, errno is set to ETIMEDOUT.
  */
 struct gemini_response * gemini_client_request(struct gemini_client *client, const char *url);
 
@@ -142,11 +236,66 @@ struct gemini_response * gemini_client_request(struct gemini_client *client, con
  */
 void gemini_client_close(struct gemini_client *client);
 
+/* Every request made by a client normally costs a full TLS handshake,
+   which is most of the work (and most of the latency) of fetching a small
+   document.  gemini_client_sessions() has the client remember the TLS
+   sessions that servers hand it, by host and port, and resume them on
+   later requests to the same place.  At most max sessions (zero means
+   GEMINI_SESSIONS_MAX) are kept, for no longer than ttl seconds (zero
+   means as long as the server said they were good for).
+
+   This has to be called after gemini_client_tls().  Returns 0 on success,
+   and negative on failure.  The sessions are freed by gemini_client_close().
+ */
+int gemini_client_sessions(struct gemini_client *client, size_t max, int ttl);
+
+/* Without any help, a client looks up the server's host name before every
+   request it makes.  gemini_client_resolver() gives it a resolver (see
+   gemini_resolver_new() for what the arguments mean) to cache those
+   lookups instead.  Returns 0 on success, and negative on failure.  The
+   resolver is freed by gemini_client_close().
+ */
+int gemini_client_resolver(struct gemini_client *client, int ttl, int negative_ttl, int threads);
+
+/* Keep successful responses on disk, in dir, and answer requests for them
+   from there, without going anywhere near the network, for as long as they
+   stay fresh.  See gemini_store_open() for what the arguments mean; use
+   gemini_store_policy() on client->store to set per-prefix TTLs.  Only
+   gemini_client_request() uses the store; asynchronous requests don't.
+
+   Returns 0 on success, and negative on failure.  The store is closed by
+   gemini_client_close().
+ */
+int gemini_client_store(struct gemini_client *client, const char *dir, size_t budget, int ttl);
+
+/* Reads the status line of the response (the "20 text/gemini\r\n" bit)
+   and fills in the status and meta fields of the response with what it
+   said.  From then on, reading from (or streaming) the response gets you
+   just the body; without calling this, you get the whole response, status
+   line and all, same as always.
+
+   Returns 0 on success, and negative values to signal errors; errno is
+   set to EPROTO if what the server sent doesn't look like a status line.
+ */
+int gemini_response_header(struct gemini_response *res);
+
+/* For callers who do their own reading (like the asynchronous interface,
+   below), gemini_response_parse() feeds n octets, straight off the wire,
+   to the status line parser.  Returns how many of them belonged to the
+   status line (the rest are body), or -1 if the status line is bogus.
+   Once the status field of the response is non-zero, the status line is
+   done, and meta points at the rest of it.
+ */
+ssize_t gemini_response_parse(struct gemini_response *res, const void *buf, size_t n);
+
 /* Reads up to n octets from the responding Gemini server, into the
    caller-provided buffer.  Returns the number of octets read, 0 on
    end-of-file, and negative values to signal errors.
 
-   This function hews to the semantics of read(2) on purpose.
+   This function hews to the semantics of read(2) on purpose, except that
+   it tries to fill the whole buffer before it returns.  Set the eager
+   field of the response if you'd rather have whatever has arrived so far,
+   as soon as it arrives.
  */
 ssize_t gemini_response_read(struct gemini_response *res, void *buf, size_t n);
 
@@ -154,7 +303,10 @@ ssize_t gemini_response_read(struct gemini_response *res, void *buf, size_t n);
    given output file descriptor (fd), until reaching end-of-file.  The block
    parameter governs how big of a buffer to allocate for the copy.  I'm
    partial to 8192.  This also controls how large of a read is attempted at
-   a given shot.
+   a given shot.  Whatever has arrived is written out straight away.
+
+   If the kernel is doing the TLS decryption (kTLS), the response is
+   splice(2)'d to fd without ever being copied through our buffers.
 
    Returns 0 on success, and negative values to incdicate failures.
  */
@@ -170,6 +322,94 @@ int gemini_response_stream(struct gemini_response *res, int fd, size_t block);
  */
 void gemini_response_close(struct gemini_response *res);
 
+/* gemini_client_request() ties up the calling thread until the response
+   starts showing up, which is fine for a handful of requests, and not so
+   fine for a control plane that wants to ask thousands of servers how
+   they're doing, all at once.  For that, there's gemini_async.
+
+   A gemini_async multiplexes any number of requests, made through a
+   client (sharing its TLS context, session cache and resolver), over a
+   single epoll(7) instance.  Each request is a gemini_call, driven
+   through name lookup, connection (happy eyeballs, as usual), the TLS
+   handshake and the response without ever blocking, and reporting back
+   through callbacks:
+
+     status(call, status, meta, data) - once the status line is in
+     body(call, buf, n, data)         - for each chunk of the body, as
+                                        it arrives
+     done(call, error, data)          - when the call is finished; error
+                                        is 0 for success, or an errno
+                                        value (ETIMEDOUT, EPROTO, ...)
+
+   Any callback may be NULL.  Callbacks run in whatever thread calls
+   gemini_async_run(), and are free to start more requests, or cancel
+   them.  A call is freed after its done() callback returns.
+
+   You can let gemini_async run its own event loop:
+
+       while (gemini_async_run(async, -1) > 0)
+         ;
+
+   or fold it into yours, by watching gemini_async_fd() for readability,
+   waking up at least every gemini_async_timeout() milliseconds, and
+   calling gemini_async_run(async, 0) whenever either happens.
+
+   One gemini_async should only be driven from one thread at a time.
+ */
+struct gemini_call;
+
+struct gemini_callbacks {
+	void (*status)(struct gemini_call *call, int status, const char *meta, void *data);
+	void (*body)(struct gemini_call *call, const void *buf, size_t n, void *data);
+	void (*done)(struct gemini_call *call, int error, void *data);
+};
+
+struct gemini_async {
+	struct gemini_client   *client;
+	struct gemini_resolver *resolver;     /* the client's, or our own */
+	int                     own_resolver; /* non-zero if it's ours */
+
+	int epfd;   /* epoll(7) instance, watching every socket */
+	int wakefd; /* eventfd(2), poked when a lookup finishes */
+
+	struct gemini_call *calls; /* every live call */
+	struct gemini_call *dead;  /* finished calls, waiting to be freed */
+	unsigned long outstanding; /* how many calls are live */
+	long next_timer;           /* when the next call times out (or
+	                              starts another connection attempt) */
+
+	pthread_mutex_t lock;       /* guards the lookup state below */
+	pthread_cond_t  idle;       /* signalled when lookups finish */
+	struct gemini_call *looked; /* calls whose lookups have finished */
+	int looking;                /* how many lookups are in progress */
+};
+
+/* Create a new multiplexer for asynchronous requests through client.
+   Returns NULL on failure. */
+struct gemini_async * gemini_async_new(struct gemini_client *client);
+
+/* Start a request for url.  Returns a handle for the call, or NULL on
+   failure (in which case none of the callbacks will be called). */
+struct gemini_call * gemini_async_request(struct gemini_async *async, const char *url, const struct gemini_callbacks *cb, void *data);
+
+/* Abandon a call; its done() callback will not be called. */
+void gemini_async_cancel(struct gemini_async *async, struct gemini_call *call);
+
+/* Wait up to timeout milliseconds (forever, if negative) for something
+   to happen, and deal with it.  Returns how many calls are still live. */
+int gemini_async_run(struct gemini_async *async, int timeout);
+
+/* The file descriptor to watch (for readability) when running
+   gemini_async from an outside event loop. */
+int gemini_async_fd(struct gemini_async *async);
+
+/* How many milliseconds until gemini_async_run() has to be called to
+   enforce a timeout, or -1 if there are no timeouts pending. */
+int gemini_async_timeout(struct gemini_async *async);
+
+/* Cancel every outstanding call, and free the multiplexer. */
+void gemini_async_free(struct gemini_async *async);
+
 /* A gemini_url gives you access to the parsed components of a gemini://
    uniform resource locator.  Specifically, the host, port, and path
    components can be accessed individually.
@@ -240,10 +480,429 @@ struct gemini_fs {
 	const char *root;
 };
 
+/* Resolve a requested file path into one relative to the root, with any
+   "." and ".." components taken care of.  gemini_fs_resolve() returns a
+   newly-allocated string (free(3) it), or NULL if the path is no good;
+   gemini_fs_resolve_into() does the same into a caller-supplied buffer of
+   at least GEMINI_MAX_PATH+1 octets, returning 0 on success or -1. */
 char * gemini_fs_resolve(const char *file);
+int gemini_fs_resolve_into(const char *file, char *path);
 int gemini_fs_open(struct gemini_fs *fs, const char *file, int flags);
 char * gemini_fs_path(struct gemini_fs *fs, const char *file);
 
+/* A gemini_map is a small, chained hash table, keyed by NUL-terminated
+   strings, that several parts of the library use for bookkeeping.  Keys are
+   copied in; values are opaque pointers owned by the caller, and may not be
+   NULL (since gemini_map_get() uses NULL to signal "not found").
+
+   Initialize one with gemini_map_init(), giving it a rough idea of how many
+   entries you expect (it grows as needed), and tear it down with
+   gemini_map_free() when you are done.
+ */
+struct gemini_map_entry;
+struct gemini_map {
+	struct gemini_map_entry **buckets;
+	size_t nbuckets; /* how many chains in buckets[] */
+	size_t n;        /* how many entries are stored */
+};
+
+int gemini_map_init(struct gemini_map *map, size_t hint);
+
+/* Look up the value stored under key; returns NULL if there isn't one. */
+void * gemini_map_get(struct gemini_map *map, const char *key);
+
+/* Store value under key, returning the value it replaced (or NULL, if the
+   key is new).  If memory is exhausted, the passed value is returned, and
+   the map is left untouched. */
+void * gemini_map_set(struct gemini_map *map, const char *key, void *value);
+
+/* Remove key from the map, returning the value it had (or NULL). */
+void * gemini_map_delete(struct gemini_map *map, const char *key);
+
+/* Call fn(key, value, udata) for every entry, in no particular order.  The
+   callback may delete the entry it was handed, but nothing else. */
+void gemini_map_each(struct gemini_map *map, void (*fn)(const char *, void *, void *), void *udata);
+
+/* Release all the memory held by the map.  If fn is non-NULL, it will be
+   called on every stored value first. */
+void gemini_map_free(struct gemini_map *map, void (*fn)(void *));
+
+/* A gemini_gemtext is a streaming parser for text/gemini documents.  Feed
+   it the document a chunk at a time, as it arrives, in whatever sizes it
+   comes in, and it calls back once per line, saying what kind of line it
+   is and where its interesting parts are.
+
+   Those parts are spans: pointers into the chunk that was fed in, not
+   copies; they are only good until the callback returns.  (A line that
+   straddles two chunks is put back together in a buffer of the parser's
+   own, and the spans point there instead.)
+
+   Newlines are found 16 octets at a time, with SSE2, where we have it.
+ */
+#define GEMINI_GEMTEXT_TEXT    1 /* plain old text */
+#define GEMINI_GEMTEXT_LINK    2 /* => url label */
+#define GEMINI_GEMTEXT_HEADING 3 /* #, ## or ### heading */
+#define GEMINI_GEMTEXT_LIST    4 /* * list item */
+#define GEMINI_GEMTEXT_QUOTE   5 /* > quote */
+#define GEMINI_GEMTEXT_TOGGLE  6 /* ``` alt text, in or out of preformatted */
+#define GEMINI_GEMTEXT_PRE     7 /* a line of preformatted text */
+
+struct gemini_span {
+	const char *p;
+	size_t      n;
+};
+
+struct gemini_gemtext_line {
+	int type;  /* GEMINI_GEMTEXT_* */
+	int level; /* for headings, 1 to 3 */
+
+	struct gemini_span line; /* the whole line, minus the line ending */
+	struct gemini_span text; /* minus the markup, too: the text of a
+	                            heading, item or quote, a link's label,
+	                            or a toggle's alt text */
+	struct gemini_span url;  /* for links, where to */
+};
+
+/* Called for each line; returning non-zero stops the parse. */
+typedef int (*gemini_gemtext_fn)(const struct gemini_gemtext_line *line, void *data);
+
+struct gemini_gemtext {
+	gemini_gemtext_fn fn;
+	void             *data;
+
+	int           pre;   /* non-zero inside a preformatted block */
+	unsigned long lines; /* how many lines so far */
+
+	char  *carry; /* the start of a line that didn't end in the last chunk */
+	size_t ncarry, capcarry;
+};
+
+/* Get a parser ready to parse a new document. */
+void gemini_gemtext_init(struct gemini_gemtext *g, gemini_gemtext_fn fn, void *data);
+
+/* Parse the next n octets of the document.  Returns 0 on success, -1 if
+   memory is exhausted, or whatever non-zero value the callback returned
+   to stop the parse. */
+int gemini_gemtext_feed(struct gemini_gemtext *g, const void *buf, size_t n);
+
+/* The document is over; parse whatever is left of the last line (if it
+   didn't end with a newline), and release the parser's memory.  Returns
+   just like gemini_gemtext_feed(). */
+int gemini_gemtext_finish(struct gemini_gemtext *g);
+
+/* A gemini_sessions is the client-side cache of TLS sessions behind
+   gemini_client_sessions().  Sessions are keyed by host:port (and by the
+   client certificate in use, if any), and the least recently used one is
+   dropped to make room for a new one.  It is safe to share one between
+   threads making requests through the same client.
+
+   Short-lived programs (like gurl) can carry their sessions from one run
+   to the next with gemini_sessions_load() and gemini_sessions_save().
+   Since a session is as good as a key, the file is written readable only
+   by its owner.
+ */
+#define GEMINI_SESSIONS_MAX 256
+
+struct gemini_sessions_stats {
+	unsigned long hits;      /* lookups that found a session to resume */
+	unsigned long misses;    /* lookups that didn't */
+	unsigned long resumed;   /* handshakes the server agreed to resume */
+	unsigned long stores;    /* sessions remembered */
+	unsigned long evictions; /* sessions dropped to make room */
+
+	size_t entries; /* sessions currently held */
+};
+
+struct gemini_sessions {
+	size_t max;      /* most sessions to hold at once */
+	int    ttl;      /* longest to hold any one session, or 0 */
+	char   ident[17]; /* which client certificate the sessions go with */
+
+	pthread_mutex_t lock;      /* guards everything below */
+	struct gemini_map entries; /* host:port -> session */
+	struct _session *lru;      /* most recently used session first */
+	struct _session *lru_tail; /* ... and the next one to be evicted */
+	struct gemini_sessions_stats stats;
+};
+
+/* Create an empty session cache.  Returns NULL on failure. */
+struct gemini_sessions * gemini_sessions_new(size_t max, int ttl);
+
+/* Find a session for key, and return a new reference to it (which the
+   caller must SSL_SESSION_free()), or NULL if there isn't a live one. */
+SSL_SESSION * gemini_sessions_get(struct gemini_sessions *sessions, const char *key);
+
+/* Remember sess under key, taking over the caller's reference to it.
+   Returns 0 if the session was kept, and negative if not (in which case
+   it has been freed). */
+int gemini_sessions_put(struct gemini_sessions *sessions, const char *key, SSL_SESSION *sess);
+
+/* Read sessions saved by gemini_sessions_save() from file, skipping those
+   that have since expired.  A missing file is not an error.  Returns the
+   number of sessions loaded, or negative on failure. */
+int gemini_sessions_load(struct gemini_sessions *sessions, const char *file);
+
+/* Write all of the live sessions out to file, replacing it atomically.
+   Returns 0 on success, and negative on failure. */
+int gemini_sessions_save(struct gemini_sessions *sessions, const char *file);
+
+/* Take a consistent snapshot of the cache's counters. */
+void gemini_sessions_stats(struct gemini_sessions *sessions, struct gemini_sessions_stats *stats);
+
+/* Free the cache, and every session in it. */
+void gemini_sessions_free(struct gemini_sessions *sessions);
+
+/* A gemini_resolver turns host names into addresses to connect to, by way
+   of getaddrinfo(3), and remembers the answers for a while.  Successful
+   lookups are kept for ttl seconds (zero means GEMINI_RESOLVE_TTL), since
+   getaddrinfo(3) doesn't tell us what the DNS said; names that don't
+   exist are remembered as not existing for negative_ttl seconds (zero
+   means GEMINI_RESOLVE_NEGATIVE_TTL).  Transient failures are not cached.
+
+   Lookups can be made in the calling thread, with gemini_resolve(), or
+   handed off to a pool of threads (at most threads of them, or
+   GEMINI_RESOLVE_THREADS, started the first time they are needed) with
+   gemini_resolve_async(), so that a client talking to lots of servers
+   doesn't have to wait on each lookup in turn.  Concurrent asynchronous
+   lookups for the same name share one call to getaddrinfo(3).
+
+   Both IPv4 and IPv6 addresses are returned, in the order getaddrinfo(3)
+   prefers them; at most GEMINI_RESOLVE_MAX are kept per name.
+ */
+#define GEMINI_RESOLVE_TTL          60
+#define GEMINI_RESOLVE_NEGATIVE_TTL 5
+#define GEMINI_RESOLVE_THREADS      4
+#define GEMINI_RESOLVE_MAX          16
+#define GEMINI_RESOLVE_ENTRIES      4096
+
+struct gemini_addr {
+	socklen_t               len;
+	struct sockaddr_storage sa;
+};
+
+struct gemini_resolver_stats {
+	unsigned long hits;     /* lookups answered from the cache */
+	unsigned long negative; /* ... of which were for names that don't exist */
+	unsigned long misses;   /* lookups that had to ask getaddrinfo(3) */
+	unsigned long shared;   /* asynchronous lookups that piggybacked */
+	unsigned long failures; /* calls to getaddrinfo(3) that failed */
+
+	size_t entries; /* names currently cached */
+};
+
+/* How lookups are actually done; getaddrinfo(3), unless you'd rather
+   stub it out (say, for testing). */
+typedef int (*gemini_lookup_fn)(const char *host, const char *service, const struct addrinfo *hints, struct addrinfo **res);
+
+/* Called when an asynchronous lookup finishes, from whichever thread
+   finished it, with n addresses, or with n < 0 and a getaddrinfo(3)
+   error code (suitable for gai_strerror(3)) in error. */
+typedef void (*gemini_resolved_fn)(void *data, const struct gemini_addr *addrs, int n, int error);
+
+struct gemini_resolver {
+	int ttl;          /* seconds to remember addresses */
+	int negative_ttl; /* seconds to remember that a name doesn't exist */
+	int threads;      /* most resolver threads to run */
+
+	gemini_lookup_fn lookup;
+
+	pthread_mutex_t lock;      /* guards everything below */
+	pthread_cond_t  work;      /* signalled when lookups are queued */
+	struct gemini_map entries; /* host -> cached answer */
+	struct gemini_map pending; /* host -> asynchronous lookup in progress */
+	struct _lookup *queue;     /* asynchronous lookups to be started */
+	struct _lookup *queue_tail;
+	pthread_t *workers;
+	int        nworkers;
+	int        stopping;
+	struct gemini_resolver_stats stats;
+};
+
+/* Create an empty resolver.  Returns NULL on failure. */
+struct gemini_resolver * gemini_resolver_new(int ttl, int negative_ttl, int threads);
+
+/* Look up host, filling in (at most max) addrs with its addresses, and
+   port.  Returns how many addresses were found, or -1 on failure, with the
+   getaddrinfo(3) error code in *error (if error is not NULL).  The resolver
+   may be NULL, to look the name up without any caching. */
+int gemini_resolve(struct gemini_resolver *r, const char *host, unsigned short port, struct gemini_addr *addrs, int max, int *error);
+
+/* Look up host in the background, and call fn(data, ...) with the answer.
+   Cached answers are given right away, before this returns.  Returns 0 if
+   fn will be (or has been) called, and negative on failure. */
+int gemini_resolve_async(struct gemini_resolver *r, const char *host, unsigned short port, gemini_resolved_fn fn, void *data);
+
+/* Take a consistent snapshot of the resolver's counters. */
+void gemini_resolver_stats(struct gemini_resolver *r, struct gemini_resolver_stats *stats);
+
+/* Wait for outstanding asynchronous lookups to finish, stop the resolver
+   threads, and free the resolver. */
+void gemini_resolver_free(struct gemini_resolver *r);
+
+/* A gemini_store keeps Gemini responses on disk, so that clients can skip
+   re-fetching documents they have fetched recently.  Only successful (20)
+   responses that the server finished sending are stored, status line and
+   all, each in a file named for the SHA-256 of its contents; URLs that
+   get the same response share one file.
+
+   Which URL (and client certificate) has which response is kept in an
+   index, a fixed-size hash table of GEMINI_STORE_SLOTS entries that is
+   mmap(2)'d by everyone using the store, and flock(2)'d while it changes,
+   so that several processes can share a store directory.
+
+   A response is fresh for ttl seconds after it was fetched, unless a
+   policy covering the URL (the longest matching prefix wins) says
+   otherwise; a policy with a ttl of zero keeps URLs out of the store.
+
+   Responses are evicted, least recently used first, to keep the total
+   size of the stored responses under budget octets, or to keep the index
+   from getting too full.
+ */
+#define GEMINI_STORE_BUDGET (256 * 1024 * 1024)
+#define GEMINI_STORE_TTL    3600
+#define GEMINI_STORE_SLOTS  8192
+
+struct gemini_store_stats {
+	unsigned long hits;      /* requests answered from the store */
+	unsigned long misses;    /* requests that had to go to the server */
+	unsigned long expired;   /* ... because what we had was too old */
+	unsigned long stores;    /* responses added to the store */
+	unsigned long evictions; /* responses dropped to make room */
+
+	size_t entries; /* responses currently stored (by anyone) */
+	size_t bytes;   /* octets currently stored (by anyone) */
+};
+
+struct gemini_store {
+	char  *dir;
+	size_t budget; /* most octets of responses to keep */
+	int    ttl;    /* seconds responses stay fresh, by default */
+	char   ident[17]; /* client certificate, as in gemini_sessions */
+
+	struct _policy *policies; /* per-prefix TTLs */
+
+	pthread_mutex_t lock;  /* guards everything below */
+	int             fd;    /* the index file, */
+	struct _index  *index; /* ... and where it is mapped */
+	size_t          size;
+	struct gemini_store_stats stats;
+};
+
+/* Open (creating, if need be) the store in dir, keeping up to budget
+   octets of responses (zero means GEMINI_STORE_BUDGET), fresh for ttl
+   seconds (zero means GEMINI_STORE_TTL).  Returns NULL on failure. */
+struct gemini_store * gemini_store_open(const char *dir, size_t budget, int ttl);
+
+/* Keep responses for URLs starting with prefix for ttl seconds instead;
+   zero means don't keep them at all.  Returns 0 on success, and negative
+   on failure. */
+int gemini_store_policy(struct gemini_store *store, const char *prefix, int ttl);
+
+/* Look up a fresh response for url.  Returns a file descriptor, open for
+   reading from the start of the response, or -1 if there isn't one. */
+int gemini_store_get(struct gemini_store *store, const char *url);
+
+/* Start recording the response for url, as it comes in.  Returns NULL if
+   url isn't one we'd keep (or if we can't keep it), in which case there
+   is no need to record anything. */
+struct gemini_store_entry * gemini_store_begin(struct gemini_store *store, const char *url);
+
+/* Record the next n octets of the response. */
+void gemini_store_append(struct gemini_store_entry *e, const void *buf, size_t n);
+
+/* Finish recording a response, and store it if keep is non-zero (and it
+   turned out to be a 20).  Either way, the entry is freed.  Returns 0 if
+   the response was stored, and negative otherwise. */
+int gemini_store_finish(struct gemini_store_entry *e, int keep);
+
+/* Take a snapshot of the store's counters. */
+void gemini_store_stats(struct gemini_store *store, struct gemini_store_stats *stats);
+
+/* Unmap the index, and free the store.  The responses stay on disk. */
+void gemini_store_close(struct gemini_store *store);
+
+/* A gemini_fs_index layers several filesystem roots on top of one another,
+   like a union mount: the first root that has a given file wins.  Rather
+   than probing each root in turn for every request, the index walks all of
+   the roots once, up front, and remembers which root owns each path.  It
+   then listens to inotify(7) so it can keep itself current as files come
+   and go; call gemini_fs_index_refresh() to apply whatever has changed.
+
+   A maximum of 64 roots (on LP64 platforms) can be layered this way.
+ */
+struct gemini_fs_index {
+	int    n;       /* how many roots are layered */
+	char **roots;   /* root directories, highest precedence first */
+	int   *dirfds;  /* an open descriptor per root, for openat(2) */
+
+	int    inotify;  /* inotify(7) instance watching every directory */
+	struct _watch *watches; /* watch descriptor -> (root, directory) */
+	int    nwatches;
+
+	struct gemini_map paths; /* resolved path -> bitmask of owning roots */
+};
+
+/* Build an index of n roots, in decreasing order of precedence.  Returns
+   NULL if any of the roots cannot be opened or walked. */
+struct gemini_fs_index * gemini_fs_index_new(const char **roots, int n);
+
+/* Apply any pending filesystem changes to the index, without blocking.
+   Returns the number of changes seen, or a negative value on error. */
+int gemini_fs_index_refresh(struct gemini_fs_index *idx);
+
+/* Determine which root (by position) owns the given resolved path, as
+   returned by gemini_fs_resolve().  Returns -1 if no root has it. */
+int gemini_fs_index_lookup(struct gemini_fs_index *idx, const char *path);
+
+/* Resolve and open a file through the index, with a single openat(2)
+   against the owning root.  Works like gemini_fs_open(). */
+int gemini_fs_index_open(struct gemini_fs_index *idx, const char *file, int flags);
+
+void gemini_fs_index_free(struct gemini_fs_index *idx);
+
+/* A gemini_fs_listings caches what the static-files handler serves for
+   directories: either the fact that the directory has an index.gmi file
+   (which should be served in its place), or a generated text/gemini
+   listing of its contents.
+
+   Listings are generated on first request, and then kept until inotify(7)
+   reports a change to the directory, so that large directories don't cost
+   a readdir(3) (and a stat(2) for each entry) on every single request.
+   Call gemini_fs_listings_refresh() to discard whatever has gone stale.
+ */
+struct gemini_fs_listing {
+	int     index; /* non-zero if the directory has an index.gmi */
+	char   *body;  /* generated text/gemini listing, if it doesn't */
+	size_t  len;   /* length of body, in octets */
+};
+
+struct gemini_fs_listings {
+	char  *root;    /* root directory listings are relative to */
+	int    dirfd;   /* an open descriptor for root, for openat(2) */
+
+	int    inotify;  /* inotify(7) instance watching cached directories */
+	char **watches;  /* watch descriptor -> (resolved) directory path */
+	int    nwatches;
+
+	struct gemini_map dirs; /* resolved path -> struct gemini_fs_listing */
+	struct gemini_fs_listing *uncached; /* last listing we couldn't watch */
+};
+
+struct gemini_fs_listings * gemini_fs_listings_new(const char *root);
+
+/* Drop any cached listings that inotify says have changed, without
+   blocking.  Returns the number of changes seen, or a negative value on
+   error. */
+int gemini_fs_listings_refresh(struct gemini_fs_listings *ls);
+
+/* Retrieve the listing for a resolved directory path (as returned by
+   gemini_fs_resolve(); "" is the root itself), generating it if need be.
+   Returns NULL if the path isn't a directory.  The returned listing is
+   owned by the cache, and is only good until the next call. */
+const struct gemini_fs_listing * gemini_fs_listings_get(struct gemini_fs_listings *ls, const char *dir);
+
+void gemini_fs_listings_free(struct gemini_fs_listings *ls);
+
 /* A gemini_request is used by the server-side handlers to route and process
    inbound requests from Gemini clients.  It contains things like the
    requested URL (fully parsed) and the client X.509 certificate (if any).
@@ -254,6 +913,54 @@ struct gemini_request {
 
 	struct gemini_url *url; /* requested URL, including host, port, and path */
 	X509 *cert;             /* The client X.509 certificate, if one was sent */
+
+	/* Streaming state.  The ring buffer is allocated the first time a
+	   response is streamed, and survives gemini_request_close(), so that a
+	   request structure reused across connections (as gemini_serve() does)
+	   only pays for it once.  See gemini_request_release(). */
+	char   *ring;     /* transfer buffer for gemini_request_stream() */
+	size_t  ringsize; /* allocated size of ring, in octets */
+	size_t  sent;     /* octets sent on this connection, for record sizing */
+
+	/* A TLS handle from an earlier connection, cleared (with SSL_clear())
+	   by gemini_request_close(), and ready to take on the next one, so that
+	   it needn't be set up from scratch.  Also freed by release. */
+	SSL    *spare;
+
+	/* Output coalescing.  Pending output (the status line, and anything
+	   written while corked) is gathered here, so that it can leave in a
+	   single TLS record.  Like ring, out outlives the connection. */
+	char   *out;    /* GEMINI_TLS_RECORD_MAX octets of pending output */
+	size_t  outlen; /* how much of out is pending */
+	int     corked; /* non-zero while gemini_request_cork() is in effect */
+
+	/* Response capture.  If tap is set, every octet of the response (the
+	   status line included) is handed to it, along with tapdata, as it is
+	   accepted for sending.  A request without a TLS session (ssl is NULL)
+	   doesn't send anything at all; it only feeds the tap.  The response
+	   cache uses this to record what the handlers it wraps produce. */
+	void  (*tap)(void *, const void *, size_t);
+	void   *tapdata;
+
+	/* Caching directives, in seconds, as given by the handler; negative
+	   values mean it has no opinion.  See gemini_request_directives(). */
+	int     maxage; /* how long the response may be reused (0 = never) */
+	int     stale;  /* how long after that it may be served while refreshing */
+
+	/* Request-scoped memory, handed out by gemini_request_alloc().  The
+	   parsed URL lives here, as do the core's own path and environment
+	   buffers.  It is reset (but kept) by gemini_request_close(), and only
+	   freed by gemini_request_release(). */
+	struct _arena *arena;
+
+	/* Which generation of the server's handlers (plus one) this request is
+	   using, while it is being dispatched; zero the rest of the time.  See
+	   gemini_reroute(). */
+	unsigned long epoch;
+
+	/* The same, for the server's TLS context, while the request is picking
+	   up a TLS handle.  See gemini_tls_reload(). */
+	unsigned long tls_epoch;
 };
 
 /* A gemini_handler is a specific type of function that is used to provide
@@ -292,6 +999,7 @@ struct gemini_handler {
 	char           *prefix;  /* registered URL path prefix */
 	gemini_handler  handler; /* the gemini_handler with all the logic */
 	void           *data;    /* Caller-supplied data (passed to handler) */
+	void          (*destroy)(void *data); /* frees data, if not NULL */
 };
 
 /* A gemini_server ties together a whole bunch of configuration, handlers,
@@ -321,9 +1029,12 @@ struct gemini_handler {
 
    Note that as of right now, you can only bind a single socket.
  */
+#define GEMINI_REQUEST_TIMEOUT 10000
+#define GEMINI_RSS_INTERVAL    100
+
 struct gemini_server {
 	int      sockfd; /* underlying (bound) socket descriptor */
-	SSL_CTX *ssl;    /* TLS configuration (cert / key to use) */
+	SSL_CTX *ssl;    /* TLS configuration (cert / key to use); see gemini_tls_reload() */
 
 	/* Some testing scenarios require that a gemini server only live long
 	   enough to handle a small, finite number of requests.  These two
@@ -337,8 +1048,51 @@ struct gemini_server {
 	/* Handlers are registered in FIFO order.  For convenience, and to avoid
 	   having to traverse the handlers list to append to the end of it, we
 	   track both the first and last handler in the list.
+
+	   Once the server is running, the list is only ever replaced whole,
+	   by gemini_reroute(), which bumps epoch each time it does.  So does
+	   gemini_tls_reload(), for ssl, with tls_epoch.
 	 */
 	struct gemini_handler *first, *last;
+	unsigned long epoch, tls_epoch;
+
+	/* By default, gemini_serve() handles one request at a time, in the
+	   calling thread.  Set threads to have that many threads (the caller
+	   included) accepting and handling requests side by side.  Handlers
+	   then need to be safe to call concurrently; the built-in ones are. */
+	int threads;
+
+	/* Identical requests that arrive while one is already being handled
+	   can wait for it, and share its response; see gemini_coalesce(). */
+	struct gemini_flights *flights;
+
+	/* Each connection is handled in a slot (see gemini_slots), set up when
+	   gemini_serve() starts, and reused from one connection to the next.
+	   There is one slot per thread, or max_connections of them, if that is
+	   non-zero and smaller; once they are all busy, new connections wait
+	   (before the TLS handshake) for one to free up.  slots is only set
+	   while serving.
+
+	   A thread stays with its connection from the handshake until the
+	   response is sent, so no more than threads connections are ever
+	   being served at once, idle or not.  To keep idle ones from holding
+	   the server up, each connection has request_timeout milliseconds
+	   (GEMINI_REQUEST_TIMEOUT, if zero) to finish the TLS handshake and
+	   send its request line, and is dropped if it doesn't. */
+	unsigned int max_connections;
+	struct gemini_slots *slots;
+	int request_timeout;
+
+	/* For holding on to lots of mostly-idle connections.  With low_memory
+	   set, OpenSSL lets go of its buffers whenever a connection is idle
+	   (see SSL_MODE_RELEASE_BUFFERS), and slots are neither set up ahead of
+	   time, nor hang on to anything between connections.  If memory_budget
+	   is non-zero, and the server's resident set size is over it (in
+	   octets) when a connection comes in, the client is asked to come back
+	   later (44), instead of being served.  The resident set size is only
+	   looked up every GEMINI_RSS_INTERVAL milliseconds. */
+	int    low_memory;
+	size_t memory_budget;
 };
 
 /* Send the Gemini response status line to the client.
@@ -348,7 +1102,11 @@ struct gemini_server {
    an upper limit of GEMINI_MAX_RESPONSE bytes on the entire status line,
    including the trailing carriage return / line feed.
 
-   Returns the number of octets written to the socket on success, and a
+   The status line isn't sent right away; it is held until the first write
+   of the response body (or until the request is closed), so that the two
+   can share a TLS record, and (usually) a packet.
+
+   Returns the number of octets accepted for sending on success, and a
    negative value on failure.
  */
 int gemini_request_respond(struct gemini_request *req, int status, const char *meta);
@@ -364,24 +1122,140 @@ int gemini_request_respond(struct gemini_request *req, int status, const char *m
  */
 ssize_t gemini_request_write(struct gemini_request *req, const void *buf, size_t n);
 
+/* Cork a request, so that gemini_request_respond() and any number of
+   subsequent gemini_request_write() calls are gathered up into as few TLS
+   records as possible, instead of each going out on its own.  This is
+   especially useful for small, dynamically generated responses that are
+   built up a piece at a time:
+
+       gemini_request_cork(req);
+       gemini_request_respond(req, 20, "text/gemini");
+       gemini_request_write(req, "# Hello, ", 9);
+       gemini_request_write(req, name, strlen(name));
+       gemini_request_write(req, "\n", 1);
+       gemini_request_close(req); // all of it goes out here, at once
+
+   Corked output is sent whenever a full record's worth has built up, when
+   gemini_request_uncork() is called, or when the request is closed.
+ */
+void gemini_request_cork(struct gemini_request *req);
+
+/* Send along anything held back by gemini_request_cork(), and go back to
+   writing straight through.  Returns 0 on success, negative on failure. */
+int gemini_request_uncork(struct gemini_request *req);
+
 /* Stream a file descriptor to the client, copy all of its contents until
    either the everything has been written, or an error occurs.  The block
-   argument controls (a) how much we try to send in a single write(2) call,
-   and (b) how big of a transfer buffer to heap-allocate.
+   argument controls how big of a transfer buffer (a ring) to allocate; it
+   will be rounded up to hold at least two maximum-sized TLS records.  The
+   buffer is kept with the request, and reused by subsequent calls.
+
+   TLS records start out small, and grow to the maximum size once the
+   response is well underway; see GEMINI_TLS_RAMP.
 
    Returns 0 on success, and negative on failure.
  */
 int gemini_request_stream(struct gemini_request *req, int fd, size_t block);
 
+/* Allocate n octets of request-scoped memory, suitably aligned for any
+   type.  There is no need (and no way) to free it; everything allocated
+   this way goes away at once, when the request is closed.  Handlers should
+   prefer it for anything that doesn't outlive the request, since it costs
+   little more than a pointer bump, and can't leak.  Returns NULL if the
+   memory cannot be had.
+ */
+void * gemini_request_alloc(struct gemini_request *req, size_t n);
+
+/* Parse s into a gemini_url, allocated from the request (see above), and
+   make it the URL of the request.  Returns 0 on success, or a negative
+   value if s is not a valid Gemini URL (see gemini_parse_url_into()).
+ */
+int gemini_request_url(struct gemini_request *req, const char *s);
+
 /* When you're all done writing to the client, call gemini_request_close().
-   Doing so releases TLS resources associated with the request, frees the
-   memory devoted to the parsed request URL, and closes the underlying
-   connection descriptor.
+   Doing so releases TLS resources associated with the request, resets its
+   request-scoped memory (including the parsed request URL), and closes the
+   underlying connection descriptor.
 
    It's just good personal hygeine.
  */
 void gemini_request_close(struct gemini_request *req);
 
+/* The maximum size (in octets) of the environment handed to CGI programs
+   and pool workers, including all the variable names and values. */
+#define GEMINI_MAX_ENVIRON (4 * GEMINI_MAX_REQUEST)
+
+/* Build a CGI environment describing a request, for use with execve(2) and
+   friends: a NULL-terminated array of "NAME=value" strings.  The script
+   and info arguments become SCRIPT_NAME and PATH_INFO, respectively; the
+   rest is derived from the request itself:
+
+       GATEWAY_INTERFACE   CGI/1.1
+       SERVER_PROTOCOL     GEMINI
+       SERVER_SOFTWARE     geminon
+       SERVER_NAME         requested host name
+       SERVER_PORT         requested port
+       GEMINI_URL          the full requested URL
+       QUERY_STRING        everything after the '?' (if anything)
+       REMOTE_ADDR         the client's numeric IP address
+       REMOTE_HOST         (same as REMOTE_ADDR; we don't do reverse DNS)
+
+   and, if the client presented a certificate:
+
+       AUTH_TYPE           CERTIFICATE
+       TLS_CLIENT_HASH     SHA256:<hex fingerprint of the certificate>
+       TLS_CLIENT_SUBJECT  the certificate's subject distinguished name
+       REMOTE_USER         the subject's common name
+
+   The whole thing is allocated from the request (see gemini_request_alloc()),
+   and goes away when it is closed.  Returns NULL on failure.
+ */
+char ** gemini_request_environ(struct gemini_request *req, const char *script, const char *info);
+
+/* CGI programs and pool workers can tell the response cache (see
+   gemini_cache) how to treat their output by starting it with a single
+   header-like line, ahead of the status line:
+
+       Cache-Control: max-age=30, stale-while-revalidate=300\r\n
+       20 text/gemini\r\n
+       ...
+
+   Or "Cache-Control: no-store", to keep it from being cached at all.
+
+   gemini_request_directives() looks for such a line at the start of the n
+   octets of output in buf, records what it says in req->maxage and
+   req->stale, and returns its length, so the caller can skip past it (it
+   is never sent to the client).  If buf doesn't start with a directive
+   line, it returns 0.  If it might, but the line isn't complete yet, it
+   returns -1; read some more, and try again.
+ */
+ssize_t gemini_request_directives(struct gemini_request *req, const char *buf, size_t n);
+
+/* The maximum size (in octets) of a key from gemini_request_key() */
+#define GEMINI_MAX_KEY (GEMINI_MAX_REQUEST + 2 * EVP_MAX_MD_SIZE + 64)
+
+/* Fill in key (n octets long) with a string identifying what is being
+   asked for: the requested host, port, path, and query string.  If
+   per_cert is non-zero, the SHA-256 fingerprint of the client certificate
+   (or "-", if there isn't one) is included as well.  Requests with the
+   same key ought to get the same response; the response cache and
+   request coalescing both rely on this. */
+void gemini_request_key(struct gemini_request *req, char *key, size_t n, int per_cert);
+
+/* Set up a request structure ahead of time, with a TLS handle (from ctx)
+   and its output buffers already allocated, so that the first connection
+   it handles costs no more than any other.  If ctx is NULL, all of that is
+   left until it is needed.  Returns 0 on success, or -1 if any of it
+   couldn't be allocated (the request can still be used).
+ */
+int gemini_request_init(struct gemini_request *req, SSL_CTX *ctx);
+
+/* Buffers that outlive a single connection (like the streaming ring, and
+   the request-scoped memory) are only freed by gemini_request_release().  Call it once you are done with
+   a request structure for good, after gemini_request_close().
+ */
+void gemini_request_release(struct gemini_request *req);
+
 /* Register a handler, using a pre-populated gemini_handler struct with all
    of the details.  From a memory perspective, there are very specific rules
    that must be followed to avoid double-frees and memory corruption:
@@ -404,12 +1278,25 @@ int gemini_handle(struct gemini_server *server, struct gemini_handler *handler);
  */
 int gemini_handle_fn(struct gemini_server *server, const char *prefix, gemini_handler fn, void *data);
 
+/* Register a handler whose data takes more than a free(3) to get rid of.
+   Works like gemini_handle_fn(), except that destroy(data) is called in
+   its place, when the server is closed or the handler is rerouted away.
+   If registration fails, data is still the caller's to free.
+ */
+int gemini_handle_fn_free(struct gemini_server *server, const char *prefix, gemini_handler fn, void *data, void (*destroy)(void *));
+
 /* Register a static-files handler.  URLs at or under the given prefix will
    be re-interpreted as being relative to root instead, and those files (if
    they exist) will be sent to requesting clients.  If no matching files are
    found, the handler will skip the request, letting future handlers
    attempt to do something useful.
 
+   Directories are served by way of their index.gmi file, if they have one,
+   or else as a generated text/gemini listing of their contents (sans dot
+   files).  Requests for directories that lack a trailing slash are
+   redirected, so that relative links in the listing work.  Listings are
+   cached; see gemini_fs_listings.
+
    Unlike other handler registration functions, gemini_handle_fs does not
    need root to be heap-allocated; it will allocate a copy via strdup(3).
    This supports the following common case:
@@ -419,6 +1306,22 @@ int gemini_handle_fn(struct gemini_server *server, const char *prefix, gemini_ha
  */
 int gemini_handle_fs(struct gemini_server *server, const char *prefix, const char *root);
 
+/* Register an overlay (or union) static-files handler.  This works like
+   gemini_handle_fs(), except that it serves from n roots at once, layered
+   so that earlier roots override later ones:
+
+       const char *roots[] = { "/srv/tenant", "/srv/base" };
+       gemini_handle_overlay(&server, "/", roots, 2);
+
+   Which root owns what is indexed at registration time, and kept up to
+   date via inotify(7), so each request costs a single lookup and a single
+   open(2), no matter how many layers there are.  See gemini_fs_index.
+
+   As with gemini_handle_fs(), roots are copied; the caller keeps ownership
+   of the array and its strings.
+ */
+int gemini_handle_overlay(struct gemini_server *server, const char *prefix, const char **roots, int n);
+
 /* Register an authn handler, which will verify that all requests to URLs at
    or below prefix are made with a client X.509 certificate signed by a
    certificate authority that has been pre-laoded into the store.  How that
@@ -447,6 +1350,525 @@ int gemini_handle_authn(struct gemini_server *server, const char *prefix, X509_S
  */
 int gemini_handle_vhosts(struct gemini_server *server, struct gemini_url **urls, int n);
 
+/* gemini_cgi_handler() runs CGI programs out of a directory (the root,
+   passed as user data, a NUL-terminated path), one fork and exec per
+   request.  Whatever follows the handler's prefix is resolved (without its
+   query string, which has no say in which program runs) and walked from
+   the root, one component at a time, until it comes to a regular file
+   that can be executed.  That's the program; SCRIPT_NAME is the prefix
+   and the path to the program, and PATH_INFO is whatever is left over, so
+   that /cgi/search/recent?q runs search, with a PATH_INFO of "/recent"
+   and a QUERY_STRING of "q".  Paths that don't lead to a program get a 51.
+
+   The program gets the gemini_request_environ() environment, and nothing
+   on standard input; whatever it writes to standard output (which may
+   start with a gemini_request_directives() line) is relayed to the client
+   as it arrives.  Programs that run for longer than GEMINI_CGI_TIMEOUT
+   seconds are killed, as are those whose client goes away.
+ */
+#define GEMINI_CGI_TIMEOUT 30
+int gemini_cgi_handler(const char *prefix, struct gemini_request *req, void *root);
+
+/* A gemini_pool keeps a number of long-lived worker processes around, all
+   running the same program, and hands requests off to them, one at a time
+   per worker, instead of fork(2)'ing and exec(2)'ing something new for each
+   request, CGI-style.
+
+   Workers talk to the server over their standard input and output, which
+   are both connected to the same Unix domain socket.  The protocol is built
+   out of netstrings (a decimal length, a colon, that many octets of data,
+   and a comma), in the spirit of SCGI:
+
+     1. The server sends a single netstring containing the request headers,
+        as alternating NUL-terminated names and values.  These are the same
+        variables a CGI program would get in its environment (see
+        gemini_request_environ()), with SCRIPT_NAME set to the prefix the
+        pool is registered under, and PATH_INFO to the rest of the path.
+
+     2. The worker replies with any number of netstrings, which together
+        make up the Gemini response (status line and body), followed by an
+        empty netstring ("0:,") to mark the end of the response.
+
+     3. The worker then waits for the next request.  When its standard
+        input reaches end-of-file, it should exit.
+
+   Workers that die, send garbage, or take longer than the timeout (in
+   seconds) to finish their response are killed and replaced.
+
+   Each worker handles a single request at a time, so the number of workers
+   is also the pool's concurrency limit.  Requests beyond that wait their
+   turn (up to the timeout); if max_queue requests are already waiting, new
+   ones are turned away immediately with a 44 (SLOW DOWN).  A max_queue of
+   zero means there is no limit to how many can wait.
+ */
+#define GEMINI_POOL_TIMEOUT 30
+
+struct gemini_pool_stats {
+	unsigned long requests; /* requests handed to a worker, all told */
+	unsigned long crashes;  /* workers that died or misbehaved */
+	unsigned long timeouts; /* requests that ran out of time */
+	unsigned long rejected; /* requests turned away by the queue limit */
+
+	unsigned int  busy;       /* workers currently handling a request */
+	unsigned int  queued;     /* requests currently waiting for a worker */
+	unsigned int  max_queued; /* the most that have ever waited at once */
+};
+
+struct gemini_pool {
+	char *program;          /* path to the worker executable */
+	int   n;                /* how many workers to keep running */
+	int   timeout;          /* per-request deadline, in seconds */
+	unsigned int max_queue; /* how many requests may wait for a worker */
+
+	struct _worker *workers;
+
+	pthread_mutex_t lock; /* guards workers[].busy and stats */
+	pthread_cond_t  idle; /* signaled when a worker frees up */
+	struct gemini_pool_stats stats;
+};
+
+/* Start up a pool of workers, running program.  A timeout of zero means
+   GEMINI_POOL_TIMEOUT.  Returns NULL if any of them can't be started. */
+struct gemini_pool * gemini_pool_new(const char *program, int workers, int timeout, unsigned int max_queue);
+
+/* Take a consistent snapshot of the pool's counters. */
+void gemini_pool_stats(struct gemini_pool *pool, struct gemini_pool_stats *stats);
+
+/* Stop all of the pool's workers, and free it. */
+void gemini_pool_free(struct gemini_pool *pool);
+
+/* The gemini_handler that dispatches to a pool (passed as user data). */
+int gemini_pool_handler(const char *prefix, struct gemini_request *req, void *pool);
+
+/* Register a pool to handle all requests at or under prefix.  The server
+   takes ownership of the pool, and will free it when it is closed. */
+int gemini_handle_pool(struct gemini_server *server, const char *prefix, struct gemini_pool *pool);
+
+/* A gemini_proxy hands requests on to one of a number of upstream Gemini
+   servers, and relays their responses back as they arrive, rather than
+   waiting for all of it first.  The request is rewritten to point at the
+   upstream: whatever follows the handler's prefix is tacked onto the
+   upstream URL's path, so a proxy at /app/ for gemini://10.0.0.5:1966/
+   passes /app/a/b?c on as gemini://10.0.0.5:1966/a/b?c.
+
+   Upstreams are picked either by whichever has the fewest requests
+   outstanding (GEMINI_PROXY_LEAST), or by consistent hashing of the rest
+   of the request path (GEMINI_PROXY_HASH), so that the same document goes
+   to the same upstream (and whatever it has cached), and adding or losing
+   an upstream only moves the documents that were, or become, its own.
+
+   An upstream that fails GEMINI_PROXY_FAILS requests in a row (can't be
+   reached, hangs up, or sends something that isn't a status line; any
+   proper response counts, even an error) is taken out of rotation for
+   GEMINI_PROXY_EJECT seconds.  With a non-zero check interval, a thread
+   also asks each upstream for its own URL that often, and takes it out
+   of rotation, or puts it back, according to whether it answers.  When
+   every upstream is out, they are all tried anyway.  A request that fails
+   before any of the response has been relayed is tried again elsewhere;
+   once every upstream has failed it, the client gets a 43 (PROXY ERROR).
+   An upstream that goes quiet for more than stall milliseconds partway
+   through a body is given up on (the client gets what there was of it),
+   and that counts as a failure, too.
+
+   Upstreams are talked to through a gemini_client of the proxy's own,
+   which resumes TLS sessions, and remembers name lookups.  Client
+   certificates can't be passed along, of course.
+ */
+#define GEMINI_PROXY_LEAST 0
+#define GEMINI_PROXY_HASH  1
+
+#define GEMINI_PROXY_FAILS  3
+#define GEMINI_PROXY_EJECT  30
+#define GEMINI_PROXY_VNODES 64 /* points on the hash ring, per upstream */
+#define GEMINI_PROXY_STALL  30000
+
+struct gemini_proxy_stats {
+	const char *upstream; /* the upstream's URL, as given */
+	int         up;       /* non-zero while it is in rotation */
+
+	unsigned long requests;  /* requests handed to it, all told */
+	unsigned long failures;  /* ... that it failed */
+	unsigned long ejections; /* times it was taken out of rotation */
+	unsigned int  inflight;  /* requests it is handling right now */
+
+	/* time to the first octet of a response, in milliseconds */
+	unsigned long latency;     /* moving average, over the last few */
+	unsigned long max_latency; /* the longest it has ever been */
+};
+
+struct gemini_proxy {
+	int n;                 /* how many upstreams */
+	int balance;           /* GEMINI_PROXY_LEAST or GEMINI_PROXY_HASH */
+	int check;             /* seconds between health checks (0 = none) */
+	int stall;             /* milliseconds an upstream may go quiet, mid-body
+	                          (GEMINI_PROXY_STALL, to start with) */
+
+	struct _upstream *upstreams;
+	struct _point    *ring; /* n * GEMINI_PROXY_VNODES of them, in order */
+	unsigned int      next; /* where the search for the least busy starts */
+
+	struct gemini_client client;
+
+	pthread_t       checker;
+	int             stopping;
+	pthread_mutex_t lock; /* guards upstream state, stats, next and stopping */
+	pthread_cond_t  stop; /* signalled when it is time for the checker to go */
+};
+
+/* Set up a proxy for n upstreams, each a gemini:// URL.  Returns NULL if
+   any of them isn't one, or if the proxy can't be set up. */
+struct gemini_proxy * gemini_proxy_new(const char **upstreams, int n, int balance, int check);
+
+/* Take a consistent snapshot of the counters for upstream i. */
+void gemini_proxy_stats(struct gemini_proxy *proxy, int i, struct gemini_proxy_stats *stats);
+
+/* Stop health checking, and free the proxy. */
+void gemini_proxy_free(struct gemini_proxy *proxy);
+
+/* The gemini_handler that dispatches to a proxy (passed as user data). */
+int gemini_proxy_handler(const char *prefix, struct gemini_request *req, void *proxy);
+
+/* Register a proxy to handle all requests at or under prefix.  The server
+   takes ownership of the proxy, and will free it when it is closed. */
+int gemini_handle_proxy(struct gemini_server *server, const char *prefix, struct gemini_proxy *proxy);
+
+/* A gemini_gather answers each request by asking a fixed set of upstream
+   Gemini servers, all at once, and putting what they say together into a
+   single gemtext document; a search across several indexes, say, or a
+   dashboard of what each of a fleet of servers reports about itself.  If
+   the request has a query string, it is passed on to every upstream, in
+   place of any query the upstream's URL came with.
+
+   Upstreams are asked in the order they were given, no more than
+   concurrency of them at a time (0 for no limit), through a gemini_async
+   of the request's own, and a gemini_client shared by every request, which
+   resumes TLS sessions and remembers name lookups.  Each upstream gets a
+   section of the document (a heading and a link to it, with its status,
+   and how long it took), which is sent as soon as that upstream is done,
+   so the client sees the quick ones while the slow ones are still going.
+   Gemtext bodies are included as they are, other text as preformatted
+   text, and anything else is only described; bodies past
+   GEMINI_GATHER_BODY octets are cut off.
+
+   The whole request has deadline milliseconds (GEMINI_GATHER_DEADLINE, if
+   0).  Upstreams that fail get a section saying why; those still going at
+   the deadline are abandoned, and marked as having timed out, and those
+   that were never asked say so.  A closing line tallies it all up.
+ */
+#define GEMINI_GATHER_DEADLINE 5000
+#define GEMINI_GATHER_BODY     65536
+
+struct gemini_gather_stats {
+	unsigned long requests; /* requests answered */
+	unsigned long calls;    /* upstreams asked, all told */
+	unsigned long failures; /* ... that failed */
+	unsigned long timeouts; /* ... that timed out */
+	unsigned long skipped;  /* upstreams never asked, for lack of time */
+};
+
+struct gemini_gather {
+	int    n;           /* how many upstreams */
+	char **urls;
+	int    concurrency; /* upstreams asked at once, per request (0 = all) */
+	int    deadline;    /* milliseconds, for the whole request */
+
+	struct gemini_client client;
+
+	pthread_mutex_t lock; /* guards stats */
+	struct gemini_gather_stats stats;
+};
+
+/* Set up a gather across n upstreams, each a gemini:// URL.  Returns NULL
+   if any of them isn't one, or if the gather can't be set up. */
+struct gemini_gather * gemini_gather_new(const char **urls, int n, int concurrency, int deadline);
+
+/* Take a consistent snapshot of the counters. */
+void gemini_gather_stats(struct gemini_gather *gather, struct gemini_gather_stats *stats);
+
+/* Free the gather. */
+void gemini_gather_free(struct gemini_gather *gather);
+
+/* The gemini_handler that dispatches to a gather (passed as user data). */
+int gemini_gather_handler(const char *prefix, struct gemini_request *req, void *gather);
+
+/* Register a gather to handle all requests at or under prefix.  The server
+   takes ownership of the gather, and will free it when it is closed. */
+int gemini_handle_gather(struct gemini_server *server, const char *prefix, struct gemini_gather *gather);
+
+/* A gemini_cache remembers the responses that handlers produce, so that
+   repeated requests for the same thing can be answered without running the
+   handler (often a CGI program) again.  Responses are keyed by requested
+   host, port, path, and query string, and optionally by the fingerprint of
+   the client certificate, for things that differ from user to user.
+
+   How long a response stays fresh is governed by policies, each of which
+   covers a URL path prefix (the longest matching prefix wins), and by any
+   Cache-Control directives the handler itself gave (which take precedence;
+   see gemini_request_directives()).  Responses that no policy or directive
+   covers, and anything other than a 2x or 3x response, are not cached.
+
+   A stale response can still be served for a while after it expires, if
+   the policy (or directive) allows it; the first request to see it stale
+   gets the old response right away, and then the handler is run again,
+   on the side, to refresh it.
+
+   The cache holds at most budget octets of responses, evicting the least
+   recently used ones to make room, and won't store anything larger than
+   GEMINI_CACHE_ENTRY_MAX.
+
+   Caches are reference counted, so that one cache can be shared by several
+   handlers: gemini_cache_new() hands back the first reference, every
+   gemini_handle_cached() takes another (dropped when the server is
+   closed), and gemini_cache_free() drops one.
+ */
+#define GEMINI_CACHE_BUDGET    (64 * 1024 * 1024)
+#define GEMINI_CACHE_ENTRY_MAX (1024 * 1024)
+
+/* Policy flag: key responses by the client certificate, as well. */
+#define GEMINI_CACHE_PER_CERT 1
+
+struct gemini_cache_stats {
+	unsigned long hits;      /* requests answered from the cache */
+	unsigned long stale;     /* ... of which were stale, and refreshed */
+	unsigned long misses;    /* requests that had to run the handler */
+	unsigned long stores;    /* responses added to the cache */
+	unsigned long evictions; /* responses dropped to stay under budget */
+
+	size_t entries; /* responses currently cached */
+	size_t bytes;   /* octets currently cached */
+};
+
+struct gemini_cache {
+	size_t budget; /* most octets of responses to hold at once */
+	int    refs;   /* outstanding references; see gemini_cache_free() */
+
+	struct _policy *policies; /* per-prefix TTLs, checked at request time */
+
+	pthread_mutex_t lock;      /* guards everything below */
+	struct gemini_map entries; /* key -> cached response */
+	struct _cached *lru;       /* most recently used response first */
+	struct _cached *lru_tail;  /* ... and the next one to be evicted */
+	struct gemini_cache_stats stats;
+};
+
+/* The user data for gemini_cache_handler(): the handler being wrapped, its
+   own user data, and the cache to keep its responses in. */
+struct gemini_cached {
+	gemini_handler        fn;
+	void                 *data;
+	struct gemini_cache  *cache;
+};
+
+/* Create an empty cache, holding up to budget octets of responses (zero
+   means GEMINI_CACHE_BUDGET).  Returns NULL on failure. */
+struct gemini_cache * gemini_cache_new(size_t budget);
+
+/* Cache responses for URLs at or under prefix for ttl seconds, and serve
+   them (while refreshing) for up to stale seconds after that.  The flags
+   are a bitwise-OR of GEMINI_CACHE_* policy flags.  Returns 0 on success,
+   and negative on failure. */
+int gemini_cache_policy(struct gemini_cache *cache, const char *prefix, int ttl, int stale, int flags);
+
+/* Take a consistent snapshot of the cache's counters. */
+void gemini_cache_stats(struct gemini_cache *cache, struct gemini_cache_stats *stats);
+
+/* Drop a reference to the cache, freeing it when the last one goes. */
+void gemini_cache_free(struct gemini_cache *cache);
+
+/* The gemini_handler that consults the cache before calling on the handler
+   it wraps (passed, with the cache, as a struct gemini_cached). */
+int gemini_cache_handler(const char *prefix, struct gemini_request *req, void *cached);
+
+/* Register a handler, exactly as gemini_handle_fn() would, but with its
+   responses cached.  The server takes ownership of data (as it would for
+   the bare handler) and a new reference to the cache. */
+int gemini_handle_cached(struct gemini_server *server, const char *prefix, gemini_handler fn, void *data, struct gemini_cache *cache);
+
+/* Request coalescing (or "single-flight") keeps a crowd of identical
+   requests, all arriving at once, from each running the same expensive
+   handler.  The first request for a given URL (and client certificate)
+   under a coalesced prefix is handled as usual, but its response is
+   recorded as it goes out; identical requests that show up while it is
+   still in flight wait for it to finish, and then get a copy of the
+   recorded response.
+
+   At most max_waiters requests (zero means GEMINI_FLIGHT_WAITERS) will
+   wait on any one flight; any more than that are handled on their own, as
+   are those that wait longer than timeout seconds (zero means
+   GEMINI_FLIGHT_TIMEOUT), and those waiting on a flight that fails, sends
+   a response larger than GEMINI_FLIGHT_MAX, or marks its response
+   "Cache-Control: no-store".
+
+   This only makes a difference if the server handles more than one
+   request at a time; see the threads member of gemini_server.
+ */
+#define GEMINI_FLIGHT_WAITERS 64
+#define GEMINI_FLIGHT_TIMEOUT 10
+#define GEMINI_FLIGHT_MAX     GEMINI_CACHE_ENTRY_MAX
+
+struct gemini_flights_stats {
+	unsigned long flights;   /* requests that were handled, and shared */
+	unsigned long coalesced; /* requests answered with a shared response */
+	unsigned long overflows; /* requests that found too many waiting */
+	unsigned long timeouts;  /* requests that gave up waiting */
+	unsigned long failures;  /* waiters whose flight couldn't be shared */
+};
+
+struct gemini_flights {
+	struct _coalesce *prefixes; /* where coalescing is in effect */
+
+	pthread_mutex_t lock;       /* guards everything below */
+	struct gemini_map inflight; /* key -> struct gemini_flight */
+	struct gemini_flights_stats stats;
+};
+
+struct gemini_flight;
+
+/* Coalesce identical requests at or under prefix.  Returns 0 on success,
+   and negative on failure. */
+int gemini_coalesce(struct gemini_server *server, const char *prefix, unsigned int max_waiters, int timeout);
+
+/* Called by gemini_serve() for each request, before dispatching it.  If an
+   identical request is already in flight, wait for it, and answer this one
+   with its response (closing the request), returning 1.  Otherwise, return
+   0, and let the caller handle the request.  If that makes it the leader of
+   a new flight, *flight is set, and the caller must pass it to
+   gemini_flights_end() once the request has been handled. */
+int gemini_flights_begin(struct gemini_flights *fl, struct gemini_request *req, struct gemini_flight **flight);
+
+/* Share the leader's response with whoever waited on the flight. */
+void gemini_flights_end(struct gemini_flights *fl, struct gemini_request *req, struct gemini_flight *flight);
+
+/* Take a consistent snapshot of the coalescing counters. */
+void gemini_flights_stats(struct gemini_flights *fl, struct gemini_flights_stats *stats);
+
+void gemini_flights_free(struct gemini_flights *fl);
+
+/* A gemini_slots is a fixed set of request structures, each with its TLS
+   handle, output buffer, and request-scoped memory set up beforehand (see
+   gemini_request_init()), that gemini_serve() handles connections in.  A
+   thread takes a slot as soon as it accepts a connection, and puts it back
+   once it is done, so in the steady state, taking on a connection allocates
+   nothing at all.
+
+   Idle slots are kept on a stack, so a thread usually gets back the slot it
+   just put back, buffers still warm in its cache.  When none are idle,
+   gemini_slots_acquire() waits for one; that is what caps the number of
+   connections the server handles at once.
+
+   Lean slots (from a NULL ctx) are the opposite: nothing is allocated until
+   a connection needs it, and it is all freed when the slot is put back.
+ */
+struct gemini_slots_stats {
+	unsigned int  size;        /* how many slots there are */
+	unsigned int  busy;        /* how many are handling a connection */
+	unsigned int  peak;        /* the most that have been busy at once */
+	unsigned long waits;       /* times a thread had to wait for a slot */
+	unsigned long shed;        /* connections turned away, over budget */
+};
+
+struct gemini_slots {
+	struct gemini_request  *slots; /* all of them */
+	struct gemini_request **idle;  /* stack of the ones not in use */
+	unsigned int nidle;
+	int lean;                      /* free everything on release */
+
+	pthread_mutex_t lock;  /* guards idle, nidle, and stats */
+	pthread_cond_t  freed; /* signalled when a slot goes back */
+	struct gemini_slots_stats stats;
+};
+
+/* Allocate n slots, with TLS handles from ctx, or lean ones, if ctx is
+   NULL.  Returns NULL on failure. */
+struct gemini_slots * gemini_slots_new(SSL_CTX *ctx, unsigned int n);
+
+/* Take an idle slot, waiting for one if need be. */
+struct gemini_request * gemini_slots_acquire(struct gemini_slots *slots);
+
+/* Put a slot back, once its connection has been closed. */
+void gemini_slots_release(struct gemini_slots *slots, struct gemini_request *req);
+
+/* Take a consistent snapshot of slot occupancy. */
+void gemini_slots_stats(struct gemini_slots *slots, struct gemini_slots_stats *stats);
+
+/* Wait until no slot is using anything from epoch, or from any epoch
+   before it (see the epoch field of gemini_request).  This only polls, so
+   it is meant for things that rarely happen.  gemini_slots_quiesce_tls()
+   does the same, going by the tls_epoch field instead. */
+void gemini_slots_quiesce(struct gemini_slots *slots, unsigned long epoch);
+void gemini_slots_quiesce_tls(struct gemini_slots *slots, unsigned long epoch);
+
+void gemini_slots_free(struct gemini_slots *slots);
+
+/* A gemini_plugin is a handler that lives in a shared object, loaded at
+   run time with dlopen(3), so that a stock server can be taught new tricks
+   without being rebuilt, and without the process-per-request overhead of
+   CGI.  The shared object must export a handler function, and may export
+   setup and teardown functions, under these names:
+
+       int  gemini_plugin_init(const char *config, void **data);
+       int  gemini_plugin_handler(const char *prefix, struct gemini_request *req, void *data);
+       void gemini_plugin_teardown(void *data);
+
+   The init function is given the plugin's configuration string, and can
+   set *data to whatever the handler will need; it returns 0 on success.
+   The handler works just like any other gemini_handler.  The teardown
+   function gets the same data pointer, once the plugin is being unloaded
+   and no more requests will be handed to it.
+
+   Plugins call back into the server's copy of the library (for things
+   like gemini_request_respond()), so the server has to be linked with
+   -rdynamic (or --export-dynamic) for them to find it.
+
+   Plugins can be reloaded while the server is running, to pick up a new
+   build of the shared object.  Requests already being handled by the old
+   version finish up with it, and it is torn down and unloaded once the
+   last of them is done; new requests go to the new version.  If the new
+   version won't load, the old one soldiers on.
+ */
+#define GEMINI_PLUGIN_INIT     "gemini_plugin_init"
+#define GEMINI_PLUGIN_HANDLER  "gemini_plugin_handler"
+#define GEMINI_PLUGIN_TEARDOWN "gemini_plugin_teardown"
+
+typedef int  (*gemini_plugin_init_fn)(const char *config, void **data);
+typedef void (*gemini_plugin_teardown_fn)(void *data);
+
+struct gemini_plugin {
+	char *path;   /* where the shared object lives */
+	char *config; /* configuration string, for the init function */
+
+	volatile sig_atomic_t reload; /* set by gemini_plugin_reload() */
+
+	pthread_mutex_t lock;   /* guards everything below */
+	struct _loaded *loaded; /* the version new requests go to */
+	unsigned long   loads;  /* how many times it has been (re)loaded */
+};
+
+/* Load a plugin, and run its init function.  Returns NULL (with the
+   reason logged) if the shared object can't be loaded, doesn't have a
+   handler, or fails to initialize. */
+struct gemini_plugin * gemini_plugin_load(const char *path, const char *config);
+
+/* Ask for a plugin to be reloaded, before it handles its next request.
+   This only sets a flag, so it is safe to call from a signal handler.
+
+   This is for programs built on the library that want to swap in a new
+   build of one plugin, and leave the rest of their handlers alone.
+   geminon doesn't call it: on SIGHUP it rebuilds every handler, plugins
+   included, with a fresh gemini_plugin_load(), and gemini_reroute()s to
+   them. */
+void gemini_plugin_reload(struct gemini_plugin *plugin);
+
+/* Tear down and unload the plugin.  No requests may be in flight. */
+void gemini_plugin_free(struct gemini_plugin *plugin);
+
+/* The gemini_handler that dispatches to a plugin (passed as user data). */
+int gemini_plugin_handler(const char *prefix, struct gemini_request *req, void *plugin);
+
+/* Register a plugin to handle requests at or under prefix.  The server
+   takes ownership of the plugin, and will free it when it is closed. */
+int gemini_handle_plugin(struct gemini_server *server, const char *prefix, struct gemini_plugin *plugin);
+
 /* Bind a socket to the given Gemini URL (path notwithstanding) so that a
    future call to gemini_serve() can listen and accept connections.  The
    socket will be set to REUSEADDR, to ensure quick startup of servers.
@@ -465,11 +1887,44 @@ int gemini_bind(struct gemini_server *server, int port);
  */
 int gemini_tls(struct gemini_server *server, const char *cert, const char *key);
 
+/* Certificates don't last forever.  gemini_tls_reload() loads a new
+   certificate and key (from the same kind of files as gemini_tls()), and
+   swaps them in for new connections, while the server is running.  The
+   new pair is checked first: if the key doesn't go with the certificate,
+   or the certificate has already expired, nothing changes, and a negative
+   value is returned.
+
+   Connections already under way carry on with the old certificate.  The
+   keys that session tickets are sealed with are carried over, so clients
+   can resume their sessions across the change, rather than all having to
+   do a full handshake at once.
+
+   The new certificate is in use as soon as it has been swapped in, but the
+   old one isn't freed until no thread can still be picking it up.  That
+   wait goes by an epoch of its own (not the one gemini_reroute() uses for
+   handlers), and only covers the moment it takes a new connection to get
+   a TLS handle, so a rotation doesn't wait on requests in flight. */
+int gemini_tls_reload(struct gemini_server *server, const char *cert, const char *key);
+
 /* Listen to the socket created by a gemini_bind() against the passed server
    object, and service clients as they connect.
  */
 int gemini_serve(struct gemini_server *server);
 
+/* Replace all of a server's handlers with those registered on next, a
+   scratch gemini_server set up (with gemini_handle() and friends) for no
+   other reason; next is left without any.  This is how a running server
+   is reconfigured, without restarting it.
+
+   Dispatching never takes a lock.  Each request picks up whichever list
+   of handlers is current when it gets to them, and sticks with it, so a
+   request that was already being handled finishes with the old ones.
+   gemini_reroute() waits for those to finish before freeing the old
+   handlers, so it is best called from a thread that can afford to wait,
+   and never from a signal handler.  Only one call at a time, please.
+ */
+void gemini_reroute(struct gemini_server *server, struct gemini_server *next);
+
 /* When you're finished with a server object, call gemini_server_close() to
    relinquish any resources it was holding onto.  Mostly this is TLS stuff,
    and bound socket descriptors, but it doesn't hurt to call it even if you
@@ -1,21 +1,29 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <signal.h>
+#include <time.h>
 
 #include <getopt.h>
 
 #include <sys/types.h>
-#include <sys/wait.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 #include "./gemini.h"
 
 #include <openssl/x509_vfy.h>
 #include <openssl/err.h>
 
+/* How often (in seconds) to check whether the TLS certificate and key, or
+   any --authn certificate authorities, have been replaced on disk */
+#define WATCH_INTERVAL 5
+
 static int echo_handler(const char *prefix, struct gemini_request *req, void *_) {
+	gemini_request_cork(req);
 	gemini_request_respond(req, 20, "text/plain");
 	gemini_request_write(req, req->url->path, strlen(req->url->path));
 	gemini_request_write(req, "\r\n", 2);
@@ -23,264 +31,950 @@ static int echo_handler(const char *prefix, struct gemini_request *req, void *_)
 	return GEMINI_HANDLER_DONE;
 }
 
-static int cgi_handler(const char *prefix, struct gemini_request *req, void *_root) {
-	int rc, pfd[2];
-	struct gemini_fs fs;
-	char *prog, **argv, **envp;
-	pid_t kid;
+/* Responses from --exec and --pool handlers are cached here, per --cache */
+static struct gemini_cache *cache;
+
+/* Everything that --stats knows how to report on.  The lists grow
+   eight entries at a time, as handlers are registered. */
+struct stats {
+	struct gemini_server *server;
+
+	int npools;
+	struct {
+		char prefix[256];
+		struct gemini_pool *pool;
+	} *pools;
+
+	int nproxies;
+	struct {
+		char prefix[256];
+		struct gemini_proxy *proxy;
+	} *proxies;
+
+	int ngathers;
+	struct {
+		char prefix[256];
+		struct gemini_gather *gather;
+	} *gathers;
+};
+
+/* Make room in one of the stats lists for another entry. */
+static int stats_grow(void **list, int n, size_t size) {
+	void *more;
 
-	fs.root = _root;
-	prog = gemini_fs_path(&fs, req->url->path + strlen(prefix));
-	if (!prog) {
-		return GEMINI_HANDLER_ABORT;
+	if (n % 8 == 0) {
+		more = realloc(*list, (n + 8) * size);
+		if (!more) {
+			return -1;
+		}
+		*list = more;
 	}
+	return 0;
+}
+
+static void stats_free(void *_stats) {
+	struct stats *stats;
 
-	fprintf(stderr, "executing '%s'...\n", prog);
-	argv = calloc(1, sizeof(char *));
-	if (!argv) {
-		free(prog);
-		return GEMINI_HANDLER_ABORT;
+	stats = _stats;
+	if (stats) {
+		free(stats->pools);
+		free(stats->proxies);
+		free(stats->gathers);
+		free(stats);
 	}
-	envp = calloc(1, sizeof(char *));
-	if (!envp) {
-		free(prog); free(argv);
-		return GEMINI_HANDLER_ABORT;
+}
+
+static int stats_handler(const char *prefix, struct gemini_request *req, void *_stats) {
+	struct stats *stats;
+	struct gemini_pool_stats ps;
+	struct gemini_proxy_stats xs;
+	struct gemini_gather_stats gs;
+	struct gemini_cache_stats cs;
+	struct gemini_flights_stats fs;
+	struct gemini_slots_stats ss;
+	char line[1024];
+	int i, j, n;
+
+	stats = _stats;
+	gemini_request_cork(req);
+	gemini_request_respond(req, 20, "text/plain");
+
+	gemini_slots_stats(stats->server->slots, &ss);
+	n = snprintf(line, sizeof(line),
+		"slots size=%u busy=%u peak=%u waits=%lu shed=%lu\n",
+		ss.size, ss.busy, ss.peak, ss.waits, ss.shed);
+	gemini_request_write(req, line, n);
+
+	for (i = 0; i < stats->npools; i++) {
+		gemini_pool_stats(stats->pools[i].pool, &ps);
+		n = snprintf(line, sizeof(line),
+			"pool %s workers=%d busy=%u queued=%u max_queued=%u requests=%lu crashes=%lu timeouts=%lu rejected=%lu\n",
+			stats->pools[i].prefix, stats->pools[i].pool->n, ps.busy, ps.queued, ps.max_queued,
+			ps.requests, ps.crashes, ps.timeouts, ps.rejected);
+		gemini_request_write(req, line, n);
 	}
 
-	rc = pipe(pfd);
-	if (rc != 0) {
-		free(prog); free(argv); free(envp);
-		return GEMINI_HANDLER_ABORT;
+	for (i = 0; i < stats->nproxies; i++) {
+		for (j = 0; j < stats->proxies[i].proxy->n; j++) {
+			gemini_proxy_stats(stats->proxies[i].proxy, j, &xs);
+			n = snprintf(line, sizeof(line),
+				"proxy %s upstream=%s up=%d inflight=%u requests=%lu failures=%lu ejections=%lu latency=%lums max_latency=%lums\n",
+				stats->proxies[i].prefix, xs.upstream, xs.up, xs.inflight, xs.requests, xs.failures, xs.ejections,
+				xs.latency, xs.max_latency);
+			gemini_request_write(req, line, n);
+		}
 	}
 
-	kid = fork();
-	if (kid < 0) {
-		fprintf(stderr, "fork failed: %s (error %d)\n", strerror(errno), errno);
-		free(prog); free(argv); free(envp);
-		return GEMINI_HANDLER_ABORT;
+	for (i = 0; i < stats->ngathers; i++) {
+		gemini_gather_stats(stats->gathers[i].gather, &gs);
+		n = snprintf(line, sizeof(line),
+			"gather %s upstreams=%d requests=%lu calls=%lu failures=%lu timeouts=%lu skipped=%lu\n",
+			stats->gathers[i].prefix, stats->gathers[i].gather->n, gs.requests, gs.calls, gs.failures,
+			gs.timeouts, gs.skipped);
+		gemini_request_write(req, line, n);
 	}
 
-	if (kid != 0) {
-		fprintf(stderr, "forked child %d\n", (int)kid);
-		/* in parent process; close write end */
-		close(pfd[1]);
+	gemini_cache_stats(cache, &cs);
+	n = snprintf(line, sizeof(line),
+		"cache entries=%zu bytes=%zu budget=%zu hits=%lu stale=%lu misses=%lu stores=%lu evictions=%lu\n",
+		cs.entries, cs.bytes, cache->budget, cs.hits, cs.stale, cs.misses, cs.stores, cs.evictions);
+	gemini_request_write(req, line, n);
+
+	if (stats->server->flights) {
+		gemini_flights_stats(stats->server->flights, &fs);
+		n = snprintf(line, sizeof(line),
+			"coalesce flights=%lu coalesced=%lu overflows=%lu timeouts=%lu failures=%lu\n",
+			fs.flights, fs.coalesced, fs.overflows, fs.timeouts, fs.failures);
+		gemini_request_write(req, line, n);
+	}
+	gemini_request_close(req);
+	return GEMINI_HANDLER_DONE;
+}
+
+/* Parse --pool [/prefix:]/path/to/worker[,workers=N][,timeout=S][,queue=Q] */
+static int configure_pool(struct gemini_server *server, struct stats *stats, const char *arg) {
+	char *s1, *s2, *s3, *prefix;
+	int workers = 4, timeout = 0, queue = 0;
+	struct gemini_pool *pool;
 
-		fprintf(stderr, "parent: streaming request from child process...\n");
-		rc = gemini_request_stream(req, pfd[0], 8192);
-		waitpid(kid, NULL, 0);
-		fprintf(stderr, "parent: child process exited.\n");
+	s1 = strdup(arg);
+	s2 = strchr(s1, ':');
+	if (s2) {
+		*s2++ = '\0';
+		prefix = s1;
+	} else {
+		s2 = s1;
+		prefix = "/";
+	}
 
-		free(prog); free(argv); free(envp);
-		if (rc != 0) {
-			return GEMINI_HANDLER_ABORT;
+	s3 = strchr(s2, ',');
+	if (s3) *s3++ = '\0';
+	while (s3) {
+		if      (strncmp(s3, "workers=", 8) == 0) workers = atoi(s3 + 8);
+		else if (strncmp(s3, "timeout=", 8) == 0) timeout = atoi(s3 + 8);
+		else if (strncmp(s3, "queue=",   6) == 0) queue   = atoi(s3 + 6);
+		else {
+			fprintf(stderr, "--pool %s: unrecognized option '%s'\n", arg, s3);
+			free(s1);
+			return -1;
 		}
-		gemini_request_close(req);
-		return GEMINI_HANDLER_DONE;
+		s3 = strchr(s3, ',');
+		if (s3) s3++;
+	}
 
+	fprintf(stderr, "registering pool handler for '%s' urls, served by %d workers running '%s'\n", prefix, workers, s2);
+	pool = gemini_pool_new(s2, workers, timeout, queue);
+	if (!pool) {
+		fprintf(stderr, "unable to start worker pool for '%s': %s (error %d)\n", s2, strerror(errno), errno);
+		free(s1);
+		return -1;
+	}
+	if (gemini_handle_cached(server, prefix, gemini_pool_handler, pool, cache) != 0) {
+		gemini_pool_free(pool);
+		free(s1);
+		return -1;
+	}
+
+	if (stats_grow((void **)&stats->pools, stats->npools, sizeof(stats->pools[0])) != 0) {
+		free(s1);
+		return -1;
+	}
+	snprintf(stats->pools[stats->npools].prefix, sizeof(stats->pools[0].prefix), "%s", prefix);
+	stats->pools[stats->npools].pool = pool;
+	stats->npools++;
+	free(s1);
+	return 0;
+}
+
+/* Parse --proxy [/prefix:]gemini://upstream[,gemini://upstream...][,balance=least|hash][,check=S][,stall=MS] */
+static int configure_proxy(struct gemini_server *server, struct stats *stats, const char *arg) {
+	char *s1, *s2, *s3, *prefix;
+	const char *upstreams[64];
+	int n = 0, balance = GEMINI_PROXY_LEAST, check = 0, stall = 0;
+	struct gemini_proxy *proxy;
+
+	/* upstream URLs have colons of their own */
+	s1 = strdup(arg);
+	s2 = *s1 == '/' ? strchr(s1, ':') : NULL;
+	if (s2) {
+		*s2++ = '\0';
+		prefix = s1;
 	} else {
-		/* in child process; close read end */
-		close(pfd[0]);
+		s2 = s1;
+		prefix = "/";
+	}
+
+	while (s2) {
+		s3 = strchr(s2, ',');
+		if (s3) *s3++ = '\0';
+		if      (strcmp(s2, "balance=least")  == 0) balance = GEMINI_PROXY_LEAST;
+		else if (strcmp(s2, "balance=hash")   == 0) balance = GEMINI_PROXY_HASH;
+		else if (strncmp(s2, "check=", 6)     == 0) check = atoi(s2 + 6);
+		else if (strncmp(s2, "stall=", 6)     == 0) stall = atoi(s2 + 6);
+		else if (strncmp(s2, "gemini://", 9)  == 0) {
+			if (n == sizeof(upstreams) / sizeof(upstreams[0])) {
+				fprintf(stderr, "--proxy %s: too many upstreams (limit is %d)\n", arg, n);
+				free(s1);
+				return -1;
+			}
+			upstreams[n++] = s2;
+		} else {
+			fprintf(stderr, "--proxy %s: unrecognized option '%s'\n", arg, s2);
+			free(s1);
+			return -1;
+		}
+		s2 = s3;
+	}
+	if (n == 0) {
+		fprintf(stderr, "--proxy %s: no upstream gemini:// servers given\n", arg);
+		free(s1);
+		return -1;
+	}
 
-		/* redirect stdout to the pipe */
-		rc = dup2(pfd[1], 1);
-		if (rc < 0) exit(1);
-		close(pfd[1]);
+	fprintf(stderr, "registering proxy handler for '%s' urls, balancing (by %s) across %d upstreams\n",
+		prefix, balance == GEMINI_PROXY_HASH ? "hash" : "least outstanding", n);
+	proxy = gemini_proxy_new(upstreams, n, balance, check);
+	if (!proxy) {
+		fprintf(stderr, "unable to set up proxy for '%s': %s (error %d)\n", prefix, strerror(errno), errno);
+		free(s1);
+		return -1;
+	}
+	if (stall > 0) {
+		proxy->stall = stall;
+	}
+	if (gemini_handle_cached(server, prefix, gemini_proxy_handler, proxy, cache) != 0) {
+		gemini_proxy_free(proxy);
+		free(s1);
+		return -1;
+	}
 
-		fprintf(stderr, "child: execve'ing '%s'...\n", prog);
-		rc = execve(prog, argv, envp);
-		fprintf(stderr, "child: execve returned %d\n", rc);
-		exit(42);
+	if (stats_grow((void **)&stats->proxies, stats->nproxies, sizeof(stats->proxies[0])) != 0) {
+		free(s1);
+		return -1;
 	}
+	snprintf(stats->proxies[stats->nproxies].prefix, sizeof(stats->proxies[0].prefix), "%s", prefix);
+	stats->proxies[stats->nproxies].proxy = proxy;
+	stats->nproxies++;
+	free(s1);
+	return 0;
 }
 
-int configure(struct gemini_server *server, int argc, char **argv, char **envp) {
-	int rc, c, idx;
+/* Parse --gather [/prefix:]gemini://upstream[,gemini://upstream...][,concurrency=N][,deadline=MS] */
+static int configure_gather(struct gemini_server *server, struct stats *stats, const char *arg) {
 	char *s1, *s2, *s3, *prefix;
+	const char *upstreams[64];
+	int n = 0, concurrency = 0, deadline = 0;
+	struct gemini_gather *gather;
+
+	/* upstream URLs have colons of their own */
+	s1 = strdup(arg);
+	s2 = *s1 == '/' ? strchr(s1, ':') : NULL;
+	if (s2) {
+		*s2++ = '\0';
+		prefix = s1;
+	} else {
+		s2 = s1;
+		prefix = "/";
+	}
+
+	while (s2) {
+		s3 = strchr(s2, ',');
+		if (s3) *s3++ = '\0';
+		if      (strncmp(s2, "concurrency=", 12) == 0) concurrency = atoi(s2 + 12);
+		else if (strncmp(s2, "deadline=", 9)     == 0) deadline = atoi(s2 + 9);
+		else if (strncmp(s2, "gemini://", 9)     == 0) {
+			if (n == sizeof(upstreams) / sizeof(upstreams[0])) {
+				fprintf(stderr, "--gather %s: too many upstreams (limit is %d)\n", arg, n);
+				free(s1);
+				return -1;
+			}
+			upstreams[n++] = s2;
+		} else {
+			fprintf(stderr, "--gather %s: unrecognized option '%s'\n", arg, s2);
+			free(s1);
+			return -1;
+		}
+		s2 = s3;
+	}
+	if (n == 0) {
+		fprintf(stderr, "--gather %s: no upstream gemini:// servers given\n", arg);
+		free(s1);
+		return -1;
+	}
 
-	int handlers = 0;
+	fprintf(stderr, "registering gather handler for '%s' urls, asking %d upstreams (%d at a time), within %dms\n",
+		prefix, n, concurrency > 0 ? concurrency : n, deadline > 0 ? deadline : GEMINI_GATHER_DEADLINE);
+	gather = gemini_gather_new(upstreams, n, concurrency, deadline);
+	if (!gather) {
+		fprintf(stderr, "unable to set up gather for '%s': %s (error %d)\n", prefix, strerror(errno), errno);
+		free(s1);
+		return -1;
+	}
+	if (gemini_handle_cached(server, prefix, gemini_gather_handler, gather, cache) != 0) {
+		gemini_gather_free(gather);
+		free(s1);
+		return -1;
+	}
 
-	int port = 0;
+	if (stats_grow((void **)&stats->gathers, stats->ngathers, sizeof(stats->gathers[0])) != 0) {
+		free(s1);
+		return -1;
+	}
+	snprintf(stats->gathers[stats->ngathers].prefix, sizeof(stats->gathers[0].prefix), "%s", prefix);
+	stats->gathers[stats->ngathers].gather = gather;
+	stats->ngathers++;
+	free(s1);
+	return 0;
+}
 
-	char *cert = NULL, *key = NULL;
+/* Parse --cache [/prefix:]TTL[,stale=S][,per-cert] */
+static int configure_cache(const char *arg) {
+	char *s1, *s2, *s3, *prefix;
+	int ttl, stale = 0, flags = 0;
 
-	X509_STORE *store;
-	X509_LOOKUP *lookup;
+	s1 = strdup(arg);
+	s2 = strchr(s1, ':');
+	if (s2) {
+		*s2++ = '\0';
+		prefix = s1;
+	} else {
+		s2 = s1;
+		prefix = "/";
+	}
+
+	s3 = strchr(s2, ',');
+	if (s3) *s3++ = '\0';
+	ttl = atoi(s2);
+	while (s3) {
+		if      (strncmp(s3, "stale=",   6) == 0) stale = atoi(s3 + 6);
+		else if (strncmp(s3, "per-cert", 8) == 0) flags |= GEMINI_CACHE_PER_CERT;
+		else {
+			fprintf(stderr, "--cache %s: unrecognized option '%s'\n", arg, s3);
+			free(s1);
+			return -1;
+		}
+		s3 = strchr(s3, ',');
+		if (s3) s3++;
+	}
+
+	fprintf(stderr, "caching responses for '%s' urls for %ds (serving stale for %ds more)%s\n",
+		prefix, ttl, stale, flags & GEMINI_CACHE_PER_CERT ? ", per client certificate" : "");
+	if (gemini_cache_policy(cache, prefix, ttl, stale, flags) != 0) {
+		fprintf(stderr, "--cache %s: invalid cache policy\n", arg);
+		free(s1);
+		return -1;
+	}
+	free(s1);
+	return 0;
+}
+
+/* Parse --coalesce [/prefix][,waiters=N][,timeout=S] */
+static int configure_coalesce(struct gemini_server *server, const char *arg) {
+	char *s1, *s2;
+	int waiters = 0, timeout = 0;
+
+	s1 = strdup(arg);
+	s2 = strchr(s1, ',');
+	if (s2) *s2++ = '\0';
+	while (s2) {
+		if      (strncmp(s2, "waiters=", 8) == 0) waiters = atoi(s2 + 8);
+		else if (strncmp(s2, "timeout=", 8) == 0) timeout = atoi(s2 + 8);
+		else {
+			fprintf(stderr, "--coalesce %s: unrecognized option '%s'\n", arg, s2);
+			free(s1);
+			return -1;
+		}
+		s2 = strchr(s2, ',');
+		if (s2) s2++;
+	}
+
+	fprintf(stderr, "coalescing identical requests for '%s' urls\n", *s1 ? s1 : "/");
+	if (gemini_coalesce(server, *s1 ? s1 : "/", waiters, timeout) != 0) {
+		fprintf(stderr, "unable to coalesce requests for '%s': %s (error %d)\n", s1, strerror(errno), errno);
+		free(s1);
+		return -1;
+	}
+	free(s1);
+	return 0;
+}
+
+/* Parse --plugin [/prefix:]/path/to/plugin.so[=config] */
+static int configure_plugin(struct gemini_server *server, const char *arg) {
+	char *s1, *s2, *config, *prefix;
+	struct gemini_plugin *plugin;
+
+	s1 = strdup(arg);
+	s2 = strchr(s1, ':');
+	if (s2) {
+		*s2++ = '\0';
+		prefix = s1;
+	} else {
+		s2 = s1;
+		prefix = "/";
+	}
+	config = strchr(s2, '=');
+	if (config) *config++ = '\0';
+
+	fprintf(stderr, "registering plugin handler for '%s' urls, served by '%s'\n", prefix, s2);
+	plugin = gemini_plugin_load(s2, config);
+	if (!plugin) {
+		fprintf(stderr, "unable to load plugin '%s'\n", s2);
+		free(s1);
+		return -1;
+	}
+	if (gemini_handle_plugin(server, prefix, plugin) != 0) {
+		gemini_plugin_free(plugin);
+		free(s1);
+		return -1;
+	}
+	free(s1);
+	return 0;
+}
+
+/* Parse a size, like 65536, 64k, or 64m */
+static long parse_size(const char *s) {
+	char *end;
+	long n;
+
+	n = strtol(s, &end, 10);
+	switch (tolower(*end)) {
+	case 'g': n *= 1024; /* fall through */
+	case 'm': n *= 1024; /* fall through */
+	case 'k': n *= 1024; end++;
+	}
+	return *end || n <= 0 ? -1 : n;
+}
+
+/* A file that is loaded again when it changes, and what it looked like
+   the last time it was loaded. */
+struct watched {
+	char        *path;
+	struct stat  st;
+};
+
+static void watch(struct watched *w, const char *path) {
+	w->path = strdup(path);
+	if (stat(path, &w->st) != 0) {
+		memset(&w->st, 0, sizeof(w->st));
+	}
+}
+
+/* Has w been replaced, or written to, since we last looked? */
+static int changed(struct watched *w) {
+	struct stat st;
+	int diff;
+
+	if (stat(w->path, &st) != 0) {
+		return 0; /* in the middle of being replaced, perhaps */
+	}
+	diff = st.st_ino  != w->st.st_ino
+	    || st.st_size != w->st.st_size
+	    || st.st_mtim.tv_sec  != w->st.st_mtim.tv_sec
+	    || st.st_mtim.tv_nsec != w->st.st_mtim.tv_nsec;
+	memcpy(&w->st, &st, sizeof(st));
+	return diff;
+}
+
+/* The TLS certificate and key, and every --authn CA bundle that the
+   handlers were last built with. */
+static struct watched certs[2];
+static struct watched cas[64];
+static int ncas;
+
+/* Everything configure() builds up, one option at a time. */
+struct config {
+	struct gemini_server *server; /* where the handlers go */
+	int reload;                   /* only the handlers matter, this time */
+
+	int handlers;
+	int port;
+	char *cert, *key;
 
 	int nvhosts, cap;
 	struct gemini_url **vhosts;
 
-	struct option options[] = {
-		{ "authn",           required_argument, NULL, 'A' },
-		{ "echo",            required_argument, NULL, 'E' },
-		{ "exec",            required_argument, NULL, 'X' },
-		{ "static",          required_argument, NULL, 'S' },
-		{ "bind",            required_argument, NULL, 'b' },
-		{ "listen",          required_argument, NULL, 'l' },
-		{ "tls-certificate", required_argument, NULL, 'c' },
-		{ "tls-key",         required_argument, NULL, 'k' },
-		{ 0, 0, 0, 0 },
-	};
-
-	nvhosts = 0;
-	vhosts = calloc(8, sizeof(struct gemini_url *));
-	if (!vhosts) {
-		return -1;
+	struct stats *stats;
+	int reporting;
+
+	struct watched cas[64];
+	int ncas;
+};
+
+static struct option options[] = {
+	{ "config",          required_argument, NULL, 'f' },
+	{ "authn",           required_argument, NULL, 'A' },
+	{ "echo",            required_argument, NULL, 'E' },
+	{ "exec",            required_argument, NULL, 'X' },
+	{ "pool",            required_argument, NULL, 'P' },
+	{ "plugin",          required_argument, NULL, 'L' },
+	{ "proxy",           required_argument, NULL, 'U' },
+	{ "gather",          required_argument, NULL, 'G' },
+	{ "stats",           required_argument, NULL, 'M' },
+	{ "cache",           required_argument, NULL, 'C' },
+	{ "cache-size",      required_argument, NULL, 'B' },
+	{ "coalesce",        required_argument, NULL, 'F' },
+	{ "threads",         required_argument, NULL, 'T' },
+	{ "max-connections", required_argument, NULL, 'N' },
+	{ "low-memory",      no_argument,       NULL, 'I' },
+	{ "memory-budget",   required_argument, NULL, 'R' },
+	{ "static",          required_argument, NULL, 'S' },
+	{ "bind",            required_argument, NULL, 'b' },
+	{ "listen",          required_argument, NULL, 'l' },
+	{ "tls-certificate", required_argument, NULL, 'c' },
+	{ "tls-key",         required_argument, NULL, 'k' },
+	{ 0, 0, 0, 0 },
+};
+
+static int configure_file(struct config *cf, const char *path);
+
+static int configure_option(struct config *cf, int c, const char *arg) {
+	struct gemini_server *server;
+	int rc;
+	char *s1, *s2, *s3, *prefix;
+
+	X509_STORE *store;
+	X509_LOOKUP *lookup;
+
+	int i, nroots;
+	const char *roots[64];
+
+	long size;
+
+	server = cf->server;
+	s1 = NULL;
+	store = NULL;
+
+	/* a reload only rebuilds the handlers; everything else is
+	   as it was when the server started */
+	if (cf->reload && strchr("CBFTNIRlck", c)) {
+		return 0;
 	}
-	cap = 8;
 
-	/* first, we try the environment */
-	cert = getenv("GEMINON_CERTIFICATE");
-	if (cert) cert = strdup(cert);
+	switch (c) {
+		case 'f':
+			if (configure_file(cf, arg) != 0) {
+				return -1;
+			}
+			break;
 
-	key = getenv("GEMINON_PRIVATE_KEY");
-	if (key) key = strdup(key);
+		case 'A':
+			store = X509_STORE_new();
+			if (!store) {
+				fprintf(stderr, "unable to create X509_store()\n");
+				goto fail;
+			}
 
-	s1 = getenv("GEMINON_PORT");
-	if (s1) {
-		port = 0;
-		for (s2 = s1; *s2; s2++) {
-			if (!isdigit(*s2)) {
-				fprintf(stderr, "GEMINON_PORT=%s: not a valid port number (try GEMINON_PORT=1965)\n", s1);
+			lookup = X509_STORE_add_lookup(store, X509_LOOKUP_file());
+			if (!lookup) {
+				fprintf(stderr, "unable to create x.509 store lookup\n");
+				goto fail;
+			}
+
+			s1 = strdup(arg);
+			if (!s1) {
+				goto fail;
+			}
+			s2 = strchr(s1, ':');
+			if (s2) {
+				*s2++ = '\0';
+				prefix = s1;
+			} else {
+				s2 = s1;
+				prefix = "/";
+			}
+
+			for (;;) {
+				s3 = strchr(s2, ',');
+				if (s3) *s3++ = '\0';
+				if (cf->ncas < sizeof(cf->cas) / sizeof(cf->cas[0])) {
+					watch(&cf->cas[cf->ncas++], s2);
+				}
+				rc = X509_load_cert_file(lookup, s2, SSL_FILETYPE_PEM);
+				if (rc == 0) {
+					fprintf(stderr, "%s: unable to load certificate authority certificate\n", s2);
+					ERR_print_errors_fp(stderr);
+					goto fail;
+				}
+				if (!s3) break;
+				s2 = s3;
+			}
+
+			rc = gemini_handle_authn(server, prefix, store);
+			if (rc != 0) {
+				fprintf(stderr, "gemini_handle_authn() failed! (e%d: %s)\n", errno, strerror(errno));
+				goto fail;
+			}
+			free(s1);
+			break;
+
+		case 'E':
+			cf->handlers++;
+			rc = gemini_handle_fn(server, arg, echo_handler, NULL);
+			if (rc != 0) {
+				fprintf(stderr, "unable to register echo handler at '%s': %s (error %d)\n", arg, strerror(errno), errno);
 				return -1;
 			}
-		}
-	}
+			break;
 
-	/* then, we try the command line */
-	while (1) {
-		idx = 0;
-		c = getopt_long(argc, argv, "A:E:X:S:b:l:c:k:", options, &idx);
-		if (c == -1)
+		case 'X':
+			if (signal(SIGCHLD, SIG_IGN) == SIG_ERR) {
+				fprintf(stderr, "unable to set child signal handler: %s (error %d)\n", strerror(errno), errno);
+				return -1;
+			}
+			s1 = strdup(arg);
+			if (!s1) {
+				goto fail;
+			}
+			s2 = strchr(s1, ':');
+			if (s2) {
+				*s2++ = '\0';
+				prefix = s1;
+			} else {
+				s2 = s1;
+				prefix = "/";
+			}
+
+			fprintf(stderr, "registering exec handler for '%s' urls, served from '%s'\n", prefix, s2);
+			cf->handlers++;
+			s3 = strdup(s2);
+			if (!s3) {
+				goto fail;
+			}
+			rc = gemini_handle_cached(server, prefix, gemini_cgi_handler, s3, cache);
+			if (rc != 0) {
+				fprintf(stderr, "unable to register exec handler at '%s': %s (error %d)\n", prefix, strerror(errno), errno);
+				free(s3);
+				goto fail;
+			}
+			free(s1);
 			break;
 
-		switch (c) {
-			case 'A':
-				store = X509_STORE_new();
-				if (!store) {
-					fprintf(stderr, "unable to create X509_store()\n");
-					return 1;
-				}
+		case 'P':
+			cf->handlers++;
+			if (configure_pool(server, cf->stats, arg) != 0) {
+				return -1;
+			}
+			break;
 
-				lookup = X509_STORE_add_lookup(store, X509_LOOKUP_file());
-				if (!store) {
-					fprintf(stderr, "unable to create x.509 store lookup\n");
-					return 1;
-				}
+		case 'L':
+			cf->handlers++;
+			if (configure_plugin(server, arg) != 0) {
+				return -1;
+			}
+			break;
 
-				s1 = strdup(optarg);
-				s2 = strchr(s1, ':');
-				if (s2) {
-					*s2++ = '\0';
-					prefix = s1;
-				} else {
-					s2 = s1;
-					prefix = "/";
-				}
+		case 'U':
+			cf->handlers++;
+			if (configure_proxy(server, cf->stats, arg) != 0) {
+				return -1;
+			}
+			break;
 
-				for (;;) {
-					s3 = strchr(s2, ',');
-					if (s3) *s3++ = '\0';
-					rc = X509_load_cert_file(lookup, s2, SSL_FILETYPE_PEM);
-					if (rc == 0) {
-						fprintf(stderr, "%s: unable to load certificate authority certificate\n", s2);
-						ERR_print_errors_fp(stderr);
-						return 1;
-					}
-					if (!s3) break;
-					s2 = s3;
-				}
+		case 'G':
+			cf->handlers++;
+			if (configure_gather(server, cf->stats, arg) != 0) {
+				return -1;
+			}
+			break;
+
+		case 'M':
+			if (cf->reporting++) {
+				fprintf(stderr, "--stats may only be given once\n");
+				return -1;
+			}
+			rc = gemini_handle_fn_free(server, arg, stats_handler, cf->stats, stats_free);
+			if (rc != 0) {
+				cf->reporting = 0; /* still ours to free */
+				fprintf(stderr, "unable to register stats handler at '%s': %s (error %d)\n", arg, strerror(errno), errno);
+				return -1;
+			}
+			break;
+
+		case 'C':
+			if (configure_cache(arg) != 0) {
+				return -1;
+			}
+			break;
+
+		case 'B':
+			size = parse_size(arg);
+			if (size < 0) {
+				fprintf(stderr, "--cache-size %s: not a valid size (try `--cache-size 64m')\n", arg);
+				return -1;
+			}
+			cache->budget = size;
+			break;
+
+		case 'F':
+			if (configure_coalesce(server, arg) != 0) {
+				return -1;
+			}
+			break;
+
+		case 'T':
+			server->threads = atoi(arg);
+			if (server->threads < 1) {
+				fprintf(stderr, "--threads %s: not a valid number of threads (try `--threads 8')\n", arg);
+				return -1;
+			}
+			break;
+
+		case 'N':
+			if (atoi(arg) < 1) {
+				fprintf(stderr, "--max-connections %s: not a valid number of connections (try `--max-connections 64')\n", arg);
+				return -1;
+			}
+			server->max_connections = atoi(arg);
+			break;
+
+		case 'I':
+			server->low_memory = 1;
+			break;
+
+		case 'R':
+			size = parse_size(arg);
+			if (size < 0) {
+				fprintf(stderr, "--memory-budget %s: not a valid size (try `--memory-budget 2g')\n", arg);
+				return -1;
+			}
+			server->memory_budget = size;
+			break;
+
+		case 'S':
+			s1 = strdup(arg);
+			if (!s1) {
+				goto fail;
+			}
+			s2 = strchr(s1, ':');
+			if (s2) {
+				*s2++ = '\0';
+				prefix = s1;
+			} else {
+				s2 = s1;
+				prefix = "/";
+			}
 
-				rc = gemini_handle_authn(server, prefix, store);
+			if (!strchr(s2, ',')) {
+				fprintf(stderr, "registering fs handler for '%s' urls, served from '%s'\n", prefix, s2);
+				cf->handlers++;
+				rc = gemini_handle_fs(server, prefix, s2);
 				if (rc != 0) {
-					fprintf(stderr, "gemini_handle_authn() failed! (e%d: %s)\n", errno, strerror(errno));
-					return 1;
+					fprintf(stderr, "unable to register fs handler at '%s': %s (error %d)\n", prefix, strerror(errno), errno);
+					goto fail;
 				}
 				free(s1);
 				break;
+			}
 
-			case 'E':
-				handlers++;
-				rc = gemini_handle_fn(server, optarg, echo_handler, NULL);
-				if (rc != 0) {
-					fprintf(stderr, "unable to register echo handler at '%s': %s (error %d)\n", optarg, strerror(errno), errno);
-					return -1;
+			/* --static /prefix:/tenant,/base layers multiple roots */
+			for (nroots = 0;;) {
+				s3 = strchr(s2, ',');
+				if (s3) *s3++ = '\0';
+				if (nroots == sizeof(roots) / sizeof(roots[0])) {
+					fprintf(stderr, "--static %s: too many overlay roots (limit is %d)\n", arg, nroots);
+					goto fail;
 				}
-				break;
+				roots[nroots++] = s2;
+				if (!s3) break;
+				s2 = s3;
+			}
 
-			case 'X':
-				if (signal(SIGCHLD, SIG_IGN) == SIG_ERR) {
-					fprintf(stderr, "unable to set child signal handler: %s (error %d)\n", strerror(errno), errno);
-					return -1;
-				}
-				s1 = strdup(optarg);
-				s2 = strchr(s1, ':');
-				if (!s2) {
-					fprintf(stderr, "registering exec handler for '/' urls, served from '%s'\n", s1);
-					handlers++;
-					rc = gemini_handle_fn(server, "/", cgi_handler, strdup(s1));
-
-				} else {
-					*s2++ = '\0';
-					fprintf(stderr, "registering exec handler for '%s' urls, served from '%s'\n", s1, s2);
-					handlers++;
-					rc = gemini_handle_fn(server, s1, cgi_handler, strdup(s2));
-				}
-				free(s1);
-				break;
+			fprintf(stderr, "registering overlay fs handler for '%s' urls, served from %d roots:\n", prefix, nroots);
+			for (i = 0; i < nroots; i++) {
+				fprintf(stderr, "  - %s\n", roots[i]);
+			}
+			cf->handlers++;
+			rc = gemini_handle_overlay(server, prefix, roots, nroots);
+			if (rc != 0) {
+				fprintf(stderr, "unable to register overlay fs handler at '%s': %s (error %d)\n", prefix, strerror(errno), errno);
+				goto fail;
+			}
+			free(s1);
+			break;
 
-			case 'S':
-				s1 = strdup(optarg);
-				s2 = strchr(s1, ':');
-				if (!s2) {
-					fprintf(stderr, "registering fs handler for '/' urls, served from '%s'\n", s1);
-					handlers++;
-					rc = gemini_handle_fs(server, "/", s1);
-				} else {
-					*s2++ = '\0';
-					fprintf(stderr, "registering fs handler for '%s' urls, served from '%s'\n", s1, s2);
-					handlers++;
-					rc = gemini_handle_fs(server, s1, s2);
+		case 'b':
+			if (cf->nvhosts == cf->cap) {
+				cf->vhosts = realloc(cf->vhosts, (cf->cap + 8) * sizeof(struct gemini_url *));
+				if (!cf->vhosts) {
+					return -1;
 				}
-				free(s1);
-				break;
+				cf->cap += 8;
+			}
+			cf->vhosts[cf->nvhosts] = gemini_parse_url(arg);
+			if (!cf->vhosts[cf->nvhosts]) {
+				fprintf(stderr, "%s: not a valid gemini:// URL\n", arg);
+				return -1;
+			}
+			cf->nvhosts++;
+			break;
 
-			case 'b':
-				if (nvhosts == cap) {
-					vhosts = realloc(vhosts, (cap + 8) * sizeof(struct gemini_url *));
-					if (!vhosts) {
-						return -1;
-					}
-					cap += 8;
-				}
-				vhosts[nvhosts] = gemini_parse_url(optarg);
-				if (!vhosts[nvhosts]) {
-					free(vhosts);
-					fprintf(stderr, "%s: not a valid gemini:// URL\n", optarg);
+		case 'l':
+			cf->port = 0;
+			for (s3 = (char *)arg; *s3; s3++) {
+				if (!isdigit(*s3)) {
+					fprintf(stderr, "-l %s: not a valid port number (try `-l 1965')\n", arg);
 					return -1;
 				}
-				nvhosts++;
-				break;
+				cf->port = cf->port * 10 + (*s3 - '0');
+			}
+			break;
 
-			case 'l':
-				port = 0;
-				for (s1 = optarg; *s1; s1++) {
-					if (!isdigit(*s1)) {
-						fprintf(stderr, "-l %s: not a valid port number (try `-l 1965')\n", optarg);
-						return -1;
-					}
-					port = port * 10 + (*s1 - '0');
-				}
-				break;
+		case 'c':
+			free(cf->cert);
+			cf->cert = strdup(arg);
+			break;
 
-			case 'c':
-				free(cert);
-				cert = strdup(optarg);
-				break;
+		case 'k':
+			free(cf->key);
+			cf->key = strdup(arg);
+			break;
 
-			case 'k':
-				free(key);
-				key = strdup(optarg);
-				break;
+		default: /* getopt_long() has already complained */
+			return -1;
+	}
+	return 0;
+
+fail:
+	/* s1 is the copy of arg that was being taken apart, and store the
+	   --authn CA bundle that never made it into a handler */
+	free(s1);
+	X509_STORE_free(store);
+	return -1;
+}
+
+/* Read options from a --config file, one to a line: the long name of the
+   option, and then its value (if it takes one), as in
+
+       listen 1965
+       tls-certificate /etc/geminon/cert.pem
+       static /:/srv/gemini
+
+   Blank lines, and lines starting with a #, are ignored. */
+static int configure_file(struct config *cf, const char *path) {
+	FILE *io;
+	char line[8192], *name, *arg, *end;
+	int lineno, i, rc;
+
+	io = fopen(path, "r");
+	if (!io) {
+		fprintf(stderr, "%s: unable to read configuration: %s (error %d)\n", path, strerror(errno), errno);
+		return -1;
+	}
+
+	rc = 0;
+	for (lineno = 1; rc == 0 && fgets(line, sizeof(line), io); lineno++) {
+		for (end = line + strlen(line); end > line && isspace(end[-1]); end--)
+			;
+		*end = '\0';
+		for (name = line; isspace(*name); name++)
+			;
+		if (!*name || *name == '#') {
+			continue;
+		}
+		for (arg = name; *arg && !isspace(*arg); arg++)
+			;
+		if (*arg) *arg++ = '\0';
+		while (isspace(*arg)) arg++;
+
+		for (i = 0; options[i].name && strcmp(options[i].name, name) != 0; i++)
+			;
+		if (!options[i].name || options[i].val == 'f') {
+			fprintf(stderr, "%s:%d: unrecognized option '%s'\n", path, lineno, name);
+			rc = -1;
+		} else if (options[i].has_arg == required_argument && !*arg) {
+			fprintf(stderr, "%s:%d: '%s' needs a value\n", path, lineno, name);
+			rc = -1;
+		} else if (options[i].has_arg == no_argument && *arg) {
+			fprintf(stderr, "%s:%d: '%s' doesn't take a value\n", path, lineno, name);
+			rc = -1;
+		} else {
+			rc = configure_option(cf, options[i].val, arg);
+		}
+	}
+	fclose(io);
+	return rc;
+}
+
+/* Set up server from the environment, the command line, and any --config
+   file.  When reloading, running is the server that is already serving;
+   server is a blank one that only gets handlers, to be handed over to
+   gemini_reroute(). */
+int configure(struct gemini_server *server, struct gemini_server *running, int argc, char **argv, char **envp) {
+	int rc, c, idx, i;
+	char *s1, *s2;
+	struct config cf;
+
+	memset(&cf, 0, sizeof(cf));
+	cf.server = server;
+	cf.reload = running != NULL;
+
+	cf.vhosts = calloc(8, sizeof(struct gemini_url *));
+	if (!cf.vhosts) {
+		goto fail;
+	}
+	cf.cap = 8;
+
+	cf.stats = calloc(1, sizeof(struct stats));
+	if (!cf.stats) {
+		goto fail;
+	}
+	cf.stats->server = running ? running : server;
+
+	if (!cache) {
+		cache = gemini_cache_new(0);
+		if (!cache) {
+			goto fail;
+		}
+	}
+
+	/* first, we try the environment */
+	cf.cert = getenv("GEMINON_CERTIFICATE");
+	if (cf.cert) cf.cert = strdup(cf.cert);
+
+	cf.key = getenv("GEMINON_PRIVATE_KEY");
+	if (cf.key) cf.key = strdup(cf.key);
+
+	s1 = getenv("GEMINON_PORT");
+	if (s1) {
+		cf.port = 0;
+		for (s2 = s1; *s2; s2++) {
+			if (!isdigit(*s2)) {
+				fprintf(stderr, "GEMINON_PORT=%s: not a valid port number (try GEMINON_PORT=1965)\n", s1);
+				goto fail;
+			}
+		}
+	}
+
+	/* then, we try the command line (from the top, if this is a reload) */
+	optind = 0;
+	while (1) {
+		idx = 0;
+		c = getopt_long(argc, argv, "f:A:E:X:P:L:U:G:M:C:B:F:T:N:IR:S:b:l:c:k:", options, &idx);
+		if (c == -1)
+			break;
+
+		if (configure_option(&cf, c, optarg) != 0) {
+			goto fail;
 		}
 	}
 
@@ -290,54 +984,221 @@ int configure(struct gemini_server *server, int argc, char **argv, char **envp)
 			fprintf(stderr, "%s ", argv[optind++]);
 		}
 		fprintf(stderr, "\n");
-		return -1;
+		goto fail;
 	}
 
-	if (!cert && !key) {
-		fprintf(stderr, "you must specify a TLS X.509 certificate and private key via the --tls-certificate=/path and --tls-key=/path options.\n");
-		return -1;
-	}
-	if (!cert) {
-		fprintf(stderr, "you must specify a TLS X.509 certificate via the --tls-certificate=/path option.\n");
-		return -1;
-	}
-	if (!key) {
-		fprintf(stderr, "you must specify a TLS X.509 private key via the --tls-key=/path option.\n");
-		return -1;
+	if (!cf.reload) {
+		if (!cf.cert && !cf.key) {
+			fprintf(stderr, "you must specify a TLS X.509 certificate and private key via the --tls-certificate=/path and --tls-key=/path options.\n");
+			goto fail;
+		}
+		if (!cf.cert) {
+			fprintf(stderr, "you must specify a TLS X.509 certificate via the --tls-certificate=/path option.\n");
+			goto fail;
+		}
+		if (!cf.key) {
+			fprintf(stderr, "you must specify a TLS X.509 private key via the --tls-key=/path option.\n");
+			goto fail;
+		}
 	}
 
-	if (handlers == 0) {
-		fprintf(stderr, "you must specify at least one handler, via the --echo or --static options\n");
-		return -1;
+	if (cf.handlers == 0) {
+		fprintf(stderr, "you must specify at least one handler, via the --echo, --exec, --pool, --plugin, --proxy, --gather, or --static options\n");
+		goto fail;
+	}
+	if (!cf.reporting) {
+		stats_free(cf.stats);
+		cf.stats = NULL;
 	}
 
-	if (nvhosts > 0) {
-		rc = gemini_handle_vhosts(server, vhosts, nvhosts);
+	if (cf.nvhosts > 0) {
+		rc = gemini_handle_vhosts(server, cf.vhosts, cf.nvhosts);
 		if (rc != 0) {
-			return -1;
+			goto fail;
 		}
 	} else {
-		free(vhosts);
+		free(cf.vhosts);
 	}
+	cf.vhosts  = NULL; /* the server's, now */
+	cf.nvhosts = 0;
 
-	port = port ? port : GEMINI_DEFAULT_PORT;
-	rc = gemini_bind(server, port);
+	/* from here on, these are the CA bundles to keep an eye on */
+	for (i = 0; i < ncas; i++) {
+		free(cas[i].path);
+	}
+	memcpy(cas, cf.cas, sizeof(cas));
+	ncas = cf.ncas;
+	cf.ncas = 0;
+
+	if (cf.reload) {
+		free(cf.cert);
+		free(cf.key);
+		return 0;
+	}
+
+	cf.port = cf.port ? cf.port : GEMINI_DEFAULT_PORT;
+	rc = gemini_bind(server, cf.port);
 	if (rc != 0) {
-		fprintf(stderr, "unable to listen on *:%d: %s (error %d)\n", port, strerror(errno), errno);
-		return -1;
+		fprintf(stderr, "unable to listen on *:%d: %s (error %d)\n", cf.port, strerror(errno), errno);
+		goto fail;
 	}
 
-	rc = gemini_tls(server, cert, key);
+	watch(&certs[0], cf.cert);
+	watch(&certs[1], cf.key);
+	rc = gemini_tls(server, cf.cert, cf.key);
 	if (rc != 0) {
 		fprintf(stderr, "tls configuration failed: %s (error %d)\n", strerror(errno), errno);
+		goto fail;
+	}
+	printf("loading tls certificate from %s\n", cf.cert);
+	printf("loading tls private key from %s\n", cf.key);
+	free(cf.cert);
+	free(cf.key);
+
+	printf("listening for inbound connections on *:%d\n", cf.port);
+	return 0;
+
+fail:
+	/* whatever did get registered goes with the server; the rest,
+	   we clean up after, since a failed reload isn't the end */
+	while (cf.vhosts && cf.nvhosts > 0) {
+		free(cf.vhosts[--cf.nvhosts]);
+	}
+	while (cf.ncas > 0) {
+		free(cf.cas[--cf.ncas].path);
+	}
+	free(cf.vhosts);
+	if (!cf.reporting) {
+		stats_free(cf.stats);
+	}
+	free(cf.cert);
+	free(cf.key);
+	return -1;
+}
+
+/* On SIGHUP, every handler is built again, from the same command line (and
+   a fresh read of any --config file), and swapped in for the old ones.
+   That is far too much for a signal handler, so it only pokes the reload
+   thread, through a pipe. */
+static int reload_pipe[2];
+static pthread_mutex_t reload_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int    config_argc;
+static char **config_argv;
+static char **config_envp;
+
+static void request_reload(int sig) {
+	int saved;
+
+	saved = errno;
+	if (write(reload_pipe[1], "", 1) < 0) {
+		/* one is already pending; that'll do */
+	}
+	errno = saved;
+}
+
+static void * reloader(void *_server) {
+	struct gemini_server *server, next;
+	ssize_t n;
+	int rc;
+	char c;
+
+	server = _server;
+	for (;;) {
+		n = read(reload_pipe[0], &c, 1);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return NULL;
+		}
+
+		fprintf(stderr, "reloading configuration...\n");
+		pthread_mutex_lock(&reload_lock);
+		memset(&next, 0, sizeof(next));
+		rc = configure(&next, server, config_argc, config_argv, config_envp);
+		pthread_mutex_unlock(&reload_lock);
+
+		/* gemini_reroute() waits out every handler still running on the
+		   old list, which may take a while; only this thread ever calls
+		   it, so there's no need to keep the watcher waiting too */
+		if (rc != 0) {
+			fprintf(stderr, "unable to reload configuration; keeping the old one\n");
+			gemini_server_close(&next);
+		} else {
+			gemini_reroute(server, &next);
+			fprintf(stderr, "reloaded configuration\n");
+		}
+	}
+}
+
+/* Certificates are rotated by replacing the files; when that happens,
+   new connections get the new certificate.  A new CA bundle for --authn
+   means building the handlers again, same as for SIGHUP. */
+static void * watcher(void *server) {
+	int i, rotate, rebuild;
+
+	for (;;) {
+		sleep(WATCH_INTERVAL);
+
+		/* the certificate and key are only named at startup; the CA
+		   bundles change with every reload */
+		rotate = changed(&certs[0]) | changed(&certs[1]);
+		pthread_mutex_lock(&reload_lock);
+		for (rebuild = i = 0; i < ncas; i++) {
+			rebuild |= changed(&cas[i]);
+		}
+		pthread_mutex_unlock(&reload_lock);
+
+		if (rotate) {
+			fprintf(stderr, "tls certificate or key has changed; reloading them...\n");
+			if (gemini_tls_reload(server, certs[0].path, certs[1].path) == 0) {
+				fprintf(stderr, "new connections will get the certificate from %s\n", certs[0].path);
+			} else {
+				fprintf(stderr, "unable to load the new certificate or key; keeping the old ones\n");
+			}
+		}
+
+		if (rebuild) {
+			fprintf(stderr, "certificate authorities for --authn have changed\n");
+			request_reload(SIGHUP);
+		}
+	}
+	return NULL;
+}
+
+static int configure_reload(struct gemini_server *server, int argc, char **argv, char **envp) {
+	struct sigaction sa;
+	pthread_t tid;
+
+	config_argc = argc;
+	config_argv = argv;
+	config_envp = envp;
+
+	if (pipe2(reload_pipe, O_CLOEXEC) != 0
+	 || fcntl(reload_pipe[1], F_SETFL, O_NONBLOCK) != 0
+	 || pthread_create(&tid, NULL, reloader, server) != 0) {
+		fprintf(stderr, "unable to start reload thread: %s (error %d)\n", strerror(errno), errno);
+		return -1;
+	}
+	pthread_detach(tid);
+
+	if (pthread_create(&tid, NULL, watcher, server) != 0) {
+		fprintf(stderr, "unable to start certificate watcher thread: %s (error %d)\n", strerror(errno), errno);
 		return -1;
 	}
-	printf("loading tls certificate from %s\n", cert);
-	printf("loading tls private key from %s\n", key);
-	free(cert);
-	free(key);
+	pthread_detach(tid);
 
-	printf("listening for inbound connections on *:%d\n", port);
+	/* SA_RESTART, so that the signal doesn't knock gemini_serve()
+	   out of its accept(2) */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = request_reload;
+	sa.sa_flags   = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGHUP, &sa, NULL) != 0) {
+		fprintf(stderr, "unable to set hangup signal handler: %s (error %d)\n", strerror(errno), errno);
+		return -1;
+	}
 	return 0;
 }
 
@@ -352,7 +1213,11 @@ int main(int argc, char **argv, char **envp) {
 	}
 
 	memset(&server, 0, sizeof(server));
-	rc = configure(&server, argc, argv, envp);
+	rc = configure(&server, NULL, argc, argv, envp);
+	if (rc != 0) {
+		return 1;
+	}
+	rc = configure_reload(&server, argc, argv, envp);
 	if (rc != 0) {
 		return 1;
 	}
@@ -363,7 +1228,11 @@ int main(int argc, char **argv, char **envp) {
 		return 4;
 	}
 
+	/* not while a reload is still using it */
+	pthread_mutex_lock(&reload_lock);
 	gemini_server_close(&server);
+	gemini_cache_free(cache);
+	pthread_mutex_unlock(&reload_lock);
 
 	rc = gemini_deinit();
 	if (rc != 0) {
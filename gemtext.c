@@ -0,0 +1,188 @@
+#include "./gemini.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* How many newlines to find before handing out lines. */
+#define BATCH 64
+
+static int s_space(char c) {
+	return c == ' ' || c == '\t';
+}
+
+/* Find (up to max of) the newlines in buf, into at[], as offsets; returns
+   how many were found, and sets *scanned to how much of buf was looked
+   at.  With SSE2, each 16 octets is one compare, and one bitmask of where
+   the newlines are; long lines cost next to nothing, and short ones don't
+   each cost a function call. */
+static size_t s_newlines(const char *buf, size_t n, size_t *at, size_t max, size_t *scanned) {
+	size_t i, k;
+#ifdef __SSE2__
+	const __m128i nl = _mm_set1_epi8('\n');
+	unsigned int m;
+#endif
+
+	i = k = 0;
+#ifdef __SSE2__
+	for (; i + 16 <= n && k + 16 <= max; i += 16) {
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i)), nl));
+		for (; m; m &= m - 1) {
+			at[k++] = i + __builtin_ctz(m);
+		}
+	}
+	if (i + 16 <= n) {
+		/* out of room; hand these lines out before looking further */
+		*scanned = i;
+		return k;
+	}
+#endif
+	for (; i < n && k < max; i++) {
+		if (buf[i] == '\n') {
+			at[k++] = i;
+		}
+	}
+	*scanned = i;
+	return k;
+}
+
+static void s_span(struct gemini_span *s, const char *a, const char *b) {
+	while (a < b && s_space(*a))     a++;
+	while (b > a && s_space(b[-1])) b--;
+	s->p = a;
+	s->n = b - a;
+}
+
+/* Work out what kind of line p is, and tell the caller. */
+static int s_line(struct gemini_gemtext *g, const char *p, size_t n) {
+	struct gemini_gemtext_line line;
+	const char *end, *a;
+
+	if (n > 0 && p[n - 1] == '\r') {
+		n--;
+	}
+	end = p + n;
+
+	memset(&line, 0, sizeof(line));
+	line.line.p = p;
+	line.line.n = n;
+
+	if (n >= 3 && p[0] == '`' && p[1] == '`' && p[2] == '`') {
+		line.type = GEMINI_GEMTEXT_TOGGLE;
+		s_span(&line.text, p + 3, end);
+		g->pre = !g->pre;
+
+	} else if (g->pre) {
+		line.type = GEMINI_GEMTEXT_PRE;
+		line.text = line.line;
+
+	} else if (n >= 2 && p[0] == '=' && p[1] == '>') {
+		for (a = p + 2; a < end && s_space(*a); a++)
+			;
+		line.url.p = a;
+		for (; a < end && !s_space(*a); a++)
+			;
+		line.url.n = a - line.url.p;
+		s_span(&line.text, a, end);
+		line.type = line.url.n ? GEMINI_GEMTEXT_LINK : GEMINI_GEMTEXT_TEXT;
+		if (!line.url.n) line.text = line.line;
+
+	} else if (n >= 1 && p[0] == '#') {
+		for (a = p; a < end && *a == '#' && a - p < 3; a++)
+			;
+		line.type  = GEMINI_GEMTEXT_HEADING;
+		line.level = a - p;
+		s_span(&line.text, a, end);
+
+	} else if (n >= 2 && p[0] == '*' && p[1] == ' ') {
+		line.type = GEMINI_GEMTEXT_LIST;
+		s_span(&line.text, p + 2, end);
+
+	} else if (n >= 1 && p[0] == '>') {
+		line.type = GEMINI_GEMTEXT_QUOTE;
+		s_span(&line.text, p + 1, end);
+
+	} else {
+		line.type = GEMINI_GEMTEXT_TEXT;
+		line.text = line.line;
+	}
+
+	g->lines++;
+	return g->fn(&line, g->data);
+}
+
+/* Hang on to the start of a line, until the rest of it shows up. */
+static int s_carry(struct gemini_gemtext *g, const char *p, size_t n) {
+	char *more;
+	size_t want;
+
+	if (g->ncarry + n > g->capcarry) {
+		for (want = g->capcarry ? g->capcarry : 256; want < g->ncarry + n; want *= 2)
+			;
+		more = realloc(g->carry, want);
+		if (!more) {
+			return -1;
+		}
+		g->carry    = more;
+		g->capcarry = want;
+	}
+	memcpy(g->carry + g->ncarry, p, n);
+	g->ncarry += n;
+	return 0;
+}
+
+void gemini_gemtext_init(struct gemini_gemtext *g, gemini_gemtext_fn fn, void *data) {
+	memset(g, 0, sizeof(*g));
+	g->fn   = fn;
+	g->data = data;
+}
+
+int gemini_gemtext_feed(struct gemini_gemtext *g, const void *_buf, size_t n) {
+	const char *buf, *start, *eol;
+	size_t at[BATCH], off, scanned, i, k, len;
+	int rc;
+
+	buf = start = _buf;
+	for (off = 0; off < n; off += scanned) {
+		k = s_newlines(buf + off, n - off, at, BATCH, &scanned);
+		for (i = 0; i < k; i++) {
+			eol = buf + off + at[i];
+			if (g->ncarry) {
+				if (s_carry(g, start, eol - start) != 0) {
+					return -1;
+				}
+				len = g->ncarry;
+				g->ncarry = 0; /* the line is still there, for the callback */
+				rc = s_line(g, g->carry, len);
+			} else {
+				rc = s_line(g, start, eol - start);
+			}
+			if (rc != 0) {
+				return rc;
+			}
+			start = eol + 1;
+		}
+	}
+
+	if (start < buf + n && s_carry(g, start, buf + n - start) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+int gemini_gemtext_finish(struct gemini_gemtext *g) {
+	int rc;
+
+	rc = 0;
+	if (g->ncarry) {
+		rc = s_line(g, g->carry, g->ncarry);
+	}
+	free(g->carry);
+	g->carry  = NULL;
+	g->ncarry = g->capcarry = 0;
+	g->pre    = 0;
+	return rc;
+}
@@ -1,11 +1,77 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include <getopt.h>
 
 #include "./gemini.h"
 
+/* where to keep TLS sessions between runs, if anywhere */
+static char *sessions = NULL;
+
+/* where to keep responses between runs, if anywhere, and for how long */
+static char  *cache_dir      = NULL;
+static size_t cache_budget   = 0;
+static int    cache_ttl      = 0;
+static char **cache_policies = NULL; /* PREFIX=TTL, as given */
+static int    ncache_policies = 0;
+
+/* how many URLs to fetch at once, where to read more URLs from (if
+   anywhere), and where to put the responses (stdout, if NULL) */
+static int   jobs   = 1;
+static char *input  = NULL;
+static char *output = NULL;
+
+/* when mirroring, where the local tree goes, which URLs (by prefix) to
+   follow links to, and where to keep track of what's been done, so that
+   an interrupted mirror can pick up where it left off */
+static char  *mirror  = NULL;
+static char **scopes  = NULL;
+static int    nscopes = 0;
+static char  *state   = NULL;
+static FILE  *statef  = NULL;
+
+/* how hard to lean on any one server: at most per_host fetches at once
+   (zero for no limit), each starting at least delay ms after the last */
+static int per_host = 0;
+static int delay    = 0;
+
+/* One URL to fetch, and how it went. */
+struct fetch {
+	const char *url;
+	char       *host; /* host:port, for politeness */
+	int         n;    /* which URL this is, counting from 1 */
+	int         started;
+
+	int    failed;
+	char   status[3];
+	char   meta[GEMINI_MAX_RESPONSE];
+	size_t bytes;
+	long   ms;
+};
+
+/* A server, and how much we're fetching from it. */
+struct host {
+	int  active; /* fetches in progress */
+	long next;   /* when the next one can start */
+};
+
+static struct fetch   **fetches  = NULL;
+static int              nfetches = 0;
+static int              first    = 0; /* the first fetch not yet started */
+static int              running  = 0; /* fetches in progress */
+static struct gemini_map visited;     /* URL -> its fetch, when mirroring */
+static struct gemini_map hosts;       /* host:port -> struct host */
+static pthread_mutex_t  lock     = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   changed  = PTHREAD_COND_INITIALIZER; /* a fetch finished, or was queued */
+
 int configure(struct gemini_client *client, int argc, char **argv, char **envp) {
 	int rc, c, idx;
 	char *cert = NULL, *key = NULL;
@@ -13,6 +79,20 @@ int configure(struct gemini_client *client, int argc, char **argv, char **envp)
 	struct option options[] = {
 		{ "tls-certificate", required_argument, NULL, 'c' },
 		{ "tls-key",         required_argument, NULL, 'k' },
+		{ "sessions",        required_argument, NULL, 's' },
+		{ "jobs",            required_argument, NULL, 'j' },
+		{ "input",           required_argument, NULL, 'i' },
+		{ "output",          required_argument, NULL, 'o' },
+		{ "directory",       required_argument, NULL, 'd' },
+		{ "cache-dir",       required_argument, NULL, 'C' },
+		{ "cache-ttl",       required_argument, NULL, 'T' },
+		{ "cache-policy",    required_argument, NULL, 'P' },
+		{ "cache-budget",    required_argument, NULL, 'B' },
+		{ "mirror",          required_argument, NULL, 'm' },
+		{ "scope",           required_argument, NULL, 'S' },
+		{ "state",           required_argument, NULL, 'r' },
+		{ "per-host",        required_argument, NULL, 'H' },
+		{ "delay",           required_argument, NULL, 'W' },
 		{ 0, 0, 0, 0 },
 	};
 
@@ -23,10 +103,13 @@ int configure(struct gemini_client *client, int argc, char **argv, char **envp)
 	key = getenv("GEMINI_CLIENT_PRIVATE_KEY");
 	if (key) key = strdup(key);
 
+	sessions = getenv("GEMINI_CLIENT_SESSIONS");
+	if (sessions) sessions = strdup(sessions);
+
 	/* then, we try the command line */
 	while (1) {
 		idx = 0;
-		c = getopt_long(argc, argv, "c:k:", options, &idx);
+		c = getopt_long(argc, argv, "c:k:s:j:i:o:d:C:T:P:B:m:S:r:H:W:", options, &idx);
 		if (c == -1)
 			break;
 
@@ -40,9 +123,138 @@ int configure(struct gemini_client *client, int argc, char **argv, char **envp)
 				free(key);
 				key = strdup(optarg);
 				break;
+
+			case 's':
+				free(sessions);
+				sessions = strdup(optarg);
+				break;
+
+			case 'j':
+				jobs = atoi(optarg);
+				if (jobs < 1) {
+					fprintf(stderr, "-j %s: not a valid number of concurrent fetches (try `-j 8')\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'i':
+				free(input);
+				input = strdup(optarg);
+				break;
+
+			case 'o':
+				free(output);
+				output = strdup(optarg);
+				break;
+
+			case 'd':
+				if (mkdir(optarg, 0777) != 0 && errno != EEXIST) {
+					fprintf(stderr, "-d %s: unable to create directory: %s (error %d)\n", optarg, strerror(errno), errno);
+					return -1;
+				}
+				free(output);
+				output = malloc(strlen(optarg) + 16);
+				if (!output) {
+					return -1;
+				}
+				sprintf(output, "%s/%%n-%%h-%%p", optarg);
+				break;
+
+			case 'C':
+				free(cache_dir);
+				cache_dir = strdup(optarg);
+				break;
+
+			case 'T':
+				cache_ttl = atoi(optarg);
+				if (cache_ttl < 1) {
+					fprintf(stderr, "--cache-ttl %s: not a valid number of seconds (try `--cache-ttl 3600')\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'P':
+				if (!strchr(optarg, '=')) {
+					fprintf(stderr, "--cache-policy %s: not a PREFIX=TTL policy (try `--cache-policy gemini://example.com/news/=300')\n", optarg);
+					return -1;
+				}
+				cache_policies = realloc(cache_policies, (ncache_policies + 1) * sizeof(char *));
+				if (!cache_policies) {
+					return -1;
+				}
+				cache_policies[ncache_policies++] = optarg;
+				break;
+
+			case 'B':
+				cache_budget = strtoul(optarg, NULL, 10);
+				if (cache_budget < 1) {
+					fprintf(stderr, "--cache-budget %s: not a valid number of octets (try `--cache-budget 104857600')\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'm':
+				free(mirror);
+				mirror = strdup(optarg);
+				break;
+
+			case 'S':
+				scopes = realloc(scopes, (nscopes + 1) * sizeof(char *));
+				if (!scopes) {
+					return -1;
+				}
+				scopes[nscopes++] = optarg;
+				break;
+
+			case 'r':
+				free(state);
+				state = strdup(optarg);
+				break;
+
+			case 'H':
+				per_host = atoi(optarg);
+				if (per_host < 1) {
+					fprintf(stderr, "--per-host %s: not a valid number of concurrent fetches (try `--per-host 2')\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'W':
+				delay = atoi(optarg);
+				if (delay < 0) {
+					fprintf(stderr, "--delay %s: not a valid number of milliseconds (try `--delay 250')\n", optarg);
+					return -1;
+				}
+				break;
 		}
 	}
 
+	if (mirror && output) {
+		fprintf(stderr, "--mirror puts each response where its URL says; it can't be combined with --output or --directory\n");
+		return -1;
+	}
+	if (mirror) {
+		if (mkdir(mirror, 0777) != 0 && errno != EEXIST) {
+			fprintf(stderr, "--mirror %s: unable to create directory: %s (error %d)\n", mirror, strerror(errno), errno);
+			return -1;
+		}
+		if (!state) {
+			state = malloc(strlen(mirror) + 16);
+			if (!state) {
+				return -1;
+			}
+			sprintf(state, "%s/.gurl-state", mirror);
+		}
+		if (!per_host) {
+			per_host = 2;
+		}
+	}
+
+	if (jobs > 1 && !output && !mirror) {
+		fprintf(stderr, "fetching more than one URL at a time (-j %d) requires either an --output template or a --directory\n", jobs);
+		return -1;
+	}
+
 	if ((cert && !key) || (!cert && key)) {
 		fprintf(stderr, "you must specify both a TLS X.509 certificate and private key via the --tls-certificate=/path and --tls-key=/path options.\n");
 		return -1;
@@ -60,33 +272,789 @@ int configure(struct gemini_client *client, int argc, char **argv, char **envp)
 		free(key);
 	}
 
+	/* even without a file to keep them in, sessions (and name lookups)
+	   save us time when we're asked for more than one URL on the same
+	   server */
+	if (gemini_client_sessions(client, 0, 0) != 0) {
+		fprintf(stderr, "tls session cache setup failed: %s (error %d)\n", strerror(errno), errno);
+		return -1;
+	}
+	if (gemini_client_resolver(client, 0, 0, 0) != 0) {
+		fprintf(stderr, "resolver setup failed: %s (error %d)\n", strerror(errno), errno);
+		return -1;
+	}
+	if (sessions && gemini_sessions_load(client->sessions, sessions) < 0) {
+		fprintf(stderr, "unable to load tls sessions from %s: %s (error %d)\n", sessions, strerror(errno), errno);
+	}
+
+	if (cache_dir) {
+		if (gemini_client_store(client, cache_dir, cache_budget, cache_ttl) != 0) {
+			fprintf(stderr, "unable to open response cache in %s: %s (error %d)\n", cache_dir, strerror(errno), errno);
+			return -1;
+		}
+		for (idx = 0; idx < ncache_policies; idx++) {
+			c = strchr(cache_policies[idx], '=') - cache_policies[idx];
+			cache_policies[idx][c] = '\0';
+			if (gemini_store_policy(client->store, cache_policies[idx], atoi(cache_policies[idx] + c + 1)) != 0) {
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Add a URL to the list of things to fetch; once there are workers, this
+   has to be called with the lock held. */
+static struct fetch * queue(const char *url) {
+	struct gemini_url *u;
+	struct fetch **more, *f;
+	struct host *h;
+	char host[1024];
+
+	if (nfetches % 64 == 0) {
+		more = realloc(fetches, (nfetches + 64) * sizeof(struct fetch *));
+		if (!more) {
+			return NULL;
+		}
+		fetches = more;
+	}
+
+	u = gemini_parse_url(url);
+	snprintf(host, sizeof(host), "%s:%u", u ? u->host : "", u ? u->port : 0);
+	free(u);
+
+	if (!gemini_map_get(&hosts, host)) {
+		h = calloc(1, sizeof(struct host));
+		if (!h || gemini_map_set(&hosts, host, h) == h) {
+			free(h);
+			return NULL;
+		}
+	}
+	f = calloc(1, sizeof(struct fetch));
+	if (!f || !(f->host = strdup(host))) {
+		free(f);
+		return NULL;
+	}
+	f->url = url;
+	f->n   = nfetches + 1;
+	fetches[nfetches++] = f;
+	pthread_cond_broadcast(&changed);
+	return f;
+}
+
+/* Read URLs, one per line, from file ("-" for standard input), skipping
+   blank lines and #-comments. */
+static int queue_from(const char *file) {
+	char line[GEMINI_MAX_REQUEST], *a, *b, *url;
+	FILE *io;
+
+	io = strcmp(file, "-") == 0 ? stdin : fopen(file, "r");
+	if (!io) {
+		fprintf(stderr, "unable to read URLs from %s: %s (error %d)\n", file, strerror(errno), errno);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), io)) {
+		for (a = line; isspace(*a); a++)
+			;
+		for (b = a + strlen(a); b > a && isspace(b[-1]); b--)
+			;
+		*b = '\0';
+		if (!*a || *a == '#') {
+			continue;
+		}
+
+		url = strdup(a);
+		if (!url || !queue(url)) {
+			fprintf(stderr, "unable to queue %s: %s (error %d)\n", a, strerror(errno), errno);
+			if (io != stdin) fclose(io);
+			return -1;
+		}
+	}
+
+	if (io != stdin) fclose(io);
+	return 0;
+}
+
+/* Copy src into dst (of size n), replacing anything that doesn't belong
+   in a file name with an underscore.  Returns how much was copied. */
+static size_t sanitize(char *dst, size_t n, const char *src) {
+	size_t i;
+
+	for (i = 0; src[i] && i + 1 < n; i++) {
+		dst[i] = isalnum(src[i]) || strchr(".-_", src[i]) ? src[i] : '_';
+	}
+	return i;
+}
+
+/* Work out where the response for a URL goes, by filling in the output
+   template:  %n is the URL's position in the list, %h its host, and %p
+   its path (with slashes made into underscores; "index" if empty). */
+static int expand(char *dst, size_t n, struct fetch *f) {
+	struct gemini_url *url;
+	const char *t, *path;
+	size_t len;
+
+	url = gemini_parse_url(f->url);
+	if (!url) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (len = 0, t = output; *t && len + 1 < n; t++) {
+		if (*t != '%' || !t[1]) {
+			dst[len++] = *t;
+			continue;
+		}
+
+		switch (*++t) {
+		case 'n': len += snprintf(dst + len, n - len, "%d", f->n); break;
+		case 'h': len += sanitize(dst + len, n - len, url->host);  break;
+		case 'p':
+			for (path = url->path; *path == '/'; path++)
+				;
+			len += sanitize(dst + len, n - len, *path ? path : "index");
+			break;
+		default:  dst[len++] = *t; break;
+		}
+	}
+	free(url);
+
+	if (len + 1 >= n) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	dst[len] = '\0';
+	return 0;
+}
+
+/* Does the output template have a %n in it, to tell the URLs apart? */
+static int numbered(const char *t) {
+	for (; *t; t++) {
+		if (*t == '%' && t[1]) {
+			if (*++t == 'n') return 1;
+		}
+	}
+	return 0;
+}
+
+/* Take the . and .. segments out of a path (which starts with a slash),
+   in place. */
+static void dedot(char *path) {
+	char *out, *s, *e;
+	size_t o, len;
+	int last;
+
+	out = strdup(path);
+	if (!out) {
+		return;
+	}
+	for (o = 0, s = path; *s == '/'; s = e) {
+		s++;
+		e = s + strcspn(s, "/");
+		len = e - s;
+		last = !*e;
+
+		if (len == 1 && s[0] == '.') {
+			if (last) out[o++] = '/';
+		} else if (len == 2 && s[0] == '.' && s[1] == '.') {
+			while (o > 0 && out[--o] != '/')
+				;
+			if (last) out[o++] = '/';
+		} else {
+			out[o++] = '/';
+			memcpy(out + o, s, len);
+			o += len;
+		}
+	}
+	if (o == 0) {
+		out[o++] = '/';
+	}
+	out[o] = '\0';
+	strcpy(path, out);
+	free(out);
+}
+
+/* Work out the absolute URL that a link, found in the document at base,
+   points to.  Returns 0 on success, and -1 if the link doesn't go anywhere
+   we can fetch from (it isn't gemini://, or it's too long). */
+static int resolve(char *dst, size_t n, const char *base, const char *link) {
+	const char *p;
+	char *path, *query;
+	size_t auth, len;
+
+	len = strcspn(link, "#");
+	for (p = link; isalnum(*p) || strchr("+.-", *p); p++)
+		;
+	auth = 9 + strcspn(base + 9, "/?#"); /* end of gemini://host:port */
+
+	if (p > link && *p == ':') {
+		if (strncasecmp(link, "gemini://", 9) != 0) {
+			return -1;
+		}
+		if (len >= n) return -1;
+		memcpy(dst, link, len);
+		dst[len] = '\0';
+
+	} else if (link[0] == '/' && link[1] == '/') {
+		if (len + 7 >= n) return -1;
+		snprintf(dst, n, "gemini:%.*s", (int)len, link);
+
+	} else if (link[0] == '/') {
+		if (auth + len >= n) return -1;
+		snprintf(dst, n, "%.*s%.*s", (int)auth, base, (int)len, link);
+
+	} else if (link[0] == '?' || len == 0) {
+		p = base + strcspn(base, len ? "?#" : "#");
+		if ((size_t)(p - base) + len >= n) return -1;
+		snprintf(dst, n, "%.*s%.*s", (int)(p - base), base, (int)len, link);
+
+	} else {
+		/* relative to the directory the base document is in */
+		for (p = base + strcspn(base, "?#"); p > base + auth && p[-1] != '/'; p--)
+			;
+		if (p == base + auth) {
+			if (auth + 1 + len >= n) return -1;
+			snprintf(dst, n, "%.*s/%.*s", (int)auth, base, (int)len, link);
+		} else {
+			if ((size_t)(p - base) + len >= n) return -1;
+			snprintf(dst, n, "%.*s%.*s", (int)(p - base), base, (int)len, link);
+		}
+	}
+
+	if (strncasecmp(dst, "gemini://", 9) != 0) {
+		return -1;
+	}
+	memcpy(dst, "gemini://", 9);
+
+	/* gemini://host, on its own, is gemini://host/ */
+	path = dst + 9 + strcspn(dst + 9, "/?");
+	if (*path != '/') {
+		if (strlen(dst) + 1 >= n) return -1;
+		memmove(path + 1, path, strlen(path) + 1);
+		*path = '/';
+	}
+
+	query = path + strcspn(path, "?");
+	if (*query) {
+		p = strdup(query);
+		if (!p) return -1;
+		*query = '\0';
+		dedot(path);
+		strcat(path, p);
+		free((char *)p);
+	} else {
+		dedot(path);
+	}
+	return 0;
+}
+
+static int in_scope(const char *url) {
+	int i;
+
+	for (i = 0; i < nscopes; i++) {
+		if (strncmp(url, scopes[i], strlen(scopes[i])) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* A link (to url) turned up; if it's in scope and new to us, fetch it.
+   Called with the lock held. */
+static void discover(const char *url) {
+	struct fetch *f;
+	char *copy;
+
+	if (!in_scope(url) || gemini_map_get(&visited, url)) {
+		return;
+	}
+
+	copy = strdup(url);
+	f = copy ? queue(copy) : NULL;
+	if (!f || gemini_map_set(&visited, url, f) == f) {
+		fprintf(stderr, "unable to queue %s: %s (error %d)\n", url, strerror(errno), errno);
+		return;
+	}
+	if (statef) {
+		fprintf(statef, "+ %s\n", url);
+		fflush(statef);
+	}
+}
+
+/* Where, in the local tree, a URL goes: DIR/host[:port]/path, with
+   index.gmi standing in for directories, so that the mirror can be served
+   as it is (with geminon --static, say).  /foo and /foo/ can't both be
+   called foo on disk, if both turn up; see place().  URLs that would climb
+   out of the tree, or that name the same file two ways (with an empty
+   segment, or a stray '%'), aren't mirrored at all. */
+static int local(char *dst, size_t n, const char *url) {
+	struct gemini_url *u;
+	const char *path, *s, *e;
+	size_t len, seg;
+	int dir;
+
+	u = gemini_parse_url(url);
+	if (!u) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	path = *u->path ? u->path : "/";
+	if (!*u->host || strchr(u->host, '/') || !u->host[strspn(u->host, ".")] || *path != '/') {
+		goto invalid;
+	}
+	for (s = path; (s = strchr(s, '%')) != NULL; s += 3) {
+		if (!isxdigit(s[1]) || !isxdigit(s[2])) {
+			goto invalid;
+		}
+	}
+
+	if (u->port == GEMINI_DEFAULT_PORT) {
+		len = snprintf(dst, n, "%s/%s", mirror, u->host);
+	} else {
+		len = snprintf(dst, n, "%s/%s:%u", mirror, u->host, u->port);
+	}
+	for (s = path; *s == '/' && len < n; s = e) {
+		s++;
+		e = s + strcspn(s, "/");
+		seg = e - s;
+		dir = *e == '/';
+		if ((dir && seg == 0) || (seg == 1 && s[0] == '.') || (seg == 2 && s[0] == '.' && s[1] == '.')) {
+			goto invalid;
+		}
+
+		len += snprintf(dst + len, n - len, "/%.*s%s", (int)seg, s,
+			!dir && seg == 0 ? "index.gmi" : "");
+	}
+	free(u);
+
+	if (len >= n) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+
+invalid:
+	free(u);
+	errno = EINVAL;
+	return -1;
+}
+
+/* Make room for file (n octets of buffer) in the mirror, creating the
+   directories it goes in.  Only when /foo and /foo/ both turn up do they
+   get in each other's way, and then the directory keeps the name (it has
+   to, for the documents under it), and the file gets a '%' on the end
+   (which no URL's own segments can have): foo is a directory, with its
+   index.gmi in it, and foo% is the file, whichever of them came first.
+   Called with the lock held, so that two fetches can't both be at it. */
+static int place(char *file, size_t n) {
+	struct stat st;
+	char *p, moved[4096];
+	size_t len;
+
+	for (p = file + strlen(mirror) + 1; (p = strchr(p, '/')) != NULL; p++) {
+		*p = '\0';
+		if (stat(file, &st) == 0 && !S_ISDIR(st.st_mode)) {
+			snprintf(moved, sizeof(moved), "%s%%", file);
+			if (rename(file, moved) != 0) {
+				*p = '/';
+				return -1;
+			}
+		}
+		if (mkdir(file, 0777) != 0 && errno != EEXIST) {
+			*p = '/';
+			return -1;
+		}
+		*p = '/';
+	}
+
+	len = strlen(file);
+	if (stat(file, &st) == 0 && S_ISDIR(st.st_mode)) {
+		if (len + 2 > n) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		file[len] = '%';
+		file[len + 1] = '\0';
+	}
+	return 0;
+}
+
+static int follow(const struct gemini_gemtext_line *line, void *url) {
+	char link[GEMINI_MAX_REQUEST], target[GEMINI_MAX_REQUEST];
+
+	if (line->type != GEMINI_GEMTEXT_LINK || line->url.n >= sizeof(link)) {
+		return 0;
+	}
+	memcpy(link, line->url.p, line->url.n);
+	link[line->url.n] = '\0';
+	if (resolve(target, sizeof(target), url, link) == 0) {
+		pthread_mutex_lock(&lock);
+		discover(target);
+		pthread_mutex_unlock(&lock);
+	}
+	return 0;
+}
+
+/* Follow the => links in a gemtext document (fetched from url, and saved
+   in file). */
+static void links(const char *url, const char *file) {
+	struct gemini_gemtext g;
+	char buf[8192];
+	ssize_t n;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		return;
+	}
+
+	gemini_gemtext_init(&g, follow, (void *)url);
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		if (gemini_gemtext_feed(&g, buf, n) != 0) {
+			break;
+		}
+	}
+	gemini_gemtext_finish(&g);
+	close(fd);
+}
+
+/* Fetch a URL into its own output file, keeping the status line (which
+   doesn't go in the file) for the summary.  When mirroring, only 2x
+   responses are kept, and links (and redirects) are followed. */
+static void fetch(struct gemini_client *client, struct fetch *f) {
+	struct gemini_response *res;
+	char file[4096], target[GEMINI_MAX_REQUEST];
+	off_t off;
+	int fd;
+
+	f->ms = gemini_now_ms();
+	f->failed = 1;
+
+	if ((mirror ? local(file, sizeof(file), f->url) : expand(file, sizeof(file), f)) != 0) {
+		snprintf(f->meta, sizeof(f->meta), "unable to name output file: %s", strerror(errno));
+		goto done;
+	}
+
+	res = gemini_client_request(client, f->url);
+	if (!res) {
+		snprintf(f->meta, sizeof(f->meta), "request failed: %s", strerror(errno));
+		goto done;
+	}
+
+	if (gemini_response_header(res) != 0) {
+		snprintf(f->meta, sizeof(f->meta), "malformed response status line");
+		gemini_response_close(res);
+		free(res);
+		goto done;
+	}
+	snprintf(f->status, sizeof(f->status), "%02d", res->status);
+	snprintf(f->meta, sizeof(f->meta), "%s", res->meta);
+
+	if (mirror && res->status / 10 != 2) {
+		if (res->status / 10 == 3 && resolve(target, sizeof(target), f->url, res->meta) == 0) {
+			pthread_mutex_lock(&lock);
+			discover(target);
+			pthread_mutex_unlock(&lock);
+		}
+		f->failed = res->status / 10 != 3;
+		gemini_response_close(res);
+		free(res);
+		goto done;
+	}
+
+	if (mirror) {
+		pthread_mutex_lock(&lock);
+		if (place(file, sizeof(file)) != 0) {
+			pthread_mutex_unlock(&lock);
+			snprintf(f->meta, sizeof(f->meta), "unable to create output directory: %s", strerror(errno));
+			gemini_response_close(res);
+			free(res);
+			goto done;
+		}
+		fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		pthread_mutex_unlock(&lock);
+	} else {
+		fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	}
+	if (fd < 0) {
+		snprintf(f->meta, sizeof(f->meta), "unable to open output file: %s", strerror(errno));
+		gemini_response_close(res);
+		free(res);
+		goto done;
+	}
+
+	f->failed = 0;
+	if (gemini_response_stream(res, fd, 8192) != 0) {
+		snprintf(f->meta, sizeof(f->meta), "unable to stream response: %s", strerror(errno));
+		f->failed = 1;
+	}
+	off = lseek(fd, 0, SEEK_CUR);
+	f->bytes = off > 0 ? off : 0;
+	close(fd);
+	gemini_response_close(res);
+	free(res);
+
+	if (mirror && !f->failed && strncmp(f->meta, "text/gemini", 11) == 0) {
+		links(f->url, file);
+	}
+
+done:
+	f->ms = gemini_now_ms() - f->ms;
+}
+
+/* Hand out the first fetch in line whose server we aren't already leaning
+   on as hard as we're allowed to, waiting for one if need be.  Returns
+   NULL once there's nothing left to fetch, and nothing being fetched that
+   might turn up more.  Called with the lock held. */
+static struct fetch * next() {
+	struct timespec ts;
+	struct fetch *f;
+	struct host *h;
+	long now, soonest;
+	int i;
+
+	for (;;) {
+		now = gemini_now_ms();
+		soonest = 0;
+		for (i = first; i < nfetches; i++) {
+			f = fetches[i];
+			if (f->started) {
+				continue;
+			}
+
+			h = gemini_map_get(&hosts, f->host);
+			if (per_host && h->active >= per_host) {
+				continue;
+			}
+			if (h->next > now) {
+				if (!soonest || h->next < soonest) soonest = h->next;
+				continue;
+			}
+
+			h->active++;
+			h->next = now + delay;
+			f->started = 1;
+			running++;
+			while (first < nfetches && fetches[first]->started) {
+				first++;
+			}
+			return f;
+		}
+
+		if (first == nfetches && running == 0) {
+			return NULL;
+		}
+		if (soonest) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec  += (soonest - now) / 1000;
+			ts.tv_nsec += (soonest - now) % 1000 * 1000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&changed, &lock, &ts);
+		} else {
+			pthread_cond_wait(&changed, &lock);
+		}
+	}
+}
+
+static void * worker(void *client) {
+	struct fetch *f;
+	struct host *h;
+
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		f = next();
+		pthread_mutex_unlock(&lock);
+		if (!f) {
+			return NULL;
+		}
+
+		fetch(client, f);
+
+		/* one summary line per URL, as they finish */
+		pthread_mutex_lock(&lock);
+		fprintf(stderr, "%-2s %7ldms %10lu  %s  %s\n",
+			f->failed ? "--" : f->status, f->ms, (unsigned long)f->bytes, f->url, f->meta);
+		if (statef) {
+			fprintf(statef, "%c %s\n", f->failed ? '!' : '=', f->url);
+			fflush(statef);
+		}
+		h = gemini_map_get(&hosts, f->host);
+		h->active--;
+		running--;
+		pthread_cond_broadcast(&changed);
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+/* Pick up where a previous mirror left off: everything it found is
+   queued again, except for what it finished. */
+static int resume() {
+	char line[GEMINI_MAX_REQUEST + 4];
+	struct fetch *f;
+	FILE *io;
+	int n;
+
+	io = fopen(state, "r");
+	if (!io) {
+		return errno == ENOENT ? 0 : -1;
+	}
+	n = 0;
+	while (fgets(line, sizeof(line), io)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (strlen(line) < 3 || line[1] != ' ') {
+			continue;
+		}
+		switch (line[0]) {
+		case '+':
+			discover(line + 2);
+			break;
+
+		case '=':
+			f = gemini_map_get(&visited, line + 2);
+			if (f && !f->started) {
+				f->started = 1; /* ... a while ago */
+				n++;
+			}
+			break;
+		}
+	}
+	fclose(io);
+
+	while (first < nfetches && fetches[first]->started) {
+		first++;
+	}
+	if (n > 0) {
+		fprintf(stderr, "resuming mirror: %d of %d URLs already fetched\n", n, nfetches);
+	}
 	return 0;
 }
 
 int main(int argc, char **argv, char **envp) {
-	int rc, nreqs;
+	int rc, i, failed;
 	struct gemini_client client;
 	struct gemini_response *res;
+	struct gemini_store_stats st;
+	pthread_t *threads;
+	char url[GEMINI_MAX_REQUEST];
+	int scoped;
 
+	failed = 0;
 	memset(&client, 0, sizeof(client));
 	rc = configure(&client, argc, argv, envp);
 	if (rc != 0) {
 		return 1;
 	}
+	scoped = nscopes > 0;
 
-	for (nreqs = 0; optind < argc; nreqs++, optind++) {
-		res = gemini_client_request(&client, argv[optind]);
-		if (!res) {
-			fprintf(stderr, "gemini_client_request() failed! (e%d: %s)\n", errno, strerror(errno));
+	if (gemini_map_init(&hosts, 64) != 0 || gemini_map_init(&visited, 1024) != 0) {
+		return 1;
+	}
+
+	if (mirror) {
+		/* each starting point brings its own directory into scope,
+		   unless we've been told otherwise */
+		for (i = optind; i < argc; i++) {
+			if (resolve(url, sizeof(url), argv[i], argv[i]) != 0) {
+				fprintf(stderr, "%s: not a gemini:// URL we can mirror\n", argv[i]);
+				return 1;
+			}
+			if (!scoped) {
+				scopes = realloc(scopes, (nscopes + 1) * sizeof(char *));
+				if (!scopes || !(scopes[nscopes] = strdup(url))) {
+					return 1;
+				}
+				*(strrchr(scopes[nscopes], '/') + 1) = '\0';
+				nscopes++;
+			}
+		}
+
+		if (resume() != 0) {
+			fprintf(stderr, "unable to read mirror state from %s: %s (error %d)\n", state, strerror(errno), errno);
 			return 1;
 		}
+		statef = fopen(state, "a");
+		if (!statef) {
+			fprintf(stderr, "unable to write mirror state to %s: %s (error %d)\n", state, strerror(errno), errno);
+			return 1;
+		}
+		for (; optind < argc; optind++) {
+			resolve(url, sizeof(url), argv[optind], argv[optind]);
+			discover(url);
+		}
+	}
 
-		rc = gemini_response_stream(res, 1, 8192);
-		if (rc != 0) {
-			fprintf(stderr, "gemini_response_stream() failed! (e%d: %s)\n", errno, strerror(errno));
+	for (; optind < argc; optind++) {
+		if (!queue(argv[optind])) {
 			return 1;
 		}
-		gemini_response_close(res);
 	}
-	return 0;
+	if (input && queue_from(input) != 0) {
+		return 1;
+	}
+	if (output && nfetches > 1 && !numbered(output)) {
+		fprintf(stderr, "--output %s: without a %%n in it, every URL would be written to the same file\n", output);
+		return 1;
+	}
+
+	if (!output && !mirror) {
+		/* the whole response, status line and all, to standard output */
+		for (i = 0; i < nfetches; i++) {
+			res = gemini_client_request(&client, fetches[i]->url);
+			if (!res) {
+				fprintf(stderr, "gemini_client_request() failed! (e%d: %s)\n", errno, strerror(errno));
+				return 1;
+			}
+
+			rc = gemini_response_stream(res, 1, 8192);
+			if (rc != 0) {
+				fprintf(stderr, "gemini_response_stream() failed! (e%d: %s)\n", errno, strerror(errno));
+				return 1;
+			}
+			gemini_response_close(res);
+			free(res);
+		}
+
+	} else {
+		if (jobs > nfetches && !mirror) {
+			jobs = nfetches;
+		}
+		threads = calloc(jobs, sizeof(pthread_t));
+		if (!threads && jobs > 0) {
+			return 1;
+		}
+		for (i = 0; i < jobs; i++) {
+			if (pthread_create(&threads[i], NULL, worker, &client) != 0) {
+				fprintf(stderr, "unable to start fetch thread: %s (error %d)\n", strerror(errno), errno);
+				return 1;
+			}
+		}
+		for (i = 0; i < jobs; i++) {
+			pthread_join(threads[i], NULL);
+		}
+		free(threads);
+
+		for (i = 0; i < nfetches; i++) {
+			if (fetches[i]->failed) failed++;
+		}
+		if (statef) {
+			fclose(statef);
+		}
+	}
+
+	if (client.store) {
+		gemini_store_stats(client.store, &st);
+		fprintf(stderr, "cache: %lu hits, %lu misses (%lu expired), %lu stored, %lu evicted; %lu responses (%lu octets) on disk\n",
+			st.hits, st.misses, st.expired, st.stores, st.evictions, (unsigned long)st.entries, (unsigned long)st.bytes);
+	}
+	if (sessions && gemini_sessions_save(client.sessions, sessions) != 0) {
+		fprintf(stderr, "unable to save tls sessions to %s: %s (error %d)\n", sessions, strerror(errno), errno);
+	}
+	gemini_client_close(&client);
+	return failed ? 1 : 0;
 }
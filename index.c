@@ -0,0 +1,373 @@
+#include "./gemini.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+
+/* Ownership of a path is tracked as a bitmask of which roots provide it;
+   the lowest set bit (the earliest root) wins. */
+#define OWNER_BIT(i) ((uintptr_t)1 << (i))
+#define MAX_ROOTS    (sizeof(uintptr_t) * 8)
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+struct _watch {
+	int   root; /* which root this directory lives under */
+	char *dir;  /* path of the directory, relative to that root */
+};
+
+static char * s_join(const char *a, const char *b) {
+	char *s;
+	size_t la, lb;
+
+	la = strlen(a);
+	lb = strlen(b);
+	s = malloc(la + 1 + lb + 1);
+	if (!s) {
+		return NULL;
+	}
+
+	memcpy(s, a, la);
+	if (la > 0) s[la++] = '/';
+	memcpy(s + la, b, lb + 1);
+	return s;
+}
+
+static void s_own(struct gemini_fs_index *idx, const char *path, int root) {
+	uintptr_t mask;
+
+	mask = (uintptr_t)gemini_map_get(&idx->paths, path);
+	gemini_map_set(&idx->paths, path, (void *)(mask | OWNER_BIT(root)));
+}
+
+static void s_disown(struct gemini_fs_index *idx, const char *path, int root) {
+	uintptr_t mask;
+
+	mask = (uintptr_t)gemini_map_get(&idx->paths, path) & ~OWNER_BIT(root);
+	if (mask) gemini_map_set(&idx->paths, path, (void *)mask);
+	else      gemini_map_delete(&idx->paths, path);
+}
+
+static int s_watch(struct gemini_fs_index *idx, int root, const char *dir) {
+	struct _watch *w;
+	char *full;
+	int wd, n;
+
+	full = s_join(idx->roots[root], dir);
+	if (!full) {
+		return -1;
+	}
+	wd = inotify_add_watch(idx->inotify, full, WATCH_MASK);
+	free(full);
+	if (wd < 0) {
+		return -1;
+	}
+
+	if (wd >= idx->nwatches) {
+		for (n = idx->nwatches ? idx->nwatches : 64; n <= wd; n *= 2)
+			;
+		w = realloc(idx->watches, n * sizeof(struct _watch));
+		if (!w) {
+			return -1;
+		}
+		memset(w + idx->nwatches, 0, (n - idx->nwatches) * sizeof(struct _watch));
+		idx->watches  = w;
+		idx->nwatches = n;
+	}
+
+	free(idx->watches[wd].dir);
+	idx->watches[wd].root = root;
+	idx->watches[wd].dir  = strdup(dir);
+	return 0;
+}
+
+/* Index everything at or below dir (relative to the given root), and
+   arrange to be told about changes to it. */
+static int s_walk(struct gemini_fs_index *idx, int root, const char *dir) {
+	DIR *d;
+	struct dirent *ent;
+	struct stat st;
+	char *path;
+	int fd, isdir;
+
+	if (s_watch(idx, root, dir) != 0) {
+		return -1;
+	}
+
+	fd = openat(idx->dirfds[root], *dir ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	d = fdopendir(fd);
+	if (!d) {
+		close(fd);
+		return -1;
+	}
+
+	while ((ent = readdir(d)) != NULL) {
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+			continue;
+		}
+
+		path = s_join(dir, ent->d_name);
+		if (!path) {
+			closedir(d);
+			return -1;
+		}
+
+		if (ent->d_type == DT_DIR || ent->d_type == DT_REG) {
+			isdir = ent->d_type == DT_DIR;
+		} else if (fstatat(idx->dirfds[root], path, &st, 0) == 0) {
+			/* symlinks and oddball filesystems; follow them, like open(2) would */
+			isdir = S_ISDIR(st.st_mode);
+			if (!isdir && !S_ISREG(st.st_mode)) {
+				free(path);
+				continue;
+			}
+		} else {
+			free(path);
+			continue;
+		}
+
+		if (isdir) s_walk(idx, root, path);
+		else       s_own(idx, path, root);
+		free(path);
+	}
+
+	closedir(d);
+	return 0;
+}
+
+struct _prune {
+	struct gemini_fs_index *idx;
+	int         root;
+	const char *dir;
+	size_t      len;
+};
+
+static void s_prune1(const char *path, void *_, void *_prune) {
+	struct _prune *p;
+
+	p = _prune;
+	if (strncmp(path, p->dir, p->len) == 0 && path[p->len] == '/') {
+		s_disown(p->idx, path, p->root);
+	}
+}
+
+/* Forget everything a root provided at or below dir, and stop watching
+   the directories under it; if they were only moved elsewhere in the tree,
+   the IN_MOVED_TO half of the rename will pick them back up. */
+static void s_prune(struct gemini_fs_index *idx, int root, const char *dir) {
+	struct _prune p;
+	struct _watch *w;
+	int i;
+
+	for (i = 0; i < idx->nwatches; i++) {
+		w = &idx->watches[i];
+		if (w->dir && w->root == root && strncmp(w->dir, dir, strlen(dir)) == 0
+		 && (w->dir[strlen(dir)] == '\0' || w->dir[strlen(dir)] == '/')) {
+			inotify_rm_watch(idx->inotify, i);
+			free(w->dir);
+			w->dir = NULL;
+		}
+	}
+
+	p.idx  = idx;
+	p.root = root;
+	p.dir  = dir;
+	p.len  = strlen(dir);
+	gemini_map_each(&idx->paths, s_prune1, &p);
+}
+
+static int s_build(struct gemini_fs_index *idx) {
+	int i;
+
+	for (i = 0; i < idx->n; i++) {
+		if (s_walk(idx, i, "") != 0) {
+			fprintf(stderr, "[gemini_fs_index] unable to index %s: %s (error %d)\n", idx->roots[i], strerror(errno), errno);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+struct gemini_fs_index * gemini_fs_index_new(const char **roots, int n) {
+	struct gemini_fs_index *idx;
+	int i;
+
+	if (n <= 0 || n > MAX_ROOTS) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	idx = calloc(1, sizeof(struct gemini_fs_index));
+	if (!idx) {
+		return NULL;
+	}
+	idx->inotify = -1;
+
+	idx->roots  = calloc(n, sizeof(char *));
+	idx->dirfds = calloc(n, sizeof(int));
+	if (!idx->roots || !idx->dirfds || gemini_map_init(&idx->paths, 1024) != 0) {
+		gemini_fs_index_free(idx);
+		return NULL;
+	}
+
+	for (i = 0; i < n; i++) idx->dirfds[i] = -1;
+	for (idx->n = 0; idx->n < n; idx->n++) {
+		idx->roots[idx->n]  = strdup(roots[idx->n]);
+		idx->dirfds[idx->n] = open(roots[idx->n], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (!idx->roots[idx->n] || idx->dirfds[idx->n] < 0) {
+			idx->n++;
+			gemini_fs_index_free(idx);
+			return NULL;
+		}
+	}
+
+	idx->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (idx->inotify < 0 || s_build(idx) != 0) {
+		gemini_fs_index_free(idx);
+		return NULL;
+	}
+
+	return idx;
+}
+
+static void s_event(struct gemini_fs_index *idx, struct inotify_event *ev) {
+	struct _watch *w;
+	struct stat st;
+	char *path;
+
+	if (ev->wd < 0 || ev->wd >= idx->nwatches || !idx->watches[ev->wd].dir) {
+		return;
+	}
+	w = &idx->watches[ev->wd];
+
+	if (ev->mask & IN_IGNORED) {
+		/* directory went away (or was moved); the watch is gone with it */
+		free(w->dir);
+		w->dir = NULL;
+		return;
+	}
+	if (!ev->len) {
+		return;
+	}
+
+	path = s_join(w->dir, ev->name);
+	if (!path) {
+		return;
+	}
+
+	if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+		if (ev->mask & IN_ISDIR) {
+			s_walk(idx, w->root, path);
+		} else if (fstatat(idx->dirfds[w->root], path, &st, 0) == 0 && S_ISREG(st.st_mode)) {
+			s_own(idx, path, w->root);
+		}
+
+	} else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+		if (ev->mask & IN_ISDIR) {
+			s_prune(idx, w->root, path);
+		} else {
+			s_disown(idx, path, w->root);
+		}
+	}
+
+	free(path);
+}
+
+int gemini_fs_index_refresh(struct gemini_fs_index *idx) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	ssize_t n;
+	char *p;
+	int changes = 0;
+
+	while ((n = read(idx->inotify, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+			ev = (struct inotify_event *)p;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				/* we lost track; start over from scratch */
+				fprintf(stderr, "[gemini_fs_index] inotify queue overflowed; rebuilding index\n");
+				gemini_map_free(&idx->paths, NULL);
+				if (gemini_map_init(&idx->paths, 1024) != 0 || s_build(idx) != 0) {
+					return -1;
+				}
+				changes++;
+				continue;
+			}
+
+			s_event(idx, ev);
+			changes++;
+		}
+	}
+
+	if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+		return -1;
+	}
+	return changes;
+}
+
+int gemini_fs_index_lookup(struct gemini_fs_index *idx, const char *path) {
+	uintptr_t mask;
+	int i;
+
+	mask = (uintptr_t)gemini_map_get(&idx->paths, path);
+	if (!mask) {
+		return -1;
+	}
+
+	for (i = 0; !(mask & OWNER_BIT(i)); i++)
+		;
+	return i;
+}
+
+int gemini_fs_index_open(struct gemini_fs_index *idx, const char *file, int flags) {
+	char path[GEMINI_MAX_PATH+1];
+	int root;
+
+	if (gemini_fs_resolve_into(file, path) != 0) {
+		return -1;
+	}
+
+	root = gemini_fs_index_lookup(idx, path);
+	if (root < 0) {
+		return -1;
+	}
+
+	return openat(idx->dirfds[root], path, flags | O_CLOEXEC);
+}
+
+void gemini_fs_index_free(struct gemini_fs_index *idx) {
+	int i;
+
+	if (!idx) return;
+
+	if (idx->paths.buckets) {
+		gemini_map_free(&idx->paths, NULL);
+	}
+	for (i = 0; i < idx->nwatches; i++) {
+		free(idx->watches[i].dir);
+	}
+	free(idx->watches);
+
+	for (i = 0; i < idx->n; i++) {
+		free(idx->roots[i]);
+		if (idx->dirfds[i] >= 0) close(idx->dirfds[i]);
+	}
+	free(idx->roots);
+	free(idx->dirfds);
+
+	if (idx->inotify >= 0) close(idx->inotify);
+	free(idx);
+}
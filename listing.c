@@ -0,0 +1,361 @@
+#include "./gemini.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+                  | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+#define INDEX_FILE "index.gmi"
+
+struct _entry {
+	char *name;
+	int   isdir;
+};
+
+struct _buf {
+	char   *data;
+	size_t  len, cap;
+};
+
+static int s_append(struct _buf *b, const char *s, size_t n) {
+	char *data;
+	size_t cap;
+
+	if (b->len + n + 1 > b->cap) {
+		for (cap = b->cap ? b->cap : 4096; cap < b->len + n + 1; cap *= 2)
+			;
+		data = realloc(b->data, cap);
+		if (!data) {
+			return -1;
+		}
+		b->data = data;
+		b->cap  = cap;
+	}
+
+	memcpy(b->data + b->len, s, n);
+	b->len += n;
+	b->data[b->len] = '\0';
+	return 0;
+}
+
+static int s_appends(struct _buf *b, const char *s) {
+	return s_append(b, s, strlen(s));
+}
+
+/* Link targets can't contain whitespace (it would end the URL part of the
+   gemtext link line), so we percent-encode anything that isn't printable.
+   A '?' or '#' would make the rest of the name a query string or a
+   fragment, and a '%' would start an escape of its own, so those get
+   encoded too. */
+static int s_append_link(struct _buf *b, const char *name) {
+	char esc[4];
+
+	for (; *name; name++) {
+		if ((unsigned char)*name <= ' ' || (unsigned char)*name >= 0x7f || strchr("%?#", *name)) {
+			snprintf(esc, sizeof(esc), "%%%02X", (unsigned char)*name);
+			if (s_append(b, esc, 3) != 0) return -1;
+		} else {
+			if (s_append(b, name, 1) != 0) return -1;
+		}
+	}
+	return 0;
+}
+
+static int s_cmp(const void *_a, const void *_b) {
+	const struct _entry *a = _a, *b = _b;
+
+	if (a->isdir != b->isdir) {
+		return b->isdir - a->isdir; /* directories first */
+	}
+	return strcmp(a->name, b->name);
+}
+
+static void s_free(void *_l) {
+	struct gemini_fs_listing *l = _l;
+
+	free(l->body);
+	free(l);
+}
+
+static int s_render(struct gemini_fs_listing *l, const char *dir, struct _entry *ents, size_t n) {
+	struct _buf b;
+	size_t i;
+
+	memset(&b, 0, sizeof(b));
+	if (s_appends(&b, "# Index of /") != 0
+	 || s_appends(&b, dir) != 0
+	 || s_appends(&b, *dir ? "/\n\n" : "\n\n") != 0) {
+		free(b.data);
+		return -1;
+	}
+	if (*dir && s_appends(&b, "=> ../ ../\n") != 0) {
+		free(b.data);
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (s_appends(&b, "=> ") != 0
+		 || s_append_link(&b, ents[i].name) != 0
+		 || s_appends(&b, ents[i].isdir ? "/ " : " ") != 0
+		 || s_appends(&b, ents[i].name) != 0
+		 || s_appends(&b, ents[i].isdir ? "/\n" : "\n") != 0) {
+			free(b.data);
+			return -1;
+		}
+	}
+
+	l->body = b.data;
+	l->len  = b.len;
+	return 0;
+}
+
+/* Read a directory, and either note that it has an index file, or build a
+   gemtext listing of what's in it. */
+static struct gemini_fs_listing * s_generate(int fd, const char *dir) {
+	struct gemini_fs_listing *l;
+	struct _entry *ents, *more;
+	size_t n, cap, i;
+	struct dirent *ent;
+	struct stat st;
+	DIR *d;
+	int isdir;
+
+	l = calloc(1, sizeof(struct gemini_fs_listing));
+	if (!l) {
+		close(fd);
+		return NULL;
+	}
+	d = fdopendir(fd);
+	if (!d) {
+		close(fd);
+		free(l);
+		return NULL;
+	}
+
+	n = cap = 0;
+	ents = NULL;
+	while ((ent = readdir(d)) != NULL) {
+		if (ent->d_name[0] == '.') {
+			continue; /* skips ., .., and hidden files alike */
+		}
+
+		if (ent->d_type == DT_DIR || ent->d_type == DT_REG) {
+			isdir = ent->d_type == DT_DIR;
+		} else if (fstatat(dirfd(d), ent->d_name, &st, 0) == 0
+		       && (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) {
+			isdir = S_ISDIR(st.st_mode);
+		} else {
+			continue;
+		}
+
+		if (!isdir && strcmp(ent->d_name, INDEX_FILE) == 0) {
+			l->index = 1;
+			break;
+		}
+
+		if (n == cap) {
+			cap = cap ? cap * 2 : 64;
+			more = realloc(ents, cap * sizeof(struct _entry));
+			if (!more) goto fail;
+			ents = more;
+		}
+		ents[n].name  = strdup(ent->d_name);
+		ents[n].isdir = isdir;
+		if (!ents[n].name) goto fail;
+		n++;
+	}
+
+	if (!l->index) {
+		qsort(ents, n, sizeof(struct _entry), s_cmp);
+		if (s_render(l, dir, ents, n) != 0) goto fail;
+	}
+
+	for (i = 0; i < n; i++) free(ents[i].name);
+	free(ents);
+	closedir(d);
+	return l;
+
+fail:
+	for (i = 0; i < n; i++) free(ents[i].name);
+	free(ents);
+	closedir(d);
+	free(l);
+	return NULL;
+}
+
+static int s_watch(struct gemini_fs_listings *ls, const char *dir) {
+	char *full, **more;
+	int wd, n;
+
+	full = malloc(strlen(ls->root) + 1 + strlen(dir) + 1);
+	if (!full) {
+		return -1;
+	}
+	sprintf(full, "%s/%s", ls->root, dir);
+	wd = inotify_add_watch(ls->inotify, full, WATCH_MASK);
+	free(full);
+	if (wd < 0) {
+		return -1;
+	}
+
+	if (wd >= ls->nwatches) {
+		for (n = ls->nwatches ? ls->nwatches : 64; n <= wd; n *= 2)
+			;
+		more = realloc(ls->watches, n * sizeof(char *));
+		if (!more) {
+			inotify_rm_watch(ls->inotify, wd);
+			return -1;
+		}
+		memset(more + ls->nwatches, 0, (n - ls->nwatches) * sizeof(char *));
+		ls->watches  = more;
+		ls->nwatches = n;
+	}
+
+	free(ls->watches[wd]);
+	ls->watches[wd] = strdup(dir);
+	if (!ls->watches[wd]) {
+		inotify_rm_watch(ls->inotify, wd);
+		return -1;
+	}
+	return wd;
+}
+
+struct gemini_fs_listings * gemini_fs_listings_new(const char *root) {
+	struct gemini_fs_listings *ls;
+
+	ls = calloc(1, sizeof(struct gemini_fs_listings));
+	if (!ls) {
+		return NULL;
+	}
+	ls->dirfd = ls->inotify = -1;
+
+	ls->root = strdup(root);
+	if (!ls->root || gemini_map_init(&ls->dirs, 64) != 0) {
+		gemini_fs_listings_free(ls);
+		return NULL;
+	}
+
+	ls->dirfd   = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	ls->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (ls->dirfd < 0 || ls->inotify < 0) {
+		gemini_fs_listings_free(ls);
+		return NULL;
+	}
+
+	return ls;
+}
+
+int gemini_fs_listings_refresh(struct gemini_fs_listings *ls) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	struct gemini_fs_listing *l;
+	ssize_t n;
+	char *p;
+	int changes = 0;
+
+	while ((n = read(ls->inotify, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+			ev = (struct inotify_event *)p;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				/* we lost track; nothing cached can be trusted */
+				gemini_map_free(&ls->dirs, s_free);
+				if (gemini_map_init(&ls->dirs, 64) != 0) {
+					return -1;
+				}
+				changes++;
+				continue;
+			}
+
+			if (ev->wd < 0 || ev->wd >= ls->nwatches || !ls->watches[ev->wd]) {
+				continue;
+			}
+
+			/* any change at all invalidates the listing; we'll rebuild
+			   it (and re-establish the watch) the next time it's asked for */
+			l = gemini_map_delete(&ls->dirs, ls->watches[ev->wd]);
+			if (l) s_free(l);
+			if (!(ev->mask & IN_IGNORED)) {
+				inotify_rm_watch(ls->inotify, ev->wd);
+			}
+			free(ls->watches[ev->wd]);
+			ls->watches[ev->wd] = NULL;
+			changes++;
+		}
+	}
+
+	if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+		return -1;
+	}
+	return changes;
+}
+
+const struct gemini_fs_listing * gemini_fs_listings_get(struct gemini_fs_listings *ls, const char *dir) {
+	struct gemini_fs_listing *l;
+	int fd, wd;
+
+	l = gemini_map_get(&ls->dirs, dir);
+	if (l) {
+		return l;
+	}
+
+	fd = openat(ls->dirfd, *dir ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	/* watch first, so that nothing can change between our readdir(3) and
+	   the establishment of the watch without us hearing about it. */
+	wd = s_watch(ls, dir);
+
+	l = s_generate(fd, dir);
+	if (!l) {
+		return NULL;
+	}
+
+	if (wd < 0) {
+		/* can't keep it fresh, so we can't keep it; the caller gets a
+		   one-off copy that lives until the next call. */
+		s_free(ls->uncached);
+		ls->uncached = l;
+		return l;
+	}
+
+	if (gemini_map_set(&ls->dirs, dir, l) == l) {
+		s_free(ls->uncached);
+		ls->uncached = l;
+	}
+	return l;
+}
+
+void gemini_fs_listings_free(struct gemini_fs_listings *ls) {
+	int i;
+
+	if (!ls) return;
+
+	if (ls->dirs.buckets) {
+		gemini_map_free(&ls->dirs, s_free);
+	}
+	if (ls->uncached) {
+		s_free(ls->uncached);
+	}
+	for (i = 0; i < ls->nwatches; i++) {
+		free(ls->watches[i]);
+	}
+	free(ls->watches);
+
+	if (ls->dirfd >= 0)   close(ls->dirfd);
+	if (ls->inotify >= 0) close(ls->inotify);
+	free(ls->root);
+	free(ls);
+}
@@ -0,0 +1,154 @@
+#include "./gemini.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct gemini_map_entry {
+	struct gemini_map_entry *next; /* bucket chain forward pointer */
+
+	unsigned long  hash;  /* cached hash of key, to speed up rehashing */
+	void          *value; /* caller-supplied value (never NULL) */
+	char           key[]; /* NUL-terminated copy of the caller's key */
+};
+
+/* FNV-1a; cheap, and good enough for path-like keys. */
+static unsigned long s_hash(const char *key) {
+	unsigned long h = 2166136261ul;
+	for (; *key; key++) {
+		h ^= (unsigned char)*key;
+		h *= 16777619ul;
+	}
+	return h;
+}
+
+static int s_grow(struct gemini_map *map) {
+	struct gemini_map_entry **buckets, *e, *next;
+	size_t i, n;
+
+	n = map->nbuckets * 2;
+	buckets = calloc(n, sizeof(struct gemini_map_entry *));
+	if (!buckets) {
+		return -1;
+	}
+
+	for (i = 0; i < map->nbuckets; i++) {
+		for (e = map->buckets[i]; e; e = next) {
+			next = e->next;
+			e->next = buckets[e->hash % n];
+			buckets[e->hash % n] = e;
+		}
+	}
+
+	free(map->buckets);
+	map->buckets  = buckets;
+	map->nbuckets = n;
+	return 0;
+}
+
+int gemini_map_init(struct gemini_map *map, size_t hint) {
+	size_t n;
+
+	for (n = 16; n < hint; n *= 2)
+		;
+
+	map->buckets = calloc(n, sizeof(struct gemini_map_entry *));
+	if (!map->buckets) {
+		return -1;
+	}
+	map->nbuckets = n;
+	map->n = 0;
+	return 0;
+}
+
+void * gemini_map_get(struct gemini_map *map, const char *key) {
+	struct gemini_map_entry *e;
+	unsigned long h;
+
+	h = s_hash(key);
+	for (e = map->buckets[h % map->nbuckets]; e; e = e->next) {
+		if (e->hash == h && strcmp(e->key, key) == 0) {
+			return e->value;
+		}
+	}
+	return NULL;
+}
+
+void * gemini_map_set(struct gemini_map *map, const char *key, void *value) {
+	struct gemini_map_entry *e;
+	unsigned long h;
+	size_t len;
+	void *old;
+
+	h = s_hash(key);
+	for (e = map->buckets[h % map->nbuckets]; e; e = e->next) {
+		if (e->hash == h && strcmp(e->key, key) == 0) {
+			old = e->value;
+			e->value = value;
+			return old;
+		}
+	}
+
+	if (map->n >= map->nbuckets && s_grow(map) != 0) {
+		return value;
+	}
+
+	len = strlen(key);
+	e = malloc(sizeof(struct gemini_map_entry) + len + 1);
+	if (!e) {
+		return value;
+	}
+	memcpy(e->key, key, len + 1);
+	e->hash  = h;
+	e->value = value;
+	e->next  = map->buckets[h % map->nbuckets];
+	map->buckets[h % map->nbuckets] = e;
+	map->n++;
+	return NULL;
+}
+
+void * gemini_map_delete(struct gemini_map *map, const char *key) {
+	struct gemini_map_entry *e, **prev;
+	unsigned long h;
+	void *value;
+
+	h = s_hash(key);
+	for (prev = &map->buckets[h % map->nbuckets]; (e = *prev) != NULL; prev = &e->next) {
+		if (e->hash == h && strcmp(e->key, key) == 0) {
+			*prev = e->next;
+			value = e->value;
+			free(e);
+			map->n--;
+			return value;
+		}
+	}
+	return NULL;
+}
+
+void gemini_map_each(struct gemini_map *map, void (*fn)(const char *, void *, void *), void *udata) {
+	struct gemini_map_entry *e, *next;
+	size_t i;
+
+	for (i = 0; i < map->nbuckets; i++) {
+		for (e = map->buckets[i]; e; e = next) {
+			next = e->next;
+			fn(e->key, e->value, udata);
+		}
+	}
+}
+
+void gemini_map_free(struct gemini_map *map, void (*fn)(void *)) {
+	struct gemini_map_entry *e, *next;
+	size_t i;
+
+	for (i = 0; i < map->nbuckets; i++) {
+		for (e = map->buckets[i]; e; e = next) {
+			next = e->next;
+			if (fn) fn(e->value);
+			free(e);
+		}
+	}
+	free(map->buckets);
+	map->buckets  = NULL;
+	map->nbuckets = 0;
+	map->n = 0;
+}
@@ -0,0 +1,206 @@
+#include "./gemini.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* One loaded version of a plugin's shared object. */
+struct _loaded {
+	void *dl; /* handle from dlopen(3) */
+
+	gemini_handler            handler;
+	gemini_plugin_teardown_fn teardown;
+	void                     *data; /* whatever the init function gave us */
+
+	unsigned long version;  /* which load this was, counting from 1 */
+	int           inflight; /* requests currently in the handler */
+	int           retired;  /* non-zero once a newer version has taken over */
+};
+
+/* The dynamic linker won't load a second copy of a shared object that it
+   already has loaded, either by name or by inode; since the old version
+   sticks around until it is drained, we have to load each version from a
+   private copy of the file.  The copy is unlinked as soon as it is mapped. */
+static void * s_dlopen(const char *path) {
+	char tmp[4096], buf[GEMINI_STREAM_BLOCK_SIZE];
+	const char *dir;
+	ssize_t n, nwrit, off;
+	int in, out;
+	void *dl;
+
+	dir = getenv("TMPDIR");
+	snprintf(tmp, sizeof(tmp), "%s/geminon-plugin-XXXXXX", dir ? dir : "/tmp");
+
+	in = open(path, O_RDONLY | O_CLOEXEC);
+	if (in < 0) {
+		fprintf(stderr, "[gemini_plugin] unable to open %s: %s (error %d)\n", path, strerror(errno), errno);
+		return NULL;
+	}
+	out = mkstemp(tmp);
+	if (out < 0) {
+		fprintf(stderr, "[gemini_plugin] unable to create a private copy of %s: %s (error %d)\n", path, strerror(errno), errno);
+		close(in);
+		return NULL;
+	}
+
+	while ((n = read(in, buf, sizeof(buf))) != 0) {
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) goto fail;
+		for (off = 0; off < n; off += nwrit) {
+			nwrit = write(out, buf + off, n - off);
+			if (nwrit < 0) goto fail;
+		}
+	}
+	close(in);
+	close(out);
+
+	dl = dlopen(tmp, RTLD_NOW | RTLD_LOCAL);
+	unlink(tmp);
+	if (!dl) {
+		fprintf(stderr, "[gemini_plugin] unable to load %s: %s\n", path, dlerror());
+	}
+	return dl;
+
+fail:
+	fprintf(stderr, "[gemini_plugin] unable to copy %s: %s (error %d)\n", path, strerror(errno), errno);
+	close(in);
+	close(out);
+	unlink(tmp);
+	return NULL;
+}
+
+static struct _loaded * s_load(struct gemini_plugin *plugin) {
+	struct _loaded *l;
+	gemini_plugin_init_fn init;
+
+	l = calloc(1, sizeof(struct _loaded));
+	if (!l) {
+		return NULL;
+	}
+
+	l->dl = s_dlopen(plugin->path);
+	if (!l->dl) {
+		free(l);
+		return NULL;
+	}
+
+	l->handler  = (gemini_handler)           dlsym(l->dl, GEMINI_PLUGIN_HANDLER);
+	l->teardown = (gemini_plugin_teardown_fn)dlsym(l->dl, GEMINI_PLUGIN_TEARDOWN);
+	init        = (gemini_plugin_init_fn)    dlsym(l->dl, GEMINI_PLUGIN_INIT);
+	if (!l->handler) {
+		fprintf(stderr, "[gemini_plugin] %s does not export " GEMINI_PLUGIN_HANDLER "()\n", plugin->path);
+		dlclose(l->dl);
+		free(l);
+		return NULL;
+	}
+
+	if (init && init(plugin->config, &l->data) != 0) {
+		fprintf(stderr, "[gemini_plugin] %s failed to initialize\n", plugin->path);
+		dlclose(l->dl);
+		free(l);
+		return NULL;
+	}
+
+	l->version = ++plugin->loads;
+	fprintf(stderr, "[gemini_plugin] loaded %s (version %lu)\n", plugin->path, l->version);
+	return l;
+}
+
+static void s_unload(struct gemini_plugin *plugin, struct _loaded *l) {
+	if (l->teardown) {
+		l->teardown(l->data);
+	}
+	dlclose(l->dl);
+	fprintf(stderr, "[gemini_plugin] unloaded %s (version %lu)\n", plugin->path, l->version);
+	free(l);
+}
+
+struct gemini_plugin * gemini_plugin_load(const char *path, const char *config) {
+	struct gemini_plugin *plugin;
+
+	plugin = calloc(1, sizeof(struct gemini_plugin));
+	if (!plugin) {
+		return NULL;
+	}
+
+	plugin->path   = strdup(path);
+	plugin->config = strdup(config ? config : "");
+	if (!plugin->path || !plugin->config) {
+		free(plugin->path);
+		free(plugin->config);
+		free(plugin);
+		return NULL;
+	}
+	pthread_mutex_init(&plugin->lock, NULL);
+
+	plugin->loaded = s_load(plugin);
+	if (!plugin->loaded) {
+		gemini_plugin_free(plugin);
+		return NULL;
+	}
+	return plugin;
+}
+
+void gemini_plugin_reload(struct gemini_plugin *plugin) {
+	plugin->reload = 1;
+}
+
+void gemini_plugin_free(struct gemini_plugin *plugin) {
+	if (!plugin) return;
+
+	if (plugin->loaded) {
+		s_unload(plugin, plugin->loaded);
+	}
+	pthread_mutex_destroy(&plugin->lock);
+	free(plugin->path);
+	free(plugin->config);
+	free(plugin);
+}
+
+int gemini_plugin_handler(const char *prefix, struct gemini_request *req, void *_plugin) {
+	struct gemini_plugin *plugin;
+	struct _loaded *l, *drained;
+	int rc;
+
+	plugin = _plugin;
+	drained = NULL;
+
+	pthread_mutex_lock(&plugin->lock);
+	if (plugin->reload) {
+		plugin->reload = 0;
+		l = s_load(plugin);
+		if (!l) {
+			fprintf(stderr, "[gemini_plugin] reload of %s failed; sticking with version %lu\n",
+				plugin->path, plugin->loaded->version);
+		} else {
+			plugin->loaded->retired = 1;
+			if (plugin->loaded->inflight == 0) {
+				drained = plugin->loaded;
+			}
+			plugin->loaded = l;
+		}
+	}
+	l = plugin->loaded;
+	l->inflight++;
+	pthread_mutex_unlock(&plugin->lock);
+
+	if (drained) {
+		s_unload(plugin, drained);
+	}
+
+	rc = l->handler(prefix, req, l->data);
+
+	/* the last request out of a retired version turns off the lights */
+	pthread_mutex_lock(&plugin->lock);
+	drained = --l->inflight == 0 && l->retired ? l : NULL;
+	pthread_mutex_unlock(&plugin->lock);
+
+	if (drained) {
+		s_unload(plugin, drained);
+	}
+	return rc;
+}
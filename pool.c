@@ -0,0 +1,401 @@
+#include "./gemini.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <spawn.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+struct _worker {
+	pid_t pid;  /* process id of the worker */
+	int   fd;   /* our end of the socket pair */
+	int   busy; /* non-zero while handling a request */
+
+	char   buf[GEMINI_STREAM_BLOCK_SIZE]; /* read buffer, for framing */
+	size_t off, len;
+};
+
+static void s_reap(struct _worker *w) {
+	if (w->fd >= 0) {
+		close(w->fd); /* well-behaved workers exit on EOF */
+		w->fd = -1;
+	}
+	if (w->pid > 0) {
+		kill(w->pid, SIGKILL);
+		waitpid(w->pid, NULL, 0);
+		w->pid = -1;
+	}
+	w->off = w->len = 0;
+}
+
+static int s_spawn(struct gemini_pool *pool, struct _worker *w) {
+	posix_spawn_file_actions_t fa;
+	char *argv[2];
+	int sv[2], rc;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+		return -1;
+	}
+
+	/* the worker talks to us over its standard input and output,
+	   which are both the far end of the socket pair. */
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, sv[1], 0);
+	posix_spawn_file_actions_adddup2(&fa, sv[1], 1);
+
+	argv[0] = pool->program;
+	argv[1] = NULL;
+	rc = posix_spawn(&w->pid, pool->program, &fa, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&fa);
+	close(sv[1]);
+
+	if (rc != 0) {
+		fprintf(stderr, "[gemini_pool] unable to spawn %s: %s (error %d)\n", pool->program, strerror(rc), rc);
+		close(sv[0]);
+		w->pid = -1;
+		w->fd  = -1;
+		return -1;
+	}
+
+	w->fd  = sv[0];
+	w->off = w->len = 0;
+	return 0;
+}
+
+/* Something went wrong with this worker; put it out of its misery and
+   start up a replacement. */
+static void s_respawn(struct gemini_pool *pool, struct _worker *w) {
+	s_reap(w);
+	if (s_spawn(pool, w) != 0) {
+		fprintf(stderr, "[gemini_pool] unable to respawn worker for %s\n", pool->program);
+	}
+}
+
+static long s_ms_left(const struct timespec *deadline) {
+	struct timespec now;
+	long ms;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	ms = (deadline->tv_sec - now.tv_sec) * 1000
+	   + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+	return ms > 0 ? ms : 0;
+}
+
+/* Read at least one more octet into the worker's buffer, waiting no
+   longer than the deadline.  Returns 0 on success, -1 on error / EOF, and
+   -2 if we ran out of time. */
+static int s_fill(struct _worker *w, const struct timespec *deadline) {
+	struct pollfd pfd;
+	ssize_t n;
+	int rc;
+
+	if (w->off > 0) {
+		memmove(w->buf, w->buf + w->off, w->len - w->off);
+		w->len -= w->off;
+		w->off  = 0;
+	}
+	if (w->len == sizeof(w->buf)) {
+		return -1;
+	}
+
+	pfd.fd     = w->fd;
+	pfd.events = POLLIN;
+	do {
+		rc = poll(&pfd, 1, s_ms_left(deadline));
+	} while (rc < 0 && errno == EINTR);
+	if (rc == 0) return -2;
+	if (rc <  0) return -1;
+
+	n = read(w->fd, w->buf + w->len, sizeof(w->buf) - w->len);
+	if (n <= 0) {
+		return -1;
+	}
+	w->len += n;
+	return 0;
+}
+
+/* Read a netstring length prefix ("123:") from the worker. */
+static ssize_t s_length(struct _worker *w, const struct timespec *deadline) {
+	size_t len;
+	int rc;
+
+	for (len = 0;;) {
+		while (w->off == w->len) {
+			if ((rc = s_fill(w, deadline)) != 0) return rc;
+		}
+		if (w->buf[w->off] == ':') {
+			w->off++;
+			return len;
+		}
+		if (w->buf[w->off] < '0' || w->buf[w->off] > '9' || len > 0xffffff) {
+			return -1;
+		}
+		len = len * 10 + (w->buf[w->off++] - '0');
+	}
+}
+
+/* Frame up the request as a netstring of NUL-separated header names and
+   values, SCGI-style, and send it along to the worker. */
+static int s_request(struct _worker *w, const char *prefix, struct gemini_request *req) {
+	char frame[GEMINI_MAX_ENVIRON + 16], info[GEMINI_MAX_REQUEST];
+	const char *path;
+	char **env, **e, *p;
+	size_t len, off;
+	ssize_t n;
+
+	path = req->url->path + strlen(prefix);
+	snprintf(info, sizeof(info), "%.*s", (int)strcspn(path, "?"), path);
+	env = gemini_request_environ(req, prefix, info);
+	if (!env) {
+		return -1;
+	}
+
+	/* NAME=value becomes NAME\0value\0 */
+	for (len = 0, e = env; *e; e++) {
+		len += strlen(*e) + 1;
+	}
+	off = snprintf(frame, sizeof(frame), "%zu:", len);
+	for (e = env; *e; e++) {
+		n = strlen(*e) + 1;
+		memcpy(frame + off, *e, n);
+		p = memchr(frame + off, '=', n);
+		if (p) *p = '\0';
+		off += n;
+	}
+	frame[off++] = ',';
+
+	for (len = off, off = 0; off < len; off += n) {
+		n = send(w->fd, frame + off, len - off, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) { n = 0; continue; }
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Relay response chunks from the worker to the client, until we see the
+   empty chunk that terminates the response.  Returns 0 on success, -1 if
+   the worker misbehaved (or died), -2 on timeout, and -3 if the client
+   went away. */
+static int s_relay(struct _worker *w, struct gemini_request *req, const struct timespec *deadline, size_t *relayed) {
+	ssize_t chunk, len, skip;
+	size_t n;
+	int rc, head;
+
+	head = 1;
+	do {
+		chunk = len = s_length(w, deadline);
+		if (len < 0) {
+			return len;
+		}
+
+		/* a Cache-Control: line (see gemini_request_directives) has to
+		   come at the very start of the first chunk, all in one piece. */
+		if (head && len > 0) {
+			while (w->len - w->off < len && !(w->off == 0 && w->len == sizeof(w->buf))) {
+				if ((rc = s_fill(w, deadline)) != 0) return rc;
+			}
+			n = w->len - w->off;
+			skip = gemini_request_directives(req, w->buf + w->off, n < len ? n : len);
+			if (skip > 0) {
+				w->off += skip;
+				len    -= skip;
+			}
+			head = 0;
+		}
+
+		while (len > 0) {
+			while (w->off == w->len) {
+				if ((rc = s_fill(w, deadline)) != 0) return rc;
+			}
+			n = w->len - w->off;
+			if (n > len) n = len;
+			if (gemini_request_write(req, w->buf + w->off, n) < 0) {
+				return -3;
+			}
+			w->off   += n;
+			len      -= n;
+			*relayed += n;
+		}
+
+		while (w->off == w->len) {
+			if ((rc = s_fill(w, deadline)) != 0) return rc;
+		}
+		if (w->buf[w->off++] != ',') {
+			return -1;
+		}
+	} while (chunk > 0);
+
+	return 0;
+}
+
+static struct _worker * s_acquire(struct gemini_pool *pool, const struct timespec *deadline) {
+	struct _worker *w;
+	int i, rc;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->max_queue > 0 && pool->stats.queued >= pool->max_queue && pool->stats.busy == pool->n) {
+		pool->stats.rejected++;
+		pthread_mutex_unlock(&pool->lock);
+		return NULL;
+	}
+
+	pool->stats.queued++;
+	if (pool->stats.queued > pool->stats.max_queued) {
+		pool->stats.max_queued = pool->stats.queued;
+	}
+
+	for (;;) {
+		for (i = 0; i < pool->n; i++) {
+			w = &pool->workers[i];
+			if (!w->busy) {
+				w->busy = 1;
+				pool->stats.busy++;
+				pool->stats.queued--;
+				pthread_mutex_unlock(&pool->lock);
+				return w;
+			}
+		}
+
+		rc = pthread_cond_timedwait(&pool->idle, &pool->lock, deadline);
+		if (rc == ETIMEDOUT) {
+			pool->stats.queued--;
+			pool->stats.timeouts++;
+			pthread_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+	}
+}
+
+static void s_release(struct gemini_pool *pool, struct _worker *w) {
+	pthread_mutex_lock(&pool->lock);
+	w->busy = 0;
+	pool->stats.busy--;
+	pool->stats.requests++;
+	pthread_cond_signal(&pool->idle);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+struct gemini_pool * gemini_pool_new(const char *program, int workers, int timeout, unsigned int max_queue) {
+	struct gemini_pool *pool;
+
+	if (workers <= 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pool = calloc(1, sizeof(struct gemini_pool));
+	if (!pool) {
+		return NULL;
+	}
+
+	pool->program   = strdup(program);
+	pool->workers   = calloc(workers, sizeof(struct _worker));
+	pool->timeout   = timeout;
+	pool->max_queue = max_queue;
+	if (!pool->program || !pool->workers) {
+		free(pool->program);
+		free(pool->workers);
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+
+	for (pool->n = 0; pool->n < workers; pool->n++) {
+		if (s_spawn(pool, &pool->workers[pool->n]) != 0) {
+			pool->n++;
+			gemini_pool_free(pool);
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
+void gemini_pool_free(struct gemini_pool *pool) {
+	int i;
+
+	if (!pool) return;
+
+	for (i = 0; i < pool->n; i++) {
+		s_reap(&pool->workers[i]);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->idle);
+	free(pool->workers);
+	free(pool->program);
+	free(pool);
+}
+
+void gemini_pool_stats(struct gemini_pool *pool, struct gemini_pool_stats *stats) {
+	pthread_mutex_lock(&pool->lock);
+	memcpy(stats, &pool->stats, sizeof(struct gemini_pool_stats));
+	pthread_mutex_unlock(&pool->lock);
+}
+
+int gemini_pool_handler(const char *prefix, struct gemini_request *req, void *_pool) {
+	struct gemini_pool *pool;
+	struct _worker *w;
+	struct timespec deadline;
+	size_t relayed;
+	int rc;
+
+	pool = _pool;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += pool->timeout > 0 ? pool->timeout : GEMINI_POOL_TIMEOUT;
+
+	w = s_acquire(pool, &deadline);
+	if (!w) {
+		gemini_request_respond(req, 44, "30");
+		gemini_request_close(req);
+		return GEMINI_HANDLER_DONE;
+	}
+
+	if (w->fd < 0) {
+		s_respawn(pool, w); /* last attempt to respawn didn't take */
+	}
+
+	relayed = 0;
+	rc = w->fd < 0 ? -1 : s_request(w, prefix, req);
+	if (rc == 0) {
+		rc = s_relay(w, req, &deadline, &relayed);
+	}
+
+	if (rc == -1 || rc == -2) {
+		fprintf(stderr, "[gemini_pool] worker %d for %s %s; respawning\n",
+			(int)w->pid, pool->program, rc == -2 ? "timed out" : "failed");
+		pthread_mutex_lock(&pool->lock);
+		if (rc == -2) pool->stats.timeouts++;
+		else          pool->stats.crashes++;
+		pthread_mutex_unlock(&pool->lock);
+		s_respawn(pool, w);
+
+	} else if (rc == -3) {
+		/* the client hung up mid-response; the worker is still going to
+		   finish sending it to us, and we can't resynchronize with it
+		   cheaply, so we'll just start over. */
+		s_respawn(pool, w);
+	}
+	s_release(pool, w);
+
+	if (rc != 0) {
+		req->maxage = 0; /* don't cache half a response */
+	}
+	if (rc != 0 && relayed == 0) {
+		gemini_request_respond(req, 42, "CGI Error");
+	}
+	gemini_request_close(req);
+	return GEMINI_HANDLER_DONE;
+}
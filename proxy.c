@@ -0,0 +1,377 @@
+#include "./gemini.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+struct _upstream {
+	char              *name; /* as given, for stats and health checks */
+	struct gemini_url *url;
+
+	unsigned int fails; /* requests failed in a row */
+	time_t       out;   /* out of rotation until then */
+	int          down;  /* the health check says it isn't answering */
+
+	struct gemini_proxy_stats stats;
+};
+
+struct _point {
+	uint32_t hash;
+	int      upstream;
+};
+
+/* FNV-1a, finished off with MurmurHash3's mixer; on its own, FNV leaves
+   strings that only differ at the end (like doc1 and doc2, or the points
+   for one upstream) bunched up together on the ring. */
+static uint32_t s_hash(const char *s) {
+	uint32_t h;
+
+	for (h = 2166136261u; *s; s++) {
+		h = (h ^ (unsigned char)*s) * 16777619u;
+	}
+	h ^= h >> 16; h *= 0x85ebca6bu;
+	h ^= h >> 13; h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return h;
+}
+
+static int s_cmp(const void *_a, const void *_b) {
+	const struct _point *a = _a, *b = _b;
+
+	return a->hash < b->hash ? -1 : a->hash > b->hash;
+}
+
+static int s_up(struct _upstream *u, time_t now) {
+	return !u->down && u->out <= now;
+}
+
+/* Should upstream i be picked for this attempt?  On the first pass, only
+   if it is in rotation; on the second, so long as it hasn't been tried. */
+static int s_candidate(struct gemini_proxy *proxy, int i, const char *tried, int pass, time_t now) {
+	return !tried[i] && (pass > 0 || s_up(&proxy->upstreams[i], now));
+}
+
+/* Pick an upstream that hasn't been tried yet, for key (the request path
+   past the prefix).  Returns -1 once they all have been.  Called with the
+   lock held. */
+static int s_pick(struct gemini_proxy *proxy, const char *key, const char *tried) {
+	unsigned int i, k, lo, hi, n;
+	uint32_t h;
+	time_t now;
+	int pass, best;
+
+	now = time(NULL);
+	for (pass = 0; pass < 2; pass++) {
+		best = -1;
+		if (proxy->balance == GEMINI_PROXY_HASH) {
+			/* the first point on the ring at or after the key's hash */
+			n = proxy->n * GEMINI_PROXY_VNODES;
+			h = s_hash(key);
+			for (lo = 0, hi = n; lo < hi; ) {
+				k = (lo + hi) / 2;
+				if (proxy->ring[k].hash < h) lo = k + 1;
+				else                         hi = k;
+			}
+			for (i = 0; i < n && best < 0; i++) {
+				k = proxy->ring[(lo + i) % n].upstream;
+				if (s_candidate(proxy, k, tried, pass, now)) {
+					best = k;
+				}
+			}
+
+		} else {
+			/* ties go to whoever is next in line, so that an idle
+			   proxy still spreads its requests around */
+			for (i = 0; i < proxy->n; i++) {
+				k = (proxy->next + i) % proxy->n;
+				if (s_candidate(proxy, k, tried, pass, now)
+				 && (best < 0 || proxy->upstreams[k].stats.inflight < proxy->upstreams[best].stats.inflight)) {
+					best = k;
+				}
+			}
+			proxy->next++;
+		}
+		if (best >= 0) {
+			return best;
+		}
+	}
+	return -1;
+}
+
+/* Tally up how a request to u went, once it is over; ms is how long the
+   response took to start. */
+static void s_answered(struct gemini_proxy *proxy, struct _upstream *u, int ok, long ms) {
+	pthread_mutex_lock(&proxy->lock);
+	if (ok) {
+		u->fails = 0;
+		u->stats.latency = u->stats.latency ? (u->stats.latency * 7 + ms) / 8 : ms;
+		if (ms > u->stats.max_latency) {
+			u->stats.max_latency = ms;
+		}
+
+	} else {
+		u->stats.failures++;
+		if (++u->fails >= GEMINI_PROXY_FAILS) {
+			fprintf(stderr, "[gemini_proxy] %s failed %u requests in a row; out of rotation for %ds\n",
+				u->name, u->fails, GEMINI_PROXY_EJECT);
+			u->fails = 0;
+			u->out = time(NULL) + GEMINI_PROXY_EJECT;
+			u->stats.ejections++;
+		}
+	}
+	pthread_mutex_unlock(&proxy->lock);
+}
+
+/* Point the rest of the request (past the prefix) at upstream u. */
+static int s_url(char *buf, size_t size, struct gemini_url *u, const char *rest) {
+	const char *base;
+	size_t len;
+	int n;
+
+	base = u->path ? u->path : "";
+	for (len = strlen(base); len > 0 && base[len - 1] == '/'; len--)
+		;
+	n = snprintf(buf, size, "gemini://%s:%u%.*s%s%s",
+		u->host, u->port, (int)len, base, *rest == '/' ? "" : "/", rest);
+	return n < 0 || (size_t)n >= size ? -1 : 0;
+}
+
+/* Ask each upstream for its own URL, every so often, until told to stop. */
+static void * s_checker(void *_proxy) {
+	struct gemini_proxy *proxy;
+	struct gemini_response *res;
+	struct _upstream *u;
+	struct timespec ts;
+	int i, ok;
+
+	proxy = _proxy;
+	for (;;) {
+		pthread_mutex_lock(&proxy->lock);
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += proxy->check;
+		while (!proxy->stopping && pthread_cond_timedwait(&proxy->stop, &proxy->lock, &ts) != ETIMEDOUT)
+			;
+		if (proxy->stopping) {
+			pthread_mutex_unlock(&proxy->lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&proxy->lock);
+
+		for (i = 0; i < proxy->n; i++) {
+			u = &proxy->upstreams[i];
+			res = gemini_client_request(&proxy->client, u->name);
+			ok = res && gemini_response_header(res) == 0;
+			if (res) {
+				gemini_response_close(res);
+				free(res);
+			}
+
+			pthread_mutex_lock(&proxy->lock);
+			if (ok && (u->down || u->out > time(NULL))) {
+				fprintf(stderr, "[gemini_proxy] %s is answering again; back in rotation\n", u->name);
+				u->down = 0;
+				u->out = 0;
+				u->fails = 0;
+			} else if (!ok && !u->down) {
+				fprintf(stderr, "[gemini_proxy] %s failed its health check; out of rotation\n", u->name);
+				u->down = 1;
+				u->stats.ejections++;
+			}
+			pthread_mutex_unlock(&proxy->lock);
+		}
+	}
+}
+
+struct gemini_proxy * gemini_proxy_new(const char **upstreams, int n, int balance, int check) {
+	struct gemini_proxy *proxy;
+	char vnode[GEMINI_MAX_REQUEST + 16];
+	int i, v;
+
+	if (n < 1) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	proxy = calloc(1, sizeof(struct gemini_proxy));
+	if (!proxy) {
+		return NULL;
+	}
+	pthread_mutex_init(&proxy->lock, NULL);
+	pthread_cond_init(&proxy->stop, NULL);
+	proxy->balance = balance;
+	proxy->check   = check;
+	proxy->stall   = GEMINI_PROXY_STALL;
+
+	proxy->upstreams = calloc(n, sizeof(struct _upstream));
+	proxy->ring      = calloc(n * GEMINI_PROXY_VNODES, sizeof(struct _point));
+	if (!proxy->upstreams || !proxy->ring) {
+		goto fail;
+	}
+
+	for (i = 0; i < n; i++) {
+		proxy->upstreams[i].url = gemini_parse_url(upstreams[i]);
+		if (!proxy->upstreams[i].url) {
+			fprintf(stderr, "[gemini_proxy] %s is not a valid gemini:// URL\n", upstreams[i]);
+			errno = EINVAL;
+			goto fail;
+		}
+		proxy->upstreams[i].name = strdup(upstreams[i]);
+		proxy->upstreams[i].stats.upstream = proxy->upstreams[i].name;
+		proxy->n = i + 1;
+
+		for (v = 0; v < GEMINI_PROXY_VNODES; v++) {
+			snprintf(vnode, sizeof(vnode), "%s#%d", upstreams[i], v);
+			proxy->ring[i * GEMINI_PROXY_VNODES + v].hash     = s_hash(vnode);
+			proxy->ring[i * GEMINI_PROXY_VNODES + v].upstream = i;
+		}
+	}
+	qsort(proxy->ring, n * GEMINI_PROXY_VNODES, sizeof(struct _point), s_cmp);
+
+	if (gemini_client_tls(&proxy->client, NULL, NULL) != 0
+	 || gemini_client_sessions(&proxy->client, 0, 0) != 0
+	 || gemini_client_resolver(&proxy->client, 0, 0, 0) != 0) {
+		goto fail;
+	}
+
+	if (check > 0 && pthread_create(&proxy->checker, NULL, s_checker, proxy) != 0) {
+		goto fail;
+	}
+	return proxy;
+
+fail:
+	proxy->check = 0; /* no checker to stop */
+	gemini_proxy_free(proxy);
+	return NULL;
+}
+
+void gemini_proxy_stats(struct gemini_proxy *proxy, int i, struct gemini_proxy_stats *stats) {
+	pthread_mutex_lock(&proxy->lock);
+	memcpy(stats, &proxy->upstreams[i].stats, sizeof(struct gemini_proxy_stats));
+	stats->up = s_up(&proxy->upstreams[i], time(NULL));
+	pthread_mutex_unlock(&proxy->lock);
+}
+
+void gemini_proxy_free(struct gemini_proxy *proxy) {
+	int i;
+
+	if (!proxy) return;
+
+	if (proxy->check > 0) {
+		pthread_mutex_lock(&proxy->lock);
+		proxy->stopping = 1;
+		pthread_cond_signal(&proxy->stop);
+		pthread_mutex_unlock(&proxy->lock);
+		pthread_join(proxy->checker, NULL);
+	}
+
+	gemini_client_close(&proxy->client);
+	for (i = 0; proxy->upstreams && i < proxy->n; i++) {
+		free(proxy->upstreams[i].name);
+		free(proxy->upstreams[i].url);
+	}
+	free(proxy->upstreams);
+	free(proxy->ring);
+	pthread_cond_destroy(&proxy->stop);
+	pthread_mutex_destroy(&proxy->lock);
+	free(proxy);
+}
+
+int gemini_proxy_handler(const char *prefix, struct gemini_request *req, void *_proxy) {
+	struct gemini_proxy *proxy;
+	struct gemini_response *res;
+	struct _upstream *u;
+	const char *rest;
+	char *tried, *url, *buf;
+	struct timeval tv;
+	ssize_t n;
+	long start, ms;
+	int i, ok;
+
+	proxy = _proxy;
+	rest  = req->url->path + strlen(prefix);
+	tried = gemini_request_alloc(req, proxy->n);
+	url   = gemini_request_alloc(req, GEMINI_MAX_REQUEST + 1);
+	buf   = gemini_request_alloc(req, GEMINI_TLS_RECORD_MAX);
+	if (!tried || !url || !buf) {
+		return GEMINI_HANDLER_ABORT;
+	}
+	memset(tried, 0, proxy->n);
+
+	for (;;) {
+		pthread_mutex_lock(&proxy->lock);
+		i = s_pick(proxy, rest, tried);
+		if (i >= 0) {
+			u = &proxy->upstreams[i];
+			u->stats.requests++;
+			u->stats.inflight++;
+		}
+		pthread_mutex_unlock(&proxy->lock);
+		if (i < 0) {
+			break; /* every last one of them failed */
+		}
+		tried[i] = 1;
+
+		if (s_url(url, GEMINI_MAX_REQUEST + 1, u->url, rest) != 0) {
+			gemini_request_respond(req, 59, "Request Too Long");
+			gemini_request_close(req);
+			pthread_mutex_lock(&proxy->lock);
+			u->stats.inflight--;
+			pthread_mutex_unlock(&proxy->lock);
+			return GEMINI_HANDLER_DONE;
+		}
+
+		start = gemini_now_ms();
+		res = gemini_client_request(&proxy->client, url);
+		ok = res && gemini_response_header(res) == 0;
+		ms = gemini_now_ms() - start;
+		if (!ok) {
+			s_answered(proxy, u, 0, ms);
+		}
+
+		if (ok) {
+			/* pass the body along as it comes, so long as the
+			   upstream doesn't go quiet on us partway through */
+			tv.tv_sec  = proxy->stall / 1000;
+			tv.tv_usec = proxy->stall % 1000 * 1000;
+			setsockopt(res->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+			gemini_request_respond(req, res->status, res->meta);
+			res->eager = 1;
+			while ((n = gemini_response_read(res, buf, GEMINI_TLS_RECORD_MAX)) > 0) {
+				if (gemini_request_write(req, buf, n) < 0) {
+					break; /* the client has gone away */
+				}
+			}
+			if (n != 0) {
+				req->maxage = 0; /* don't cache half a response */
+			}
+			if (n < 0) {
+				fprintf(stderr, "[gemini_proxy] %s stopped sending partway through a response\n", u->name);
+			}
+			s_answered(proxy, u, n >= 0, ms);
+		}
+		if (res) {
+			gemini_response_close(res);
+			free(res);
+		}
+
+		pthread_mutex_lock(&proxy->lock);
+		u->stats.inflight--;
+		pthread_mutex_unlock(&proxy->lock);
+
+		if (ok) {
+			gemini_request_close(req);
+			return GEMINI_HANDLER_DONE;
+		}
+	}
+
+	req->maxage = 0;
+	gemini_request_respond(req, 43, "Proxy Error");
+	gemini_request_close(req);
+	return GEMINI_HANDLER_DONE;
+}
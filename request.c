@@ -1,11 +1,186 @@
 #include "./gemini.h"
 
+#include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <netdb.h>
+
+#include <openssl/x509.h>
+#include <openssl/evp.h>
+#include <openssl/err.h>
+
+/* Request-scoped memory comes out of a chain of blocks; the newest (and
+   the one being carved up) is first. */
+struct _arena {
+	struct _arena *next;
+	size_t         size; /* how big data is, in octets */
+	size_t         used; /* how much of it has been handed out */
+	max_align_t    data[];
+};
+
+#define ALIGN(n) (((n) + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1))
+
+static struct _arena * s_block(size_t size) {
+	struct _arena *a;
+
+	a = malloc(sizeof(struct _arena) + size);
+	if (!a) {
+		return NULL;
+	}
+	a->next = NULL;
+	a->size = size;
+	a->used = 0;
+	return a;
+}
+
+void * gemini_request_alloc(struct gemini_request *req, size_t n) {
+	struct _arena *a;
+	void *p;
+
+	n = ALIGN(n ? n : 1);
+	a = req->arena;
+	if (!a || a->size - a->used < n) {
+		a = s_block(n > GEMINI_ARENA_BLOCK ? n : GEMINI_ARENA_BLOCK);
+		if (!a) {
+			return NULL;
+		}
+
+		/* keep carving up whichever block has more room left */
+		if (req->arena && a->size - n < req->arena->size - req->arena->used) {
+			a->next = req->arena->next;
+			req->arena->next = a;
+		} else {
+			a->next = req->arena;
+			req->arena = a;
+		}
+	}
+
+	p = (char *)a->data + a->used;
+	a->used += n;
+	return p;
+}
+
+/* Get the arena ready for the next request.  If one block was enough, we
+   just start it over; otherwise, the blocks are replaced by a single one
+   as big as all of them, so that a request like this one won't need more
+   than one, next time.  Either way, nothing past GEMINI_ARENA_MAX is
+   kept. */
+static void s_reset(struct gemini_request *req) {
+	struct _arena *a, *next;
+	size_t total;
+
+	if (!req->arena) {
+		return;
+	}
+	if (!req->arena->next) {
+		req->arena->used = 0;
+		if (req->arena->size > GEMINI_ARENA_MAX) {
+			free(req->arena);
+			req->arena = NULL;
+		}
+		return;
+	}
+
+	for (total = 0, a = req->arena; a; a = next) {
+		next = a->next;
+		total += a->size;
+		free(a);
+	}
+	req->arena = total <= GEMINI_ARENA_MAX ? s_block(total) : NULL;
+}
+
+int gemini_request_url(struct gemini_request *req, const char *s) {
+	struct gemini_url *url;
+	size_t len;
+	int rc;
+
+	len = strlen(s) + 1;
+	url = gemini_request_alloc(req, sizeof(struct gemini_url) + len);
+	if (!url) {
+		return -1;
+	}
+	url->len = len;
+
+	rc = gemini_parse_url_into(s, url);
+	req->url = rc == 0 ? url : NULL;
+	return rc;
+}
+
+static int s_out(struct gemini_request *req) {
+	if (!req->out) {
+		req->out = malloc(GEMINI_TLS_RECORD_MAX);
+	}
+	return req->out ? 0 : -1;
+}
+
+static int s_flush(struct gemini_request *req) {
+	size_t off, nwrit;
+
+	if (!req->ssl) {
+		req->outlen = 0; /* detached; the tap already has it */
+		return 0;
+	}
+
+	for (off = 0; off < req->outlen; off += nwrit) {
+		if (SSL_write_ex(req->ssl, req->out + off, req->outlen - off, &nwrit) != 1) {
+			req->outlen = 0;
+			req->maxage = 0; /* a partial response is no good to anyone */
+			return -1;
+		}
+		req->sent += nwrit;
+	}
+
+	req->outlen = 0;
+	return 0;
+}
+
+/* Hand up to n octets to TLS, returning how many were consumed.  If there
+   is pending (buffered) output, we top it off with as much of buf as will
+   fit, and send it all as a single record, instead of two; while corked,
+   we don't send anything until the buffer is full. */
+static ssize_t s_send(struct gemini_request *req, const char *buf, size_t n) {
+	size_t nwrit;
+
+	if (!req->ssl) {
+		if (req->tap) req->tap(req->tapdata, buf, n);
+		return n;
+	}
+
+	if (req->outlen == 0 && !req->corked) {
+		if (SSL_write_ex(req->ssl, buf, n, &nwrit) != 1) {
+			req->maxage = 0;
+			return -1;
+		}
+		if (req->tap) req->tap(req->tapdata, buf, nwrit);
+		req->sent += nwrit;
+		return nwrit;
+	}
+
+	if (n > GEMINI_TLS_RECORD_MAX - req->outlen) {
+		n = GEMINI_TLS_RECORD_MAX - req->outlen;
+	}
+	memcpy(req->out + req->outlen, buf, n);
+	req->outlen += n;
+	if (req->tap) req->tap(req->tapdata, buf, n);
+
+	if (req->corked && req->outlen < GEMINI_TLS_RECORD_MAX) {
+		return n;
+	}
+	return s_flush(req) == 0 ? n : -1;
+}
 
 int gemini_request_respond(struct gemini_request *req, int status, const char *meta) {
 	char buf[GEMINI_MAX_RESPONSE];
+	size_t n;
 	memset(buf, 0, sizeof(buf));
 
 	buf[0] = '0' + status / 10 % 10;
@@ -16,61 +191,147 @@ int gemini_request_respond(struct gemini_request *req, int status, const char *m
 	                                 - 2 /*   \r\n   */
 	                                 - 1 /*   \0     */);
 	strcat(buf, "\r\n");
+	n = strlen(buf);
 
-	return gemini_request_write(req, buf, strlen(buf));
+	/* hold on to the status line, so it can go out with the first bit of
+	   the body, or when the request is closed, whichever comes first. */
+	if (s_out(req) != 0 || req->outlen + n > GEMINI_TLS_RECORD_MAX) {
+		return gemini_request_write(req, buf, n);
+	}
+	memcpy(req->out + req->outlen, buf, n);
+	req->outlen += n;
+	if (req->tap) req->tap(req->tapdata, buf, n);
+	return n;
 }
 
 ssize_t gemini_request_write(struct gemini_request *req, const void *buf, size_t n) {
-	int rc;
-	size_t ntotal, nwrit;
+	const char *p;
+	size_t ntotal;
+	ssize_t nwrit;
 
 	ntotal = 0;
-	while (n > 0) {
-		rc = SSL_write_ex(req->ssl, buf, n, &nwrit);
-		if (rc == 0) {
+	for (p = buf; n > 0; p += nwrit, n -= nwrit) {
+		nwrit = s_send(req, p, n);
+		if (nwrit < 0) {
 			return -1;
 		}
-		n -= nwrit;
-		buf += n;
 		ntotal += nwrit;
 	}
 
 	return ntotal;
 }
 
-int gemini_request_stream(struct gemini_request *req, int fd, size_t block) {
-	char *buf;
-	ssize_t n, nread, nwrit;
+void gemini_request_cork(struct gemini_request *req) {
+	if (s_out(req) == 0) {
+		req->corked = 1;
+	}
+}
+
+int gemini_request_uncork(struct gemini_request *req) {
+	req->corked = 0;
+	return req->outlen > 0 ? s_flush(req) : 0;
+}
 
-	buf = malloc(block);
-	if (!buf) {
+/* How big should the next TLS record be?  Small ones until the response is
+   well underway, then as big as the protocol allows. */
+static size_t s_record(struct gemini_request *req) {
+	return req->sent < GEMINI_TLS_RAMP ? GEMINI_TLS_RECORD_SMALL
+	                                   : GEMINI_TLS_RECORD_MAX;
+}
+
+static int s_ring(struct gemini_request *req, size_t block) {
+	char *ring;
+
+	if (block < 2 * GEMINI_TLS_RECORD_MAX) {
+		block = 2 * GEMINI_TLS_RECORD_MAX;
+	}
+	if (req->ring && req->ringsize >= block) {
+		return 0;
+	}
+
+	ring = realloc(req->ring, block);
+	if (!ring) {
 		return -1;
 	}
+	req->ring     = ring;
+	req->ringsize = block;
+	return 0;
+}
 
-	n = 0;
-	while ((nread = read(fd, buf+n, block-n)) > 0) {
-		n += nread;
-		nwrit = gemini_request_write(req, buf, n);
-		if (nwrit < 0) return nwrit;
-		memmove(buf, buf+nwrit, n-nwrit);
-		n -= nwrit;
+static void s_advise(int fd) {
+	struct stat st;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= GEMINI_STREAM_FADVISE_MIN) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 	}
-	if (nread < 0) return nread;
-	while (n > 0) {
-		nwrit = gemini_request_write(req, buf, n);
-		if (nwrit < 0) return nwrit;
-		memmove(buf, buf+nwrit, n-nwrit);
-		n -= nwrit;
+}
+
+int gemini_request_stream(struct gemini_request *req, int fd, size_t block) {
+	size_t size, head, tail, len, want;
+	ssize_t nread, nwrit;
+	int eof;
+
+	if (s_ring(req, block) != 0) {
+		return -1;
+	}
+	s_advise(fd);
+
+	/* the ring holds len octets, starting at tail; we read into the free
+	   space after them, and send from tail, one TLS record at a time. */
+	size = req->ringsize;
+	tail = len = 0;
+	eof  = 0;
+
+	while (!eof || len > 0) {
+		if (!eof && len < size) {
+			head = (tail + len) % size;
+			want = head < tail ? tail - head : size - head;
+
+			nread = read(fd, req->ring + head, want);
+			if (nread < 0) {
+				if (errno == EINTR) continue;
+				return -1;
+			}
+			if (nread == 0) eof = 1;
+			len += nread;
+		}
+
+		/* hold off on partial records until we either run out of input or
+		   run out of room to read more of it. */
+		while (len > 0 && (len >= s_record(req) || len == size || eof)) {
+			want = s_record(req);
+			if (want > len)         want = len;
+			if (want > size - tail) want = size - tail;
+
+			nwrit = s_send(req, req->ring + tail, want);
+			if (nwrit < 0) {
+				return -1;
+			}
+			tail = (tail + nwrit) % size;
+			len -= nwrit;
+		}
 	}
 
-	free(buf);
 	return 0;
 }
 
 void gemini_request_close(struct gemini_request *req) {
+	if (req->ssl && gemini_request_uncork(req) != 0) {
+		fprintf(stderr, "[gemini_request] unable to flush buffered response\n");
+	}
+	req->corked = 0;
+	req->outlen = 0;
+
 	if (req->ssl) {
 		SSL_shutdown(req->ssl);
-		SSL_free(req->ssl);
+
+		/* keep one handle around for the next connection */
+		if (!req->spare && SSL_clear(req->ssl) == 1) {
+			req->spare = req->ssl;
+		} else {
+			SSL_free(req->ssl);
+		}
+		ERR_clear_error();
 		req->ssl = NULL;
 	}
 
@@ -79,8 +340,210 @@ void gemini_request_close(struct gemini_request *req) {
 		req->fd = -1;
 	}
 
-	if (req->url) {
-		free(req->url);
-		req->url = NULL;
+	req->url  = NULL;
+	req->sent = 0;
+	s_reset(req);
+}
+
+void gemini_request_key(struct gemini_request *req, char *key, size_t n, int per_cert) {
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int i, mdlen;
+	size_t len;
+
+	len = snprintf(key, n, "%s:%u%s", req->url->host, req->url->port, req->url->path);
+	if (!per_cert || len >= n) {
+		return;
+	}
+
+	if (!req->cert || X509_digest(req->cert, EVP_sha256(), md, &mdlen) != 1) {
+		snprintf(key + len, n - len, "#-");
+		return;
+	}
+	len += snprintf(key + len, n - len, "#");
+	for (i = 0; i < mdlen && len < n; i++) {
+		len += snprintf(key + len, n - len, "%02x", md[i]);
+	}
+}
+
+#define DIRECTIVE "Cache-Control:"
+
+static int s_directive(const char *d, size_t n, const char *name, int *value) {
+	size_t len;
+
+	len = strlen(name);
+	if (n < len || strncasecmp(d, name, len) != 0) {
+		return 0;
+	}
+	if (n == len) {
+		*value = 0;
+		return 1;
+	}
+	if (d[len] != '=') {
+		return 0;
+	}
+	*value = atoi(d + len + 1);
+	if (*value < 0) *value = 0;
+	return 1;
+}
+
+ssize_t gemini_request_directives(struct gemini_request *req, const char *buf, size_t n) {
+	const char *eol, *p, *d;
+	size_t len;
+	int v;
+
+	len = sizeof(DIRECTIVE) - 1;
+	if (strncasecmp(buf, DIRECTIVE, n < len ? n : len) != 0) {
+		return 0;
+	}
+	eol = memchr(buf, '\n', n);
+	if (n < len || !eol) {
+		return -1;
+	}
+
+	for (p = buf + len; p < eol; p = d + len) {
+		while (p < eol && (*p == ' ' || *p == '\t' || *p == ',' || *p == '\r')) p++;
+		for (d = p, len = 0; d + len < eol && d[len] != ',' && d[len] != '\r'; len++)
+			;
+		while (len > 0 && (d[len-1] == ' ' || d[len-1] == '\t')) len--;
+
+		if (s_directive(d, len, "no-store", &v)) {
+			req->maxage = 0;
+		} else if (s_directive(d, len, "max-age", &v)) {
+			if (req->maxage != 0) req->maxage = v;
+		} else if (s_directive(d, len, "stale-while-revalidate", &v)) {
+			req->stale = v;
+		}
+		/* anything else, we don't understand, and ignore */
+	}
+
+	return eol - buf + 1;
+}
+
+int gemini_request_init(struct gemini_request *req, SSL_CTX *ctx) {
+	memset(req, 0, sizeof(*req));
+	req->fd = -1;
+	if (!ctx) {
+		return 0;
+	}
+
+	req->spare = SSL_new(ctx);
+	if (!req->spare || s_out(req) != 0 || !gemini_request_alloc(req, 1)) {
+		return -1;
+	}
+	s_reset(req);
+	return 0;
+}
+
+void gemini_request_release(struct gemini_request *req) {
+	struct _arena *a;
+
+	SSL_free(req->spare);
+	req->spare = NULL;
+
+	free(req->out);
+	req->out = NULL;
+
+	free(req->ring);
+	req->ring     = NULL;
+	req->ringsize = 0;
+
+	while (req->arena) {
+		a = req->arena->next;
+		free(req->arena);
+		req->arena = a;
+	}
+}
+
+/* An environment block is a single (request-scoped) allocation: a
+   NULL-terminated array of pointers, followed by the "KEY=value" strings
+   they point to. */
+#define ENVIRON_SLOTS 32
+
+struct _environ {
+	char  **env;
+	size_t  n;
+	char   *buf;
+	size_t  len;
+};
+
+static int s_setenv(struct _environ *e, const char *k, const char *v) {
+	size_t lk, lv;
+	char *p;
+
+	lk = strlen(k);
+	lv = strlen(v);
+	if (e->n + 1 >= ENVIRON_SLOTS || e->len + lk + lv + 2 > GEMINI_MAX_ENVIRON) {
+		return -1;
+	}
+
+	p = e->buf + e->len;
+	memcpy(p, k, lk);
+	p[lk] = '=';
+	memcpy(p + lk + 1, v, lv + 1);
+	e->len += lk + lv + 2;
+
+	e->env[e->n++] = p;
+	e->env[e->n] = NULL;
+	return 0;
+}
+
+char ** gemini_request_environ(struct gemini_request *req, const char *script, const char *info) {
+	char url[GEMINI_MAX_REQUEST + 64], port[8], addr[NI_MAXHOST], hash[2 * EVP_MAX_MD_SIZE + 8];
+	char cn[256], subject[512], *query;
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int i, mdlen;
+	struct sockaddr_storage sa;
+	socklen_t salen;
+	struct _environ e;
+	X509_NAME *name;
+	int rc;
+
+	e.env = gemini_request_alloc(req, ENVIRON_SLOTS * sizeof(char *) + GEMINI_MAX_ENVIRON);
+	if (!e.env) {
+		return NULL;
 	}
+	e.buf = (char *)(e.env + ENVIRON_SLOTS);
+	e.n = e.len = 0;
+	e.env[0] = NULL;
+
+	query = strchr(req->url->path, '?');
+	snprintf(url,  sizeof(url),  "gemini://%s:%d%s", req->url->host, req->url->port, req->url->path);
+	snprintf(port, sizeof(port), "%d", req->url->port);
+
+	rc = s_setenv(&e, "GATEWAY_INTERFACE", "CGI/1.1")
+	   | s_setenv(&e, "SERVER_PROTOCOL",   "GEMINI")
+	   | s_setenv(&e, "SERVER_SOFTWARE",   "geminon")
+	   | s_setenv(&e, "SERVER_NAME",       req->url->host)
+	   | s_setenv(&e, "SERVER_PORT",       port)
+	   | s_setenv(&e, "GEMINI_URL",        url)
+	   | s_setenv(&e, "SCRIPT_NAME",       script)
+	   | s_setenv(&e, "PATH_INFO",         info)
+	   | s_setenv(&e, "QUERY_STRING",      query ? query + 1 : "");
+
+	salen = sizeof(sa);
+	if (getpeername(req->fd, (struct sockaddr *)&sa, &salen) == 0
+	 && getnameinfo((struct sockaddr *)&sa, salen, addr, sizeof(addr), NULL, 0, NI_NUMERICHOST) == 0) {
+		rc |= s_setenv(&e, "REMOTE_ADDR", addr)
+		    | s_setenv(&e, "REMOTE_HOST", addr);
+	}
+
+	if (req->cert && X509_digest(req->cert, EVP_sha256(), md, &mdlen) == 1) {
+		memcpy(hash, "SHA256:", 7);
+		for (i = 0; i < mdlen; i++) {
+			snprintf(hash + 7 + 2 * i, 3, "%02X", md[i]);
+		}
+
+		name = X509_get_subject_name(req->cert);
+		X509_NAME_oneline(name, subject, sizeof(subject));
+		if (X509_NAME_get_text_by_NID(name, NID_commonName, cn, sizeof(cn)) < 0) {
+			cn[0] = '\0';
+		}
+
+		rc |= s_setenv(&e, "AUTH_TYPE",          "CERTIFICATE")
+		    | s_setenv(&e, "TLS_CLIENT_HASH",    hash)
+		    | s_setenv(&e, "TLS_CLIENT_SUBJECT", subject)
+		    | s_setenv(&e, "REMOTE_USER",        cn);
+	}
+
+	return rc == 0 ? e.env : NULL;
 }
@@ -0,0 +1,358 @@
+#include "./gemini.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <netinet/in.h>
+
+/* What we know about a name. */
+struct _resolved {
+	time_t expires;
+	int    error; /* getaddrinfo(3) error, for names that don't exist */
+	int    n;     /* how many addresses there are */
+	struct gemini_addr addrs[];
+};
+
+/* Someone waiting on an asynchronous lookup. */
+struct _waiter {
+	struct _waiter *next;
+
+	unsigned short     port;
+	gemini_resolved_fn fn;
+	void              *data;
+};
+
+/* An asynchronous lookup, and everyone waiting on it. */
+struct _lookup {
+	struct _lookup *next; /* in the queue */
+
+	char           *host;
+	struct _waiter *waiters;
+};
+
+static void s_port(struct gemini_addr *addr, unsigned short port) {
+	if (addr->sa.ss_family == AF_INET6) {
+		((struct sockaddr_in6 *)&addr->sa)->sin6_port = htons(port);
+	} else if (addr->sa.ss_family == AF_INET) {
+		((struct sockaddr_in *)&addr->sa)->sin_port = htons(port);
+	}
+}
+
+/* Copy (at most max) cached addresses out, for a given port. */
+static int s_copy(struct _resolved *e, unsigned short port, struct gemini_addr *addrs, int max) {
+	int i;
+
+	for (i = 0; i < e->n && i < max; i++) {
+		memcpy(&addrs[i], &e->addrs[i], sizeof(struct gemini_addr));
+		s_port(&addrs[i], port);
+	}
+	return i;
+}
+
+static void s_sweep(const char *host, void *_e, void *_r) {
+	struct gemini_resolver *r;
+	struct _resolved *e;
+
+	r = _r;
+	e = _e;
+	if (time(NULL) >= e->expires) {
+		gemini_map_delete(&r->entries, host);
+		free(e);
+	}
+}
+
+/* Find a cached answer, if it is still good; called with the lock held. */
+static struct _resolved * s_cached(struct gemini_resolver *r, const char *host) {
+	struct _resolved *e;
+
+	e = gemini_map_get(&r->entries, host);
+	if (e && time(NULL) >= e->expires) {
+		gemini_map_delete(&r->entries, host);
+		free(e);
+		e = NULL;
+		r->stats.entries = r->entries.n;
+	}
+	if (e) {
+		r->stats.hits++;
+		if (e->n == 0) r->stats.negative++;
+	}
+	return e;
+}
+
+/* Ask getaddrinfo(3) about host, and (if r isn't NULL) remember what it
+   said.  Returns a freshly allocated answer, which the caller must free,
+   or NULL if we are out of memory. */
+static struct _resolved * s_lookup(struct gemini_resolver *r, const char *host) {
+	struct addrinfo hint, *info, *rp;
+	struct _resolved *e, *copy, *old;
+	int rc, n;
+
+	memset(&hint, 0, sizeof(hint));
+	hint.ai_family   = AF_UNSPEC;
+	hint.ai_socktype = SOCK_STREAM;
+
+	rc = (r && r->lookup ? r->lookup : getaddrinfo)(host, NULL, &hint, &info);
+
+	e = calloc(1, sizeof(struct _resolved) + GEMINI_RESOLVE_MAX * sizeof(struct gemini_addr));
+	if (!e) {
+		if (rc == 0) freeaddrinfo(info);
+		return NULL;
+	}
+
+	if (rc != 0) {
+		e->error = rc;
+	} else {
+		for (n = 0, rp = info; rp && n < GEMINI_RESOLVE_MAX; rp = rp->ai_next) {
+			if (rp->ai_addrlen > sizeof(struct sockaddr_storage)) continue;
+			e->addrs[n].len = rp->ai_addrlen;
+			memcpy(&e->addrs[n].sa, rp->ai_addr, rp->ai_addrlen);
+			n++;
+		}
+		e->n = n;
+		freeaddrinfo(info);
+	}
+
+	if (!r) {
+		return e;
+	}
+
+	/* transient failures are worth trying again right away; names that
+	   don't exist are not (for a little while, anyway) */
+	pthread_mutex_lock(&r->lock);
+	r->stats.misses++;
+	if (rc != 0) {
+		r->stats.failures++;
+	}
+	if (rc == 0 || rc == EAI_NONAME || rc == EAI_FAIL
+#ifdef EAI_NODATA
+	 || rc == EAI_NODATA
+#endif
+	) {
+		n = rc == 0 ? e->n : 0;
+		copy = malloc(sizeof(struct _resolved) + n * sizeof(struct gemini_addr));
+		if (copy) {
+			memcpy(copy, e, sizeof(struct _resolved) + n * sizeof(struct gemini_addr));
+			copy->expires = time(NULL) + (rc == 0 ? r->ttl : r->negative_ttl);
+
+			if (r->entries.n >= GEMINI_RESOLVE_ENTRIES) {
+				gemini_map_each(&r->entries, s_sweep, r);
+			}
+			old = gemini_map_set(&r->entries, host, copy);
+			if (old == copy) {
+				free(copy);
+			} else {
+				free(old);
+			}
+			r->stats.entries = r->entries.n;
+		}
+	}
+	pthread_mutex_unlock(&r->lock);
+	return e;
+}
+
+int gemini_resolve(struct gemini_resolver *r, const char *host, unsigned short port, struct gemini_addr *addrs, int max, int *error) {
+	struct _resolved *e;
+	int n;
+
+	if (r) {
+		pthread_mutex_lock(&r->lock);
+		e = s_cached(r, host);
+		if (e) {
+			n = e->n ? s_copy(e, port, addrs, max) : -1;
+			if (n < 0 && error) *error = e->error;
+			pthread_mutex_unlock(&r->lock);
+			return n;
+		}
+		pthread_mutex_unlock(&r->lock);
+	}
+
+	e = s_lookup(r, host);
+	if (!e) {
+		if (error) *error = EAI_MEMORY;
+		return -1;
+	}
+	n = e->n ? s_copy(e, port, addrs, max) : -1;
+	if (n < 0 && error) *error = e->error ? e->error : EAI_NONAME;
+	free(e);
+	return n;
+}
+
+static void * s_worker(void *_r) {
+	struct gemini_resolver *r;
+	struct gemini_addr addrs[GEMINI_RESOLVE_MAX];
+	struct _resolved *e;
+	struct _lookup *l;
+	struct _waiter *w, *next;
+	int n;
+
+	r = _r;
+	for (;;) {
+		pthread_mutex_lock(&r->lock);
+		while (!r->queue && !r->stopping) {
+			pthread_cond_wait(&r->work, &r->lock);
+		}
+		l = r->queue;
+		if (!l) {
+			/* stopping, and there's nothing left to do */
+			pthread_mutex_unlock(&r->lock);
+			return NULL;
+		}
+		r->queue = l->next;
+		if (!r->queue) r->queue_tail = NULL;
+		pthread_mutex_unlock(&r->lock);
+
+		e = s_lookup(r, l->host);
+
+		/* anyone who shows up after this will find the answer cached
+		   (or start a new lookup, if it couldn't be) */
+		pthread_mutex_lock(&r->lock);
+		gemini_map_delete(&r->pending, l->host);
+		pthread_mutex_unlock(&r->lock);
+
+		for (w = l->waiters; w; w = next) {
+			next = w->next;
+			if (!e) {
+				w->fn(w->data, NULL, -1, EAI_MEMORY);
+			} else if (e->n == 0) {
+				w->fn(w->data, NULL, -1, e->error ? e->error : EAI_NONAME);
+			} else {
+				n = s_copy(e, w->port, addrs, GEMINI_RESOLVE_MAX);
+				w->fn(w->data, addrs, n, 0);
+			}
+			free(w);
+		}
+		free(e);
+		free(l->host);
+		free(l);
+	}
+}
+
+int gemini_resolve_async(struct gemini_resolver *r, const char *host, unsigned short port, gemini_resolved_fn fn, void *data) {
+	struct gemini_addr addrs[GEMINI_RESOLVE_MAX];
+	struct _resolved *e;
+	struct _lookup *l;
+	struct _waiter *w;
+	int n, error;
+
+	w = calloc(1, sizeof(struct _waiter));
+	if (!w) {
+		return -1;
+	}
+	w->port = port;
+	w->fn   = fn;
+	w->data = data;
+
+	pthread_mutex_lock(&r->lock);
+	e = s_cached(r, host);
+	if (e) {
+		error = e->error;
+		n = e->n ? s_copy(e, port, addrs, GEMINI_RESOLVE_MAX) : -1;
+		pthread_mutex_unlock(&r->lock);
+
+		free(w);
+		fn(data, n < 0 ? NULL : addrs, n, n < 0 ? error : 0);
+		return 0;
+	}
+
+	l = gemini_map_get(&r->pending, host);
+	if (l) {
+		w->next = l->waiters;
+		l->waiters = w;
+		r->stats.shared++;
+		pthread_mutex_unlock(&r->lock);
+		return 0;
+	}
+
+	/* start up another resolver thread, if we're allowed one */
+	if (r->nworkers < r->threads && !r->stopping) {
+		if (pthread_create(&r->workers[r->nworkers], NULL, s_worker, r) == 0) {
+			r->nworkers++;
+		}
+	}
+	if (r->nworkers == 0 || r->stopping) {
+		pthread_mutex_unlock(&r->lock);
+		free(w);
+		return -1;
+	}
+
+	l = calloc(1, sizeof(struct _lookup));
+	if (!l || !(l->host = strdup(host)) || gemini_map_set(&r->pending, host, l) == l) {
+		pthread_mutex_unlock(&r->lock);
+		if (l) free(l->host);
+		free(l);
+		free(w);
+		return -1;
+	}
+	l->waiters = w;
+	if (r->queue_tail) r->queue_tail->next = l;
+	else               r->queue = l;
+	r->queue_tail = l;
+	pthread_cond_signal(&r->work);
+	pthread_mutex_unlock(&r->lock);
+	return 0;
+}
+
+struct gemini_resolver * gemini_resolver_new(int ttl, int negative_ttl, int threads) {
+	struct gemini_resolver *r;
+
+	r = calloc(1, sizeof(struct gemini_resolver));
+	if (!r) {
+		return NULL;
+	}
+
+	r->ttl          = ttl          > 0 ? ttl          : GEMINI_RESOLVE_TTL;
+	r->negative_ttl = negative_ttl > 0 ? negative_ttl : GEMINI_RESOLVE_NEGATIVE_TTL;
+	r->threads      = threads      > 0 ? threads      : GEMINI_RESOLVE_THREADS;
+	r->lookup       = getaddrinfo;
+
+	r->workers = calloc(r->threads, sizeof(pthread_t));
+	if (!r->workers) {
+		free(r);
+		return NULL;
+	}
+	if (gemini_map_init(&r->entries, 64) != 0) {
+		free(r->workers);
+		free(r);
+		return NULL;
+	}
+	if (gemini_map_init(&r->pending, 16) != 0) {
+		gemini_map_free(&r->entries, NULL);
+		free(r->workers);
+		free(r);
+		return NULL;
+	}
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->work, NULL);
+	return r;
+}
+
+void gemini_resolver_stats(struct gemini_resolver *r, struct gemini_resolver_stats *stats) {
+	pthread_mutex_lock(&r->lock);
+	memcpy(stats, &r->stats, sizeof(struct gemini_resolver_stats));
+	pthread_mutex_unlock(&r->lock);
+}
+
+void gemini_resolver_free(struct gemini_resolver *r) {
+	int i;
+
+	if (!r) return;
+
+	pthread_mutex_lock(&r->lock);
+	r->stopping = 1;
+	pthread_cond_broadcast(&r->work);
+	pthread_mutex_unlock(&r->lock);
+
+	for (i = 0; i < r->nworkers; i++) {
+		pthread_join(r->workers[i], NULL);
+	}
+	free(r->workers);
+
+	gemini_map_free(&r->entries, free);
+	gemini_map_free(&r->pending, NULL); /* empty, now that the workers are done */
+	pthread_cond_destroy(&r->work);
+	pthread_mutex_destroy(&r->lock);
+	free(r);
+}
@@ -1,59 +1,274 @@
+#define _GNU_SOURCE /* for splice(2) */
 #include "./gemini.h"
 
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <openssl/bio.h>
+#include <openssl/err.h>
+
+/* Read from the server (or, for responses out of a store, the file),
+   recording what comes in, if the response is going into a store. */
+static int s_recv(struct gemini_response *res, void *buf, size_t n) {
+	int nread;
+
+	if (!res->ssl) {
+		while ((nread = read(res->fd, buf, n)) < 0 && errno == EINTR)
+			;
+		return nread;
+	}
+
+	nread = SSL_read(res->ssl, buf, n);
+	if (res->fill) {
+		if (nread > 0) {
+			gemini_store_append(res->fill, buf, nread);
+		} else {
+			/* only a response the server finished sending is worth keeping */
+			gemini_store_finish(res->fill, SSL_get_error(res->ssl, nread) == SSL_ERROR_ZERO_RETURN);
+			res->fill = NULL;
+		}
+	}
+	return nread;
+}
+
+/* Pick the status line out of the head of the response, if all of it is
+   there; returns how long it was, 0 if we need more, or -1 if it's bogus. */
+static ssize_t s_line(struct gemini_response *res) {
+	char *eol, *meta;
+
+	eol = memchr(res->head, '\n', res->nhead);
+	if (!eol) {
+		return res->nhead >= sizeof(res->head) - 1 ? -1 : 0;
+	}
+	if (eol - res->head < 2 || res->head[0] < '1' || res->head[0] > '9' || res->head[1] < '0' || res->head[1] > '9') {
+		return -1;
+	}
+
+	*eol = '\0';
+	if (eol[-1] == '\r') {
+		eol[-1] = '\0';
+	}
+	for (meta = res->head + 2; *meta == ' ' || *meta == '\t'; meta++)
+		;
+
+	res->status = (res->head[0] - '0') * 10 + (res->head[1] - '0');
+	res->meta   = meta;
+	return eol - res->head + 1;
+}
+
+ssize_t gemini_response_parse(struct gemini_response *res, const void *buf, size_t n) {
+	const char *eol;
+	size_t len;
+
+	if (res->status) {
+		return 0;
+	}
+
+	/* only take up to the end of the line; the rest is the caller's */
+	eol = memchr(buf, '\n', n);
+	len = eol ? (size_t)(eol - (const char *)buf) + 1 : n;
+	if (res->nhead + len > sizeof(res->head) - 1) {
+		return -1;
+	}
+	memcpy(res->head + res->nhead, buf, len);
+	res->nhead += len;
+
+	return s_line(res) < 0 ? -1 : (ssize_t)len;
+}
+
+int gemini_response_header(struct gemini_response *res) {
+	ssize_t n;
+	int nread;
+
+	while (!res->status) {
+		nread = s_recv(res, res->head + res->nhead, sizeof(res->head) - 1 - res->nhead);
+		if (nread <= 0) {
+			errno = EPROTO;
+			return -1;
+		}
+		res->nhead += nread;
+
+		n = s_line(res);
+		if (n < 0) {
+			errno = EPROTO;
+			return -1;
+		}
+		if (n > 0) {
+			/* whatever came after the status line is body, and
+			   is the first thing a read should get */
+			res->rest  = n;
+			res->nrest = res->nhead - n;
+		}
+	}
+	return 0;
+}
 
 ssize_t gemini_response_read(struct gemini_response *res, void *buf, size_t n) {
 	size_t ntotal;
 	int nread;
 
 	ntotal = 0;
-	while (n > 0 && (nread = SSL_read(res->ssl, buf, n)) > 0) {
+	if (res->nrest > 0) {
+		ntotal = n < res->nrest ? n : res->nrest;
+		memcpy(buf, res->head + res->rest, ntotal);
+		res->rest  += ntotal;
+		res->nrest -= ntotal;
+		n   -= ntotal;
+		buf += ntotal;
+		if (res->eager) {
+			return ntotal;
+		}
+	}
+
+	nread = 0;
+	while (n > 0 && (nread = s_recv(res, buf, n)) > 0) {
 		n -= nread;
 		buf += nread;
 		ntotal += nread;
+		if (res->eager) {
+			break;
+		}
 	}
-	if (nread < 0) {
+	if (nread < 0 && ntotal == 0) {
 		return nread;
 	}
 
 	return ntotal;
 }
 
+static int s_write(int fd, const char *buf, size_t n) {
+	ssize_t nwrit;
+
+	while (n > 0) {
+		nwrit = write(fd, buf, n);
+		if (nwrit < 0 && errno == EINTR) continue;
+		if (nwrit < 0) return -1;
+		buf += nwrit;
+		n   -= nwrit;
+	}
+	return 0;
+}
+
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+/* With kTLS, the kernel decrypts records as they come in, so the body can
+   go from the socket to fd without ever coming up into user space.  One
+   end of a splice(2) has to be a pipe; if fd isn't one, we go through a
+   pipe of our own.
+
+   Returns 0 at end-of-file, -1 on failure, and 1 if OpenSSL has to take
+   it from here: the kernel hands anything that isn't application data
+   (like the close_notify alert at the end) back to user space. */
+static int s_splice(struct gemini_response *res, int fd, size_t block) {
+	struct stat st;
+	int p[2], in, out, rc;
+	ssize_t n, m;
+
+	if (fstat(fd, &st) != 0) {
+		return -1;
+	}
+	p[0] = p[1] = -1;
+	if (!S_ISFIFO(st.st_mode) && pipe2(p, O_CLOEXEC) != 0) {
+		return 1;
+	}
+	in  = SSL_get_rfd(res->ssl);
+	out = p[1] >= 0 ? p[1] : fd;
+
+	for (;;) {
+		n = splice(in, NULL, out, NULL, block, SPLICE_F_MOVE);
+		if (n == 0) {
+			rc = 0;
+			break;
+		}
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			rc = errno == EINVAL || errno == EIO ? 1 : -1;
+			break;
+		}
+
+		for (; p[0] >= 0 && n > 0; n -= m) {
+			m = splice(p[0], NULL, fd, NULL, n, SPLICE_F_MOVE);
+			if (m < 0 && errno == EINTR) {
+				m = 0;
+				continue;
+			}
+			if (m <= 0) {
+				break;
+			}
+		}
+		if (n > 0) {
+			rc = -1;
+			break;
+		}
+	}
+
+	if (p[0] >= 0) {
+		close(p[0]);
+		close(p[1]);
+	}
+	return rc;
+}
+#endif
+
 int gemini_response_stream(struct gemini_response *res, int fd, size_t block) {
 	char *buf;
-	ssize_t n, nread, nwrit;
+	int nread;
+
+	if (s_write(fd, res->head + res->rest, res->nrest) != 0) {
+		return -1;
+	}
+	res->rest += res->nrest;
+	res->nrest = 0;
+
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+	if (res->ssl && !res->fill && BIO_get_ktls_recv(SSL_get_rbio(res->ssl)) && SSL_pending(res->ssl) == 0) {
+		switch (s_splice(res, fd, block)) {
+		case 0:  return 0;
+		case -1: return -1;
+		}
+	}
+#endif
 
 	buf = malloc(block);
 	if (!buf) {
 		return -1;
 	}
 
-	n = 0;
-	while ((nread = gemini_response_read(res, buf+n, block-n)) > 0) {
-		n += nread;
-		nwrit = write(fd, buf, n);
-		if (nwrit < 0) return nwrit;
-		memmove(buf, buf+nwrit, n-nwrit);
-		n -= nwrit;
+	while ((nread = s_recv(res, buf, block)) > 0) {
+		if (s_write(fd, buf, nread) != 0) {
+			free(buf);
+			return -1;
+		}
 	}
-	if (nread < 0) return nread;
-	while (n > 0) {
-		nwrit = write(fd, buf, n);
-		fprintf(stderr, "wrote %ldb to stream\n", nwrit);
-		if (nwrit < 0) return nwrit;
-		memmove(buf, buf+nwrit, n-nwrit);
-		n -= nwrit;
+	free(buf);
+	if (!res->ssl) {
+		return nread == 0 ? 0 : -1;
 	}
 
-	free(buf);
-	return 0;
+	switch (SSL_get_error(res->ssl, nread)) {
+	case SSL_ERROR_ZERO_RETURN:
+	case SSL_ERROR_SYSCALL: /* plenty of servers just hang up */
+		ERR_clear_error();
+		return 0;
+	}
+	ERR_clear_error();
+	return -1;
 }
 
 void gemini_response_close(struct gemini_response *res) {
+	if (res->fill) {
+		gemini_store_finish(res->fill, 0); /* we never saw the end of it */
+		res->fill = NULL;
+	}
+
 	if (res->ssl) {
 		SSL_shutdown(res->ssl);
+		free(SSL_get_app_data(res->ssl)); /* see gemini_client_request() */
 		SSL_free(res->ssl);
 		res->ssl = NULL;
 	}
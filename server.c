@@ -1,10 +1,13 @@
+#define _GNU_SOURCE
 #include "./gemini.h"
 
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
-#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -26,6 +29,10 @@ int gemini_handle(struct gemini_server *server, struct gemini_handler *handler)
 }
 
 int gemini_handle_fn(struct gemini_server *server, const char *prefix, gemini_handler fn, void *data) {
+	return gemini_handle_fn_free(server, prefix, fn, data, NULL);
+}
+
+int gemini_handle_fn_free(struct gemini_server *server, const char *prefix, gemini_handler fn, void *data, void (*destroy)(void *)) {
 	struct gemini_handler *handler;
 
 	handler = malloc(sizeof(struct gemini_handler));
@@ -36,18 +43,116 @@ int gemini_handle_fn(struct gemini_server *server, const char *prefix, gemini_ha
 	handler->prefix  = strdup(prefix);
 	handler->handler = fn;
 	handler->data    = data;
+	handler->destroy = destroy;
 
 	return gemini_handle(server, handler);
 }
 
-static int s_handler_fs(const char *prefix, struct gemini_request *req, void *_root) {
+struct _fs {
+	char *root;
+	struct gemini_fs_listings *listings;
+	pthread_mutex_t lock; /* guards listings */
+};
+
+static void s_fs_free(struct _fs *x) {
+	gemini_fs_listings_free(x->listings);
+	pthread_mutex_destroy(&x->lock);
+	free(x->root);
+	free(x);
+}
+
+static int s_handler_fs_dir(struct gemini_request *req, struct _fs *x, const char *path) {
+	const struct gemini_fs_listing *l;
+	char *redir, *index, *body;
+	size_t n, len;
+	int resfd, found, isindex;
+
+	/* listings only last until the next call, so we take a copy of
+	   whatever we need before letting anyone else at the cache. */
+	pthread_mutex_lock(&x->lock);
+	if (gemini_fs_listings_refresh(x->listings) < 0) {
+		fprintf(stderr, "[gemini_serve] unable to refresh directory listings; serving from stale cache\n");
+	}
+
+	l = gemini_fs_listings_get(x->listings, path);
+	found   = l != NULL;
+	isindex = l && l->index;
+	body    = NULL;
+	len     = 0;
+	if (l && !l->index) {
+		len  = l->len;
+		body = gemini_request_alloc(req, len + 1);
+		if (body) memcpy(body, l->body, len);
+	}
+	pthread_mutex_unlock(&x->lock);
+
+	if (!found) {
+		return GEMINI_HANDLER_CONTINUE;
+	}
+
+	n = strlen(req->url->path);
+	if (n == 0 || req->url->path[n-1] != '/') {
+		redir = gemini_request_alloc(req, n + 2);
+		if (!redir) {
+			return GEMINI_HANDLER_ABORT;
+		}
+		memcpy(redir, req->url->path, n);
+		memcpy(redir + n, "/", 2);
+		gemini_request_respond(req, 31, redir);
+		gemini_request_close(req);
+		return GEMINI_HANDLER_DONE;
+	}
+
+	if (!isindex) {
+		if (!body) {
+			return GEMINI_HANDLER_ABORT;
+		}
+		gemini_request_respond(req, 20, "text/gemini");
+		if (gemini_request_write(req, body, len) < 0) {
+			fprintf(stderr, "short write!\n");
+		}
+		gemini_request_close(req);
+		return GEMINI_HANDLER_DONE;
+	}
+
+	index = gemini_request_alloc(req, strlen(path) + sizeof("/index.gmi"));
+	if (!index) {
+		return GEMINI_HANDLER_ABORT;
+	}
+	sprintf(index, "%s%sindex.gmi", path, *path ? "/" : "");
+	resfd = openat(x->listings->dirfd, index, O_RDONLY | O_CLOEXEC);
+	if (resfd < 0) {
+		return GEMINI_HANDLER_CONTINUE;
+	}
+
+	gemini_request_respond(req, 20, "text/gemini");
+	if (gemini_request_stream(req, resfd, GEMINI_STREAM_BLOCK_SIZE) < 0) {
+		fprintf(stderr, "short write!\n");
+	}
+	close(resfd);
+	gemini_request_close(req);
+	return GEMINI_HANDLER_DONE;
+}
+
+static int s_handler_fs(const char *prefix, struct gemini_request *req, void *_fs) {
+	struct _fs *x;
 	struct gemini_fs fs;
+	char *path;
 	int resfd;
 
-	fs.root = _root;
+	x = _fs;
+	fs.root = x->root;
 	resfd = gemini_fs_open(&fs, req->url->path + strlen(prefix), O_RDONLY);
 	if (resfd < 0) {
-		return GEMINI_HANDLER_CONTINUE;
+		/* not a regular file; maybe it's a directory? */
+		path = gemini_request_alloc(req, GEMINI_MAX_PATH+1);
+		if (!path) {
+			return GEMINI_HANDLER_ABORT;
+		}
+		if (gemini_fs_resolve_into(req->url->path + strlen(prefix), path) != 0) {
+			return GEMINI_HANDLER_CONTINUE;
+		}
+		return s_handler_fs_dir(req, x, path);
 	}
 
 	gemini_request_respond(req, 20, "text/plain");
@@ -60,7 +165,121 @@ static int s_handler_fs(const char *prefix, struct gemini_request *req, void *_r
 }
 
 int gemini_handle_fs(struct gemini_server *server, const char *prefix, const char *root) {
-	return gemini_handle_fn(server, prefix, s_handler_fs, strdup(root));
+	struct _fs *x;
+
+	x = calloc(1, sizeof(struct _fs));
+	if (!x) {
+		return -1;
+	}
+
+	pthread_mutex_init(&x->lock, NULL);
+	x->root     = strdup(root);
+	x->listings = gemini_fs_listings_new(root);
+	if (!x->root || !x->listings) {
+		s_fs_free(x);
+		return -1;
+	}
+
+	if (gemini_handle_fn(server, prefix, s_handler_fs, x) != 0) {
+		s_fs_free(x);
+		return -1;
+	}
+	return 0;
+}
+
+struct _overlay {
+	struct gemini_fs_index *idx;
+	pthread_mutex_t lock; /* guards idx */
+};
+
+static void s_overlay_free(struct _overlay *x) {
+	gemini_fs_index_free(x->idx);
+	pthread_mutex_destroy(&x->lock);
+	free(x);
+}
+
+static int s_handler_overlay(const char *prefix, struct gemini_request *req, void *_overlay) {
+	struct _overlay *x;
+	int resfd;
+
+	x = _overlay;
+	pthread_mutex_lock(&x->lock);
+	if (gemini_fs_index_refresh(x->idx) < 0) {
+		fprintf(stderr, "[gemini_serve] unable to refresh overlay index; serving from stale index\n");
+	}
+	resfd = gemini_fs_index_open(x->idx, req->url->path + strlen(prefix), O_RDONLY);
+	pthread_mutex_unlock(&x->lock);
+	if (resfd < 0) {
+		return GEMINI_HANDLER_CONTINUE;
+	}
+
+	gemini_request_respond(req, 20, "text/plain");
+	if (gemini_request_stream(req, resfd, GEMINI_STREAM_BLOCK_SIZE) < 0) {
+		fprintf(stderr, "short write!\n");
+	}
+	close(resfd);
+	gemini_request_close(req);
+	return GEMINI_HANDLER_DONE;
+}
+
+int gemini_handle_overlay(struct gemini_server *server, const char *prefix, const char **roots, int n) {
+	struct _overlay *x;
+
+	x = calloc(1, sizeof(struct _overlay));
+	if (!x) {
+		return -1;
+	}
+	pthread_mutex_init(&x->lock, NULL);
+
+	x->idx = gemini_fs_index_new(roots, n);
+	if (!x->idx) {
+		s_overlay_free(x);
+		return -1;
+	}
+
+	if (gemini_handle_fn(server, prefix, s_handler_overlay, x) != 0) {
+		s_overlay_free(x);
+		return -1;
+	}
+	return 0;
+}
+
+int gemini_handle_cached(struct gemini_server *server, const char *prefix, gemini_handler fn, void *data, struct gemini_cache *cache) {
+	struct gemini_cached *c;
+
+	c = malloc(sizeof(struct gemini_cached));
+	if (!c) {
+		return -1;
+	}
+	c->fn    = fn;
+	c->data  = data;
+	c->cache = cache;
+
+	if (gemini_handle_fn(server, prefix, gemini_cache_handler, c) != 0) {
+		free(c);
+		return -1;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	cache->refs++;
+	pthread_mutex_unlock(&cache->lock);
+	return 0;
+}
+
+int gemini_handle_pool(struct gemini_server *server, const char *prefix, struct gemini_pool *pool) {
+	return gemini_handle_fn(server, prefix, gemini_pool_handler, pool);
+}
+
+int gemini_handle_plugin(struct gemini_server *server, const char *prefix, struct gemini_plugin *plugin) {
+	return gemini_handle_fn(server, prefix, gemini_plugin_handler, plugin);
+}
+
+int gemini_handle_proxy(struct gemini_server *server, const char *prefix, struct gemini_proxy *proxy) {
+	return gemini_handle_fn(server, prefix, gemini_proxy_handler, proxy);
+}
+
+int gemini_handle_gather(struct gemini_server *server, const char *prefix, struct gemini_gather *gather) {
+	return gemini_handle_fn(server, prefix, gemini_gather_handler, gather);
 }
 
 static int s_handler_authn(const char *prefix, struct gemini_request *req, void *_store) {
@@ -145,7 +364,7 @@ int gemini_bind(struct gemini_server *server, int port) {
 	int fd, rc, v;
 	struct sockaddr_in sa;
 
-	fd = socket(AF_INET, SOCK_STREAM, 0);
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
 	if (fd < 0) {
 		return fd;
 	}
@@ -177,141 +396,459 @@ int gemini_bind(struct gemini_server *server, int port) {
 	return 0;
 }
 
-static ssize_t s_readto(SSL *ssl, char *dst, size_t len, const char *end) {
-	size_t ntotal = 0, nread;
+/* Wait, no later than the deadline, for the connection to be ready for
+   what OpenSSL wanted to do when it returned rc.  Returns 0 once it is,
+   and -1 on error, or if OpenSSL wasn't waiting on the connection. */
+static int s_wait(struct gemini_request *req, int rc, long deadline) {
+	struct pollfd pfd;
+	long left;
+	int n;
+
+	pfd.fd = req->fd;
+	switch (SSL_get_error(req->ssl, rc)) {
+	case SSL_ERROR_WANT_READ:  pfd.events = POLLIN;  break;
+	case SSL_ERROR_WANT_WRITE: pfd.events = POLLOUT; break;
+	default: return -1;
+	}
 
-	while ((SSL_read_ex(ssl, dst+ntotal, len-1-ntotal, &nread)) == 1) {
+	do {
+		left = deadline - gemini_now_ms();
+		n = left > 0 ? poll(&pfd, 1, left) : 0;
+	} while (n < 0 && errno == EINTR);
+	return n > 0 ? 0 : -1;
+}
+
+/* Read the request line (sans CRLF) into request-scoped memory, which
+   isn't allocated until there is something to put in it, so that an idle
+   connection doesn't tie up GEMINI_MAX_REQUEST octets while it waits.
+   The connection is non-blocking, and all of it has to be in by the
+   deadline. */
+static char * s_readline(struct gemini_request *req, long deadline) {
+	struct pollfd pfd;
+	size_t ntotal, nread;
+	char *buf, *eol;
+	long left;
+	int rc;
+
+	if (!SSL_has_pending(req->ssl)) {
+		pfd.fd     = req->fd;
+		pfd.events = POLLIN;
+		do {
+			left = deadline - gemini_now_ms();
+			rc = left > 0 ? poll(&pfd, 1, left) : 0;
+		} while (rc < 0 && errno == EINTR);
+		if (rc <= 0) {
+			return NULL;
+		}
+	}
+
+	buf = gemini_request_alloc(req, GEMINI_MAX_REQUEST);
+	if (!buf) {
+		return NULL;
+	}
+	for (ntotal = 0; ntotal < GEMINI_MAX_REQUEST-1; ) {
+		rc = SSL_read_ex(req->ssl, buf+ntotal, GEMINI_MAX_REQUEST-1-ntotal, &nread);
+		if (rc != 1) {
+			if (s_wait(req, rc, deadline) != 0) return NULL;
+			continue;
+		}
 		ntotal += nread;
-		*(dst+ntotal) = '\0';
-		if (strstr(dst, end) != NULL) {
-			return ntotal;
+		buf[ntotal] = '\0';
+		if ((eol = strstr(buf, "\r\n")) != NULL) {
+			*eol = '\0';
+			return buf;
 		}
 	}
-	return -1;
+	return NULL;
+}
+
+/* How much memory is the server using, as far as the kernel is concerned?
+   Reading /proc for every connection would cost more than the answer is
+   worth, so it is only looked at again once GEMINI_RSS_INTERVAL ms have
+   gone by, by whichever thread notices first. */
+static size_t s_rss(void) {
+	static long   checked;
+	static size_t rss;
+	unsigned long size, resident;
+	long now, last;
+	FILE *io;
+
+	now  = gemini_now_ms();
+	last = __atomic_load_n(&checked, __ATOMIC_SEQ_CST);
+	if (now - last < GEMINI_RSS_INTERVAL
+	 || !__atomic_compare_exchange_n(&checked, &last, now, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		return __atomic_load_n(&rss, __ATOMIC_SEQ_CST);
+	}
+
+	io = fopen("/proc/self/statm", "r");
+	if (!io) {
+		return 0;
+	}
+	if (fscanf(io, "%lu %lu", &size, &resident) == 2) {
+		__atomic_store_n(&rss, resident * sysconf(_SC_PAGESIZE), __ATOMIC_SEQ_CST);
+	}
+	fclose(io);
+	return __atomic_load_n(&rss, __ATOMIC_SEQ_CST);
 }
 
 static int _tls_verify(int preverify_ok, X509_STORE_CTX *ctx) {
 	return 1;
 }
 
+/* Load cert and key into a new TLS context, set up for serving. */
+static int s_tls(SSL_CTX *ctx, const char *cert, const char *key) {
+	if (SSL_CTX_use_certificate_file(ctx, cert, SSL_FILETYPE_PEM) <= 0) {
+		ERR_print_errors_fp(stderr);
+		return -2;
+	}
+
+	if (SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) <= 0) {
+		ERR_print_errors_fp(stderr);
+		return -3;
+	}
+
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_CLIENT_ONCE, _tls_verify);
+
+	/* OpenSSL refuses to resume sessions for servers that ask for client
+	   certificates, unless it knows which server context they came from. */
+	SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"geminon", 7);
+	return 0;
+}
+
 int gemini_tls(struct gemini_server *server, const char *cert, const char *key) {
 	server->ssl = SSL_CTX_new(TLS_method());
 	if (!server->ssl) {
 		ERR_print_errors_fp(stderr);
 		return -1;
 	}
+	return s_tls(server->ssl, cert, key);
+}
 
-	if (SSL_CTX_use_certificate_file(server->ssl, cert, SSL_FILETYPE_PEM) <= 0) {
+int gemini_tls_reload(struct gemini_server *server, const char *cert, const char *key) {
+	SSL_CTX *ctx, *old;
+	unsigned char keys[80];
+	unsigned long epoch;
+	int rc;
+
+	ctx = SSL_CTX_new(TLS_method());
+	if (!ctx) {
 		ERR_print_errors_fp(stderr);
-		return -2;
+		return -1;
+	}
+	rc = s_tls(ctx, cert, key);
+	if (rc != 0) {
+		SSL_CTX_free(ctx);
+		return rc;
 	}
 
-	if (SSL_CTX_use_PrivateKey_file(server->ssl, key, SSL_FILETYPE_PEM) <= 0) {
-		ERR_print_errors_fp(stderr);
-		return -3;
+	/* OpenSSL has already turned away a key that doesn't go with the
+	   certificate; there's no point trading a good certificate for an
+	   expired one, either */
+	if (X509_cmp_current_time(X509_get0_notAfter(SSL_CTX_get0_certificate(ctx))) <= 0) {
+		fprintf(stderr, "[gemini_tls] %s has already expired\n", cert);
+		SSL_CTX_free(ctx);
+		return -4;
 	}
 
-	SSL_CTX_set_verify(server->ssl, SSL_VERIFY_PEER | SSL_VERIFY_CLIENT_ONCE, _tls_verify);
+	/* carry over what the old context was doing, including the keys that
+	   session tickets are sealed with, so that clients can resume the
+	   sessions they already have */
+	old = __atomic_load_n(&server->ssl, __ATOMIC_SEQ_CST);
+	if (old) {
+		SSL_CTX_set_mode(ctx, SSL_CTX_get_mode(old));
+		if (SSL_CTX_get_tlsext_ticket_keys(old, keys, sizeof(keys)) == 1) {
+			SSL_CTX_set_tlsext_ticket_keys(ctx, keys, sizeof(keys));
+		}
+		OPENSSL_cleanse(keys, sizeof(keys));
+	}
+
+	old = __atomic_exchange_n(&server->ssl, ctx, __ATOMIC_SEQ_CST);
+	epoch = __atomic_add_fetch(&server->tls_epoch, 1, __ATOMIC_SEQ_CST);
+	if (server->slots) {
+		gemini_slots_quiesce_tls(server->slots, epoch);
+	}
+	SSL_CTX_free(old); /* connections still using it have their own reference */
 	return 0;
 }
 
-int gemini_serve(struct gemini_server *server) {
-	int rc, handled;
-	ssize_t n;
-	char *p, buf[GEMINI_MAX_REQUEST];
-	struct gemini_request req;
+/* A TLS handle for a new connection: the slot's spare, unless the server's
+   TLS context has been replaced since the spare was set up.  As with the
+   handlers (see s_dispatch()), the request's tls_epoch keeps the context
+   from being freed before SSL_new() has taken its own reference to it. */
+static SSL * s_ssl(struct gemini_server *server, struct gemini_request *req) {
+	SSL_CTX *ctx;
+	SSL *ssl;
+
+	__atomic_store_n(&req->tls_epoch, __atomic_load_n(&server->tls_epoch, __ATOMIC_SEQ_CST) + 1, __ATOMIC_SEQ_CST);
+	ctx = __atomic_load_n(&server->ssl, __ATOMIC_SEQ_CST);
+
+	ssl = req->spare;
+	req->spare = NULL;
+	if (ssl && SSL_get_SSL_CTX(ssl) != ctx) {
+		SSL_free(ssl);
+		ssl = NULL;
+	}
+	if (!ssl) {
+		ssl = SSL_new(ctx);
+	}
+
+	__atomic_store_n(&req->tls_epoch, 0, __ATOMIC_RELEASE);
+	return ssl;
+}
+
+/* Find the handler (or handlers) responsible for a request, and let them
+   have at it.  The request's epoch keeps the handlers it is using from
+   being freed out from under it by gemini_reroute(); it is set before the
+   list is picked up, so that a reroute either sees it, or has already
+   swapped in the list that the request is about to pick up. */
+static void s_dispatch(struct gemini_server *server, struct gemini_request *req) {
 	struct gemini_handler *handler;
+	int rc, handled;
 
-	memset(&req, 0, sizeof(req));
-	while ((req.fd = accept(server->sockfd, NULL, NULL)) != -1) {
-		fprintf(stderr, "[gemini_serve] accepted inbound connection on fd %d\n", req.fd);
+	__atomic_store_n(&req->epoch, __atomic_load_n(&server->epoch, __ATOMIC_SEQ_CST) + 1, __ATOMIC_SEQ_CST);
 
-		req.ssl = SSL_new(server->ssl);
-		SSL_set_fd(req.ssl, req.fd);
-		if (SSL_accept(req.ssl) <= 0) {
-			SSL_free(req.ssl);
-			close(req.fd);
+	handled = 0;
+	for (handler = __atomic_load_n(&server->first, __ATOMIC_SEQ_CST); handler; handler = handler->next) {
+		if (strlen(req->url->path) < strlen(handler->prefix)) {
+			continue;
+		}
+		if (strncmp(req->url->path, handler->prefix, strlen(handler->prefix)) != 0) {
 			continue;
 		}
 
-		req.cert = SSL_get_peer_certificate(req.ssl);
-
-		n = s_readto(req.ssl, buf, sizeof(buf), "\r\n");
-		if (n <= 0) {
-			fprintf(stderr, "[gemini_serve] received error while reading from connection on fd %d\n", req.fd);
-			gemini_request_close(&req);
+		rc = handler->handler(handler->prefix, req, handler->data);
+		if (rc == GEMINI_HANDLER_CONTINUE) {
 			continue;
 		}
+		if (rc == GEMINI_HANDLER_DONE) {
+			handled = 1;
+			break;
+		}
 
-		p = strstr(buf, "\r\n");
-		assert(p); *p = '\0';
+		if (rc == GEMINI_HANDLER_ABORT) {
+			gemini_request_respond(req, 59, "Internal Error");
+			gemini_request_close(req);
+			handled = 1;
+			break;
+		}
+	}
 
-		fprintf(stderr, "[gemini_serve] checking url '%s'\n", buf);
-		req.url = gemini_parse_url(buf);
-		if (!req.url) {
-			fprintf(stderr, "[gemini_serve] '%s' is an invalid gemini:// protocol url\n", buf);
-			gemini_request_respond(&req, 50, "Bad URL");
-			gemini_request_close(&req);
+	if (!handled) {
+		fprintf(stderr, "[gemini_serve] not handled; trying fallback handler...\n");
+		gemini_request_respond(req, 51, "Not Found");
+		gemini_request_close(req);
+	}
+
+	__atomic_store_n(&req->epoch, 0, __ATOMIC_RELEASE);
+}
+
+static int s_serve(struct gemini_server *server) {
+	ssize_t n;
+	char *line;
+	struct gemini_request *req;
+	struct gemini_flight *flight;
+	int fd, rc, shed;
+	long deadline;
+
+	while ((fd = accept4(server->sockfd, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+		fprintf(stderr, "[gemini_serve] accepted inbound connection on fd %d\n", fd);
+		shed = server->memory_budget > 0 && s_rss() > server->memory_budget;
+
+		req = gemini_slots_acquire(server->slots);
+		req->fd  = fd;
+		req->ssl = s_ssl(server, req);
+
+		/* the handshake and the request line have to be done with by the
+		   deadline; after that, the connection blocks, for the handlers */
+		deadline = gemini_now_ms() + (server->request_timeout > 0 ? server->request_timeout : GEMINI_REQUEST_TIMEOUT);
+		rc = -1;
+		if (req->ssl && SSL_set_fd(req->ssl, req->fd) == 1 && fcntl(fd, F_SETFL, O_NONBLOCK) == 0) {
+			while ((rc = SSL_accept(req->ssl)) != 1 && s_wait(req, rc, deadline) == 0)
+				;
+		}
+		if (rc != 1) {
+			fprintf(stderr, "[gemini_serve] no tls handshake by the deadline on fd %d\n", fd);
+			gemini_request_close(req);
+			gemini_slots_release(server->slots, req);
 			continue;
 		}
 
-		handled = 0;
-		for (handler = server->first; handler; handler = handler->next) {
-			if (strlen(req.url->path) < strlen(handler->prefix)) {
-				continue;
-			}
-			if (strncmp(req.url->path, handler->prefix, strlen(handler->prefix)) != 0) {
-				continue;
-			}
+		req->cert = SSL_get_peer_certificate(req->ssl);
+		req->maxage = req->stale = -1;
 
-			rc = handler->handler(handler->prefix, &req, handler->data);
-			if (rc == GEMINI_HANDLER_CONTINUE) {
-				continue;
-			}
-			if (rc == GEMINI_HANDLER_DONE) {
-				handled = 1;
-				break;
-			}
+		line = s_readline(req, deadline);
+		if (!line || fcntl(fd, F_SETFL, 0) != 0) {
+			fprintf(stderr, "[gemini_serve] no request line by the deadline on fd %d\n", req->fd);
+			gemini_request_close(req);
+			goto next;
+		}
 
-			if (rc == GEMINI_HANDLER_ABORT) {
-				gemini_request_respond(&req, 59, "Internal Error");
-				gemini_request_close(&req);
-				handled = 1;
-				break;
-			}
+		if (shed) {
+			fprintf(stderr, "[gemini_serve] over memory budget; turning away connection on fd %d\n", req->fd);
+			__atomic_add_fetch(&server->slots->stats.shed, 1, __ATOMIC_SEQ_CST);
+			gemini_request_respond(req, 44, "30");
+			gemini_request_close(req);
+			goto next;
 		}
 
-		if (!handled) {
-			fprintf(stderr, "[gemini_serve] not handled; trying fallback handler...\n");
-			gemini_request_respond(&req, 51, "Not Found");
-			gemini_request_close(&req);
+		fprintf(stderr, "[gemini_serve] checking url '%s'\n", line);
+		if (gemini_request_url(req, line) != 0) {
+			fprintf(stderr, "[gemini_serve] '%s' is an invalid gemini:// protocol url\n", line);
+			gemini_request_respond(req, 50, "Bad URL");
+			gemini_request_close(req);
+			goto next;
 		}
 
-		server->requests++;
-		if (server->max_requests > 0 && server->requests > server->max_requests) {
+		flight = NULL;
+		if (server->flights && gemini_flights_begin(server->flights, req, &flight)) {
+			goto next; /* someone else already did the work */
+		}
+		s_dispatch(server, req);
+		if (flight) {
+			gemini_flights_end(server->flights, req, flight);
+		}
+
+	next:
+		X509_free(req->cert);
+		req->cert = NULL;
+		gemini_slots_release(server->slots, req);
+
+		n = __atomic_add_fetch(&server->requests, 1, __ATOMIC_SEQ_CST);
+		if (server->max_requests > 0 && n > server->max_requests) {
+			if (server->threads > 1) {
+				shutdown(server->sockfd, SHUT_RDWR); /* stop the others, too */
+			}
 			return 0;
 		}
 	}
 
-	return -1;
+	return server->max_requests > 0 && server->requests > server->max_requests ? 0 : -1;
 }
 
-void gemini_server_close(struct gemini_server *server) {
-	struct gemini_handler *handler, *next;
+static void * s_thread(void *server) {
+	s_serve(server);
+	return NULL;
+}
 
-	SSL_CTX_free(server->ssl);
+int gemini_serve(struct gemini_server *server) {
+	pthread_t *threads;
+	unsigned int slots;
+	int i, n, rc;
+
+	/* the calling thread is one of the threads */
+	n = server->threads > 1 ? server->threads - 1 : 0;
+
+	/* more slots than threads would never be used */
+	slots = n + 1;
+	if (server->max_connections > 0 && server->max_connections < slots) {
+		slots = server->max_connections;
+	}
+	if (server->low_memory) {
+		SSL_CTX_set_mode(server->ssl, SSL_MODE_RELEASE_BUFFERS);
+	}
+	server->slots = gemini_slots_new(server->low_memory ? NULL : server->ssl, slots);
+	if (!server->slots) {
+		return -1;
+	}
+
+	threads = NULL;
+	if (n > 0) {
+		threads = calloc(n, sizeof(pthread_t));
+		if (!threads) {
+			gemini_slots_free(server->slots);
+			server->slots = NULL;
+			return -1;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		if (pthread_create(&threads[i], NULL, s_thread, server) != 0) {
+			fprintf(stderr, "[gemini_serve] unable to start thread #%d; continuing with %d\n", i + 2, i + 1);
+			n = i;
+			break;
+		}
+	}
+
+	rc = s_serve(server);
+
+	/* whoever stops first wakes up the rest, by shutting down the
+	   listening socket out from under their accept(2)s. */
+	if (n > 0) {
+		shutdown(server->sockfd, SHUT_RDWR);
+		for (i = 0; i < n; i++) {
+			pthread_join(threads[i], NULL);
+		}
+	}
+	free(threads);
+
+	gemini_slots_free(server->slots);
+	server->slots = NULL;
+	return rc;
+}
 
-	for (handler = server->first; handler; handler = next) {
+/* Handlers' user data is freed according to what kind of handler it is. */
+static void s_handler_free(gemini_handler fn, void *data) {
+	struct gemini_cached *cached;
+
+	if (fn == s_handler_vhosts) {
+		s_vhosts_free(data);
+	} else if (fn == s_handler_authn) {
+		X509_STORE_free(data);
+	} else if (fn == s_handler_fs) {
+		s_fs_free(data);
+	} else if (fn == gemini_pool_handler) {
+		gemini_pool_free(data);
+	} else if (fn == gemini_plugin_handler) {
+		gemini_plugin_free(data);
+	} else if (fn == gemini_proxy_handler) {
+		gemini_proxy_free(data);
+	} else if (fn == gemini_gather_handler) {
+		gemini_gather_free(data);
+	} else if (fn == s_handler_overlay) {
+		s_overlay_free(data);
+	} else if (fn == gemini_cache_handler) {
+		cached = data;
+		s_handler_free(cached->fn, cached->data);
+		gemini_cache_free(cached->cache);
+		free(cached);
+	} else {
+		free(data);
+	}
+}
+
+static void s_handlers_free(struct gemini_handler *handler) {
+	struct gemini_handler *next;
+
+	for (; handler; handler = next) {
 		next = handler->next;
 
-		if (handler->handler == s_handler_vhosts) {
-			s_vhosts_free(handler->data);
-		} else if (handler->handler == s_handler_authn) {
-			X509_STORE_free(handler->data);
+		if (handler->destroy) {
+			handler->destroy(handler->data);
 		} else {
-			free(handler->data);
+			s_handler_free(handler->handler, handler->data);
 		}
 		free(handler->prefix);
 		free(handler);
 	}
 }
+
+void gemini_reroute(struct gemini_server *server, struct gemini_server *next) {
+	struct gemini_handler *old;
+	unsigned long epoch;
+
+	old = __atomic_exchange_n(&server->first, next->first, __ATOMIC_SEQ_CST);
+	server->last = next->last;
+	next->first = next->last = NULL;
+
+	/* anyone dispatching from before this epoch might have the old list */
+	epoch = __atomic_add_fetch(&server->epoch, 1, __ATOMIC_SEQ_CST);
+	if (server->slots) {
+		gemini_slots_quiesce(server->slots, epoch);
+	}
+	s_handlers_free(old);
+}
+
+void gemini_server_close(struct gemini_server *server) {
+	SSL_CTX_free(server->ssl);
+	gemini_flights_free(server->flights);
+	s_handlers_free(server->first);
+}
@@ -0,0 +1,242 @@
+#include "./gemini.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/pem.h>
+
+struct _session {
+	struct _session *prev, *next; /* LRU list, most recent first */
+
+	char        *key;
+	SSL_SESSION *sess;
+	time_t       expires;
+};
+
+static void s_free(struct _session *e) {
+	SSL_SESSION_free(e->sess);
+	free(e->key);
+	free(e);
+}
+
+static void s_unlink(struct gemini_sessions *sessions, struct _session *e) {
+	if (e->prev) e->prev->next = e->next;
+	else         sessions->lru = e->next;
+	if (e->next) e->next->prev = e->prev;
+	else         sessions->lru_tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void s_push(struct gemini_sessions *sessions, struct _session *e) {
+	e->prev = NULL;
+	e->next = sessions->lru;
+	if (sessions->lru) sessions->lru->prev = e;
+	else               sessions->lru_tail  = e;
+	sessions->lru = e;
+}
+
+/* Forget a session; called with the lock held. */
+static void s_evict(struct gemini_sessions *sessions, struct _session *e) {
+	gemini_map_delete(&sessions->entries, e->key);
+	s_unlink(sessions, e);
+	sessions->stats.entries--;
+	s_free(e);
+}
+
+/* When does a session stop being worth resuming?  Servers say how long
+   they'll honor a session (or a ticket) for; we might not want to wait
+   that long. */
+static time_t s_expires(struct gemini_sessions *sessions, SSL_SESSION *sess) {
+	long timeout;
+
+	timeout = SSL_SESSION_get_timeout(sess);
+	if (sessions->ttl > 0 && sessions->ttl < timeout) {
+		timeout = sessions->ttl;
+	}
+	return SSL_SESSION_get_time(sess) + timeout;
+}
+
+struct gemini_sessions * gemini_sessions_new(size_t max, int ttl) {
+	struct gemini_sessions *sessions;
+
+	sessions = calloc(1, sizeof(struct gemini_sessions));
+	if (!sessions) {
+		return NULL;
+	}
+
+	sessions->max = max ? max : GEMINI_SESSIONS_MAX;
+	sessions->ttl = ttl > 0 ? ttl : 0;
+	if (gemini_map_init(&sessions->entries, sessions->max) != 0) {
+		free(sessions);
+		return NULL;
+	}
+	pthread_mutex_init(&sessions->lock, NULL);
+	return sessions;
+}
+
+SSL_SESSION * gemini_sessions_get(struct gemini_sessions *sessions, const char *key) {
+	struct _session *e;
+	SSL_SESSION *sess;
+
+	sess = NULL;
+	pthread_mutex_lock(&sessions->lock);
+	e = gemini_map_get(&sessions->entries, key);
+	if (e && time(NULL) >= e->expires) {
+		s_evict(sessions, e);
+		e = NULL;
+	}
+	if (e) {
+		s_unlink(sessions, e);
+		s_push(sessions, e);
+		SSL_SESSION_up_ref(e->sess);
+		sess = e->sess;
+		sessions->stats.hits++;
+	} else {
+		sessions->stats.misses++;
+	}
+	pthread_mutex_unlock(&sessions->lock);
+	return sess;
+}
+
+int gemini_sessions_put(struct gemini_sessions *sessions, const char *key, SSL_SESSION *sess) {
+	struct _session *e, *old;
+
+	if (!SSL_SESSION_is_resumable(sess)) {
+		SSL_SESSION_free(sess);
+		return -1;
+	}
+
+	e = calloc(1, sizeof(struct _session));
+	if (!e || !(e->key = strdup(key))) {
+		free(e);
+		SSL_SESSION_free(sess);
+		return -1;
+	}
+	e->sess    = sess;
+	e->expires = s_expires(sessions, sess);
+	if (time(NULL) >= e->expires) {
+		s_free(e);
+		return -1;
+	}
+
+	pthread_mutex_lock(&sessions->lock);
+	old = gemini_map_get(&sessions->entries, key);
+	if (old) {
+		s_evict(sessions, old);
+	}
+	while (sessions->lru_tail && sessions->stats.entries >= sessions->max) {
+		s_evict(sessions, sessions->lru_tail);
+		sessions->stats.evictions++;
+	}
+	if (gemini_map_set(&sessions->entries, key, e) == e) {
+		pthread_mutex_unlock(&sessions->lock);
+		s_free(e);
+		return -1;
+	}
+	s_push(sessions, e);
+	sessions->stats.entries++;
+	sessions->stats.stores++;
+	pthread_mutex_unlock(&sessions->lock);
+	return 0;
+}
+
+int gemini_sessions_load(struct gemini_sessions *sessions, const char *file) {
+	FILE *io;
+	SSL_SESSION *sess;
+	char key[GEMINI_MAX_REQUEST];
+	int n;
+
+	io = fopen(file, "r");
+	if (!io) {
+		return errno == ENOENT ? 0 : -1;
+	}
+
+	/* each session is a host:port line, followed by the PEM-encoded
+	   session; a file we can't make sense of is just a cold cache. */
+	n = 0;
+	while (fgets(key, sizeof(key), io)) {
+		key[strcspn(key, "\r\n")] = '\0';
+		sess = PEM_read_SSL_SESSION(io, NULL, NULL, NULL);
+		if (!sess) {
+			break;
+		}
+		if (gemini_sessions_put(sessions, key, sess) == 0) {
+			n++;
+		}
+	}
+	fclose(io);
+	return n;
+}
+
+int gemini_sessions_save(struct gemini_sessions *sessions, const char *file) {
+	struct _session *e;
+	char tmp[4096];
+	FILE *io;
+	time_t now;
+	int fd, rc;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", file) >= (int)sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	fd = mkstemp(tmp); /* mode 0600, which is what we want */
+	if (fd < 0) {
+		return -1;
+	}
+	io = fdopen(fd, "w");
+	if (!io) {
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+
+	/* oldest first, so that loading them back in leaves the LRU in the
+	   same order it is in now */
+	rc = 0;
+	now = time(NULL);
+	pthread_mutex_lock(&sessions->lock);
+	for (e = sessions->lru_tail; e && rc == 0; e = e->prev) {
+		if (now >= e->expires) {
+			continue;
+		}
+		if (fprintf(io, "%s\n", e->key) < 0 || !PEM_write_SSL_SESSION(io, e->sess)) {
+			rc = -1;
+		}
+	}
+	pthread_mutex_unlock(&sessions->lock);
+
+	if (fclose(io) != 0) {
+		rc = -1;
+	}
+	if (rc == 0 && rename(tmp, file) != 0) {
+		rc = -1;
+	}
+	if (rc != 0) {
+		unlink(tmp);
+	}
+	return rc;
+}
+
+void gemini_sessions_stats(struct gemini_sessions *sessions, struct gemini_sessions_stats *stats) {
+	pthread_mutex_lock(&sessions->lock);
+	memcpy(stats, &sessions->stats, sizeof(struct gemini_sessions_stats));
+	pthread_mutex_unlock(&sessions->lock);
+}
+
+void gemini_sessions_free(struct gemini_sessions *sessions) {
+	struct _session *e, *next;
+
+	if (!sessions) return;
+
+	for (e = sessions->lru; e; e = next) {
+		next = e->next;
+		s_free(e);
+	}
+	gemini_map_free(&sessions->entries, NULL);
+	pthread_mutex_destroy(&sessions->lock);
+	free(sessions);
+}
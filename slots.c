@@ -0,0 +1,113 @@
+#include "./gemini.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct gemini_slots * gemini_slots_new(SSL_CTX *ctx, unsigned int n) {
+	struct gemini_slots *slots;
+	unsigned int i;
+
+	slots = calloc(1, sizeof(struct gemini_slots));
+	if (!slots) {
+		return NULL;
+	}
+	slots->slots = calloc(n, sizeof(struct gemini_request));
+	slots->idle  = calloc(n, sizeof(struct gemini_request *));
+	if (!slots->slots || !slots->idle) {
+		free(slots->slots);
+		free(slots->idle);
+		free(slots);
+		return NULL;
+	}
+	pthread_mutex_init(&slots->lock, NULL);
+	pthread_cond_init(&slots->freed, NULL);
+	slots->lean = ctx == NULL;
+
+	/* the first slot taken is the last one pushed; keep them in order */
+	for (i = 0; i < n; i++) {
+		slots->stats.size = i + 1;
+		if (gemini_request_init(&slots->slots[i], ctx) != 0) {
+			gemini_slots_free(slots);
+			return NULL;
+		}
+		slots->idle[slots->nidle++] = &slots->slots[n - 1 - i];
+	}
+	return slots;
+}
+
+struct gemini_request * gemini_slots_acquire(struct gemini_slots *slots) {
+	struct gemini_request *req;
+
+	pthread_mutex_lock(&slots->lock);
+	if (slots->nidle == 0) {
+		slots->stats.waits++;
+		while (slots->nidle == 0) {
+			pthread_cond_wait(&slots->freed, &slots->lock);
+		}
+	}
+	req = slots->idle[--slots->nidle];
+
+	slots->stats.busy++;
+	if (slots->stats.busy > slots->stats.peak) {
+		slots->stats.peak = slots->stats.busy;
+	}
+	pthread_mutex_unlock(&slots->lock);
+	return req;
+}
+
+void gemini_slots_release(struct gemini_slots *slots, struct gemini_request *req) {
+	if (slots->lean) {
+		gemini_request_release(req);
+	}
+
+	pthread_mutex_lock(&slots->lock);
+	slots->idle[slots->nidle++] = req;
+	slots->stats.busy--;
+	pthread_cond_signal(&slots->freed);
+	pthread_mutex_unlock(&slots->lock);
+}
+
+void gemini_slots_stats(struct gemini_slots *slots, struct gemini_slots_stats *stats) {
+	pthread_mutex_lock(&slots->lock);
+	memcpy(stats, &slots->stats, sizeof(struct gemini_slots_stats));
+	pthread_mutex_unlock(&slots->lock);
+}
+
+void gemini_slots_quiesce(struct gemini_slots *slots, unsigned long epoch) {
+	unsigned long e;
+	unsigned int i;
+
+	for (i = 0; i < slots->stats.size; i++) {
+		while ((e = __atomic_load_n(&slots->slots[i].epoch, __ATOMIC_SEQ_CST)) != 0 && e <= epoch) {
+			usleep(1000);
+		}
+	}
+}
+
+void gemini_slots_quiesce_tls(struct gemini_slots *slots, unsigned long epoch) {
+	unsigned long e;
+	unsigned int i;
+
+	for (i = 0; i < slots->stats.size; i++) {
+		while ((e = __atomic_load_n(&slots->slots[i].tls_epoch, __ATOMIC_SEQ_CST)) != 0 && e <= epoch) {
+			usleep(1000);
+		}
+	}
+}
+
+void gemini_slots_free(struct gemini_slots *slots) {
+	unsigned int i;
+
+	if (!slots) return;
+
+	for (i = 0; i < slots->stats.size; i++) {
+		gemini_request_release(&slots->slots[i]);
+	}
+	pthread_cond_destroy(&slots->freed);
+	pthread_mutex_destroy(&slots->lock);
+	free(slots->idle);
+	free(slots->slots);
+	free(slots);
+}
@@ -0,0 +1,500 @@
+#include "./gemini.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include <openssl/evp.h>
+
+#define STORE_MAGIC "gemstor1"
+
+#define SLOT_EMPTY 0
+#define SLOT_LIVE  1
+#define SLOT_GONE  2 /* deleted; lookups have to probe past it */
+
+struct _slot {
+	unsigned char key[32];    /* SHA-256 of the URL (and client certificate) */
+	unsigned char object[32]; /* SHA-256 of the response, which names its file */
+	int64_t  stored; /* when it was fetched */
+	uint64_t used;   /* the index's clock, when it was last used */
+	uint64_t size;
+	uint32_t state;  /* SLOT_* */
+	uint32_t unused;
+};
+
+/* The index file, as mapped; the slots are an open-addressed hash table,
+   probed linearly from the first 32 bits of the key. */
+struct _index {
+	char     magic[8];
+	uint32_t slots;
+	uint32_t entries;
+	uint32_t gone;    /* SLOT_GONE slots */
+	uint32_t unused;
+	uint64_t bytes;   /* sum of the sizes of the live slots */
+	uint64_t clock;   /* ticks on every hit and store, for LRU */
+
+	struct _slot slot[];
+};
+
+struct _policy {
+	struct _policy *next;
+
+	char *prefix;
+	int   ttl;
+};
+
+struct gemini_store_entry {
+	struct gemini_store *store;
+	unsigned char        key[32];
+
+	char       *tmp; /* where the response is being written */
+	int         fd;
+	EVP_MD_CTX *md;
+
+	char   status[2]; /* the first two octets of the response */
+	size_t size;
+	int    skip;      /* non-zero once we know it isn't worth keeping */
+};
+
+/* Take the index for ourselves, from other threads and other processes. */
+static void s_lock(struct gemini_store *store) {
+	pthread_mutex_lock(&store->lock);
+	while (flock(store->fd, LOCK_EX) != 0 && errno == EINTR)
+		;
+}
+
+static void s_unlock(struct gemini_store *store) {
+	flock(store->fd, LOCK_UN);
+	pthread_mutex_unlock(&store->lock);
+}
+
+static void s_key(struct gemini_store *store, const char *url, unsigned char *key) {
+	EVP_MD_CTX *md;
+
+	md = EVP_MD_CTX_new();
+	EVP_DigestInit_ex(md, EVP_sha256(), NULL);
+	EVP_DigestUpdate(md, store->ident, strlen(store->ident));
+	EVP_DigestUpdate(md, " ", 1);
+	EVP_DigestUpdate(md, url, strlen(url));
+	EVP_DigestFinal_ex(md, key, NULL);
+	EVP_MD_CTX_free(md);
+}
+
+/* Where the response with a given hash lives: DIR/ab/cdef... */
+static int s_path(struct gemini_store *store, const unsigned char *object, char *path, size_t len) {
+	char hex[65];
+	int i;
+
+	for (i = 0; i < 32; i++) {
+		snprintf(hex + 2 * i, 3, "%02x", object[i]);
+	}
+	return snprintf(path, len, "%s/%.2s/%s", store->dir, hex, hex + 2) < (int)len ? 0 : -1;
+}
+
+static int s_ttl(struct gemini_store *store, const char *url) {
+	struct _policy *p, *best;
+
+	for (best = NULL, p = store->policies; p; p = p->next) {
+		if (strncmp(url, p->prefix, strlen(p->prefix)) == 0
+		 && (!best || strlen(p->prefix) > strlen(best->prefix))) {
+			best = p;
+		}
+	}
+	return best ? best->ttl : store->ttl;
+}
+
+/* Find the slot for key, and (if spare isn't NULL) the first slot a new
+   entry for it could go in; called with the lock held. */
+static struct _slot * s_find(struct gemini_store *store, const unsigned char *key, struct _slot **spare) {
+	struct _index *idx;
+	struct _slot *slot;
+	uint32_t i, n;
+
+	idx = store->index;
+	if (spare) *spare = NULL;
+
+	i = (key[0] | key[1] << 8 | key[2] << 16 | (uint32_t)key[3] << 24) % idx->slots;
+	for (n = 0; n < idx->slots; n++, i = (i + 1) % idx->slots) {
+		slot = &idx->slot[i];
+		if (slot->state == SLOT_EMPTY) {
+			if (spare && !*spare) *spare = slot;
+			return NULL;
+		}
+		if (slot->state == SLOT_GONE) {
+			if (spare && !*spare) *spare = slot;
+			continue;
+		}
+		if (memcmp(slot->key, key, 32) == 0) {
+			return slot;
+		}
+	}
+	return NULL;
+}
+
+/* Is anyone still using the response with a given hash? */
+static int s_shared(struct gemini_store *store, const unsigned char *object) {
+	uint32_t i;
+
+	for (i = 0; i < store->index->slots; i++) {
+		if (store->index->slot[i].state == SLOT_LIVE && memcmp(store->index->slot[i].object, object, 32) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Forget an entry, and its response (if no one else has it); called with
+   the lock held. */
+static void s_drop(struct gemini_store *store, struct _slot *slot) {
+	char path[4096];
+
+	slot->state = SLOT_GONE;
+	store->index->entries--;
+	store->index->gone++;
+	store->index->bytes -= slot->size;
+
+	if (!s_shared(store, slot->object) && s_path(store, slot->object, path, sizeof(path)) == 0) {
+		unlink(path);
+	}
+}
+
+static void s_evict(struct gemini_store *store) {
+	struct _slot *lru;
+	uint32_t i;
+
+	for (lru = NULL, i = 0; i < store->index->slots; i++) {
+		if (store->index->slot[i].state == SLOT_LIVE && (!lru || store->index->slot[i].used < lru->used)) {
+			lru = &store->index->slot[i];
+		}
+	}
+	if (lru) {
+		s_drop(store, lru);
+		store->stats.evictions++;
+	}
+}
+
+/* Once enough of the table is tombstones, lookups for things that aren't
+   there have to look at nearly every slot; put the live ones back in
+   place, and start over. */
+static void s_rehash(struct gemini_store *store) {
+	struct _index *idx;
+	struct _slot *live, *spare;
+	uint32_t i, n;
+
+	idx = store->index;
+	live = malloc(idx->entries * sizeof(struct _slot));
+	if (!live) {
+		return;
+	}
+	for (n = i = 0; i < idx->slots; i++) {
+		if (idx->slot[i].state == SLOT_LIVE) {
+			memcpy(&live[n++], &idx->slot[i], sizeof(struct _slot));
+		}
+	}
+	memset(idx->slot, 0, idx->slots * sizeof(struct _slot));
+	idx->gone = 0;
+	for (i = 0; i < n; i++) {
+		s_find(store, live[i].key, &spare);
+		memcpy(spare, &live[i], sizeof(struct _slot));
+	}
+	free(live);
+}
+
+struct gemini_store * gemini_store_open(const char *dir, size_t budget, int ttl) {
+	struct gemini_store *store;
+	struct stat st;
+	char path[4096];
+	size_t size;
+
+	if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+		return NULL;
+	}
+	if (snprintf(path, sizeof(path), "%s/index", dir) >= (int)sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	store = calloc(1, sizeof(struct gemini_store));
+	if (!store || !(store->dir = strdup(dir))) {
+		free(store);
+		return NULL;
+	}
+	store->budget = budget ? budget : GEMINI_STORE_BUDGET;
+	store->ttl    = ttl > 0 ? ttl : GEMINI_STORE_TTL;
+	pthread_mutex_init(&store->lock, NULL);
+
+	store->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+	if (store->fd < 0) {
+		goto fail;
+	}
+
+	/* an index we don't recognize (or a half-made one) is just a cold
+	   store; whoever gets here first sets it up */
+	size = sizeof(struct _index) + GEMINI_STORE_SLOTS * sizeof(struct _slot);
+	flock(store->fd, LOCK_EX);
+	if (fstat(store->fd, &st) != 0) {
+		flock(store->fd, LOCK_UN);
+		goto fail;
+	}
+	if ((size_t)st.st_size != size && (ftruncate(store->fd, 0) != 0 || ftruncate(store->fd, size) != 0)) {
+		flock(store->fd, LOCK_UN);
+		goto fail;
+	}
+	store->index = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, store->fd, 0);
+	if (store->index == MAP_FAILED) {
+		store->index = NULL;
+		flock(store->fd, LOCK_UN);
+		goto fail;
+	}
+	store->size = size;
+	if (memcmp(store->index->magic, STORE_MAGIC, 8) != 0 || store->index->slots != GEMINI_STORE_SLOTS) {
+		memset(store->index, 0, size);
+		memcpy(store->index->magic, STORE_MAGIC, 8);
+		store->index->slots = GEMINI_STORE_SLOTS;
+	}
+	flock(store->fd, LOCK_UN);
+	return store;
+
+fail:
+	gemini_store_close(store);
+	return NULL;
+}
+
+int gemini_store_policy(struct gemini_store *store, const char *prefix, int ttl) {
+	struct _policy *p;
+
+	p = calloc(1, sizeof(struct _policy));
+	if (!p || !(p->prefix = strdup(prefix))) {
+		free(p);
+		return -1;
+	}
+	p->ttl = ttl > 0 ? ttl : 0;
+
+	pthread_mutex_lock(&store->lock);
+	p->next = store->policies;
+	store->policies = p;
+	pthread_mutex_unlock(&store->lock);
+	return 0;
+}
+
+int gemini_store_get(struct gemini_store *store, const char *url) {
+	unsigned char key[32];
+	struct _slot *slot;
+	char path[4096];
+	int ttl, fd;
+
+	pthread_mutex_lock(&store->lock);
+	ttl = s_ttl(store, url);
+	pthread_mutex_unlock(&store->lock);
+	if (ttl <= 0) {
+		return -1;
+	}
+
+	s_key(store, url, key);
+	fd = -1;
+	s_lock(store);
+	slot = s_find(store, key, NULL);
+	if (slot && slot->stored + ttl <= time(NULL)) {
+		store->stats.expired++;
+		slot = NULL;
+	}
+	if (slot && s_path(store, slot->object, path, sizeof(path)) == 0) {
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			s_drop(store, slot); /* someone cleaned up after us */
+		} else {
+			slot->used = ++store->index->clock;
+		}
+	}
+	if (fd < 0) store->stats.misses++;
+	else        store->stats.hits++;
+	s_unlock(store);
+	return fd;
+}
+
+struct gemini_store_entry * gemini_store_begin(struct gemini_store *store, const char *url) {
+	struct gemini_store_entry *e;
+	char tmp[4096];
+	int ttl;
+
+	pthread_mutex_lock(&store->lock);
+	ttl = s_ttl(store, url);
+	pthread_mutex_unlock(&store->lock);
+	if (ttl <= 0) {
+		return NULL;
+	}
+	if (snprintf(tmp, sizeof(tmp), "%s/tmp.XXXXXX", store->dir) >= (int)sizeof(tmp)) {
+		return NULL;
+	}
+
+	e = calloc(1, sizeof(struct gemini_store_entry));
+	if (!e) {
+		return NULL;
+	}
+	e->store = store;
+	s_key(store, url, e->key);
+
+	e->fd = mkstemp(tmp);
+	if (e->fd < 0) {
+		free(e);
+		return NULL;
+	}
+	e->tmp = strdup(tmp);
+	e->md  = EVP_MD_CTX_new();
+	if (!e->tmp || !e->md || !EVP_DigestInit_ex(e->md, EVP_sha256(), NULL)) {
+		e->skip = 1;
+		gemini_store_finish(e, 0);
+		return NULL;
+	}
+	return e;
+}
+
+void gemini_store_append(struct gemini_store_entry *e, const void *buf, size_t n) {
+	const char *p;
+	ssize_t nwrit;
+
+	if (e->skip) {
+		return;
+	}
+
+	/* don't bother writing down anything but a 20 */
+	if (e->size < 2) {
+		memcpy(e->status + e->size, buf, n < 2 - e->size ? n : 2 - e->size);
+		if (e->size + n >= 2 && memcmp(e->status, "20", 2) != 0) {
+			e->skip = 1;
+			return;
+		}
+	}
+	if (e->size + n > e->store->budget) {
+		e->skip = 1;
+		return;
+	}
+
+	EVP_DigestUpdate(e->md, buf, n);
+	e->size += n;
+	for (p = buf; n > 0; p += nwrit, n -= nwrit) {
+		nwrit = write(e->fd, p, n);
+		if (nwrit < 0 && errno == EINTR) {
+			nwrit = 0;
+			continue;
+		}
+		if (nwrit < 0) {
+			e->skip = 1;
+			return;
+		}
+	}
+}
+
+int gemini_store_finish(struct gemini_store_entry *e, int keep) {
+	struct gemini_store *store;
+	unsigned char object[32], old[32];
+	struct _slot *slot, *spare;
+	char path[4096];
+	int rc, replaced;
+
+	store = e->store;
+	rc = replaced = -1;
+	if (!keep || e->skip || e->size < 2 || !EVP_DigestFinal_ex(e->md, object, NULL)
+	 || s_path(store, object, path, sizeof(path)) != 0) {
+		goto done;
+	}
+
+	/* the response's file goes in before the index points at it */
+	path[strlen(store->dir) + 3] = '\0';
+	if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+		goto done;
+	}
+	path[strlen(store->dir) + 3] = '/';
+
+	s_lock(store);
+	if (rename(e->tmp, path) != 0) {
+		s_unlock(store);
+		goto done;
+	}
+
+	if (store->index->gone > store->index->slots / 4) {
+		s_rehash(store);
+	}
+	while (store->index->entries >= store->index->slots / 4 * 3) {
+		s_evict(store);
+	}
+
+	slot = s_find(store, e->key, &spare);
+	if (slot) {
+		replaced = 1;
+		memcpy(old, slot->object, 32);
+		store->index->bytes -= slot->size;
+	} else {
+		slot = spare;
+		store->index->entries++;
+		if (slot->state == SLOT_GONE) store->index->gone--;
+	}
+	memcpy(slot->key,    e->key, 32);
+	memcpy(slot->object, object, 32);
+	slot->stored = time(NULL);
+	slot->used   = ++store->index->clock;
+	slot->size   = e->size;
+	store->index->bytes += e->size;
+
+	if (replaced == 1 && memcmp(old, object, 32) != 0
+	 && !s_shared(store, old) && s_path(store, old, path, sizeof(path)) == 0) {
+		unlink(path); /* what we had for this URL before */
+	}
+	slot->state = SLOT_LIVE;
+
+	/* everything else is older than what we just stored */
+	while (store->index->bytes > store->budget && store->index->entries > 1) {
+		s_evict(store);
+	}
+	store->stats.stores++;
+	s_unlock(store);
+	rc = 0;
+
+done:
+	close(e->fd);
+	if (rc != 0) {
+		unlink(e->tmp);
+	}
+	free(e->tmp);
+	EVP_MD_CTX_free(e->md);
+	free(e);
+	return rc;
+}
+
+void gemini_store_stats(struct gemini_store *store, struct gemini_store_stats *stats) {
+	s_lock(store);
+	memcpy(stats, &store->stats, sizeof(struct gemini_store_stats));
+	stats->entries = store->index->entries;
+	stats->bytes   = store->index->bytes;
+	s_unlock(store);
+}
+
+void gemini_store_close(struct gemini_store *store) {
+	struct _policy *p, *next;
+
+	if (!store) return;
+
+	for (p = store->policies; p; p = next) {
+		next = p->next;
+		free(p->prefix);
+		free(p);
+	}
+	if (store->index) {
+		munmap(store->index, store->size);
+	}
+	if (store->fd >= 0) {
+		close(store->fd);
+	}
+	pthread_mutex_destroy(&store->lock);
+	free(store->dir);
+	free(store);
+}
@@ -0,0 +1,146 @@
+#include "./ctap.h"
+#include "./fixtures.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+/* Stands in for a CGI program: counts how many times it runs, and says
+   so in its response. */
+static int s_handler(const char *prefix, struct gemini_request *req, void *_calls) {
+	char body[64];
+	int *calls, n;
+
+	calls = _calls;
+	(*calls)++;
+
+	if (strstr(req->url->path, "/missing")) {
+		gemini_request_respond(req, 51, "Not Found");
+		gemini_request_close(req);
+		return GEMINI_HANDLER_DONE;
+	}
+	if (strstr(req->url->path, "/private")) {
+		gemini_request_directives(req, "Cache-Control: no-store\r\n", 25);
+	}
+	if (strstr(req->url->path, "/brief")) {
+		gemini_request_directives(req, "Cache-Control: max-age=1, stale-while-revalidate=60\r\n", 53);
+	}
+
+	gemini_request_respond(req, 20, "text/plain");
+	n = snprintf(body, sizeof(body), "call %d\n", *calls);
+	gemini_request_write(req, body, n);
+	gemini_request_close(req);
+	return GEMINI_HANDLER_DONE;
+}
+
+/* Make a request through the cache (or the handler behind it). */
+static const char * s_fetch(struct gemini_cached *c, const char *url) {
+	return test_fetch(gemini_cache_handler, "/", c, url);
+}
+
+static inline void run_directives_tests() {
+	struct gemini_request req;
+	const char *s;
+
+	memset(&req, 0, sizeof(req));
+	req.maxage = req.stale = -1;
+
+	s = "Cache-Control: max-age=30, stale-while-revalidate=60\r\n20 text/gemini\r\n";
+	is_int(gemini_request_directives(&req, s, strlen(s)), strlen(s) - 16, "directive line length should be returned");
+	is_int(req.maxage, 30, "max-age should be parsed");
+	is_int(req.stale,  60, "stale-while-revalidate should be parsed");
+
+	req.maxage = req.stale = -1;
+	s = "20 text/gemini\r\n";
+	is_int(gemini_request_directives(&req, s, strlen(s)), 0, "status lines are not directives");
+	is_int(req.maxage, -1, "status lines leave max-age alone");
+
+	s = "Cache-Con";
+	is_int(gemini_request_directives(&req, s, strlen(s)), -1, "a partial directive needs more input");
+	s = "Cache-Control: max-age=5";
+	is_int(gemini_request_directives(&req, s, strlen(s)), -1, "an unterminated directive needs more input");
+
+	s = "cache-control: no-store, max-age=10\n";
+	is_int(gemini_request_directives(&req, s, strlen(s)), strlen(s), "directives are case-insensitive");
+	is_int(req.maxage, 0, "no-store wins out over max-age");
+}
+
+static inline void run_cache_tests() {
+	struct gemini_cache *cache;
+	struct gemini_cache_stats st;
+	struct gemini_cached c;
+	int calls = 0;
+
+	cache = gemini_cache_new(0);
+	isnt_null(cache, "should be able to create a cache");
+	if (!cache) return;
+	ok(gemini_cache_policy(cache, "/cached", 60, 0, 0) == 0, "should be able to set a policy for /cached");
+	ok(gemini_cache_policy(cache, "/cached/never", 0, 0, 0) == 0, "should be able to set a policy for /cached/never");
+
+	c.fn    = s_handler;
+	c.data  = &calls;
+	c.cache = cache;
+
+	is(s_fetch(&c, "gemini://localhost/other"), "20 text/plain\r\ncall 1\n", "uncovered URLs go to the handler");
+	is(s_fetch(&c, "gemini://localhost/other"), "20 text/plain\r\ncall 2\n", "uncovered URLs are not cached");
+
+	is(s_fetch(&c, "gemini://localhost/cached/x"), "20 text/plain\r\ncall 3\n", "first request for /cached/x runs the handler");
+	is(s_fetch(&c, "gemini://localhost/cached/x"), "20 text/plain\r\ncall 3\n", "second request for /cached/x comes from the cache");
+	is(s_fetch(&c, "gemini://localhost/cached/x?q"), "20 text/plain\r\ncall 4\n", "query strings are part of the key");
+	is(s_fetch(&c, "gemini://elsewhere/cached/x"), "20 text/plain\r\ncall 5\n", "host names are part of the key");
+
+	s_fetch(&c, "gemini://localhost/cached/never");
+	is(s_fetch(&c, "gemini://localhost/cached/never"), "20 text/plain\r\ncall 7\n", "the longest matching policy wins");
+	s_fetch(&c, "gemini://localhost/cached/private");
+	is(s_fetch(&c, "gemini://localhost/cached/private"), "20 text/plain\r\ncall 9\n", "handlers can opt out with no-store");
+	s_fetch(&c, "gemini://localhost/cached/missing");
+	is(s_fetch(&c, "gemini://localhost/cached/missing"), "51 Not Found\r\n", "error responses are not cached");
+	is_int(calls, 11, "error responses run the handler every time");
+
+	is(s_fetch(&c, "gemini://localhost/brief"), "20 text/plain\r\ncall 12\n", "handlers can opt in without a policy");
+	is(s_fetch(&c, "gemini://localhost/brief"), "20 text/plain\r\ncall 12\n", "opted-in responses are cached");
+	sleep(2);
+	is(s_fetch(&c, "gemini://localhost/brief"), "20 text/plain\r\ncall 12\n", "stale responses are served while refreshing");
+	is_int(calls, 13, "serving a stale response refreshes it");
+	is(s_fetch(&c, "gemini://localhost/brief"), "20 text/plain\r\ncall 13\n", "refreshed responses replace stale ones");
+
+	gemini_cache_stats(cache, &st);
+	is_uint(st.entries, 4, "four responses should be cached");
+	is_uint(st.hits,    4, "four requests should have been hits");
+	is_uint(st.stale,   1, "one of which was stale");
+	gemini_cache_free(cache);
+}
+
+static inline void run_budget_tests() {
+	struct gemini_cache *cache;
+	struct gemini_cache_stats st;
+	struct gemini_cached c;
+	int calls = 0;
+
+	/* each response is 23 octets; only two fit */
+	cache = gemini_cache_new(50);
+	if (!cache) return;
+	gemini_cache_policy(cache, "/", 60, 0, 0);
+
+	c.fn    = s_handler;
+	c.data  = &calls;
+	c.cache = cache;
+
+	s_fetch(&c, "gemini://localhost/a");
+	s_fetch(&c, "gemini://localhost/b");
+	s_fetch(&c, "gemini://localhost/a"); /* now b is the least recently used */
+	s_fetch(&c, "gemini://localhost/c");
+
+	gemini_cache_stats(cache, &st);
+	is_uint(st.entries,   2, "only two responses fit in the budget");
+	is_uint(st.evictions, 1, "one response should have been evicted");
+	cmp_ok(st.bytes, "<=", 50, "the cache should stay within its budget");
+	is(s_fetch(&c, "gemini://localhost/a"), "20 text/plain\r\ncall 1\n", "recently used responses survive eviction");
+	is(s_fetch(&c, "gemini://localhost/b"), "20 text/plain\r\ncall 4\n", "the least recently used response is evicted");
+	gemini_cache_free(cache);
+}
+
+TESTS {
+	run_directives_tests();
+	run_cache_tests();
+	run_budget_tests();
+}
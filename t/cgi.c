@@ -0,0 +1,57 @@
+#include "./ctap.h"
+#include "./fixtures.h"
+
+#include <stdlib.h>
+#include <sys/stat.h>
+
+static char dir[] = "/tmp/geminon-cgi-test-XXXXXX";
+
+/* Write a program (or just a file) into the CGI directory. */
+static void s_program(const char *name, const char *body, int mode) {
+	char path[256];
+	FILE *io;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	io = fopen(path, "w");
+	if (!io) {
+		BAIL_OUT("unable to write a test program");
+	}
+	fprintf(io, "#!/bin/sh\n%s\n", body);
+	fclose(io);
+	chmod(path, mode);
+}
+
+static const char * s_fetch(const char *url) {
+	return test_fetch(gemini_cgi_handler, "/cgi", dir, url);
+}
+
+TESTS {
+	char path[256];
+
+	if (!mkdtemp(dir)) {
+		BAIL_OUT("unable to create a temporary directory");
+	}
+	snprintf(path, sizeof(path), "%s/sub", dir);
+	mkdir(path, 0755);
+	s_program("echo",     "printf '20 text/plain\\r\\n%s|%s|%s\\n' \"$SCRIPT_NAME\" \"$PATH_INFO\" \"$QUERY_STRING\"", 0755);
+	s_program("sub/deep", "printf '20 text/plain\\r\\n%s|%s|%s\\n' \"$SCRIPT_NAME\" \"$PATH_INFO\" \"$QUERY_STRING\"", 0755);
+	s_program("other",    "printf '20 text/plain\\r\\nother\\n'", 0755);
+	s_program("plain",    "printf '20 text/plain\\r\\nplain\\n'", 0644);
+
+	is(s_fetch("gemini://localhost/cgi/echo"), "20 text/plain\r\n/cgi/echo||\n",
+		"a program should be run, with nothing left over for its PATH_INFO");
+	is(s_fetch("gemini://localhost/cgi/echo/extra"), "20 text/plain\r\n/cgi/echo|/extra|\n",
+		"whatever follows the program in the path should be its PATH_INFO");
+	is(s_fetch("gemini://localhost/cgi/echo/extra/more?a=b"), "20 text/plain\r\n/cgi/echo|/extra/more|a=b\n",
+		"PATH_INFO can run to several components, and comes apart from the query string");
+	is(s_fetch("gemini://localhost/cgi/sub/deep/x?y"), "20 text/plain\r\n/cgi/sub/deep|/x|y\n",
+		"programs in subdirectories should be found");
+	is(s_fetch("gemini://localhost/cgi/echo?x=/../other"), "20 text/plain\r\n/cgi/echo||x=/../other\n",
+		"the query string should have no say in which program runs");
+	is(s_fetch("gemini://localhost/cgi/missing/extra"), "51 Not Found\r\n", "paths that lead nowhere should not be found");
+	is(s_fetch("gemini://localhost/cgi/plain"), "51 Not Found\r\n", "files that can't be executed should not be run");
+	is(s_fetch("gemini://localhost/cgi/sub"), "51 Not Found\r\n", "directories should not be run");
+
+	snprintf(path, sizeof(path), "rm -rf %s", dir);
+	system(path);
+}
@@ -0,0 +1,316 @@
+#include "./ctap.h"
+#include "./fixtures.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+
+static unsigned short port;
+
+/* Answers requests, one at a time, forever; requests for /slow take a
+   second to get an answer. */
+static void * s_server(void *_fd) {
+	SSL_CTX *ctx;
+	SSL *ssl;
+	char buf[1024];
+	int fd, n;
+
+	ctx = test_server_ctx();
+	for (;;) {
+		fd = accept(*(int *)_fd, NULL, NULL);
+		if (fd < 0) continue;
+
+		ssl = SSL_new(ctx);
+		SSL_set_fd(ssl, fd);
+		if (SSL_accept(ssl) == 1 && (n = SSL_read(ssl, buf, sizeof(buf) - 1)) > 0) {
+			buf[n] = '\0';
+			if (strstr(buf, "/slow")) sleep(1);
+			SSL_write(ssl, "20 text/plain\r\nhi\n", 18);
+		}
+		SSL_shutdown(ssl);
+		SSL_free(ssl);
+		close(fd);
+	}
+	return NULL;
+}
+
+/* Listen on ip:port (port zero picks one). */
+static int s_listen(const char *ip, unsigned short p, int backlog) {
+	struct sockaddr_in sin;
+	socklen_t len;
+	int fd;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port   = htons(p);
+	inet_pton(AF_INET, ip, &sin.sin_addr);
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0 || listen(fd, backlog) != 0) {
+		return -1;
+	}
+	len = sizeof(sin);
+	getsockname(fd, (struct sockaddr *)&sin, &len);
+	port = ntohs(sin.sin_port);
+	return fd;
+}
+
+/* multi.example is a blackhole (127.0.0.2) and a working server
+   (127.0.0.1); hole.example is just the blackhole, and so is
+   stall.example, which takes a while to look up. */
+static int s_stub(const char *host, const char *service, const struct addrinfo *hints, struct addrinfo **res) {
+	struct addrinfo hint, *hole, *good;
+
+	if (strcmp(host, "stall.example") == 0) {
+		usleep(300 * 1000);
+	}
+	memset(&hint, 0, sizeof(hint));
+	hint.ai_flags    = AI_NUMERICHOST;
+	hint.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo("127.0.0.2", service, &hint, &hole) != 0) {
+		return EAI_FAIL;
+	}
+	if (strcmp(host, "multi.example") == 0) {
+		if (getaddrinfo("127.0.0.1", service, &hint, &good) != 0) {
+			freeaddrinfo(hole);
+			return EAI_FAIL;
+		}
+		hole->ai_next = good;
+	}
+	*res = hole;
+	return 0;
+}
+
+/* Make a request, and return the whole response (or "(failed)"). */
+static const char * s_fetch(struct gemini_client *client, const char *path, long *ms) {
+	static char buf[256];
+	struct gemini_response *res;
+	char url[128];
+	ssize_t n;
+
+	snprintf(url, sizeof(url), "gemini://%s:%u%s", strstr(path, "/hole") ? "hole.example" : "multi.example", port, path);
+	*ms = gemini_now_ms();
+	res = gemini_client_request(client, url);
+	*ms = gemini_now_ms() - *ms;
+	if (!res) return "(failed)";
+
+	n = gemini_response_read(res, buf, sizeof(buf) - 1);
+	buf[n > 0 ? n : 0] = '\0';
+	gemini_response_close(res);
+	free(res);
+	return buf;
+}
+
+/* What an asynchronous call has seen. */
+struct _call {
+	int    status;
+	char   meta[64];
+	char   body[64];
+	size_t len;
+	int    done, error;
+};
+
+static void s_on_status(struct gemini_call *call, int status, const char *meta, void *_c) {
+	struct _call *c = _c;
+
+	c->status = status;
+	snprintf(c->meta, sizeof(c->meta), "%s", meta);
+}
+
+static void s_on_body(struct gemini_call *call, const void *buf, size_t n, void *_c) {
+	struct _call *c = _c;
+
+	if (c->len + n < sizeof(c->body)) {
+		memcpy(c->body + c->len, buf, n);
+		c->len += n;
+	}
+}
+
+static void s_on_done(struct gemini_call *call, int error, void *_c) {
+	struct _call *c = _c;
+
+	c->done++;
+	c->error = error;
+}
+
+static const struct gemini_callbacks callbacks = { s_on_status, s_on_body, s_on_done };
+
+static inline void run_async_tests(struct gemini_client *client) {
+	struct gemini_async *async;
+	struct gemini_call *call;
+	struct epoll_event ev;
+	struct _call calls[20], hole, cancelled, outside;
+	char url[128];
+	int i, ok, epfd;
+	long ms;
+
+	async = gemini_async_new(client);
+	isnt_null(async, "should be able to set up for asynchronous requests");
+	if (!async) return;
+
+	memset(calls, 0, sizeof(calls));
+	snprintf(url, sizeof(url), "gemini://multi.example:%u/", port);
+	for (ok = i = 0; i < 20; i++) {
+		if (gemini_async_request(async, url, &callbacks, &calls[i])) ok++;
+	}
+	is_int(ok, 20, "should be able to start twenty asynchronous requests");
+
+	memset(&hole, 0, sizeof(hole));
+	snprintf(url, sizeof(url), "gemini://hole.example:%u/", port);
+	gemini_async_request(async, url, &callbacks, &hole);
+
+	memset(&cancelled, 0, sizeof(cancelled));
+	call = gemini_async_request(async, url, &callbacks, &cancelled);
+	gemini_async_cancel(async, call);
+
+	ms = gemini_now_ms();
+	while (gemini_async_run(async, -1) > 0)
+		;
+	ms = gemini_now_ms() - ms;
+
+	for (ok = i = 0; i < 20; i++) {
+		if (calls[i].done == 1 && calls[i].error == 0 && calls[i].status == 20
+		 && strcmp(calls[i].meta, "text/plain") == 0 && strcmp(calls[i].body, "hi\n") == 0) ok++;
+	}
+	is_int(ok, 20, "all twenty asynchronous requests should get the whole response");
+	is_int(hole.done, 1, "requests to a blackhole should finish");
+	is_int(hole.error, ETIMEDOUT, "requests to a blackhole should time out");
+	is_int(cancelled.done, 0, "cancelled requests should not finish");
+	cmp_ok(ms, "<", 1500, "asynchronous requests should all run at once");
+
+	/* from someone else's event loop */
+	epfd = epoll_create1(0);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, gemini_async_fd(async), &ev);
+
+	memset(&outside, 0, sizeof(outside));
+	snprintf(url, sizeof(url), "gemini://multi.example:%u/", port);
+	gemini_async_request(async, url, &callbacks, &outside);
+	for (i = 0; i < 100 && !outside.done; i++) {
+		epoll_wait(epfd, &ev, 1, gemini_async_timeout(async));
+		gemini_async_run(async, 0);
+	}
+	is_int(outside.status, 20, "requests can be driven from an outside event loop");
+	close(epfd);
+
+	gemini_async_free(async);
+
+	/* let go of it while the (shared) resolver is still looking */
+	async = gemini_async_new(client);
+	if (!async) return;
+	snprintf(url, sizeof(url), "gemini://stall.example:%u/", port);
+	memset(&cancelled, 0, sizeof(cancelled));
+	gemini_async_request(async, url, &callbacks, &cancelled);
+	ms = gemini_now_ms();
+	gemini_async_free(async);
+	cmp_ok(gemini_now_ms() - ms, ">=", 200, "freeing should wait for lookups still in progress");
+	usleep(100 * 1000); /* give the resolver thread time to trip over it */
+	is_int(cancelled.done, 0, "calls still being looked up when freed should not finish");
+}
+
+static inline void run_header_tests(struct gemini_client *client) {
+	struct gemini_response *res, parsed;
+	char url[128], buf[64];
+	ssize_t n;
+	int p[2];
+
+	snprintf(url, sizeof(url), "gemini://multi.example:%u/", port);
+	res = gemini_client_request(client, url);
+	isnt_null(res, "should be able to make a request");
+	if (!res) return;
+
+	is_int(gemini_response_header(res), 0, "should be able to read the status line");
+	is_int(res->status, 20, "the status line should have a status");
+	is(res->meta, "text/plain", "the status line should have a meta");
+
+	res->eager = 1;
+	n = gemini_response_read(res, buf, sizeof(buf) - 1);
+	buf[n > 0 ? n : 0] = '\0';
+	is(buf, "hi\n", "reads after the status line get just the body");
+	gemini_response_close(res);
+	free(res);
+
+	res = gemini_client_request(client, url);
+	if (res && gemini_response_header(res) == 0 && pipe(p) == 0) {
+		is_int(gemini_response_stream(res, p[1], 8192), 0, "should be able to stream a response into a pipe");
+		close(p[1]);
+		n = read(p[0], buf, sizeof(buf) - 1);
+		buf[n > 0 ? n : 0] = '\0';
+		is(buf, "hi\n", "streaming after the status line gets just the body");
+		close(p[0]);
+	}
+	if (res) {
+		gemini_response_close(res);
+		free(res);
+	}
+
+	memset(&parsed, 0, sizeof(parsed));
+	is_int(gemini_response_parse(&parsed, "3", 1), 1, "status lines can be parsed in pieces");
+	is_int(parsed.status, 0, "a partial status line has no status yet");
+	is_int(gemini_response_parse(&parsed, "1 gemini://x/\r\nbody", 19), 15, "only the status line is taken");
+	is_int(parsed.status, 31, "a whole status line has a status");
+	is(parsed.meta, "gemini://x/", "a whole status line has a meta");
+
+	memset(&parsed, 0, sizeof(parsed));
+	ok(gemini_response_parse(&parsed, "hello\r\n", 7) < 0, "bogus status lines are rejected");
+}
+
+TESTS {
+	struct gemini_client client;
+	struct sockaddr_in sin;
+	pthread_t tid;
+	int fd, hole, plug;
+	long ms;
+
+	signal(SIGPIPE, SIG_IGN); /* the server writes to clients that gave up */
+
+	fd = s_listen("127.0.0.1", 0, 64);
+	if (fd < 0) BAIL_OUT("unable to listen on 127.0.0.1");
+	pthread_create(&tid, NULL, s_server, &fd);
+
+	/* with a backlog of zero, and one connection nobody will ever accept,
+	   the kernel drops any more SYNs on the floor */
+	hole = s_listen("127.0.0.2", port, 0);
+	if (hole < 0) BAIL_OUT("unable to listen on 127.0.0.2");
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port   = htons(port);
+	inet_pton(AF_INET, "127.0.0.2", &sin.sin_addr);
+	plug = socket(AF_INET, SOCK_STREAM, 0);
+	connect(plug, (struct sockaddr *)&sin, sizeof(sin));
+
+	memset(&client, 0, sizeof(client));
+	gemini_client_tls(&client, NULL, NULL);
+	gemini_client_resolver(&client, 0, 0, 0);
+	client.resolver->lookup   = s_stub;
+	client.stagger            = 100;
+	client.connect_timeout    = 500;
+	client.first_byte_timeout = 300;
+
+	is(s_fetch(&client, "/", &ms), "20 text/plain\r\nhi\n", "a blackholed address shouldn't keep us from a working one");
+	cmp_ok(ms, "<", 400, "the working address should be tried after the stagger delay");
+
+	is(s_fetch(&client, "/hole", &ms), "(failed)", "requests to only a blackhole should fail");
+	is_int(errno, ETIMEDOUT, "requests to only a blackhole should time out");
+	cmp_ok(ms, ">=", 450, "connection attempts should get the whole connect timeout");
+	cmp_ok(ms, "<", 2000, "connection attempts should get no more than the connect timeout");
+
+	is(s_fetch(&client, "/slow", &ms), "(failed)", "slow responses should fail");
+	is_int(errno, ETIMEDOUT, "slow responses should time out");
+
+	client.first_byte_timeout = 3000;
+	is(s_fetch(&client, "/slow", &ms), "20 text/plain\r\nhi\n", "slow responses are fine, with a long enough timeout");
+
+	client.first_byte_timeout = 300;
+	run_header_tests(&client);
+	run_async_tests(&client);
+
+	close(plug);
+	close(hole);
+	gemini_client_close(&client);
+}
@@ -0,0 +1,208 @@
+#ifndef FIXTURES_H
+#define FIXTURES_H
+
+/* Shared scaffolding for the tests that need something to talk to: stub
+   Gemini servers on the loopback interface, and a way to run a handler
+   with nobody on the other end of the request. */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+
+#include "../gemini.h"
+
+/* A self-signed certificate for cn, good from from seconds from now until
+   until seconds from now, along with the (new) key it was signed with. */
+static inline X509 * test_cert(const char *cn, long from, long until, EVP_PKEY **key) {
+	X509 *cert;
+
+	*key = EVP_EC_gen("P-256");
+	cert = X509_new();
+	ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+	X509_gmtime_adj(X509_getm_notBefore(cert), from);
+	X509_gmtime_adj(X509_getm_notAfter(cert), until);
+	X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC, (const unsigned char *)cn, -1, -1, 0);
+	X509_set_issuer_name(cert, X509_get_subject_name(cert));
+	X509_set_pubkey(cert, *key);
+	X509_sign(cert, *key, EVP_sha256());
+	return cert;
+}
+
+/* The same, written out to PEM files, for gemini_tls() and friends. */
+static inline int test_pem(const char *certfile, const char *keyfile, const char *cn, long from, long until) {
+	EVP_PKEY *key;
+	X509 *cert;
+	FILE *c, *k;
+	int ok;
+
+	cert = test_cert(cn, from, until, &key);
+	c = fopen(certfile, "w");
+	k = fopen(keyfile, "w");
+	ok = c && k && PEM_write_X509(c, cert) && PEM_write_PrivateKey(k, key, NULL, NULL, 0, NULL, NULL);
+	if (c) fclose(c);
+	if (k) fclose(k);
+	X509_free(cert);
+	EVP_PKEY_free(key);
+	return ok ? 0 : -1;
+}
+
+/* A throwaway, self-signed server certificate. */
+static inline SSL_CTX * test_server_ctx() {
+	SSL_CTX *ctx;
+	EVP_PKEY *key;
+	X509 *cert;
+
+	cert = test_cert("localhost", 0, 3600, &key);
+	ctx = SSL_CTX_new(TLS_method());
+	SSL_CTX_use_certificate(ctx, cert);
+	SSL_CTX_use_PrivateKey(ctx, key);
+	X509_free(cert);
+	EVP_PKEY_free(key);
+	return ctx;
+}
+
+/* An upstream, which waits delay milliseconds, and then answers every
+   request with the same response, save that %s is replaced by the URL it
+   was asked for, and then holds on to the connection for linger
+   milliseconds more.  Run test_upstream() in a thread of its own, once
+   test_listen() has found it somewhere to listen. */
+struct test_upstream {
+	int            fd;
+	unsigned short port;
+	int            delay;
+	int            linger;
+	const char    *response;
+	char           url[64]; /* gemini://127.0.0.1:port/ */
+};
+
+static inline void * test_upstream(void *_u) {
+	struct test_upstream *u = _u;
+	SSL_CTX *ctx;
+	SSL *ssl;
+	char buf[1024], out[1100];
+	int fd, n;
+
+	ctx = test_server_ctx();
+	for (;;) {
+		fd = accept(u->fd, NULL, NULL);
+		if (fd < 0) continue;
+
+		ssl = SSL_new(ctx);
+		SSL_set_fd(ssl, fd);
+		if (SSL_accept(ssl) == 1 && (n = SSL_read(ssl, buf, sizeof(buf) - 1)) > 2) {
+			buf[n - 2] = '\0';
+			usleep(u->delay * 1000);
+			n = snprintf(out, sizeof(out), u->response, buf);
+			SSL_write(ssl, out, n);
+			usleep(u->linger * 1000);
+		}
+		SSL_shutdown(ssl);
+		SSL_free(ssl);
+		close(fd);
+	}
+	return NULL;
+}
+
+/* Listen on 127.0.0.1, on some port or other. */
+static inline int test_listen(struct test_upstream *u) {
+	struct sockaddr_in sin;
+	socklen_t len;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	inet_pton(AF_INET, "127.0.0.1", &sin.sin_addr);
+
+	u->fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (u->fd < 0 || bind(u->fd, (struct sockaddr *)&sin, sizeof(sin)) != 0 || listen(u->fd, 64) != 0) {
+		return -1;
+	}
+	len = sizeof(sin);
+	getsockname(u->fd, (struct sockaddr *)&sin, &len);
+	u->port = ntohs(sin.sin_port);
+	snprintf(u->url, sizeof(u->url), "gemini://127.0.0.1:%u/", u->port);
+	return 0;
+}
+
+/* Make a request of a server listening on 127.0.0.1, and return the whole
+   response, status line and all. */
+static inline const char * test_get(unsigned short port, const char *url) {
+	static char out[4096];
+	struct sockaddr_in sin;
+	SSL_CTX *ctx;
+	SSL *ssl;
+	size_t len;
+	int fd, n;
+
+	out[0] = '\0';
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port   = htons(port);
+	inet_pton(AF_INET, "127.0.0.1", &sin.sin_addr);
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+		return out;
+	}
+	ctx = SSL_CTX_new(TLS_client_method());
+	ssl = SSL_new(ctx);
+	SSL_set_fd(ssl, fd);
+	if (SSL_connect(ssl) == 1) {
+		SSL_write(ssl, url, strlen(url));
+		SSL_write(ssl, "\r\n", 2);
+		for (len = 0; len < sizeof(out) - 1 && (n = SSL_read(ssl, out + len, sizeof(out) - 1 - len)) > 0; len += n)
+			;
+		out[len] = '\0';
+	}
+	SSL_free(ssl);
+	SSL_CTX_free(ctx);
+	close(fd);
+	return out;
+}
+
+struct test_output {
+	char   buf[4096];
+	size_t len;
+};
+
+static inline void test_collect(void *_out, const void *buf, size_t n) {
+	struct test_output *out = _out;
+
+	if (out->len + n < sizeof(out->buf)) {
+		memcpy(out->buf + out->len, buf, n);
+		out->len += n;
+		out->buf[out->len] = '\0';
+	}
+}
+
+/* Set up a request for url, with nobody on the other end, the way the
+   server would; whatever is sent goes to out. */
+static inline void test_request(struct gemini_request *req, struct test_output *out, const char *url) {
+	memset(out, 0, sizeof(*out));
+	memset(req, 0, sizeof(*req));
+	req->fd      = -1;
+	req->maxage  = req->stale = -1;
+	gemini_request_url(req, url);
+	req->tap     = test_collect;
+	req->tapdata = out;
+}
+
+/* Run a handler for url, with nobody on the other end, and return what it
+   sent back. */
+static inline const char * test_fetch(gemini_handler fn, const char *prefix, void *data, const char *url) {
+	static struct test_output out;
+	struct gemini_request req;
+
+	test_request(&req, &out, url);
+	fn(prefix, &req, data);
+	gemini_request_close(&req);
+	gemini_request_release(&req);
+	return out.buf;
+}
+
+#endif
@@ -0,0 +1,103 @@
+#include "./ctap.h"
+#include "./fixtures.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+struct _waiter {
+	pthread_t              tid;
+	struct gemini_flights *fl;
+	struct gemini_request  req;
+	struct test_output     out;
+	struct gemini_flight  *flight;
+	int                    rc;
+};
+
+static void * s_wait(void *_w) {
+	struct _waiter *w = _w;
+
+	w->rc = gemini_flights_begin(w->fl, &w->req, &w->flight);
+	return NULL;
+}
+
+static void s_board(struct _waiter *w, struct gemini_flights *fl, const char *url) {
+	w->fl = fl;
+	test_request(&w->req, &w->out, url);
+	pthread_create(&w->tid, NULL, s_wait, w);
+	usleep(200 * 1000); /* long enough to start waiting */
+}
+
+TESTS {
+	struct gemini_server server;
+	struct gemini_flights_stats st;
+	struct gemini_request req;
+	struct gemini_flight *flight;
+	struct test_output out;
+	struct _waiter w1, w2;
+
+	memset(&server, 0, sizeof(server));
+	ok(gemini_coalesce(&server, "/slow", 1, 1) == 0, "should be able to coalesce /slow");
+	isnt_null(server.flights, "coalescing should set up the server's flights");
+	if (!server.flights) return;
+
+	test_request(&req, &out, "gemini://localhost/fast");
+	is_int(gemini_flights_begin(server.flights, &req, &flight), 0, "requests outside of /slow are left alone");
+	is_null(flight, "requests outside of /slow don't lead flights");
+	gemini_request_close(&req);
+
+	/* one leader, one waiter, one too many */
+	test_request(&req, &out, "gemini://localhost/slow/thing");
+	is_int(gemini_flights_begin(server.flights, &req, &flight), 0, "the first request handles itself");
+	isnt_null(flight, "the first request leads a flight");
+
+	s_board(&w1, server.flights, "gemini://localhost/slow/thing");
+	s_board(&w2, server.flights, "gemini://localhost/slow/thing");
+	pthread_join(w2.tid, NULL);
+	is_int(w2.rc, 0, "waiters beyond the limit handle themselves");
+	is_null(w2.flight, "waiters beyond the limit don't lead flights");
+	gemini_request_close(&w2.req);
+
+	gemini_request_respond(&req, 20, "text/plain");
+	gemini_request_write(&req, "shared\n", 7);
+	gemini_request_close(&req);
+	gemini_flights_end(server.flights, &req, flight);
+	is(out.buf, "20 text/plain\r\nshared\n", "the leader's response goes to its own client");
+
+	pthread_join(w1.tid, NULL);
+	is_int(w1.rc, 1, "the waiter is answered by the flight");
+	is(w1.out.buf, "20 text/plain\r\nshared\n", "the waiter gets a copy of the leader's response");
+
+	/* waiters give up eventually */
+	test_request(&req, &out, "gemini://localhost/slow/thing");
+	gemini_flights_begin(server.flights, &req, &flight);
+	isnt_null(flight, "once a flight lands, the next request starts another");
+	s_board(&w1, server.flights, "gemini://localhost/slow/thing");
+	pthread_join(w1.tid, NULL);
+	is_int(w1.rc, 0, "waiters that time out handle themselves");
+	gemini_request_close(&w1.req);
+
+	/* ... and don't get responses they shouldn't */
+	s_board(&w1, server.flights, "gemini://localhost/slow/thing");
+	gemini_request_directives(&req, "Cache-Control: no-store\r\n", 25);
+	gemini_request_respond(&req, 20, "text/plain");
+	gemini_request_write(&req, "private\n", 8);
+	gemini_request_close(&req);
+	gemini_flights_end(server.flights, &req, flight);
+	pthread_join(w1.tid, NULL);
+	is_int(w1.rc, 0, "no-store responses are not shared");
+	is(w1.out.buf, "", "waiters on unshared flights get nothing from them");
+	gemini_request_close(&w1.req);
+
+	gemini_flights_stats(server.flights, &st);
+	is_uint(st.flights,   2, "two flights should have been led");
+	is_uint(st.coalesced, 1, "one request should have been coalesced");
+	is_uint(st.overflows, 1, "one request should have overflowed the waiter limit");
+	is_uint(st.timeouts,  1, "one request should have timed out");
+	is_uint(st.failures,  1, "one request should have waited for nothing");
+
+	gemini_request_release(&req);
+	gemini_request_release(&w1.req);
+	gemini_request_release(&w2.req);
+	gemini_flights_free(server.flights);
+}
@@ -20,7 +20,7 @@ static const char * path_too_long() {
 }
 
 static inline void run_resolve_tests() {
-	char *path;
+	char *path, buf[GEMINI_MAX_PATH+1];
 	int i;
 	struct test cases[] = {
 		{
@@ -100,6 +100,10 @@ static inline void run_resolve_tests() {
 			"%s '%s' should resolve to '%s'", cases[i].name, cases[i].in, cases[i].out);
 		free(path);
 	}
+
+	ok(gemini_fs_resolve_into("/a/../b/c", buf) == 0, "should be able to resolve into a buffer");
+	is(buf, "b/c", "resolving into a buffer should work like gemini_fs_resolve()");
+	ok(gemini_fs_resolve_into(path_too_long(), buf) != 0, "should not resolve bad paths into a buffer");
 }
 
 static inline void run_open_tests() {
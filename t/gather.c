@@ -0,0 +1,121 @@
+#include "./ctap.h"
+#include "./fixtures.h"
+
+#include <pthread.h>
+#include <signal.h>
+
+/* Make a request through the gather. */
+static const char * s_fetch(struct gemini_gather *gather, const char *url) {
+	return test_fetch(gemini_gather_handler, "/", gather, url);
+}
+
+/* stall.example takes its time to look up, and is 127.0.0.1 in the end. */
+static int s_stall(const char *host, const char *service, const struct addrinfo *hints, struct addrinfo **res) {
+	if (strcmp(host, "stall.example") == 0) {
+		usleep(1000 * 1000);
+		host = "127.0.0.1";
+	}
+	return getaddrinfo(host, service, hints, res);
+}
+
+/* Where does needle show up in the document, if at all? */
+static int s_at(const char *doc, const char *needle) {
+	const char *s;
+
+	s = strstr(doc, needle);
+	return s ? s - doc : -1;
+}
+
+TESTS {
+	struct test_upstream gem, slow, text, dead;
+	struct gemini_gather *gather;
+	struct gemini_gather_stats st;
+	const char *urls[4];
+	char want[256];
+	const char *s;
+	pthread_t tid;
+	long start, stop;
+
+	signal(SIGPIPE, SIG_IGN); /* upstreams write to calls that were given up on */
+
+	memset(&gem, 0, sizeof(gem));
+	memset(&slow, 0, sizeof(slow));
+	memset(&text, 0, sizeof(text));
+	memset(&dead, 0, sizeof(dead));
+	gem.response  = "20 text/gemini\r\n# %s\n```\nunclosed";
+	slow.response = "20 text/gemini\r\neventually\n";
+	slow.delay    = 1000;
+	text.response = "20 text/plain\r\n```\n%s\n";
+	if (test_listen(&gem) != 0 || test_listen(&slow) != 0 || test_listen(&text) != 0 || test_listen(&dead) != 0) {
+		BAIL_OUT("unable to listen on 127.0.0.1");
+	}
+	close(dead.fd); /* nobody home */
+	pthread_create(&tid, NULL, test_upstream, &gem);
+	pthread_create(&tid, NULL, test_upstream, &slow);
+	pthread_create(&tid, NULL, test_upstream, &text);
+
+	urls[0] = slow.url;
+	urls[1] = gem.url;
+	urls[2] = dead.url;
+	urls[3] = text.url;
+	gather = gemini_gather_new(urls, 4, 0, 300);
+	isnt_null(gather, "should be able to set up a gather");
+	if (!gather) return;
+
+	start = gemini_now_ms();
+	s = s_fetch(gather, "gemini://example.com/?needle");
+	cmp_ok(gemini_now_ms() - start, "<", 900, "a slow upstream shouldn't hold things up past the deadline");
+
+	ok(strncmp(s, "20 text/gemini\r\n# 4 upstreams\n", 30) == 0, "the answer should be a gemtext document about every upstream");
+	snprintf(want, sizeof(want), "## %s?needle\n=> %s?needle 20 text/gemini (", gem.url, gem.url);
+	cmp_ok(s_at(s, want), ">", 0, "each answer should get a section, with a link to where it came from");
+	snprintf(want, sizeof(want), "# %s?needle\n```\nunclosed\n```\n\n", gem.url);
+	cmp_ok(s_at(s, want), ">", 0, "gemtext should be included as-is, with preformatting closed off");
+	snprintf(want, sizeof(want), "```\n ```\n%s?needle\n```\n\n", text.url);
+	cmp_ok(s_at(s, want), ">", 0, "other text should be preformatted, and kept from closing it early");
+
+	snprintf(want, sizeof(want), "## %s?needle\nFailed after ", dead.url);
+	cmp_ok(s_at(s, want), ">", 0, "upstreams that can't be reached should be marked as failed");
+	snprintf(want, sizeof(want), "## %s?needle\nTimed out after ", slow.url);
+	cmp_ok(s_at(s, want), ">", s_at(s, gem.url), "upstreams still going at the deadline should come last, marked as timed out");
+	cmp_ok(s_at(s, "1 failed, 1 timed out"), ">", 0, "the document should end with a tally");
+
+	gemini_gather_stats(gather, &st);
+	is_uint(st.requests, 1, "requests should be counted");
+	is_uint(st.calls, 4, "every upstream should have been asked");
+	is_uint(st.failures, 1, "failures should be counted");
+	is_uint(st.timeouts, 1, "timeouts should be counted");
+	gemini_gather_free(gather);
+
+	/* one at a time, so the slow one leaves no time for the rest */
+	gather = gemini_gather_new(urls, 4, 1, 300);
+	if (!gather) return;
+	s = s_fetch(gather, "gemini://example.com/");
+	snprintf(want, sizeof(want), "## %s\nNot asked; out of time\n", gem.url);
+	cmp_ok(s_at(s, want), ">", 0, "upstreams that never got asked should say so");
+	gemini_gather_stats(gather, &st);
+	is_uint(st.calls, 1, "no more than concurrency upstreams should be asked at once");
+	is_uint(st.skipped, 3, "upstreams that never got asked should be counted");
+	gemini_gather_free(gather);
+
+	/* an upstream whose name lookup outlasts the deadline */
+	snprintf(want, sizeof(want), "gemini://stall.example:%u/", gem.port);
+	urls[0] = want;
+	gather = gemini_gather_new(urls, 2, 0, 300);
+	if (!gather) return;
+	gather->client.resolver->lookup = s_stall;
+	start = gemini_now_ms();
+	s = s_fetch(gather, "gemini://example.com/");
+	stop  = gemini_now_ms();
+	ok(strstr(s, "stall.example") && strstr(s, "Timed out after "), "upstreams still being looked up at the deadline should be marked as timed out");
+	cmp_ok(stop - start, ">=", 900, "the lookup should be waited out before the handler returns");
+	cmp_ok(s_at(s, "1 answered, 0 failed, 1 timed out"), ">", 0, "the tally should come out as usual");
+	cmp_ok(atol(strstr(s, "not asked, in ") + 14), "<", 900, "the answer should be finished by the deadline, all the same");
+	s = s_fetch(gather, "gemini://example.com/");
+	cmp_ok(s_at(s, "2 answered"), ">", 0, "once looked up, the upstream should be asked as usual");
+	gemini_gather_free(gather);
+
+	urls[0] = "http://example.com/";
+	ok(gemini_gather_new(urls, 4, 0, 0) == NULL, "every upstream should be a gemini:// URL");
+	ok(gemini_gather_new(urls, 0, 0, 0) == NULL, "a gather needs somewhere to ask");
+}
@@ -0,0 +1,100 @@
+#include "./ctap.h"
+#include "../gemini.h"
+
+#include <stdio.h>
+
+/* Every line we're told about, one per line: type, level, url, text. */
+static char seen[4096];
+
+static int s_record(const struct gemini_gemtext_line *line, void *_n) {
+	size_t len;
+
+	len = strlen(seen);
+	snprintf(seen + len, sizeof(seen) - len, "%d%d[%.*s][%.*s]\n", line->type, line->level,
+		(int)line->url.n, line->url.p, (int)line->text.n, line->text.p);
+	if (_n && --*(int *)_n == 0) {
+		return 42;
+	}
+	return 0;
+}
+
+/* Parse doc, chunk octets at a time. */
+static const char * s_parse(const char *doc, size_t chunk) {
+	struct gemini_gemtext g;
+	size_t off, n;
+
+	seen[0] = '\0';
+	gemini_gemtext_init(&g, s_record, NULL);
+	for (off = 0; off < strlen(doc); off += n) {
+		n = strlen(doc) - off < chunk ? strlen(doc) - off : chunk;
+		if (gemini_gemtext_feed(&g, doc + off, n) != 0) {
+			return "(failed)";
+		}
+	}
+	gemini_gemtext_finish(&g);
+	return seen;
+}
+
+static const char *doc =
+	"# Title\r\n"
+	"Some text, with a => in it.\n"
+	"=> gemini://example.com/  A link  \n"
+	"=>/bare\n"
+	"=>\n"
+	"## Sub\n"
+	"####Deep\n"
+	"* item\n"
+	"*not an item\n"
+	"> quoted\n"
+	"```sh\n"
+	"# not a heading\n"
+	"=> not a link\n"
+	"```\n"
+	"\n"
+	"the end";
+
+static const char *want =
+	"31[][Title]\n"
+	"10[][Some text, with a => in it.]\n"
+	"20[gemini://example.com/][A link]\n"
+	"20[/bare][]\n"
+	"10[][=>]\n"
+	"32[][Sub]\n"
+	"33[][#Deep]\n"
+	"40[][item]\n"
+	"10[][*not an item]\n"
+	"50[][quoted]\n"
+	"60[][sh]\n"
+	"70[][# not a heading]\n"
+	"70[][=> not a link]\n"
+	"60[][]\n"
+	"10[][]\n"
+	"10[][the end]\n";
+
+TESTS {
+	struct gemini_gemtext g;
+	char big[200];
+	int i, stop;
+
+	is(s_parse(doc, 4096), want, "should parse every kind of line");
+	is(s_parse(doc, 1), want, "should parse a document fed an octet at a time");
+	is(s_parse(doc, 7), want, "should parse lines that straddle chunks");
+	is(s_parse(doc, 17), want, "should parse lines that straddle more than one chunk");
+
+	/* long enough to go through the vectorized scan */
+	memset(big, 'x', sizeof(big));
+	for (i = 3; i < (int)sizeof(big); i += 5) big[i] = '\n';
+	big[sizeof(big) - 1] = '\0';
+	s_parse(big, 64);
+	for (stop = 0, i = 0; seen[i]; i++) {
+		if (seen[i] == '\n') stop++;
+	}
+	is_int(stop, 40, "should find every newline in a long stretch of lines");
+
+	seen[0] = '\0';
+	stop = 2;
+	gemini_gemtext_init(&g, s_record, &stop);
+	is_int(gemini_gemtext_feed(&g, doc, strlen(doc)), 42, "callbacks can stop the parse");
+	is_unsigned(g.lines, 2, "no more lines are parsed once the callback says stop");
+	gemini_gemtext_finish(&g);
+}
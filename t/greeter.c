@@ -0,0 +1,30 @@
+/* A tiny plugin for t/plugin.c, built twice over (with different
+   greetings) so that there is something to reload. */
+#include "../gemini.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int gemini_plugin_init(const char *config, void **data) {
+	if (strcmp(config, "fail") == 0) {
+		return -1;
+	}
+	*data = strdup(config);
+	return *data ? 0 : -1;
+}
+
+int gemini_plugin_handler(const char *prefix, struct gemini_request *req, void *name) {
+	char buf[256];
+	int n;
+
+	n = snprintf(buf, sizeof(buf), GREETING ", %s\n", (char *)name);
+	gemini_request_respond(req, 20, "text/plain");
+	gemini_request_write(req, buf, n);
+	gemini_request_close(req);
+	return GEMINI_HANDLER_DONE;
+}
+
+void gemini_plugin_teardown(void *name) {
+	free(name);
+}
@@ -0,0 +1,99 @@
+#include "./ctap.h"
+#include "../gemini.h"
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+static int s_slurp(int fd, char *buf, size_t len) {
+	ssize_t n;
+
+	if (fd < 0) return -1;
+	n = read(fd, buf, len - 1);
+	close(fd);
+	if (n < 0) return -1;
+	buf[n] = '\0';
+	return 0;
+}
+
+static inline void run_lookup_tests() {
+	struct gemini_fs_index *idx;
+	const char *roots[] = { "t/data/overlay/tenant", "t/data/overlay/base" };
+	char buf[64];
+
+	idx = gemini_fs_index_new(roots, 2);
+	isnt_null(idx, "should be able to index t/data/overlay/{tenant,base}");
+	if (!idx) return;
+
+	is_int(gemini_fs_index_lookup(idx, "index.gmi"), 0, "tenant root should override index.gmi");
+	is_int(gemini_fs_index_lookup(idx, "docs/guide.gmi"), 1, "base root should provide docs/guide.gmi");
+	is_int(gemini_fs_index_lookup(idx, "docs/custom.gmi"), 0, "tenant root should provide docs/custom.gmi");
+	is_int(gemini_fs_index_lookup(idx, "docs"), -1, "directories are not indexed");
+	is_int(gemini_fs_index_lookup(idx, "nope.gmi"), -1, "missing files are not indexed");
+
+	ok(s_slurp(gemini_fs_index_open(idx, "/index.gmi", O_RDONLY), buf, sizeof(buf)) == 0,
+		"should be able to open /index.gmi through the index");
+	is(buf, "tenant index\n", "/index.gmi should come from the tenant root");
+
+	ok(s_slurp(gemini_fs_index_open(idx, "/docs/../docs/guide.gmi", O_RDONLY), buf, sizeof(buf)) == 0,
+		"should be able to open /docs/../docs/guide.gmi through the index");
+	is(buf, "base only\n", "/docs/guide.gmi should come from the base root");
+
+	gemini_fs_index_free(idx);
+}
+
+static inline void run_refresh_tests() {
+	struct gemini_fs_index *idx;
+	char top[] = "/tmp/geminon-index-XXXXXX";
+	char tenant[64], base[64], file[128];
+	const char *roots[2];
+	FILE *f;
+
+	if (!mkdtemp(top)) {
+		fail("unable to create a temporary directory for testing");
+		return;
+	}
+	snprintf(tenant, sizeof(tenant), "%s/tenant", top); mkdir(tenant, 0777);
+	snprintf(base,   sizeof(base),   "%s/base",   top); mkdir(base,   0777);
+	roots[0] = tenant;
+	roots[1] = base;
+
+	snprintf(file, sizeof(file), "%s/a.gmi", base);
+	f = fopen(file, "w"); fclose(f);
+
+	idx = gemini_fs_index_new(roots, 2);
+	isnt_null(idx, "should be able to index the temporary roots");
+	if (!idx) return;
+	is_int(gemini_fs_index_lookup(idx, "a.gmi"), 1, "base root should provide a.gmi");
+
+	snprintf(file, sizeof(file), "%s/a.gmi", tenant);
+	f = fopen(file, "w"); fclose(f);
+	cmp_ok(gemini_fs_index_refresh(idx), ">", 0, "refresh should notice the new tenant file");
+	is_int(gemini_fs_index_lookup(idx, "a.gmi"), 0, "tenant root should now override a.gmi");
+
+	unlink(file);
+	gemini_fs_index_refresh(idx);
+	is_int(gemini_fs_index_lookup(idx, "a.gmi"), 1, "base root should provide a.gmi once the override is removed");
+
+	snprintf(file, sizeof(file), "%s/sub", tenant); mkdir(file, 0777);
+	gemini_fs_index_refresh(idx);
+	snprintf(file, sizeof(file), "%s/sub/b.gmi", tenant);
+	f = fopen(file, "w"); fclose(f);
+	gemini_fs_index_refresh(idx);
+	is_int(gemini_fs_index_lookup(idx, "sub/b.gmi"), 0, "files in new directories should be indexed");
+
+	unlink(file);
+	snprintf(file, sizeof(file), "%s/sub", tenant); rmdir(file);
+	gemini_fs_index_refresh(idx);
+	is_int(gemini_fs_index_lookup(idx, "sub/b.gmi"), -1, "files in removed directories should be forgotten");
+
+	snprintf(file, sizeof(file), "%s/a.gmi", base); unlink(file);
+	rmdir(tenant);
+	rmdir(base);
+	rmdir(top);
+	gemini_fs_index_free(idx);
+}
+
+TESTS {
+	run_lookup_tests();
+	run_refresh_tests();
+}
@@ -0,0 +1,94 @@
+#include "./ctap.h"
+#include "../gemini.h"
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+static inline void run_generate_tests() {
+	struct gemini_fs_listings *ls;
+	const struct gemini_fs_listing *l;
+
+	ls = gemini_fs_listings_new("t/data");
+	isnt_null(ls, "should be able to set up listings for t/data");
+	if (!ls) return;
+
+	l = gemini_fs_listings_get(ls, "foo/bar/baz/quux");
+	is_null(l, "regular files have no listing");
+	l = gemini_fs_listings_get(ls, "non/existent");
+	is_null(l, "missing directories have no listing");
+
+	l = gemini_fs_listings_get(ls, "foo/bar");
+	isnt_null(l, "should be able to list [t/data/]foo/bar");
+	if (l) {
+		ok(!l->index, "[t/data/]foo/bar has no index.gmi");
+		is(l->body, "# Index of /foo/bar/\n\n=> ../ ../\n=> baz/ baz/\n",
+			"[t/data/]foo/bar listing should link to its parent and children");
+	}
+
+	l = gemini_fs_listings_get(ls, "overlay/base");
+	isnt_null(l, "should be able to list [t/data/]overlay/base");
+	if (l) {
+		ok(l->index, "[t/data/]overlay/base has an index.gmi");
+	}
+
+	l = gemini_fs_listings_get(ls, "foo/bar");
+	ok(l && gemini_map_get(&ls->dirs, "foo/bar") == l, "listings should be cached");
+
+	gemini_fs_listings_free(ls);
+}
+
+static inline void run_refresh_tests() {
+	struct gemini_fs_listings *ls;
+	const struct gemini_fs_listing *l;
+	char top[] = "/tmp/geminon-listing-XXXXXX";
+	char file[128];
+	FILE *f;
+
+	if (!mkdtemp(top)) {
+		fail("unable to create a temporary directory for testing");
+		return;
+	}
+
+	ls = gemini_fs_listings_new(top);
+	isnt_null(ls, "should be able to set up listings for a temporary root");
+	if (!ls) return;
+
+	l = gemini_fs_listings_get(ls, "");
+	isnt_null(l, "should be able to list the (empty) root");
+	if (l) is(l->body, "# Index of /\n\n", "empty root lists nothing");
+
+	snprintf(file, sizeof(file), "%s/new file.gmi", top);
+	f = fopen(file, "w"); fclose(f);
+	cmp_ok(gemini_fs_listings_refresh(ls), ">", 0, "refresh should notice the new file");
+	is_null(gemini_map_get(&ls->dirs, ""), "stale listings should be dropped");
+
+	l = gemini_fs_listings_get(ls, "");
+	if (l) is(l->body, "# Index of /\n\n=> new%20file.gmi new file.gmi\n",
+		"regenerated listing should include the new file");
+
+	snprintf(file, sizeof(file), "%s/a?b#c.gmi", top);
+	f = fopen(file, "w"); fclose(f);
+	gemini_fs_listings_refresh(ls);
+	l = gemini_fs_listings_get(ls, "");
+	if (l) is(l->body, "# Index of /\n\n=> a%3Fb%23c.gmi a?b#c.gmi\n=> new%20file.gmi new file.gmi\n",
+		"query and fragment characters in names should be percent-encoded");
+	unlink(file);
+	gemini_fs_listings_refresh(ls);
+
+	snprintf(file, sizeof(file), "%s/index.gmi", top);
+	f = fopen(file, "w"); fclose(f);
+	gemini_fs_listings_refresh(ls);
+	l = gemini_fs_listings_get(ls, "");
+	ok(l && l->index, "new index.gmi should take over for the generated listing");
+
+	unlink(file);
+	snprintf(file, sizeof(file), "%s/new file.gmi", top);
+	unlink(file);
+	rmdir(top);
+	gemini_fs_listings_free(ls);
+}
+
+TESTS {
+	run_generate_tests();
+	run_refresh_tests();
+}
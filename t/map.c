@@ -0,0 +1,44 @@
+#include "./ctap.h"
+#include "../gemini.h"
+
+#include <stdint.h>
+
+static void s_count(const char *key, void *value, void *_n) {
+	*(int *)_n += (int)(uintptr_t)value;
+}
+
+TESTS {
+	struct gemini_map map;
+	char key[32];
+	int i, n;
+
+	ok(gemini_map_init(&map, 0) == 0, "should be able to initialize a map");
+	is_null(gemini_map_get(&map, "nope"), "empty maps have nothing in them");
+
+	is_null(gemini_map_set(&map, "a", (void *)1), "setting a new key returns NULL");
+	is_pointer(gemini_map_get(&map, "a"), (void *)1, "should be able to retrieve 'a'");
+	is_pointer(gemini_map_set(&map, "a", (void *)2), (void *)1, "overwriting a key returns the old value");
+	is_pointer(gemini_map_get(&map, "a"), (void *)2, "overwritten values are retrievable");
+	is_uint(map.n, 1, "overwriting does not create a new entry");
+
+	is_pointer(gemini_map_delete(&map, "a"), (void *)2, "deleting a key returns its value");
+	is_null(gemini_map_get(&map, "a"), "deleted keys are gone");
+	is_null(gemini_map_delete(&map, "a"), "deleting a missing key returns NULL");
+	is_uint(map.n, 0, "deleting removes the entry");
+
+	for (i = 1; i <= 1000; i++) {
+		snprintf(key, sizeof(key), "path/to/file%d", i);
+		gemini_map_set(&map, key, (void *)(uintptr_t)i);
+	}
+	is_uint(map.n, 1000, "should hold 1000 entries");
+	cmp_ok(map.nbuckets, ">=", 1000, "map should have grown to accommodate the entries");
+	is_pointer(gemini_map_get(&map, "path/to/file1"), (void *)1, "first key survives rehashing");
+	is_pointer(gemini_map_get(&map, "path/to/file1000"), (void *)1000, "last key survives rehashing");
+
+	n = 0;
+	gemini_map_each(&map, s_count, &n);
+	is_int(n, 500500, "iteration should visit every value exactly once");
+
+	gemini_map_free(&map, NULL);
+	is_uint(map.n, 0, "freed maps are empty");
+}
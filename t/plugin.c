@@ -0,0 +1,59 @@
+#include "./ctap.h"
+#include "./fixtures.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+/* Make a request of the plugin. */
+static const char * s_fetch(struct gemini_plugin *plugin) {
+	return test_fetch(gemini_plugin_handler, "/", plugin, "gemini://localhost/plugin");
+}
+
+static int s_copy(const char *from, const char *to) {
+	char tmp[256];
+
+	/* rename(2) it into place, the way any sane deploy would */
+	snprintf(tmp, sizeof(tmp), "%s.new", to);
+	if (link(from, tmp) != 0) {
+		return -1;
+	}
+	return rename(tmp, to);
+}
+
+TESTS {
+	struct gemini_plugin *plugin;
+	char dir[] = "/tmp/geminon-plugin-test-XXXXXX";
+	char so[256];
+
+	is_null(gemini_plugin_load("t/no-such-plugin.so", "world"), "missing plugins don't load");
+	is_null(gemini_plugin_load("t/hello.so", "fail"), "plugins that fail to initialize don't load");
+
+	if (!mkdtemp(dir)) {
+		fail("unable to create a temporary directory for testing");
+		return;
+	}
+	snprintf(so, sizeof(so), "%s/greeter.so", dir);
+	if (s_copy("t/hello.so", so) != 0) {
+		fail("unable to install the hello plugin");
+		return;
+	}
+
+	plugin = gemini_plugin_load(so, "world");
+	isnt_null(plugin, "should be able to load the hello plugin");
+	if (!plugin) return;
+	is(s_fetch(plugin), "20 text/plain\r\nhello, world\n", "plugins get their config as user data");
+	is(s_fetch(plugin), "20 text/plain\r\nhello, world\n", "plugins stay loaded between requests");
+
+	s_copy("t/howdy.so", so);
+	is(s_fetch(plugin), "20 text/plain\r\nhello, world\n", "plugins don't change until they are reloaded");
+	gemini_plugin_reload(plugin);
+	is(s_fetch(plugin), "20 text/plain\r\nhowdy, world\n", "reloaded plugins pick up the new shared object");
+	is_uint(plugin->loads, 2, "the plugin should have been loaded twice");
+
+	unlink(so);
+	gemini_plugin_reload(plugin);
+	is(s_fetch(plugin), "20 text/plain\r\nhowdy, world\n", "failed reloads keep the old version");
+
+	gemini_plugin_free(plugin);
+	rmdir(dir);
+}
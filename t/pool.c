@@ -0,0 +1,114 @@
+#include "./ctap.h"
+#include "./fixtures.h"
+
+#include <pthread.h>
+
+/* Make a request through the pool. */
+static const char * s_fetch(struct gemini_pool *pool, const char *url) {
+	return test_fetch(gemini_pool_handler, "/pool", pool, url);
+}
+
+/* Make a request that keeps the pool's only worker busy for a while. */
+static void * s_slow(void *_pool) {
+	static struct test_output out[2];
+	static int n;
+	struct gemini_request req;
+	struct test_output *o;
+
+	o = &out[__atomic_fetch_add(&n, 1, __ATOMIC_SEQ_CST) % 2];
+	test_request(&req, o, "gemini://localhost/pool/slow");
+	gemini_pool_handler("/pool", &req, _pool);
+	gemini_request_close(&req);
+	gemini_request_release(&req);
+	return o->buf;
+}
+
+static void * s_serve(void *server) {
+	gemini_serve(server);
+	return NULL;
+}
+
+TESTS {
+	struct gemini_server server;
+	struct sockaddr_in sin;
+	socklen_t len;
+	char dir[] = "/tmp/geminon-pool-test-XXXXXX", cert[256], key[256];
+	struct gemini_pool *pool;
+	struct gemini_pool_stats st;
+	pthread_t tid[2];
+	char pid[64];
+	const char *s;
+	void *rv;
+	time_t start;
+
+	is_null(gemini_pool_new("t/no-such-worker", 1, 1, 0), "pools of workers that can't be started don't start");
+
+	pool = gemini_pool_new("t/worker", 1, 1, 1);
+	isnt_null(pool, "should be able to start a pool");
+	if (!pool) return;
+
+	is(s_fetch(pool, "gemini://localhost/pool/echo?a=b"), "20 text/plain\r\n/pool|/echo|a=b\n",
+		"the request should be framed up for the worker, and its response put back together");
+	is(s_fetch(pool, "gemini://localhost/pool/echo"), "20 text/plain\r\n/pool|/echo|\n",
+		"the worker should be able to take another request after that");
+
+	snprintf(pid, sizeof(pid), "%s", s_fetch(pool, "gemini://localhost/pool/pid"));
+	is(s_fetch(pool, "gemini://localhost/pool/crash"), "42 CGI Error\r\n", "a worker that dies should be reported as a CGI error");
+	s = s_fetch(pool, "gemini://localhost/pool/pid");
+	ok(strncmp(s, "20 ", 3) == 0 && strcmp(s, pid) != 0, "a worker that dies should be replaced");
+	snprintf(pid, sizeof(pid), "%s", s);
+
+	start = time(NULL);
+	is(s_fetch(pool, "gemini://localhost/pool/hang"), "42 CGI Error\r\n", "a worker that takes too long should be reported as a CGI error");
+	cmp_ok(time(NULL) - start, "<=", 3, "a worker that takes too long should be given up on by the deadline");
+	s = s_fetch(pool, "gemini://localhost/pool/pid");
+	ok(strncmp(s, "20 ", 3) == 0 && strcmp(s, pid) != 0, "a worker that takes too long should be replaced");
+
+	gemini_pool_stats(pool, &st);
+	is_uint(st.crashes, 1, "crashes should be counted");
+	is_uint(st.timeouts, 1, "timeouts should be counted");
+
+	/* one worker, busy; one request waiting; no room for another */
+	pthread_create(&tid[0], NULL, s_slow, pool);
+	usleep(100 * 1000);
+	pthread_create(&tid[1], NULL, s_slow, pool);
+	usleep(100 * 1000);
+	is(s_fetch(pool, "gemini://localhost/pool/echo"), "44 30\r\n", "requests beyond the queue limit should be told to slow down");
+	pthread_join(tid[0], &rv);
+	is(rv, "20 text/plain\r\nok\n", "the request that had the worker should be answered");
+	pthread_join(tid[1], &rv);
+	is(rv, "20 text/plain\r\nok\n", "the request that was waiting should be answered, in its turn");
+
+	gemini_pool_stats(pool, &st);
+	is_uint(st.rejected, 1, "requests turned away should be counted");
+	is_uint(st.max_queued, 1, "the queue should never have grown past its limit");
+	is_uint(st.requests, 9, "every request that got a worker should be counted");
+	gemini_pool_free(pool);
+
+	/* workers started while a server is running shouldn't hold on to its
+	   connections (or anything else), or clients never see the end of
+	   their responses */
+	if (!mkdtemp(dir)) {
+		BAIL_OUT("unable to create a temporary directory");
+	}
+	snprintf(cert, sizeof(cert), "%s/cert.pem", dir);
+	snprintf(key,  sizeof(key),  "%s/key.pem",  dir);
+	memset(&server, 0, sizeof(server));
+	server.threads = 2;
+	pool = gemini_pool_new("t/worker", 1, 1, 0);
+	if (!pool || test_pem(cert, key, "localhost", 0, 3600) != 0 || gemini_bind(&server, 0) != 0
+	 || gemini_tls(&server, cert, key) != 0 || gemini_handle_pool(&server, "/pool", pool) != 0) {
+		BAIL_OUT("unable to set up a server");
+	}
+	len = sizeof(sin);
+	getsockname(server.sockfd, (struct sockaddr *)&sin, &len);
+	pthread_create(&tid[0], NULL, s_serve, &server);
+
+	is(test_get(ntohs(sin.sin_port), "gemini://localhost/pool/crash"), "42 CGI Error\r\n", "a worker should be able to die mid-request");
+	is(test_get(ntohs(sin.sin_port), "gemini://localhost/pool/fds"), "20 text/plain\r\n0\n",
+		"a worker started in the middle of a request should have no sockets but its own");
+
+	unlink(cert);
+	unlink(key);
+	rmdir(dir);
+}
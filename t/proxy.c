@@ -0,0 +1,120 @@
+#include "./ctap.h"
+#include "./fixtures.h"
+
+#include <pthread.h>
+
+/* Make a request through the proxy. */
+static const char * s_fetch(struct gemini_proxy *proxy, const char *url) {
+	return test_fetch(gemini_proxy_handler, "/app/", proxy, url);
+}
+
+TESTS {
+	struct test_upstream a, b, dead, stall;
+	struct gemini_proxy *proxy;
+	struct gemini_proxy_stats st;
+	struct gemini_sessions_stats ss;
+	const char *ups[3];
+	char want[128], path[64];
+	const char *s;
+	pthread_t tid;
+	int i, as, bs, same;
+
+	memset(&a, 0, sizeof(a));
+	memset(&b, 0, sizeof(b));
+	memset(&dead, 0, sizeof(dead));
+	memset(&stall, 0, sizeof(stall));
+	a.response = "20 text/plain\r\nA %s\n";
+	b.response = "20 text/plain\r\nB %s\n";
+	stall.response = "20 text/plain\r\npartial";
+	stall.linger   = 500;
+	if (test_listen(&a) != 0 || test_listen(&b) != 0 || test_listen(&dead) != 0 || test_listen(&stall) != 0) {
+		BAIL_OUT("unable to listen on 127.0.0.1");
+	}
+	close(dead.fd); /* nobody home */
+	pthread_create(&tid, NULL, test_upstream, &a);
+	pthread_create(&tid, NULL, test_upstream, &b);
+	pthread_create(&tid, NULL, test_upstream, &stall);
+
+	/* least outstanding */
+	ups[0] = a.url;
+	ups[1] = b.url;
+	proxy = gemini_proxy_new(ups, 2, GEMINI_PROXY_LEAST, 0);
+	isnt_null(proxy, "should be able to set up a proxy");
+	if (!proxy) return;
+
+	s = s_fetch(proxy, "gemini://example.com/app/x/y?q");
+	snprintf(want, sizeof(want), "20 text/plain\r\nA gemini://127.0.0.1:%u/x/y?q\n", a.port);
+	is(s, want, "requests should be passed along, past the prefix, and answered");
+	s = s_fetch(proxy, "gemini://example.com/app/x/y?q");
+	snprintf(want, sizeof(want), "20 text/plain\r\nB gemini://127.0.0.1:%u/x/y?q\n", b.port);
+	is(s, want, "with nothing outstanding anywhere, requests should take turns");
+
+	for (i = 0; i < 4; i++) {
+		s_fetch(proxy, "gemini://example.com/app/");
+	}
+	gemini_sessions_stats(proxy->client.sessions, &ss);
+	cmp_ok(ss.resumed, ">", 0, "upstream TLS sessions should be resumed");
+
+	gemini_proxy_stats(proxy, 0, &st);
+	is(st.upstream, a.url, "stats should say which upstream they're for");
+	is_uint(st.requests, 3, "requests to each upstream should be counted");
+	is_uint(st.inflight, 0, "finished requests should no longer be outstanding");
+	ok(st.up, "working upstreams should be in rotation");
+	gemini_proxy_free(proxy);
+
+	/* consistent hashing */
+	proxy = gemini_proxy_new(ups, 2, GEMINI_PROXY_HASH, 0);
+	if (!proxy) return;
+	for (as = bs = 0, same = 1, i = 0; i < 16; i++) {
+		snprintf(path, sizeof(path), "gemini://example.com/app/doc%d", i);
+		s = s_fetch(proxy, path);
+		as += s[15] == 'A';
+		bs += s[15] == 'B';
+		same &= s[15] == s_fetch(proxy, path)[15];
+	}
+	ok(same, "the same document should always go to the same upstream");
+	ok(as > 0 && bs > 0 && as + bs == 16, "different documents should be spread across upstreams");
+	gemini_proxy_free(proxy);
+
+	/* an upstream that isn't there */
+	ups[0] = dead.url;
+	ups[1] = a.url;
+	proxy = gemini_proxy_new(ups, 2, GEMINI_PROXY_LEAST, 0);
+	if (!proxy) return;
+	for (same = 1, i = 0; i < 2 * GEMINI_PROXY_FAILS; i++) {
+		same &= s_fetch(proxy, "gemini://example.com/app/")[15] == 'A';
+	}
+	ok(same, "requests to an upstream that fails should be tried on another");
+	gemini_proxy_stats(proxy, 0, &st);
+	ok(!st.up, "an upstream that keeps failing should be taken out of rotation");
+	is_uint(st.ejections, 1, "taking an upstream out of rotation should be counted");
+	is_uint(st.failures, GEMINI_PROXY_FAILS, "once it is out, it shouldn't be tried any more");
+	gemini_proxy_free(proxy);
+
+	proxy = gemini_proxy_new(ups, 1, GEMINI_PROXY_LEAST, 1);
+	if (!proxy) return;
+	is(s_fetch(proxy, "gemini://example.com/app/"), "43 Proxy Error\r\n", "with no upstreams left to try, the client should be told");
+	gemini_proxy_stats(proxy, 0, &st);
+	ok(st.up, "a single failure shouldn't take an upstream out of rotation");
+	usleep(1500 * 1000);
+	gemini_proxy_stats(proxy, 0, &st);
+	ok(!st.up, "upstreams that fail their health check should be taken out of rotation");
+	gemini_proxy_free(proxy);
+
+	/* an upstream that goes quiet partway through */
+	ups[0] = stall.url;
+	proxy = gemini_proxy_new(ups, 1, GEMINI_PROXY_LEAST, 0);
+	if (!proxy) return;
+	proxy->stall = 100;
+	for (same = 1, i = 0; i < GEMINI_PROXY_FAILS; i++) {
+		same &= strcmp(s_fetch(proxy, "gemini://example.com/app/"), "20 text/plain\r\npartial") == 0;
+	}
+	ok(same, "what a stalled upstream did send should be passed along");
+	gemini_proxy_stats(proxy, 0, &st);
+	is_uint(st.failures, GEMINI_PROXY_FAILS, "an upstream stalling mid-response should count as a failure");
+	ok(!st.up, "an upstream that keeps stalling should be taken out of rotation");
+	gemini_proxy_free(proxy);
+
+	ups[0] = dead.url;
+	ok(gemini_proxy_new(ups, 0, GEMINI_PROXY_LEAST, 0) == NULL, "a proxy needs somewhere to send requests");
+}
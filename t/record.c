@@ -0,0 +1,197 @@
+#include "./ctap.h"
+#include "./fixtures.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#define BODY (200 * 1024)
+
+/* The client end of a connection, which reads whatever the server sends,
+   one TLS record at a time, so that it can tell how big each one was. */
+struct peer {
+	int  fd;
+
+	char   out[BODY + 1024]; /* everything the server said, decrypted */
+	size_t len;
+
+	size_t records[256]; /* octets of application data, per record */
+	int    n;
+};
+
+static void * s_peer(void *_p) {
+	struct peer *p;
+	unsigned char raw[5 + 16384 + 256];
+	size_t have, len;
+	ssize_t nread;
+	SSL_CTX *ctx;
+	SSL *ssl;
+	BIO *rbio;
+	int got, rc;
+
+	p = _p;
+	ctx = SSL_CTX_new(TLS_client_method());
+	ssl = SSL_new(ctx);
+	rbio = BIO_new(BIO_s_mem());
+	SSL_set_bio(ssl, rbio, BIO_new_socket(p->fd, BIO_NOCLOSE));
+	SSL_set_connect_state(ssl);
+	SSL_do_handshake(ssl);
+
+	for (have = 0; (nread = read(p->fd, raw + have, sizeof(raw) - have)) > 0; ) {
+		/* hand TLS one whole record at a time, and see what comes of it */
+		for (have += nread; have >= 5 && have >= 5 + (len = raw[3] << 8 | raw[4]); ) {
+			BIO_write(rbio, raw, 5 + len);
+			have -= 5 + len;
+			memmove(raw, raw + 5 + len, have);
+
+			if (!SSL_is_init_finished(ssl)) {
+				SSL_do_handshake(ssl);
+				continue;
+			}
+			for (got = 0; (rc = SSL_read(ssl, p->out + p->len + got, sizeof(p->out) - p->len - got)) > 0; got += rc)
+				;
+			if (got > 0 && p->n < sizeof(p->records) / sizeof(p->records[0])) {
+				p->records[p->n++] = got;
+			}
+			p->len += got;
+		}
+	}
+
+	SSL_free(ssl);
+	SSL_CTX_free(ctx);
+	return NULL;
+}
+
+/* Set up a connection over a socket pair, with a small send buffer on the
+   server's end, so that its writes only ever go through a bit at a time,
+   and hand the server's end over to req. */
+static void s_connect(struct gemini_request *req, SSL_CTX *ctx, struct peer *p, pthread_t *tid) {
+	int sv[2], size;
+
+	memset(p, 0, sizeof(*p));
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		BAIL_OUT("unable to create a socket pair");
+	}
+	size = 4096;
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	p->fd = sv[1];
+	pthread_create(tid, NULL, s_peer, p);
+
+	req->fd  = sv[0];
+	req->ssl = SSL_new(ctx);
+	SSL_set_fd(req->ssl, sv[0]);
+	if (SSL_accept(req->ssl) != 1) {
+		BAIL_OUT("unable to finish the TLS handshake");
+	}
+}
+
+/* Wait for the peer to see the connection out. */
+static void s_finish(struct gemini_request *req, struct peer *p, pthread_t tid) {
+	gemini_request_close(req);
+	pthread_join(tid, NULL);
+	close(p->fd);
+	p->out[p->len] = '\0';
+}
+
+TESTS {
+	struct gemini_request req;
+	struct peer *p;
+	pthread_t tid;
+	SSL_CTX *ctx;
+	char file[] = "/tmp/geminon-record-test-XXXXXX", *body;
+	size_t i, off, small, big;
+	int fd, ramped;
+
+	ctx = test_server_ctx();
+	SSL_CTX_set_num_tickets(ctx, 0); /* nothing but the response, after the handshake */
+	p = malloc(sizeof(*p));
+	body = malloc(BODY);
+	fd = mkstemp(file);
+	if (!p || !body || fd < 0) {
+		BAIL_OUT("unable to set up");
+	}
+	for (i = 0; i < BODY; i++) {
+		body[i] = "0123456789abcdef"[(i * 7 + i / 13) % 16];
+	}
+	if (write(fd, body, BODY) != BODY) {
+		BAIL_OUT("unable to write a test file");
+	}
+	memset(&req, 0, sizeof(req));
+
+	/* a file, streamed */
+	lseek(fd, 0, SEEK_SET);
+	s_connect(&req, ctx, p, &tid);
+	gemini_request_respond(&req, 20, "text/plain");
+	is_int(gemini_request_stream(&req, fd, 0), 0, "should be able to stream a file");
+	s_finish(&req, p, tid);
+
+	is_uint(p->len, 15 + BODY, "every octet should make it to the client, in the end");
+	ok(p->len == 15 + BODY && memcmp(p->out, "20 text/plain\r\n", 15) == 0 && memcmp(p->out + 15, body, BODY) == 0,
+		"and should arrive exactly as it was sent, in order");
+	is_uint(p->records[0], 15 + GEMINI_TLS_RECORD_SMALL, "the status line should go out with the first (small) record of the body");
+
+	/* records stay small until GEMINI_TLS_RAMP octets are out, then go
+	   as big as they can */
+	for (ramped = 1, small = big = 0, off = 0, i = 0; i < p->n; off += p->records[i++]) {
+		if (off < GEMINI_TLS_RAMP) {
+			small++;
+			ramped = ramped && (i == 0 || p->records[i] <= GEMINI_TLS_RECORD_SMALL);
+		} else if (i < p->n - 1) {
+			big++;
+			ramped = ramped && p->records[i] == GEMINI_TLS_RECORD_MAX;
+		}
+	}
+	ok(ramped, "records should be small until the ramp is done with, and as big as they get after");
+	cmp_ok(small, ">=", GEMINI_TLS_RAMP / (GEMINI_TLS_RECORD_SMALL + 15), "there should be a good number of small records");
+	cmp_ok(big, ">=", (BODY - GEMINI_TLS_RAMP) / GEMINI_TLS_RECORD_MAX - 1, "and then big ones, for the rest");
+
+	/* the status line waits for the first bit of the body */
+	s_connect(&req, ctx, p, &tid);
+	gemini_request_respond(&req, 20, "text/plain");
+	gemini_request_write(&req, "a", 1);
+	gemini_request_write(&req, "bc", 2);
+	s_finish(&req, p, tid);
+	is(p->out, "20 text/plain\r\nabc", "the response should make it to the client");
+	is_int(p->n, 2, "uncorked, the status line should share a record with the first write, and no more");
+	is_uint(p->records[0], 16, "that record should have the status line, and the first write");
+
+	/* corked, everything waits for the close */
+	s_connect(&req, ctx, p, &tid);
+	gemini_request_cork(&req);
+	gemini_request_respond(&req, 20, "text/plain");
+	gemini_request_write(&req, "a", 1);
+	gemini_request_write(&req, "b", 1);
+	gemini_request_write(&req, "c", 1);
+	s_finish(&req, p, tid);
+	is(p->out, "20 text/plain\r\nabc", "a corked response should make it to the client");
+	is_int(p->n, 1, "a corked response should go out as a single record");
+
+	/* corked, but only until uncorked */
+	s_connect(&req, ctx, p, &tid);
+	gemini_request_cork(&req);
+	gemini_request_respond(&req, 20, "text/plain");
+	gemini_request_write(&req, "a", 1);
+	is_int(gemini_request_uncork(&req), 0, "should be able to uncork a response");
+	gemini_request_write(&req, "b", 1);
+	s_finish(&req, p, tid);
+	is(p->out, "20 text/plain\r\nab", "an uncorked response should make it to the client");
+	is_int(p->n, 2, "uncorking should send what has built up, as one record");
+	is_uint(p->records[0], 16, "and that record should be everything before the uncork");
+
+	/* corked, but more than a record's worth */
+	s_connect(&req, ctx, p, &tid);
+	gemini_request_cork(&req);
+	gemini_request_respond(&req, 20, "text/plain");
+	gemini_request_write(&req, body, 20000);
+	s_finish(&req, p, tid);
+	ok(p->len == 15 + 20000 && memcmp(p->out + 15, body, 20000) == 0, "a big corked response should make it to the client");
+	is_int(p->n, 2, "a big corked response should go out in as few records as will hold it");
+	is_uint(p->records[0], GEMINI_TLS_RECORD_MAX, "corked output should go out as soon as there is a full record of it");
+
+	gemini_request_release(&req);
+	SSL_CTX_free(ctx);
+	close(fd);
+	unlink(file);
+	free(body);
+	free(p);
+}
@@ -0,0 +1,61 @@
+#include "./ctap.h"
+#include "../gemini.h"
+
+#include <stdint.h>
+
+TESTS {
+	struct gemini_request req;
+	char *a, *b, *c, **env;
+	int i, found;
+
+	memset(&req, 0, sizeof(req));
+	req.fd = -1;
+
+	a = gemini_request_alloc(&req, 3);
+	b = gemini_request_alloc(&req, 5);
+	isnt_null(a, "should be able to allocate request-scoped memory");
+	ok(a && b && b >= a + 3, "allocations should not overlap");
+	ok((uintptr_t)b % sizeof(max_align_t) == 0, "allocations should be suitably aligned");
+
+	c = gemini_request_alloc(&req, 4 * GEMINI_ARENA_BLOCK);
+	isnt_null(c, "should be able to allocate more than a block at a time");
+	memset(c, 'x', 4 * GEMINI_ARENA_BLOCK);
+	ok(gemini_request_alloc(&req, 8) == b + sizeof(max_align_t), "small allocations should carry on where they left off");
+
+	ok(gemini_request_url(&req, "gemini://example.com:1966/a/path") == 0, "should be able to parse a request URL");
+	is(req.url ? req.url->host : NULL, "example.com", "request URLs should have a host");
+	is(req.url ? req.url->path : NULL, "/a/path", "request URLs should have a path");
+	is_int(req.url ? req.url->port : 0, 1966, "request URLs should have a port");
+	ok(gemini_request_url(&req, "http://example.com/") != 0, "bad request URLs should not parse");
+	is_null(req.url, "bad request URLs should leave the request without one");
+
+	gemini_request_url(&req, "gemini://example.com/cgi-bin/env?q");
+	env = gemini_request_environ(&req, "/cgi-bin/env", "");
+	isnt_null(env, "should be able to build a CGI environment from the request");
+	for (found = i = 0; env && env[i]; i++) {
+		found |= strcmp(env[i], "QUERY_STRING=q") == 0;
+	}
+	ok(found, "the CGI environment should include the query string");
+
+	gemini_request_close(&req);
+	is_null(req.url, "closing a request should forget its URL");
+
+	/* everything that request needed should now fit in one block */
+	a = gemini_request_alloc(&req, GEMINI_ARENA_BLOCK);
+	b = gemini_request_alloc(&req, GEMINI_ARENA_BLOCK);
+	ok(a && b == a + GEMINI_ARENA_BLOCK, "the next request should get by with a single block");
+
+	gemini_request_close(&req);
+	ok(gemini_request_alloc(&req, 1) == a, "blocks should be reused from one request to the next");
+
+	/* one big allocation shouldn't stay with the request for good */
+	gemini_request_close(&req);
+	ok(gemini_request_alloc(&req, 2 * GEMINI_ARENA_MAX) != NULL, "should be able to allocate more than the arena keeps");
+	gemini_request_close(&req);
+	is_null(req.arena, "a block too big to keep should be let go, between requests");
+
+	gemini_request_alloc(&req, 1);
+	gemini_request_close(&req);
+	gemini_request_release(&req);
+	is_null(req.arena, "releasing a request should free its memory");
+}
@@ -0,0 +1,154 @@
+#include "./ctap.h"
+#include "../gemini.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+static int calls = 0;
+
+/* Stands in for the DNS: stub.example is 192.0.2.1, gone.example doesn't
+   exist, and flaky.example never answers in time. */
+static int s_stub(const char *host, const char *service, const struct addrinfo *hints, struct addrinfo **res) {
+	__atomic_add_fetch(&calls, 1, __ATOMIC_SEQ_CST);
+	usleep(100 * 1000); /* slow enough for lookups to pile up */
+
+	if (strcmp(host, "stub.example") == 0) {
+		struct addrinfo hint;
+		memset(&hint, 0, sizeof(hint));
+		hint.ai_flags    = AI_NUMERICHOST;
+		hint.ai_socktype = SOCK_STREAM;
+		return getaddrinfo("192.0.2.1", service, &hint, res);
+	}
+	if (strcmp(host, "flaky.example") == 0) {
+		return EAI_AGAIN;
+	}
+	return EAI_NONAME;
+}
+
+/* Where does an address point (as host:port)? */
+static const char * s_addr(struct gemini_addr *addr) {
+	static char buf[INET6_ADDRSTRLEN + 8];
+	char ip[INET6_ADDRSTRLEN];
+	struct sockaddr_in *sin;
+
+	if (addr->sa.ss_family != AF_INET) return "(not ipv4)";
+	sin = (struct sockaddr_in *)&addr->sa;
+	inet_ntop(AF_INET, &sin->sin_addr, ip, sizeof(ip));
+	snprintf(buf, sizeof(buf), "%s:%u", ip, ntohs(sin->sin_port));
+	return buf;
+}
+
+struct _answer {
+	pthread_mutex_t lock;
+	pthread_cond_t  done;
+	int  answered;
+	int  n, error;
+	char addr[64];
+};
+
+static void s_answer(void *_a, const struct gemini_addr *addrs, int n, int error) {
+	struct _answer *a = _a;
+
+	pthread_mutex_lock(&a->lock);
+	a->n = n;
+	a->error = error;
+	if (n > 0) strcpy(a->addr, s_addr((struct gemini_addr *)&addrs[0]));
+	a->answered++;
+	pthread_cond_broadcast(&a->done);
+	pthread_mutex_unlock(&a->lock);
+}
+
+static void s_wait(struct _answer *a, int n) {
+	pthread_mutex_lock(&a->lock);
+	while (a->answered < n) {
+		pthread_cond_wait(&a->done, &a->lock);
+	}
+	pthread_mutex_unlock(&a->lock);
+}
+
+static inline void run_sync_tests() {
+	struct gemini_resolver *r;
+	struct gemini_resolver_stats st;
+	struct gemini_addr addrs[GEMINI_RESOLVE_MAX];
+	int error;
+
+	/* the real thing, from /etc/hosts */
+	cmp_ok(gemini_resolve(NULL, "localhost", 1965, addrs, GEMINI_RESOLVE_MAX, &error), ">", 0, "localhost should resolve without a resolver");
+
+	r = gemini_resolver_new(1, 1, 2);
+	isnt_null(r, "should be able to create a resolver");
+	if (!r) return;
+	cmp_ok(gemini_resolve(r, "localhost", 1965, addrs, GEMINI_RESOLVE_MAX, &error), ">", 0, "localhost should resolve");
+
+	r->lookup = s_stub;
+	calls = 0;
+	is_int(gemini_resolve(r, "stub.example", 1965, addrs, GEMINI_RESOLVE_MAX, &error), 1, "stub.example should resolve");
+	is(s_addr(&addrs[0]), "192.0.2.1:1965", "stub.example should resolve to 192.0.2.1");
+	is_int(gemini_resolve(r, "stub.example", 1966, addrs, GEMINI_RESOLVE_MAX, &error), 1, "stub.example should resolve again");
+	is(s_addr(&addrs[0]), "192.0.2.1:1966", "cached addresses take the asked-for port");
+	is_int(calls, 1, "the second lookup should come from the cache");
+
+	is_int(gemini_resolve(r, "gone.example", 1965, addrs, GEMINI_RESOLVE_MAX, &error), -1, "gone.example should not resolve");
+	is_int(error, EAI_NONAME, "gone.example should not exist");
+	is_int(gemini_resolve(r, "gone.example", 1965, addrs, GEMINI_RESOLVE_MAX, &error), -1, "gone.example should still not resolve");
+	is_int(error, EAI_NONAME, "gone.example should still not exist");
+	is_int(calls, 2, "names that don't exist should be cached");
+
+	gemini_resolve(r, "flaky.example", 1965, addrs, GEMINI_RESOLVE_MAX, &error);
+	gemini_resolve(r, "flaky.example", 1965, addrs, GEMINI_RESOLVE_MAX, &error);
+	is_int(error, EAI_AGAIN, "flaky.example should time out");
+	is_int(calls, 4, "transient failures should not be cached");
+
+	sleep(2);
+	gemini_resolve(r, "stub.example", 1965, addrs, GEMINI_RESOLVE_MAX, &error);
+	is_int(calls, 5, "cached answers should expire");
+
+	gemini_resolver_stats(r, &st);
+	is_uint(st.hits,     2, "two lookups should have been cached");
+	is_uint(st.negative, 1, "one of which was negative");
+	is_uint(st.failures, 3, "three lookups should have failed");
+	gemini_resolver_free(r);
+}
+
+static inline void run_async_tests() {
+	struct gemini_resolver *r;
+	struct gemini_resolver_stats st;
+	struct _answer a, b, c;
+
+	r = gemini_resolver_new(60, 60, 2);
+	if (!r) return;
+	r->lookup = s_stub;
+	calls = 0;
+
+	memset(&a, 0, sizeof(a)); pthread_mutex_init(&a.lock, NULL); pthread_cond_init(&a.done, NULL);
+	memset(&b, 0, sizeof(b)); pthread_mutex_init(&b.lock, NULL); pthread_cond_init(&b.done, NULL);
+	memset(&c, 0, sizeof(c)); pthread_mutex_init(&c.lock, NULL); pthread_cond_init(&c.done, NULL);
+
+	is_int(gemini_resolve_async(r, "stub.example", 1965, s_answer, &a), 0, "should be able to look up stub.example asynchronously");
+	is_int(gemini_resolve_async(r, "stub.example", 1966, s_answer, &b), 0, "should be able to look it up twice");
+	is_int(gemini_resolve_async(r, "gone.example", 1965, s_answer, &c), 0, "should be able to look up gone.example too");
+	s_wait(&a, 1);
+	s_wait(&b, 1);
+	s_wait(&c, 1);
+
+	is(a.addr, "192.0.2.1:1965", "the first lookup should get its answer");
+	is(b.addr, "192.0.2.1:1966", "the second lookup should get its answer, with its own port");
+	is_int(c.n, -1, "lookups for names that don't exist fail");
+	is_int(c.error, EAI_NONAME, "... with the getaddrinfo() error");
+	is_int(calls, 2, "concurrent lookups for the same name should be shared");
+
+	is_int(gemini_resolve_async(r, "stub.example", 1965, s_answer, &a), 0, "should be able to look up stub.example again");
+	is_int(a.answered, 2, "cached answers are given right away");
+
+	gemini_resolver_stats(r, &st);
+	is_uint(st.shared, 1, "one lookup should have been shared");
+	is_uint(st.hits,   1, "one lookup should have been cached");
+	gemini_resolver_free(r);
+}
+
+TESTS {
+	run_sync_tests();
+	run_async_tests();
+}
@@ -0,0 +1,105 @@
+#include "./ctap.h"
+#include "../gemini.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+static const SSL_CIPHER *cipher;
+
+/* A TLS 1.2 session, as a server might have handed it out at time
+   when, good for timeout seconds. */
+static SSL_SESSION * s_session(const char *id, time_t when, long timeout) {
+	SSL_SESSION *sess;
+	unsigned char secret[48];
+
+	sess = SSL_SESSION_new();
+	if (!sess) return NULL;
+
+	if (!cipher) {
+		SSL_CTX *ctx = SSL_CTX_new(TLS_method());
+		SSL *ssl = SSL_new(ctx);
+		cipher = SSL_CIPHER_find(ssl, (const unsigned char *)"\xc0\x2f"); /* ECDHE-RSA-AES128-GCM-SHA256 */
+		SSL_free(ssl);
+		SSL_CTX_free(ctx);
+	}
+
+	memset(secret, 0x42, sizeof(secret));
+	SSL_SESSION_set_protocol_version(sess, TLS1_2_VERSION);
+	SSL_SESSION_set1_id(sess, (const unsigned char *)id, strlen(id));
+	SSL_SESSION_set1_master_key(sess, secret, sizeof(secret));
+	SSL_SESSION_set_cipher(sess, cipher);
+	SSL_SESSION_set_time(sess, when);
+	SSL_SESSION_set_timeout(sess, timeout);
+	return sess;
+}
+
+/* Which session (by id) is cached under key, if any? */
+static const char * s_lookup(struct gemini_sessions *sessions, const char *key) {
+	static char id[SSL_MAX_SSL_SESSION_ID_LENGTH + 1];
+	const unsigned char *p;
+	SSL_SESSION *sess;
+	unsigned int n;
+
+	sess = gemini_sessions_get(sessions, key);
+	if (!sess) return "(none)";
+
+	p = SSL_SESSION_get_id(sess, &n);
+	memcpy(id, p, n);
+	id[n] = '\0';
+	SSL_SESSION_free(sess);
+	return id;
+}
+
+TESTS {
+	struct gemini_sessions *sessions, *again;
+	struct gemini_sessions_stats st;
+	char file[64];
+	time_t now;
+
+	now = time(NULL);
+	sessions = gemini_sessions_new(2, 60);
+	isnt_null(sessions, "should be able to create a session cache");
+	if (!sessions) return;
+
+	is(s_lookup(sessions, "example.com:1965"), "(none)", "an empty cache has no sessions");
+	is_int(gemini_sessions_put(sessions, "example.com:1965", s_session("one", now, 300)), 0, "should be able to cache a session");
+	is(s_lookup(sessions, "example.com:1965"), "one", "cached sessions can be found by host:port");
+	is(s_lookup(sessions, "example.com:1966"), "(none)", "ports are part of the key");
+
+	is_int(gemini_sessions_put(sessions, "example.com:1965", s_session("two", now, 300)), 0, "should be able to replace a session");
+	is(s_lookup(sessions, "example.com:1965"), "two", "newer sessions replace older ones");
+
+	ok(gemini_sessions_put(sessions, "stale.example.com:1965", s_session("old", now - 600, 300)) != 0,
+		"sessions the server no longer honors are not cached");
+	ok(gemini_sessions_put(sessions, "long.example.com:1965", s_session("long", now - 120, 86400)) != 0,
+		"sessions older than the cache's ttl are not cached");
+
+	gemini_sessions_put(sessions, "a.example.com:1965", s_session("a", now, 300));
+	s_lookup(sessions, "example.com:1965"); /* now a is the least recently used */
+	gemini_sessions_put(sessions, "b.example.com:1965", s_session("b", now, 300));
+	is(s_lookup(sessions, "a.example.com:1965"), "(none)", "the least recently used session is evicted");
+	is(s_lookup(sessions, "example.com:1965"), "two", "recently used sessions survive eviction");
+	is(s_lookup(sessions, "b.example.com:1965"), "b", "new sessions survive eviction");
+
+	gemini_sessions_stats(sessions, &st);
+	is_uint(st.entries,   2, "only two sessions fit");
+	is_uint(st.evictions, 1, "one session should have been evicted");
+	is_uint(st.stores,    4, "four sessions should have been stored");
+
+	/* round-trip through a file */
+	snprintf(file, sizeof(file), "/tmp/gemini-sessions-%d", getpid());
+	unlink(file);
+	again = gemini_sessions_new(2, 60);
+	is_int(gemini_sessions_load(again, file), 0, "a missing file loads no sessions");
+	is_int(gemini_sessions_save(sessions, file), 0, "should be able to save sessions");
+	ok(access(file, F_OK) == 0, "saving sessions creates the file");
+	is_int(gemini_sessions_load(again, file), 2, "should be able to load saved sessions");
+	is(s_lookup(again, "example.com:1965"), "two", "loaded sessions can be resumed");
+	is(s_lookup(again, "b.example.com:1965"), "b", "all of the saved sessions are loaded");
+	unlink(file);
+
+	gemini_sessions_free(again);
+	gemini_sessions_free(sessions);
+}
@@ -0,0 +1,116 @@
+#include "./ctap.h"
+#include "../gemini.h"
+
+#include <unistd.h>
+#include <pthread.h>
+
+struct _waiter {
+	pthread_t              tid;
+	struct gemini_slots   *slots;
+	struct gemini_request *req;
+};
+
+static void * s_wait(void *_w) {
+	struct _waiter *w = _w;
+
+	w->req = gemini_slots_acquire(w->slots);
+	return NULL;
+}
+
+static void * s_quiesce(void *_w) {
+	struct _waiter *w = _w;
+
+	gemini_slots_quiesce(w->slots, 3);
+	w->req = w->slots->slots; /* done waiting */
+	return NULL;
+}
+
+TESTS {
+	struct gemini_slots *slots;
+	struct gemini_slots_stats st;
+	struct gemini_request *a, *b, *c;
+	struct _waiter w;
+	SSL_CTX *ctx;
+	SSL *ssl;
+
+	ctx = SSL_CTX_new(TLS_server_method());
+	slots = gemini_slots_new(ctx, 2);
+	isnt_null(slots, "should be able to set up connection slots");
+	if (!slots) return;
+
+	gemini_slots_stats(slots, &st);
+	is_uint(st.size, 2, "there should be as many slots as asked for");
+	is_uint(st.busy, 0, "no slots should be busy to start with");
+
+	a = gemini_slots_acquire(slots);
+	b = gemini_slots_acquire(slots);
+	ok(a && b && a != b, "each connection should get a slot of its own");
+	ok(a && a->spare && a->out, "slots should come with a TLS handle and buffers ready to go");
+	is_int(a ? a->fd : 0, -1, "slots should start out without a connection");
+
+	gemini_slots_stats(slots, &st);
+	is_uint(st.busy, 2, "taken slots should count as busy");
+	is_uint(st.peak, 2, "the peak should follow the busy count up");
+
+	gemini_slots_release(slots, b);
+	c = gemini_slots_acquire(slots);
+	ok(c == b, "the most recently released slot should be the next one taken");
+
+	/* a connection's TLS handle is kept for the next one */
+	ssl = a->ssl = a->spare;
+	a->spare = NULL;
+	gemini_request_close(a);
+	ok(a->ssl == NULL && a->spare == ssl, "closing a request should keep its TLS handle for reuse");
+
+	memset(&w, 0, sizeof(w));
+	w.slots = slots;
+	pthread_create(&w.tid, NULL, s_wait, &w);
+	usleep(200 * 1000); /* long enough to start waiting */
+	is_null(w.req, "with every slot busy, nobody else should get one");
+	gemini_slots_release(slots, a);
+	pthread_join(w.tid, NULL);
+	ok(w.req == a, "a released slot should go to whoever is waiting for one");
+
+	gemini_slots_stats(slots, &st);
+	is_uint(st.waits, 1, "waiting for a slot should be counted");
+	is_uint(st.peak, 2, "the peak should never exceed the number of slots");
+
+	gemini_slots_release(slots, w.req);
+	gemini_slots_release(slots, c);
+	gemini_slots_stats(slots, &st);
+	is_uint(st.busy, 0, "released slots should no longer be busy");
+
+	/* a request dispatching to the handlers from epoch 2 (plus one) */
+	a = gemini_slots_acquire(slots);
+	a->epoch = 3;
+	gemini_slots_quiesce(slots, 2);
+	pass("requests on a later epoch shouldn't hold up an earlier one");
+
+	memset(&w, 0, sizeof(w));
+	w.slots = slots;
+	pthread_create(&w.tid, NULL, s_quiesce, &w);
+	usleep(200 * 1000);
+	is_null(w.req, "requests still on an epoch should hold it up");
+	__atomic_store_n(&a->epoch, 0, __ATOMIC_SEQ_CST);
+	pthread_join(w.tid, NULL);
+	isnt_null(w.req, "once they are done with it, the epoch should be over");
+	gemini_slots_release(slots, a);
+
+	gemini_slots_free(slots);
+
+	/* lean slots only have what the connection in them needs */
+	slots = gemini_slots_new(NULL, 1);
+	isnt_null(slots, "should be able to set up lean connection slots");
+	if (!slots) return;
+
+	a = gemini_slots_acquire(slots);
+	ok(!a->spare && !a->out && !a->arena, "lean slots shouldn't have anything allocated ahead of time");
+	gemini_request_respond(a, 20, "text/plain");
+	gemini_request_url(a, "gemini://example.com/");
+	gemini_request_close(a);
+	gemini_slots_release(slots, a);
+	ok(!a->out && !a->arena, "lean slots should let go of everything when released");
+
+	gemini_slots_free(slots);
+	SSL_CTX_free(ctx);
+}
@@ -0,0 +1,90 @@
+#include "./ctap.h"
+#include "../gemini.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* Store a response for url, as if it had just come in over the wire. */
+static int s_put(struct gemini_store *store, const char *url, const char *response) {
+	struct gemini_store_entry *e;
+
+	e = gemini_store_begin(store, url);
+	if (!e) return -1;
+
+	gemini_store_append(e, response, 1); /* a little at a time is fine */
+	gemini_store_append(e, response + 1, strlen(response) - 1);
+	return gemini_store_finish(e, 1);
+}
+
+/* What's stored for url, if anything? */
+static const char * s_get(struct gemini_store *store, const char *url) {
+	static char buf[256];
+	ssize_t n;
+	int fd;
+
+	fd = gemini_store_get(store, url);
+	if (fd < 0) return "(none)";
+
+	n = read(fd, buf, sizeof(buf) - 1);
+	buf[n > 0 ? n : 0] = '\0';
+	close(fd);
+	return buf;
+}
+
+TESTS {
+	struct gemini_store *store, *again;
+	struct gemini_store_entry *e;
+	struct gemini_store_stats st;
+	char dir[64], cmd[128];
+
+	snprintf(dir, sizeof(dir), "/tmp/gemini-store-%d", getpid());
+	store = gemini_store_open(dir, 64, 60);
+	isnt_null(store, "should be able to open a store");
+	if (!store) return;
+
+	is(s_get(store, "gemini://example.com/"), "(none)", "an empty store has no responses");
+	is_int(s_put(store, "gemini://example.com/", "20 text/gemini\r\n# hi\n"), 0, "should be able to store a response");
+	is(s_get(store, "gemini://example.com/"), "20 text/gemini\r\n# hi\n", "stored responses can be found by URL");
+	is(s_get(store, "gemini://example.com/other"), "(none)", "other URLs are not found");
+
+	ok(s_put(store, "gemini://example.com/gone", "51 not found\r\n") != 0, "only 20 responses are stored");
+	e = gemini_store_begin(store, "gemini://example.com/cut");
+	gemini_store_append(e, "20 text/plain\r\nhalf", 19);
+	ok(gemini_store_finish(e, 0) != 0, "responses that never finish are not stored");
+	is(s_get(store, "gemini://example.com/cut"), "(none)", "responses that never finish cannot be found");
+
+	is_int(s_put(store, "gemini://example.com/", "20 text/gemini\r\n# hey\n"), 0, "should be able to replace a response");
+	is(s_get(store, "gemini://example.com/"), "20 text/gemini\r\n# hey\n", "newer responses replace older ones");
+
+	gemini_store_policy(store, "gemini://example.com/private/", 0);
+	ok(gemini_store_begin(store, "gemini://example.com/private/x") == NULL, "policies can keep URLs out of the store");
+
+	/* 64 octets only fits a couple of these */
+	s_put(store, "gemini://example.com/a", "20 text/plain\r\naaaaaaaaaa\n");
+	s_get(store, "gemini://example.com/");
+	s_put(store, "gemini://example.com/b", "20 text/plain\r\nbbbbbbbbbb\n");
+	is(s_get(store, "gemini://example.com/a"), "(none)", "the least recently used response is evicted");
+	is(s_get(store, "gemini://example.com/b"), "20 text/plain\r\nbbbbbbbbbb\n", "new responses survive eviction");
+
+	gemini_store_stats(store, &st);
+	is_uint(st.entries, 2, "two responses should fit in the budget");
+	cmp_ok(st.bytes, "<=", 64, "the store should stay under budget");
+	is_uint(st.stores, 4, "four responses should have been stored");
+	cmp_ok(st.evictions, ">=", 1, "a response should have been evicted");
+
+	again = gemini_store_open(dir, 64, 60);
+	is(s_get(again, "gemini://example.com/b"), "20 text/plain\r\nbbbbbbbbbb\n", "stores can be shared");
+	gemini_store_close(again);
+
+	again = gemini_store_open(dir, 64, 1);
+	sleep(2);
+	is(s_get(again, "gemini://example.com/b"), "(none)", "stale responses are not served");
+	gemini_store_stats(again, &st);
+	is_uint(st.expired, 1, "stale responses count as expired");
+	gemini_store_close(again);
+
+	gemini_store_close(store);
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	system(cmd);
+}
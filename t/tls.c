@@ -0,0 +1,206 @@
+#include "./ctap.h"
+#include "./fixtures.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+static int s_hello(const char *prefix, struct gemini_request *req, void *_) {
+	if (strcmp(req->url->path, "/slow") == 0) {
+		usleep(1500 * 1000);
+	}
+	gemini_request_respond(req, 20, "text/plain");
+	gemini_request_close(req);
+	return GEMINI_HANDLER_DONE;
+}
+
+/* A destructor that counts how often it is called. */
+static void s_destroy(void *n) {
+	(*(int *)n)++;
+}
+
+/* Make a request that keeps the server's only thread busy for a while. */
+static void * s_slow(void *port) {
+	return (void *)test_get(*(unsigned short *)port, "gemini://localhost/slow");
+}
+
+static void * s_serve(void *server) {
+	gemini_serve(server);
+	return NULL;
+}
+
+/* Connect to the server, make a request, and return the common name on
+   the certificate it handed over, once the connection is done with. */
+static const char * s_cn(unsigned short port) {
+	static char cn[256];
+	struct sockaddr_in sin;
+	SSL_CTX *ctx;
+	SSL *ssl;
+	X509 *cert;
+	char buf[256];
+	int fd;
+
+	strcpy(cn, "(no certificate)");
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port   = htons(port);
+	inet_pton(AF_INET, "127.0.0.1", &sin.sin_addr);
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+		return cn;
+	}
+	ctx = SSL_CTX_new(TLS_client_method());
+	ssl = SSL_new(ctx);
+	SSL_set_fd(ssl, fd);
+	if (SSL_connect(ssl) == 1 && (cert = SSL_get_peer_certificate(ssl)) != NULL) {
+		X509_NAME_get_text_by_NID(X509_get_subject_name(cert), NID_commonName, cn, sizeof(cn));
+		X509_free(cert);
+		SSL_write(ssl, "gemini://localhost/\r\n", 21);
+		while (SSL_read(ssl, buf, sizeof(buf)) > 0)
+			;
+	}
+	SSL_free(ssl);
+	SSL_CTX_free(ctx);
+	close(fd);
+	return cn;
+}
+
+/* Connect to the server, and then say nothing (after the handshake, if
+   asked to), until the server hangs up.  Returns how long that took, in
+   milliseconds. */
+static long s_silent(unsigned short port, int handshake) {
+	struct sockaddr_in sin;
+	long start;
+	SSL_CTX *ctx;
+	SSL *ssl;
+	char buf[256];
+	int fd;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port   = htons(port);
+	inet_pton(AF_INET, "127.0.0.1", &sin.sin_addr);
+
+	start = gemini_now_ms();
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+		return -1;
+	}
+	ctx = SSL_CTX_new(TLS_client_method());
+	ssl = SSL_new(ctx);
+	SSL_set_fd(ssl, fd);
+	if (handshake ? SSL_connect(ssl) == 1 : 1) {
+		while ((handshake ? SSL_read(ssl, buf, sizeof(buf)) : read(fd, buf, sizeof(buf))) > 0)
+			;
+	}
+	SSL_free(ssl);
+	SSL_CTX_free(ctx);
+	close(fd);
+	return gemini_now_ms() - start;
+}
+
+/* Wait for the server to put its slot back, after a connection. */
+static void s_idle(struct gemini_server *server) {
+	struct gemini_slots_stats st;
+	int i;
+
+	for (i = 0; i < 1000; i++) {
+		gemini_slots_stats(server->slots, &st);
+		if (st.busy == 0) return;
+		usleep(1000);
+	}
+}
+
+TESTS {
+	struct gemini_server server, scratch[2];
+	struct sockaddr_in sin;
+	socklen_t len;
+	char dir[] = "/tmp/geminon-tls-test-XXXXXX";
+	char first[2][256], rotated[2][256], expired[2][256];
+	unsigned short port;
+	pthread_t tid, slow;
+	SSL_CTX *ctx;
+	long start;
+	void *rv;
+	SSL *spare;
+	int destroyed;
+
+	if (!mkdtemp(dir)) {
+		BAIL_OUT("unable to create a temporary directory");
+	}
+	snprintf(first[0],   sizeof(first[0]),   "%s/first.pem",   dir);
+	snprintf(first[1],   sizeof(first[1]),   "%s/first.key",   dir);
+	snprintf(rotated[0], sizeof(rotated[0]), "%s/rotated.pem", dir);
+	snprintf(rotated[1], sizeof(rotated[1]), "%s/rotated.key", dir);
+	snprintf(expired[0], sizeof(expired[0]), "%s/expired.pem", dir);
+	snprintf(expired[1], sizeof(expired[1]), "%s/expired.key", dir);
+	if (test_pem(first[0],   first[1],   "first",   0,     3600) != 0
+	 || test_pem(rotated[0], rotated[1], "rotated", 0,     3600) != 0
+	 || test_pem(expired[0], expired[1], "expired", -7200, -3600) != 0) {
+		BAIL_OUT("unable to write test certificates");
+	}
+
+	memset(&server, 0, sizeof(server));
+	server.threads = 1;
+	server.request_timeout = 300;
+	if (gemini_bind(&server, 0) != 0 || gemini_tls(&server, first[0], first[1]) != 0
+	 || gemini_handle_fn(&server, "/", s_hello, NULL) != 0) {
+		BAIL_OUT("unable to set up a server");
+	}
+	len = sizeof(sin);
+	getsockname(server.sockfd, (struct sockaddr *)&sin, &len);
+	port = ntohs(sin.sin_port);
+	pthread_create(&tid, NULL, s_serve, &server);
+
+	is(s_cn(port), "first", "new connections should get the certificate the server started with");
+	s_idle(&server);
+	ctx = server.ssl;
+
+	cmp_ok(gemini_tls_reload(&server, expired[0], expired[1]), "==", -4, "an expired certificate should be turned away");
+	ok(server.ssl == ctx, "an expired certificate should leave the old one in place");
+	cmp_ok(gemini_tls_reload(&server, rotated[0], first[1]), "<", 0, "a key that doesn't go with the certificate should be turned away");
+	ok(server.ssl == ctx, "a mismatched key should leave the old certificate in place");
+	is(s_cn(port), "first", "new connections should still get the old certificate, after a failed reload");
+	s_idle(&server);
+
+	spare = server.slots->slots[0].spare;
+	ok(spare && SSL_get_SSL_CTX(spare) == ctx, "the slot should have a spare TLS handle from the old certificate");
+	is_int(gemini_tls_reload(&server, rotated[0], rotated[1]), 0, "a good certificate and key should be swapped in");
+	ok(server.ssl != ctx, "the server should have a new TLS context");
+	is(s_cn(port), "rotated", "new connections should get the new certificate");
+	s_idle(&server);
+	spare = server.slots->slots[0].spare;
+	ok(spare && SSL_get_SSL_CTX(spare) == server.ssl, "the stale spare should have been swapped for one from the new certificate");
+
+	/* rotating the certificate shouldn't have to wait on handlers */
+	pthread_create(&slow, NULL, s_slow, &port);
+	usleep(200 * 1000);
+	start = gemini_now_ms();
+	is_int(gemini_tls_reload(&server, first[0], first[1]), 0, "a certificate should be swapped in while a request is being handled");
+	cmp_ok(gemini_now_ms() - start, "<", 500, "the swap shouldn't wait for the request to finish");
+	pthread_join(slow, &rv);
+	is(rv, "20 text/plain\r\n", "the request should finish, as usual");
+	s_idle(&server);
+	is_int(gemini_tls_reload(&server, rotated[0], rotated[1]), 0, "and should be able to swap back again");
+
+	/* there is only the one thread, so these would hold the server up */
+	cmp_ok(s_silent(port, 0), "<", 2000, "connections that don't start a handshake should be dropped");
+	cmp_ok(s_silent(port, 1), "<", 2000, "connections that don't send a request line should be dropped");
+	is(s_cn(port), "rotated", "the server should carry on, once they have been");
+
+	/* handler data that takes more than free(3) gets its own destructor,
+	   whichever way the handler goes */
+	memset(scratch, 0, sizeof(scratch));
+	destroyed = 0;
+	gemini_handle_fn_free(&scratch[0], "/", s_hello, &destroyed, s_destroy);
+	gemini_handle_fn_free(&scratch[1], "/", s_hello, &destroyed, s_destroy);
+	gemini_reroute(&scratch[0], &scratch[1]);
+	is_int(destroyed, 1, "handlers rerouted away from should have their data destroyed");
+	gemini_server_close(&scratch[0]);
+	is_int(destroyed, 2, "handlers should have their data destroyed when the server is closed");
+
+	unlink(first[0]);   unlink(first[1]);
+	unlink(rotated[0]); unlink(rotated[1]);
+	unlink(expired[0]); unlink(expired[1]);
+	rmdir(dir);
+}
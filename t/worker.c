@@ -0,0 +1,102 @@
+/* A pool worker for t/pool.c, which does whatever the last part of the
+   path tells it to:
+
+     /echo   answers with the SCRIPT_NAME, PATH_INFO and QUERY_STRING it
+             was given, spread over several netstrings
+     /pid    answers with its process id
+     /fds    answers with how many sockets it has, past its standard
+             input and output (there should be none)
+     /slow   answers, after half a second
+     /crash  exits, without a word
+     /hang   never answers at all */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+static void s_chunk(const char *s) {
+	printf("%zu:%s,", strlen(s), s);
+}
+
+/* How many sockets are open, other than on 0, 1 and 2?  (Whatever else
+   the test itself was started with isn't the server's doing.) */
+static int s_fds() {
+	struct dirent *e;
+	struct stat st;
+	DIR *d;
+	int n, fd;
+
+	d = opendir("/proc/self/fd");
+	if (!d) {
+		return -1;
+	}
+	for (n = 0; (e = readdir(d)) != NULL; ) {
+		fd = atoi(e->d_name);
+		if (fd > 2 && fd != dirfd(d) && fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode)) n++;
+	}
+	closedir(d);
+	return n;
+}
+
+/* Look up a header in a request frame of len octets. */
+static const char * s_header(const char *frame, size_t len, const char *name) {
+	const char *p, *end;
+
+	for (p = frame, end = frame + len; p < end; p += strlen(p) + 1) {
+		if (strcmp(p, name) == 0) {
+			return p + strlen(p) + 1;
+		}
+		p += strlen(p) + 1; /* skip the value */
+	}
+	return "";
+}
+
+int main(int argc, char **argv) {
+	char *frame, buf[256];
+	const char *path;
+	size_t len;
+	int c;
+
+	for (;;) {
+		for (len = 0; (c = getchar()) != ':'; len = len * 10 + (c - '0')) {
+			if (c == EOF || c < '0' || c > '9') return 0;
+		}
+		frame = malloc(len + 1);
+		if (!frame || fread(frame, 1, len, stdin) != len || getchar() != ',') {
+			return 1;
+		}
+		frame[len] = '\0';
+
+		path = s_header(frame, len, "PATH_INFO");
+		if (strcmp(path, "/crash") == 0) {
+			return 1;
+		}
+		if (strcmp(path, "/hang") == 0) {
+			pause();
+		}
+		if (strcmp(path, "/slow") == 0) {
+			usleep(500 * 1000);
+		}
+
+		s_chunk("20 text/plain\r\n");
+		if (strcmp(path, "/pid") == 0) {
+			snprintf(buf, sizeof(buf), "%d\n", (int)getpid());
+			s_chunk(buf);
+		} else if (strcmp(path, "/fds") == 0) {
+			snprintf(buf, sizeof(buf), "%d\n", s_fds());
+			s_chunk(buf);
+		} else if (strcmp(path, "/echo") == 0) {
+			snprintf(buf, sizeof(buf), "%s|%s|", s_header(frame, len, "SCRIPT_NAME"), path);
+			s_chunk(buf);
+			snprintf(buf, sizeof(buf), "%s\n", s_header(frame, len, "QUERY_STRING"));
+			s_chunk(buf);
+		} else {
+			s_chunk("ok\n");
+		}
+		s_chunk("");
+		fflush(stdout);
+		free(frame);
+	}
+}